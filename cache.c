@@ -0,0 +1,776 @@
+/*
+ * cache.c: persistent on-disk block cache for s3 object data.
+ * See cache.h for an overview.
+ *
+ * Layout of the cache directory:
+ *   <keyhash>-<etaghash>.data   sparse file holding the cached blocks
+ *   <keyhash>.meta              metadata: key, ETag, size, block bitmap
+ *   <keyhash>.meta.tmp          metadata being written (removed on load)
+ *
+ * cache_lock only protects the index.  Data is read and written outside
+ * it, through cache_io, while the entry is pinned by a reference; an
+ * entry removed while pinned is freed when its last reference goes.
+ */
+
+#include "cache.h"
+#include "cache_io.h"
+#include "libs3_wrapper.h" // for S3FS_ETAG_MAX
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define CACHE_META_MAGIC 0x53334643 // "S3FC"
+#define CACHE_META_VERSION 1
+#define CACHE_HASH_BUCKETS 4096
+
+typedef struct cache_entry {
+    char *key;
+    char etag[S3FS_ETAG_MAX];
+    uint64_t keyhash;
+    int64_t size;          // object size, or -1 if not known yet
+    uint32_t nblocks;      // number of blocks the bitmap can describe
+    uint8_t *bitmap;       // one bit per block: is the block cached?
+    uint64_t bytes;        // bytes of object data cached
+    time_t atime;          // last time the entry was read or filled
+    time_t checked;        // last time the ETag was known current (in memory)
+    int fd;                // open data file, or -1
+    uint64_t gen;          // identifies this entry's data file
+    int refs;              // readers/fillers using the entry outside the lock
+    int dead;              // removed from the index, free at last reference
+    struct cache_entry *hnext;             // hash chain
+    struct cache_entry *prev, *next;       // LRU list
+} cache_entry_t;
+
+// on-disk metadata header; followed by the key, the bitmap and a checksum
+struct cache_meta_hdr {
+    uint32_t magic;
+    uint32_t version;
+    int64_t size;
+    int64_t atime;
+    uint32_t keylen;
+    uint32_t nblocks;
+    char etag[S3FS_ETAG_MAX];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_enabled = 0;
+static char cache_dir[PATH_MAX];
+static uint64_t cache_max_bytes = 0;
+static uint64_t cache_total_bytes = 0;
+static cache_entry_t *cache_table[CACHE_HASH_BUCKETS];
+static cache_entry_t *lru_head = NULL; // most recently used
+static cache_entry_t *lru_tail = NULL; // least recently used
+static uint64_t cache_gen = 0;
+
+
+// hashing and naming --------------------------------------------------------
+
+static uint64_t fnv64(const char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (uint8_t) *s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint32_t fnv32_buf(const uint8_t *p, size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void data_path(const cache_entry_t *e, char *out, size_t outlen)
+{
+    snprintf(out, outlen, "%s/%016llx-%016llx.data", cache_dir,
+             (unsigned long long) e->keyhash,
+             (unsigned long long) fnv64(e->etag));
+}
+
+static void meta_path(uint64_t keyhash, const char *suffix, char *out,
+                      size_t outlen)
+{
+    snprintf(out, outlen, "%s/%016llx.meta%s", cache_dir,
+             (unsigned long long) keyhash, suffix);
+}
+
+
+// block bookkeeping ---------------------------------------------------------
+
+static int block_present(const cache_entry_t *e, uint32_t blk)
+{
+    return blk < e->nblocks && (e->bitmap[blk / 8] & (1 << (blk % 8)));
+}
+
+static int block_mark(cache_entry_t *e, uint32_t blk)
+{
+    if (blk >= e->nblocks) {
+        uint32_t n = e->nblocks ? e->nblocks : 8;
+        while (n <= blk) {
+            n *= 2;
+        }
+        uint8_t *bm = realloc(e->bitmap, (n + 7) / 8);
+        if (!bm) {
+            return -1;
+        }
+        memset(bm + (e->nblocks + 7) / 8, 0,
+               (n + 7) / 8 - (e->nblocks + 7) / 8);
+        e->bitmap = bm;
+        e->nblocks = n;
+    }
+    e->bitmap[blk / 8] |= (1 << (blk % 8));
+    return 0;
+}
+
+// number of object bytes held in block blk
+static uint64_t block_len(const cache_entry_t *e, uint32_t blk)
+{
+    uint64_t start = (uint64_t) blk * S3FS_CACHE_BLOCK;
+    if (e->size >= 0 && start + S3FS_CACHE_BLOCK > (uint64_t) e->size) {
+        return (uint64_t) e->size > start ? (uint64_t) e->size - start : 0;
+    }
+    return S3FS_CACHE_BLOCK;
+}
+
+static uint64_t entry_bytes(const cache_entry_t *e)
+{
+    uint64_t total = 0;
+    uint32_t i;
+    for (i = 0; i < e->nblocks; i++) {
+        if (block_present(e, i)) {
+            total += block_len(e, i);
+        }
+    }
+    return total;
+}
+
+
+// index and LRU list --------------------------------------------------------
+
+static cache_entry_t *entry_find(const char *key)
+{
+    uint64_t h = fnv64(key);
+    cache_entry_t *e = cache_table[h % CACHE_HASH_BUCKETS];
+    while (e) {
+        if (e->keyhash == h && strcmp(e->key, key) == 0) {
+            return e;
+        }
+        e = e->hnext;
+    }
+    return NULL;
+}
+
+static void lru_unlink(cache_entry_t *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        lru_tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(cache_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = e;
+    }
+    lru_head = e;
+    if (!lru_tail) {
+        lru_tail = e;
+    }
+}
+
+static void entry_touch(cache_entry_t *e)
+{
+    e->atime = time(NULL);
+    lru_unlink(e);
+    lru_push(e);
+}
+
+static void entry_insert(cache_entry_t *e)
+{
+    cache_entry_t **bucket = &cache_table[e->keyhash % CACHE_HASH_BUCKETS];
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push(e);
+    cache_total_bytes += e->bytes;
+}
+
+static void entry_free(cache_entry_t *e)
+{
+    if (e->fd >= 0) {
+        close(e->fd);
+    }
+    free(e->bitmap);
+    free(e->key);
+    free(e);
+}
+
+// Remove e from the index and delete its files.  The metadata goes first,
+// so a crash in between leaves an unreferenced data file, which is cleaned
+// up on the next load.
+static void entry_remove(cache_entry_t *e)
+{
+    char path[PATH_MAX];
+    cache_entry_t **pp = &cache_table[e->keyhash % CACHE_HASH_BUCKETS];
+    while (*pp && *pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    if (*pp) {
+        *pp = e->hnext;
+    }
+    lru_unlink(e);
+    cache_total_bytes -= e->bytes;
+
+    meta_path(e->keyhash, "", path, sizeof(path));
+    unlink(path);
+    data_path(e, path, sizeof(path));
+    unlink(path);
+    if (e->refs > 0) {
+        e->dead = 1;
+    } else {
+        entry_free(e);
+    }
+}
+
+static void entry_put(cache_entry_t *e)
+{
+    if (--e->refs == 0 && e->dead) {
+        entry_free(e);
+    }
+}
+
+// Split [offset, offset+len) into one request per cache block, so the
+// blocks can be transferred in parallel.  Returns the number of requests.
+static int block_requests(s3fs_io_req_t *reqs, int op, int fd, uint8_t *buf,
+                          size_t len, off_t offset)
+{
+    int n = 0;
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = S3FS_CACHE_BLOCK - (offset + done) % S3FS_CACHE_BLOCK;
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+        reqs[n].op = op;
+        reqs[n].fd = fd;
+        reqs[n].buf = buf + done;
+        reqs[n].len = chunk;
+        reqs[n].offset = offset + done;
+        reqs[n].result = 0;
+        n++;
+        done += chunk;
+    }
+    return n;
+}
+
+// Transfer len bytes between buf and fd at offset, one request per cache
+// block.  With io_uring, the data goes through the thread's registered
+// staging buffer a buffer's worth at a time, so the kernel doesn't pin
+// the caller's pages for every request.  Returns 0 or -1.
+static int block_transfer(int op, int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    size_t staging_len = 0;
+    uint8_t *staging = s3fs_io_staging_buffer(&staging_len);
+    if (!staging || staging_len < S3FS_CACHE_BLOCK) {
+        int nreqs = (offset % S3FS_CACHE_BLOCK + len + S3FS_CACHE_BLOCK - 1) /
+            S3FS_CACHE_BLOCK;
+        s3fs_io_req_t reqs[nreqs];
+        block_requests(reqs, op, fd, buf, len, offset);
+        return s3fs_io_submit(reqs, nreqs);
+    }
+    int maxreqs = staging_len / S3FS_CACHE_BLOCK + 1;
+    s3fs_io_req_t reqs[maxreqs];
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done < staging_len ? len - done : staging_len;
+        if (op == S3FS_IO_WRITE) {
+            memcpy(staging, buf + done, chunk);
+        }
+        int nreqs = block_requests(reqs, op, fd, staging, chunk, offset + done);
+        if (s3fs_io_submit(reqs, nreqs) < 0) {
+            return -1;
+        }
+        if (op == S3FS_IO_READ) {
+            memcpy(buf + done, staging, chunk);
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+static int entry_open_data(cache_entry_t *e)
+{
+    if (e->fd < 0) {
+        char path[PATH_MAX];
+        data_path(e, path, sizeof(path));
+        e->fd = open(path, O_RDWR | O_CREAT, 0600);
+    }
+    return e->fd;
+}
+
+static void evict_until_fits(const cache_entry_t *keep)
+{
+    cache_entry_t *e = lru_tail;
+    while (e && cache_total_bytes > cache_max_bytes) {
+        cache_entry_t *victim = e;
+        e = e->prev;
+        if (victim != keep) {
+            entry_remove(victim);
+        }
+    }
+}
+
+
+// metadata persistence ------------------------------------------------------
+
+static int meta_write(const cache_entry_t *e)
+{
+    char path[PATH_MAX], tmppath[PATH_MAX];
+    meta_path(e->keyhash, "", path, sizeof(path));
+    meta_path(e->keyhash, ".tmp", tmppath, sizeof(tmppath));
+
+    struct cache_meta_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CACHE_META_MAGIC;
+    hdr.version = CACHE_META_VERSION;
+    hdr.size = e->size;
+    hdr.atime = e->atime;
+    hdr.keylen = strlen(e->key);
+    hdr.nblocks = e->nblocks;
+    memcpy(hdr.etag, e->etag, sizeof(hdr.etag));
+
+    size_t bmlen = (e->nblocks + 7) / 8;
+    size_t len = sizeof(hdr) + hdr.keylen + bmlen;
+    uint8_t *rec = malloc(len + sizeof(uint32_t));
+    if (!rec) {
+        return -1;
+    }
+    memcpy(rec, &hdr, sizeof(hdr));
+    memcpy(rec + sizeof(hdr), e->key, hdr.keylen);
+    memcpy(rec + sizeof(hdr) + hdr.keylen, e->bitmap, bmlen);
+    uint32_t sum = fnv32_buf(rec, len);
+    memcpy(rec + len, &sum, sizeof(sum));
+    len += sizeof(sum);
+
+    int rv = -1;
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        if (write(fd, rec, len) == (ssize_t) len && fsync(fd) == 0) {
+            rv = 0;
+        }
+        close(fd);
+        if (rv == 0 && rename(tmppath, path) < 0) {
+            rv = -1;
+        }
+        if (rv < 0) {
+            unlink(tmppath);
+        }
+    }
+    free(rec);
+    return rv;
+}
+
+static cache_entry_t *meta_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    uint8_t *rec = NULL;
+    cache_entry_t *e = NULL;
+    if (fstat(fd, &st) < 0 ||
+        (size_t) st.st_size < sizeof(struct cache_meta_hdr) + sizeof(uint32_t)) {
+        goto out;
+    }
+    rec = malloc(st.st_size);
+    if (!rec || read(fd, rec, st.st_size) != st.st_size) {
+        goto out;
+    }
+
+    size_t len = st.st_size - sizeof(uint32_t);
+    uint32_t sum;
+    memcpy(&sum, rec + len, sizeof(sum));
+    struct cache_meta_hdr hdr;
+    memcpy(&hdr, rec, sizeof(hdr));
+    size_t bmlen = (hdr.nblocks + 7) / 8;
+    if (sum != fnv32_buf(rec, len) || hdr.magic != CACHE_META_MAGIC ||
+        hdr.version != CACHE_META_VERSION ||
+        sizeof(hdr) + hdr.keylen + bmlen != len) {
+        goto out;
+    }
+
+    e = calloc(1, sizeof(cache_entry_t));
+    if (!e) {
+        goto out;
+    }
+    e->fd = -1;
+    e->gen = ++cache_gen;
+    e->key = malloc(hdr.keylen + 1);
+    e->bitmap = malloc(bmlen ? bmlen : 1);
+    if (!e->key || !e->bitmap) {
+        entry_free(e);
+        e = NULL;
+        goto out;
+    }
+    memcpy(e->key, rec + sizeof(hdr), hdr.keylen);
+    e->key[hdr.keylen] = '\0';
+    memcpy(e->bitmap, rec + sizeof(hdr) + hdr.keylen, bmlen);
+    memcpy(e->etag, hdr.etag, sizeof(e->etag));
+    e->etag[sizeof(e->etag) - 1] = '\0';
+    e->keyhash = fnv64(e->key);
+    e->size = hdr.size;
+    e->atime = hdr.atime;
+    e->nblocks = hdr.nblocks;
+    e->bytes = entry_bytes(e);
+
+out:
+    free(rec);
+    close(fd);
+    return e;
+}
+
+static int atime_cmp(const void *a, const void *b)
+{
+    const cache_entry_t *ea = *(cache_entry_t * const *) a;
+    const cache_entry_t *eb = *(cache_entry_t * const *) b;
+    return (ea->atime > eb->atime) - (ea->atime < eb->atime);
+}
+
+// Load all metadata files, then remove anything they don't reference
+// (leftover temp files, data for evicted or superseded objects).
+static void cache_load(void)
+{
+    DIR *d = opendir(cache_dir);
+    if (!d) {
+        return;
+    }
+    size_t count = 0, cap = 0;
+    cache_entry_t **loaded = NULL;
+    struct dirent *de;
+    char path[PATH_MAX + NAME_MAX + 2];
+
+    while ((de = readdir(d)) != NULL) {
+        size_t n = strlen(de->d_name);
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+        if (n > 4 && strcmp(de->d_name + n - 4, ".tmp") == 0) {
+            unlink(path);
+        } else if (n > 5 && strcmp(de->d_name + n - 5, ".meta") == 0) {
+            cache_entry_t *e = meta_load(path);
+            if (!e || entry_find(e->key)) {
+                if (e) {
+                    entry_free(e);
+                }
+                unlink(path);
+                continue;
+            }
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                cache_entry_t **tmp = realloc(loaded, cap * sizeof(*tmp));
+                if (!tmp) {
+                    entry_free(e);
+                    break;
+                }
+                loaded = tmp;
+            }
+            loaded[count++] = e;
+            // index now so duplicate keys are detected; LRU order is
+            // fixed up below
+            e->hnext = cache_table[e->keyhash % CACHE_HASH_BUCKETS];
+            cache_table[e->keyhash % CACHE_HASH_BUCKETS] = e;
+        }
+    }
+
+    qsort(loaded, count, sizeof(*loaded), atime_cmp);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        lru_push(loaded[i]);
+        cache_total_bytes += loaded[i]->bytes;
+    }
+    free(loaded);
+
+    rewinddir(d);
+    while ((de = readdir(d)) != NULL) {
+        unsigned long long kh, eh;
+        size_t n = strlen(de->d_name);
+        if (n <= 5 || strcmp(de->d_name + n - 5, ".data") != 0) {
+            continue;
+        }
+        cache_entry_t *owner = NULL;
+        if (sscanf(de->d_name, "%16llx-%16llx.data", &kh, &eh) == 2) {
+            owner = cache_table[kh % CACHE_HASH_BUCKETS];
+            while (owner && !(owner->keyhash == kh &&
+                              fnv64(owner->etag) == eh)) {
+                owner = owner->hnext;
+            }
+        }
+        if (!owner) {
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+
+    evict_until_fits(NULL);
+}
+
+
+// public interface ----------------------------------------------------------
+
+int s3fs_cache_init(const char *dir, uint64_t max_bytes)
+{
+    pthread_mutex_lock(&cache_lock);
+    snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    if (mkdir(cache_dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "s3fs cache: can't create %s: %s\n", cache_dir,
+                strerror(errno));
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    cache_max_bytes = max_bytes;
+    cache_load();
+    cache_enabled = 1;
+    fprintf(stderr, "s3fs cache: %s, %llu of %llu bytes in use\n", cache_dir,
+            (unsigned long long) cache_total_bytes,
+            (unsigned long long) cache_max_bytes);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+void s3fs_cache_destroy(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = lru_head;
+    while (e) {
+        cache_entry_t *next = e->next;
+        meta_write(e); // persist access times for LRU order
+        entry_free(e);
+        e = next;
+    }
+    memset(cache_table, 0, sizeof(cache_table));
+    lru_head = lru_tail = NULL;
+    cache_total_bytes = 0;
+    cache_enabled = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int s3fs_cache_enabled(void)
+{
+    return cache_enabled;
+}
+
+// Find the entry for key if it holds all of [offset, offset+*size), with
+// *size clipped at end of object.  The data file is open on success.
+// Called with cache_lock held.
+static cache_entry_t *entry_lookup_range(const char *key, size_t *size,
+                                         off_t offset)
+{
+    cache_entry_t *e = cache_enabled ? entry_find(key) : NULL;
+    if (!e) {
+        return NULL;
+    }
+
+    // clip the request at end of object, if we know where that is
+    if (e->size >= 0) {
+        if (offset >= e->size) {
+            *size = 0;
+        } else if (offset + (off_t) *size > e->size) {
+            *size = e->size - offset;
+        }
+    }
+    if (*size > 0) {
+        uint32_t blk = offset / S3FS_CACHE_BLOCK;
+        uint32_t last = (offset + *size - 1) / S3FS_CACHE_BLOCK;
+        for (; blk <= last; blk++) {
+            if (!block_present(e, blk)) {
+                return NULL;
+            }
+        }
+    }
+    return entry_open_data(e) < 0 ? NULL : e;
+}
+
+ssize_t s3fs_cache_read(const char *key, uint8_t *buf, size_t size,
+                        off_t offset)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = entry_lookup_range(key, &size, offset);
+    if (!e) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    if (size == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    e->refs++;
+    entry_touch(e);
+    int fd = e->fd;
+    pthread_mutex_unlock(&cache_lock);
+
+    ssize_t rv = block_transfer(S3FS_IO_READ, fd, buf, size, offset) == 0 ?
+        (ssize_t) size : -1;
+
+    pthread_mutex_lock(&cache_lock);
+    entry_put(e);
+    pthread_mutex_unlock(&cache_lock);
+    return rv;
+}
+
+int s3fs_cache_read_fd(const char *key, size_t size, off_t offset,
+                       uint64_t *gen, int *fd, size_t *len)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = entry_lookup_range(key, &size, offset);
+    int rv = -1;
+    if (e) {
+        rv = 0;
+        if (e->gen != *gen) {
+            int nfd = dup(e->fd);
+            if (nfd < 0) {
+                rv = -1;
+            } else {
+                *fd = nfd;
+                *gen = e->gen;
+            }
+        }
+        if (rv == 0) {
+            *len = size;
+            entry_touch(e);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rv;
+}
+
+int s3fs_cache_fill(const char *key, const char *etag, const uint8_t *buf,
+                    size_t len, off_t offset, int eof)
+{
+    if (offset % S3FS_CACHE_BLOCK != 0 || !etag || !etag[0] || len == 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    if (!cache_enabled) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+
+    cache_entry_t *e = entry_find(key);
+    if (e && strcmp(e->etag, etag) != 0) {
+        // the object changed underneath us; the old data is useless
+        entry_remove(e);
+        e = NULL;
+    }
+    if (!e) {
+        e = calloc(1, sizeof(cache_entry_t));
+        if (!e || !(e->key = strdup(key))) {
+            free(e);
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        snprintf(e->etag, sizeof(e->etag), "%s", etag);
+        e->keyhash = fnv64(key);
+        e->size = -1;
+        e->fd = -1;
+        e->gen = ++cache_gen;
+        entry_insert(e);
+    }
+    if (entry_open_data(e) < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    e->refs++;
+    int fd = e->fd;
+    pthread_mutex_unlock(&cache_lock);
+
+    // the data must be durable before the metadata says it's there
+    int rv = block_transfer(S3FS_IO_WRITE, fd, (uint8_t *) buf, len, offset);
+    if (rv == 0) {
+        rv = s3fs_io_fdatasync(fd);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (rv == 0 && !e->dead) {
+        if (eof) {
+            e->size = offset + len;
+        }
+        uint32_t blk = offset / S3FS_CACHE_BLOCK;
+        size_t done = 0;
+        for (; rv == 0 && done < len; blk++, done += S3FS_CACHE_BLOCK) {
+            // a partial block is only complete if it is the last one
+            if (len - done >= S3FS_CACHE_BLOCK || eof) {
+                rv = block_mark(e, blk);
+            }
+        }
+        cache_total_bytes -= e->bytes;
+        e->bytes = entry_bytes(e);
+        cache_total_bytes += e->bytes;
+        entry_touch(e);
+        e->checked = e->atime;
+        if (rv == 0) {
+            rv = meta_write(e);
+        }
+        evict_until_fits(e);
+    }
+    entry_put(e);
+    pthread_mutex_unlock(&cache_lock);
+    return rv;
+}
+
+int s3fs_cache_etag(const char *key, char *etag, size_t etaglen,
+                    time_t *checked)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = cache_enabled ? entry_find(key) : NULL;
+    if (e) {
+        snprintf(etag, etaglen, "%s", e->etag);
+        *checked = e->checked;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return e != NULL;
+}
+
+void s3fs_cache_validated(const char *key, const char *etag)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = cache_enabled ? entry_find(key) : NULL;
+    if (e && strcmp(e->etag, etag) == 0) {
+        e->checked = time(NULL);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void s3fs_cache_invalidate(const char *key)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = cache_enabled ? entry_find(key) : NULL;
+    if (e) {
+        entry_remove(e);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
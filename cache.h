@@ -0,0 +1,93 @@
+/*
+ * Persistent on-disk block cache for s3 object data.
+ *
+ * Object data is kept in a local directory as one sparse data file per
+ * object, keyed by the object key and its ETag.  Data is cached in
+ * fixed-size blocks (S3FS_CACHE_BLOCK bytes); a per-object metadata file
+ * records which blocks are present.  Metadata files are replaced
+ * atomically (write to a temp file, fsync, rename), and only after the
+ * data they describe has been flushed, so a crash can lose recently
+ * cached blocks but never expose garbage.
+ *
+ * The total amount of cached data is capped; when the cap is exceeded
+ * the least recently used objects are evicted.
+ */
+#ifndef __S3FS_CACHE_H__
+#define __S3FS_CACHE_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+#define S3FS_CACHE_BLOCK (1024 * 1024)
+
+/*
+ * Open (creating if necessary) the cache in directory dir, holding at
+ * most max_bytes of object data.  Existing cache contents are loaded.
+ * Returns 0 on success and -1 on failure; on failure the cache stays
+ * disabled and all other calls are harmless no-ops/misses.
+ */
+int s3fs_cache_init(const char *dir, uint64_t max_bytes);
+
+/*
+ * Persist any in-memory cache state and release all resources.
+ */
+void s3fs_cache_destroy(void);
+
+/*
+ * Returns 1 if the cache has been successfully initialized, 0 otherwise.
+ */
+int s3fs_cache_enabled(void);
+
+/*
+ * Read size bytes at offset from the cached copy of key into buf.
+ * Returns the number of bytes read (which is less than size only at
+ * end of object), or -1 if any part of the range is not cached.
+ */
+ssize_t s3fs_cache_read(const char *key, uint8_t *buf, size_t size,
+                        off_t offset);
+
+/*
+ * Zero-copy variant of s3fs_cache_read: if size bytes at offset of key are
+ * all cached, returns 0 and sets *len to the number of bytes there
+ * (clipped at end of object), which can then be read from the cached copy
+ * at the same offset.  If *gen doesn't name the current cached copy, a new
+ * descriptor for it (which the caller must close) is returned in *fd and
+ * *gen is updated; otherwise the caller's descriptor for *gen is still
+ * good and *fd is left alone.  Start with *gen = 0.  A descriptor stays
+ * valid after its copy is evicted.  Returns -1 on a miss.
+ */
+int s3fs_cache_read_fd(const char *key, size_t size, off_t offset,
+                       uint64_t *gen, int *fd, size_t *len);
+
+/*
+ * Add len bytes of object data for key (with the given ETag) to the cache.
+ * offset must be block aligned.  If eof is non-zero, the data runs up
+ * to the end of the object, so a trailing partial block is complete.
+ * If the cached ETag for key differs from etag, the old data is dropped.
+ * Returns 0 on success and -1 on failure.
+ */
+int s3fs_cache_fill(const char *key, const char *etag, const uint8_t *buf,
+                    size_t len, off_t offset, int eof);
+
+/*
+ * Look up the ETag of the cached copy of key.  Returns 1 if key is cached,
+ * filling in etag and *checked (the last time the cached copy was known to
+ * be current; 0 if it was loaded from disk and hasn't been checked since).
+ * Returns 0 if key is not cached.
+ */
+int s3fs_cache_etag(const char *key, char *etag, size_t etaglen,
+                    time_t *checked);
+
+/*
+ * Record that the cached copy of key is still current, if it has the
+ * given ETag.
+ */
+void s3fs_cache_validated(const char *key, const char *etag);
+
+/*
+ * Drop any cached data for key.
+ */
+void s3fs_cache_invalidate(const char *key);
+
+#endif // __S3FS_CACHE_H__
@@ -0,0 +1,515 @@
+/*
+ * cache_io.c: batched local file I/O for the data cache and spill files.
+ * See cache_io.h for an overview.
+ *
+ * The io_uring path talks to the kernel directly through the io_uring
+ * system calls, so there is no extra library to build against.  Rings
+ * are created lazily, one per calling thread, and torn down when the
+ * thread exits.
+ */
+
+#include "cache_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define IO_RING_ENTRIES 64
+#define IO_STAGING_LEN (1024 * 1024)
+
+#define IO_MODE_SYNC  0 // not initialized: run requests in the caller
+#define IO_MODE_URING 1
+#define IO_MODE_POOL  2
+
+static int io_mode = IO_MODE_SYNC;
+
+
+// synchronous execution (used by the pool workers and as a last resort) -----
+
+static void io_do_sync(s3fs_io_req_t *req)
+{
+    ssize_t rv;
+    do {
+        switch (req->op) {
+        case S3FS_IO_READ:
+            rv = pread(req->fd, req->buf, req->len, req->offset);
+            break;
+        case S3FS_IO_WRITE:
+            rv = pwrite(req->fd, req->buf, req->len, req->offset);
+            break;
+        default:
+            rv = fdatasync(req->fd);
+            break;
+        }
+    } while (rv < 0 && errno == EINTR);
+    req->result = rv < 0 ? -errno : rv;
+}
+
+static int io_batch_ok(const s3fs_io_req_t *reqs, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        if (reqs[i].result < 0 ||
+            (reqs[i].op != S3FS_IO_FSYNC &&
+             (size_t) reqs[i].result != reqs[i].len)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// io_uring ------------------------------------------------------------------
+
+struct io_ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    uint8_t *staging;      // registered buffer, or NULL if registration failed
+};
+
+static pthread_key_t ring_key;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_free(void *arg)
+{
+    struct io_ring *r = (struct io_ring *) arg;
+    if (!r) {
+        return;
+    }
+    if (r->sqes) {
+        munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    free(r->staging);
+    free(r);
+}
+
+static struct io_ring *ring_create(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(IO_RING_ENTRIES, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct io_ring *r = calloc(1, sizeof(struct io_ring));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->sq_entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(0, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+    if (single) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(0, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    r->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = (uint8_t *) r->sq_ptr, *cq = (uint8_t *) r->cq_ptr;
+    r->sq_head = (unsigned *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // the staging buffer is an optimization; carry on without it if the
+    // memlock limit doesn't allow registering it
+    if (posix_memalign((void **) &r->staging, 4096, IO_STAGING_LEN) == 0) {
+        struct iovec iov = { r->staging, IO_STAGING_LEN };
+        if (sys_io_uring_register(fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+            free(r->staging);
+            r->staging = NULL;
+        }
+    } else {
+        r->staging = NULL;
+    }
+    return r;
+
+fail:
+    ring_free(r);
+    return NULL;
+}
+
+static struct io_ring *ring_get(void)
+{
+    struct io_ring *r = pthread_getspecific(ring_key);
+    if (!r) {
+        r = ring_create();
+        if (r) {
+            pthread_setspecific(ring_key, r);
+        }
+    }
+    return r;
+}
+
+static int ring_is_staged(const struct io_ring *r, const s3fs_io_req_t *req)
+{
+    const uint8_t *p = (const uint8_t *) req->buf;
+    return r->staging && p >= r->staging &&
+        p + req->len <= r->staging + IO_STAGING_LEN;
+}
+
+static void ring_prep(struct io_ring *r, struct io_uring_sqe *sqe,
+                      s3fs_io_req_t *req, struct iovec *iov)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    if (req->op == S3FS_IO_FSYNC) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        return;
+    }
+    sqe->off = req->offset;
+    if (ring_is_staged(r, req)) {
+        sqe->opcode = req->op == S3FS_IO_READ ? IORING_OP_READ_FIXED
+                                              : IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t) req->buf;
+        sqe->len = req->len;
+        sqe->buf_index = 0;
+    } else {
+        // readv/writev work on every io_uring capable kernel
+        iov->iov_base = req->buf;
+        iov->iov_len = req->len;
+        sqe->opcode = req->op == S3FS_IO_READ ? IORING_OP_READV
+                                              : IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t) iov;
+        sqe->len = 1;
+    }
+}
+
+static int ring_submit(struct io_ring *r, s3fs_io_req_t *reqs, int count)
+{
+    int next = 0, done = 0;
+    unsigned mask = *r->sq_mask;
+    // iovecs must stay put until their request completes
+    struct iovec *iovs = malloc(sizeof(struct iovec) * count);
+    if (!iovs) {
+        int i;
+        for (i = 0; i < count; i++) {
+            io_do_sync(&reqs[i]);
+        }
+        return io_batch_ok(reqs, count);
+    }
+
+    while (done < count) {
+        // queue as much of the batch as the ring has room for
+        unsigned tail = *r->sq_tail;
+        while (next < count && (unsigned) (next - done) < r->sq_entries) {
+            unsigned idx = tail & mask;
+            ring_prep(r, &r->sqes[idx], &reqs[next], &iovs[next]);
+            r->sqes[idx].user_data = next;
+            r->sq_array[idx] = idx;
+            tail++;
+            next++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned to_submit = tail - __atomic_load_n(r->sq_head,
+                                                    __ATOMIC_ACQUIRE);
+        if (sys_io_uring_enter(r->fd, to_submit, 1,
+                               IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // take back whatever the kernel hasn't consumed and do it
+            // here; requests it already took still complete below
+            unsigned khead = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+            __atomic_store_n(r->sq_tail, khead, __ATOMIC_RELEASE);
+            next -= tail - khead;
+            for (; next < count; next++, done++) {
+                io_do_sync(&reqs[next]);
+            }
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            reqs[cqe->user_data].result = cqe->res;
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    free(iovs);
+    return io_batch_ok(reqs, count);
+}
+
+
+// thread pool fallback ------------------------------------------------------
+
+struct io_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int remaining;
+};
+
+struct io_job {
+    s3fs_io_req_t *req;
+    struct io_batch *batch;
+    struct io_job *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct io_job *pool_head = NULL, *pool_tail = NULL;
+static pthread_t *pool_threads = NULL;
+static int pool_size = 0;
+static int pool_stop = 0;
+
+static void *pool_worker(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!pool_head && !pool_stop) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        if (!pool_head) {
+            break;
+        }
+        struct io_job *job = pool_head;
+        pool_head = job->next;
+        if (!pool_head) {
+            pool_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        io_do_sync(job->req);
+        struct io_batch *batch = job->batch;
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->remaining == 0) {
+            pthread_cond_signal(&batch->cond);
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        pthread_mutex_lock(&pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+static int pool_submit(s3fs_io_req_t *reqs, int count)
+{
+    struct io_job *jobs = malloc(sizeof(struct io_job) * count);
+    if (!jobs) {
+        int i;
+        for (i = 0; i < count; i++) {
+            io_do_sync(&reqs[i]);
+        }
+        return io_batch_ok(reqs, count);
+    }
+
+    struct io_batch batch;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+    batch.remaining = count;
+
+    int i;
+    pthread_mutex_lock(&pool_lock);
+    for (i = 0; i < count; i++) {
+        jobs[i].req = &reqs[i];
+        jobs[i].batch = &batch;
+        jobs[i].next = NULL;
+        if (pool_tail) {
+            pool_tail->next = &jobs[i];
+        } else {
+            pool_head = &jobs[i];
+        }
+        pool_tail = &jobs[i];
+    }
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&batch.cond, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.cond);
+    free(jobs);
+    return io_batch_ok(reqs, count);
+}
+
+
+// public interface ----------------------------------------------------------
+
+int s3fs_io_init(int workers)
+{
+    if (!getenv("S3FS_NO_IO_URING") &&
+        pthread_key_create(&ring_key, ring_free) == 0) {
+        struct io_ring *probe = ring_create();
+        if (probe) {
+            ring_free(probe);
+            io_mode = IO_MODE_URING;
+            fprintf(stderr, "s3fs io: using io_uring\n");
+            return 0;
+        }
+        pthread_key_delete(ring_key);
+    }
+
+    pool_threads = calloc(workers, sizeof(pthread_t));
+    if (!pool_threads) {
+        return -1;
+    }
+    pool_stop = 0;
+    for (pool_size = 0; pool_size < workers; pool_size++) {
+        if (pthread_create(&pool_threads[pool_size], NULL, pool_worker,
+                           NULL) != 0) {
+            break;
+        }
+    }
+    if (pool_size == 0) {
+        free(pool_threads);
+        pool_threads = NULL;
+        return -1;
+    }
+    io_mode = IO_MODE_POOL;
+    fprintf(stderr, "s3fs io: io_uring unavailable, using %d I/O threads\n",
+            pool_size);
+    return 0;
+}
+
+void s3fs_io_destroy(void)
+{
+    if (io_mode == IO_MODE_POOL) {
+        pthread_mutex_lock(&pool_lock);
+        pool_stop = 1;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+        int i;
+        for (i = 0; i < pool_size; i++) {
+            pthread_join(pool_threads[i], NULL);
+        }
+        free(pool_threads);
+        pool_threads = NULL;
+        pool_size = 0;
+    }
+    io_mode = IO_MODE_SYNC;
+}
+
+int s3fs_io_submit(s3fs_io_req_t *reqs, int count)
+{
+    if (count <= 0) {
+        return 0;
+    }
+    if (io_mode == IO_MODE_URING) {
+        struct io_ring *r = ring_get();
+        if (r) {
+            return ring_submit(r, reqs, count);
+        }
+    }
+    if (io_mode == IO_MODE_POOL && count > 1) {
+        return pool_submit(reqs, count);
+    }
+    // a single request gains nothing from being handed to another thread
+    int i;
+    for (i = 0; i < count; i++) {
+        io_do_sync(&reqs[i]);
+    }
+    return io_batch_ok(reqs, count);
+}
+
+ssize_t s3fs_io_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    s3fs_io_req_t req = { S3FS_IO_READ, fd, buf, len, offset, 0 };
+    s3fs_io_submit(&req, 1);
+    return req.result;
+}
+
+ssize_t s3fs_io_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    s3fs_io_req_t req = { S3FS_IO_WRITE, fd, (void *) buf, len, offset, 0 };
+    s3fs_io_submit(&req, 1);
+    return req.result;
+}
+
+int s3fs_io_fdatasync(int fd)
+{
+    s3fs_io_req_t req = { S3FS_IO_FSYNC, fd, NULL, 0, 0, 0 };
+    s3fs_io_submit(&req, 1);
+    return req.result < 0 ? (int) req.result : 0;
+}
+
+void *s3fs_io_staging_buffer(size_t *len)
+{
+    if (io_mode != IO_MODE_URING) {
+        return NULL;
+    }
+    struct io_ring *r = ring_get();
+    if (!r || !r->staging) {
+        return NULL;
+    }
+    *len = IO_STAGING_LEN;
+    return r->staging;
+}
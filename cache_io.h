@@ -0,0 +1,71 @@
+/*
+ * Local file I/O for the data cache and write-back spill files.
+ *
+ * Requests are submitted in batches.  When the kernel supports io_uring,
+ * each calling thread gets its own submission ring (so FUSE threads never
+ * contend with each other for it), and each ring has a registered staging
+ * buffer that cache fills and hits go through to avoid per-request page
+ * pinning.  When
+ * io_uring is not available, batches are spread over a small pool of
+ * worker threads instead.
+ */
+#ifndef __S3FS_CACHE_IO_H__
+#define __S3FS_CACHE_IO_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define S3FS_IO_READ  0
+#define S3FS_IO_WRITE 1
+#define S3FS_IO_FSYNC 2 // fdatasync; buf, len and offset are ignored
+
+typedef struct {
+    int op;          // S3FS_IO_READ, S3FS_IO_WRITE or S3FS_IO_FSYNC
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    ssize_t result;  // set on completion: bytes transferred, or -errno
+} s3fs_io_req_t;
+
+/*
+ * Set up the I/O layer.  workers is the size of the fallback thread pool,
+ * used only when io_uring is unavailable (or disabled by setting the
+ * S3FS_NO_IO_URING environment variable).  Returns 0 on success and -1
+ * on failure, in which case requests are performed synchronously.
+ */
+int s3fs_io_init(int workers);
+
+/*
+ * Stop the worker threads (if any).
+ */
+void s3fs_io_destroy(void);
+
+/*
+ * Perform count requests and wait for all of them to complete.  Requests
+ * within a batch may complete in any order, so a batch must not contain
+ * requests that depend on each other (e.g. a write and the fsync meant
+ * to make it durable).  Returns 0 if every request transferred its full
+ * length (or succeeded, for fsync) and -1 otherwise; see the result field
+ * of each request for details.
+ */
+int s3fs_io_submit(s3fs_io_req_t *reqs, int count);
+
+/*
+ * Single-request conveniences.  Same return values as pread/pwrite/
+ * fdatasync, except that errors are returned as -errno.
+ */
+ssize_t s3fs_io_pread(int fd, void *buf, size_t len, off_t offset);
+ssize_t s3fs_io_pwrite(int fd, const void *buf, size_t len, off_t offset);
+int s3fs_io_fdatasync(int fd);
+
+/*
+ * The calling thread's registered staging buffer, and its length.  Data
+ * staged here (e.g. assembled for a cache fill) is transferred without
+ * pinning pages on every request.  Returns NULL when io_uring is not in
+ * use.  The buffer must not be used across calls that may themselves
+ * use it (it belongs to the thread, not the caller).
+ */
+void *s3fs_io_staging_buffer(size_t *len);
+
+#endif // __S3FS_CACHE_IO_H__
@@ -0,0 +1,228 @@
+/*
+ * chunk.c: content-defined chunking and chunk manifests.  See chunk.h
+ * for an overview.
+ *
+ * Boundaries are found with a gear hash: each byte shifts the hash left
+ * and adds a random value for the byte, so the hash only depends on the
+ * last 64 bytes.  A chunk ends where the low bits of the hash are all
+ * zero, giving chunks of the average size on average, but never shorter
+ * than a quarter of it or longer than four times it.
+ *
+ * Manifest layout: magic and chunk count (32 bits each), data length,
+ * then the end offset (64 bits) and hash of each chunk, in host byte
+ * order.
+ */
+
+#include "chunk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#define MANIFEST_MAGIC 0x43463353   // "S3FC"
+#define MANIFEST_FIXED 16           // manifest bytes before the chunks
+#define MANIFEST_ENTRY (8 + S3FS_CHUNK_HASH)
+
+static size_t chunk_avg = 0;
+static uint64_t chunk_mask;
+static uint64_t gear[256];
+
+
+void s3fs_chunk_init(size_t avg)
+{
+    if (avg == 0) {
+        chunk_avg = 0;
+        return;
+    }
+    size_t size = 64 * 1024;
+    while (size * 2 <= avg && size < 16 * 1024 * 1024) {
+        size *= 2;
+    }
+    chunk_avg = size;
+    chunk_mask = size - 1;
+
+    // the same table every time: stored chunks depend on it
+    uint64_t x = 0x5333465343484e4bULL;
+    int i;
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+int s3fs_chunk_enabled(void)
+{
+    return chunk_avg != 0;
+}
+
+int s3fs_chunk_wanted(size_t len)
+{
+    // anything smaller would be a single chunk anyway
+    return chunk_avg != 0 && len > chunk_avg;
+}
+
+// Length of the chunk at the start of the len bytes of buf
+static size_t chunk_length(const uint8_t *buf, size_t len)
+{
+    size_t min = chunk_avg / 4, max = chunk_avg * 4;
+    if (len <= min) {
+        return len;
+    }
+    if (len > max) {
+        len = max;
+    }
+    uint64_t h = 0;
+    size_t i;
+    for (i = min; i < len; i++) {
+        h = (h << 1) + gear[buf[i]];
+        if ((h & chunk_mask) == 0) {
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+int s3fs_chunk_split(const uint8_t *buf, size_t len, s3fs_manifest_t *m)
+{
+    size_t cap = len / (chunk_avg / 4) + 1;
+    m->chunks = malloc(cap * sizeof(s3fs_chunk_t));
+    if (!m->chunks) {
+        return -1;
+    }
+    m->size = len;
+    m->count = 0;
+    size_t off = 0;
+    while (off < len) {
+        size_t n = chunk_length(buf + off, len - off);
+        s3fs_chunk_t *c = &m->chunks[m->count++];
+        SHA256(buf + off, n, c->hash);
+        off += n;
+        c->end = off;
+    }
+    return 0;
+}
+
+size_t s3fs_manifest_encode(const s3fs_manifest_t *m, uint8_t **out)
+{
+    size_t len = MANIFEST_FIXED + (size_t) m->count * MANIFEST_ENTRY;
+    uint8_t *p = malloc(len);
+    if (!p) {
+        return 0;
+    }
+    uint32_t magic = MANIFEST_MAGIC;
+    memcpy(p, &magic, 4);
+    memcpy(p + 4, &m->count, 4);
+    memcpy(p + 8, &m->size, 8);
+    uint32_t i;
+    for (i = 0; i < m->count; i++) {
+        uint8_t *e = p + MANIFEST_FIXED + (size_t) i * MANIFEST_ENTRY;
+        memcpy(e, &m->chunks[i].end, 8);
+        memcpy(e + 8, m->chunks[i].hash, S3FS_CHUNK_HASH);
+    }
+    *out = p;
+    return len;
+}
+
+int s3fs_manifest_parse(const uint8_t *buf, size_t len, s3fs_manifest_t *m)
+{
+    uint32_t magic, count;
+    uint64_t size;
+    if (len < MANIFEST_FIXED) {
+        return -1;
+    }
+    memcpy(&magic, buf, 4);
+    memcpy(&count, buf + 4, 4);
+    memcpy(&size, buf + 8, 8);
+    if (magic != MANIFEST_MAGIC ||
+        len != MANIFEST_FIXED + (size_t) count * MANIFEST_ENTRY) {
+        return -1;
+    }
+    m->chunks = malloc((count ? count : 1) * sizeof(s3fs_chunk_t));
+    if (!m->chunks) {
+        return -1;
+    }
+    uint64_t prev = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        const uint8_t *e = buf + MANIFEST_FIXED + (size_t) i * MANIFEST_ENTRY;
+        memcpy(&m->chunks[i].end, e, 8);
+        memcpy(m->chunks[i].hash, e + 8, S3FS_CHUNK_HASH);
+        if (m->chunks[i].end <= prev) {
+            break;
+        }
+        prev = m->chunks[i].end;
+    }
+    if (i < count || prev != size) {
+        free(m->chunks);
+        m->chunks = NULL;
+        return -1;
+    }
+    m->size = size;
+    m->count = count;
+    return 0;
+}
+
+void s3fs_manifest_free(s3fs_manifest_t *m)
+{
+    free(m->chunks);
+    m->chunks = NULL;
+}
+
+uint32_t s3fs_manifest_find(const s3fs_manifest_t *m, uint64_t offset)
+{
+    uint32_t lo = 0, hi = m->count - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (m->chunks[mid].end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+uint64_t s3fs_chunk_start(const s3fs_manifest_t *m, uint32_t i)
+{
+    return i ? m->chunks[i - 1].end : 0;
+}
+
+static int hash_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, S3FS_CHUNK_HASH);
+}
+
+ssize_t s3fs_manifest_hashes(const s3fs_manifest_t *m, uint8_t **hashes)
+{
+    uint8_t *h = malloc((m->count ? m->count : 1) * S3FS_CHUNK_HASH);
+    if (!h) {
+        return -1;
+    }
+    uint32_t i;
+    for (i = 0; i < m->count; i++) {
+        memcpy(h + (size_t) i * S3FS_CHUNK_HASH, m->chunks[i].hash, S3FS_CHUNK_HASH);
+    }
+    qsort(h, m->count, S3FS_CHUNK_HASH, hash_cmp);
+    ssize_t n = 0;
+    for (i = 0; i < m->count; i++) {
+        if (n == 0 || hash_cmp(h + (n - 1) * S3FS_CHUNK_HASH, h + (size_t) i * S3FS_CHUNK_HASH)) {
+            memmove(h + n * S3FS_CHUNK_HASH, h + (size_t) i * S3FS_CHUNK_HASH, S3FS_CHUNK_HASH);
+            n++;
+        }
+    }
+    *hashes = h;
+    return n;
+}
+
+void s3fs_chunk_key(const uint8_t *hash, char *key, size_t size)
+{
+    char hex[S3FS_CHUNK_HASH * 2 + 1];
+    int i;
+    for (i = 0; i < S3FS_CHUNK_HASH; i++) {
+        sprintf(hex + 2 * i, "%02x", hash[i]);
+    }
+    snprintf(key, size, "/.s3fs-chunks/%s", hex);
+}
@@ -0,0 +1,85 @@
+/*
+ * Content-defined chunking.
+ *
+ * A large object can be stored as a manifest listing the chunks of its
+ * data, each chunk being stored once, under the hash of its contents (see
+ * libs3_wrapper.c).  Chunk boundaries are chosen by a rolling hash of the
+ * data rather than at fixed offsets, so an insertion or deletion only
+ * changes the chunks around it, and a file that is mostly the same as
+ * another shares most of its chunks.  Storing it again then only uploads
+ * the chunks that aren't stored yet.
+ */
+#ifndef __S3FS_CHUNK_H__
+#define __S3FS_CHUNK_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define S3FS_CHUNK_HASH 32         // SHA-256
+#define S3FS_CHUNK_KEY_MAX 96
+
+typedef struct {
+    uint64_t end;                  // offset just past the chunk
+    uint8_t hash[S3FS_CHUNK_HASH];
+} s3fs_chunk_t;
+
+// The chunks of an object, in order
+typedef struct {
+    uint64_t size;
+    uint32_t count;
+    s3fs_chunk_t *chunks;
+} s3fs_manifest_t;
+
+/*
+ * Chunk objects from now on into chunks of about avg bytes (rounded down
+ * to a power of two, 64 KB to 16 MB); 0 turns chunking off (the default).
+ */
+void s3fs_chunk_init(size_t avg);
+
+/*
+ * Whether chunking is on, and whether an object of len bytes should be
+ * stored chunked.
+ */
+int s3fs_chunk_enabled(void);
+int s3fs_chunk_wanted(size_t len);
+
+/*
+ * Split len bytes of buf into chunks.  Returns 0 on success and -1 if
+ * out of memory.  Free the result with s3fs_manifest_free.
+ */
+int s3fs_chunk_split(const uint8_t *buf, size_t len, s3fs_manifest_t *m);
+
+/*
+ * Encode m as a manifest object; *out is malloc'ed.  Returns its length,
+ * or 0 if out of memory.
+ */
+size_t s3fs_manifest_encode(const s3fs_manifest_t *m, uint8_t **out);
+
+/*
+ * Decode the manifest object in the len bytes of buf.  Returns 0 on
+ * success and -1 if it isn't a valid manifest.
+ */
+int s3fs_manifest_parse(const uint8_t *buf, size_t len, s3fs_manifest_t *m);
+
+void s3fs_manifest_free(s3fs_manifest_t *m);
+
+/*
+ * Index of the chunk holding offset (which must be less than m->size),
+ * and the offset at which chunk i starts.
+ */
+uint32_t s3fs_manifest_find(const s3fs_manifest_t *m, uint64_t offset);
+uint64_t s3fs_chunk_start(const s3fs_manifest_t *m, uint32_t i);
+
+/*
+ * The distinct chunk hashes of m, sorted (with memcmp), S3FS_CHUNK_HASH
+ * bytes each; *hashes is malloc'ed.  Returns their number, or -1 if out
+ * of memory.
+ */
+ssize_t s3fs_manifest_hashes(const s3fs_manifest_t *m, uint8_t **hashes);
+
+/*
+ * The key of the chunk with hash.
+ */
+void s3fs_chunk_key(const uint8_t *hash, char *key, size_t size);
+
+#endif // __S3FS_CHUNK_H__
@@ -0,0 +1,155 @@
+/*
+ * compress.c: the compressed object format.  See compress.h for an
+ * overview.
+ *
+ * Header layout: magic, block size and block count (32 bits each), data
+ * length, then the block offsets (64 bits each), in host byte order.
+ */
+
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define ZHDR_MAGIC 0x5a463353          // "S3FZ"
+#define ZHDR_FIXED 20                  // header bytes before the offsets
+#define ZHDR_MIN_DATA 4096             // smaller objects aren't worth it
+
+static int z_level = 0;
+
+
+void s3fs_compress_init(int level)
+{
+    z_level = level < 0 ? 0 : level > 9 ? 9 : level;
+}
+
+size_t s3fs_zheader_size(uint64_t size)
+{
+    uint64_t nblocks = (size + S3FS_ZBLOCK - 1) / S3FS_ZBLOCK;
+    return ZHDR_FIXED + (nblocks + 1) * sizeof(uint64_t);
+}
+
+ssize_t s3fs_compress(const uint8_t *buf, size_t len, uint8_t **out)
+{
+    if (z_level == 0 || len < ZHDR_MIN_DATA) {
+        return 0;
+    }
+    // probe: the first block has to shrink by an eighth
+    uLongf probe = compressBound(S3FS_ZBLOCK);
+    uint8_t *obj = malloc(s3fs_zheader_size(len) + (len / S3FS_ZBLOCK + 1) * probe);
+    if (!obj) {
+        return 0;
+    }
+    size_t first = len < S3FS_ZBLOCK ? len : S3FS_ZBLOCK;
+    size_t hdr = s3fs_zheader_size(len);
+    if (compress2(obj + hdr, &probe, buf, first, z_level) != Z_OK ||
+        probe > first - first / 8) {
+        free(obj);
+        return 0;
+    }
+
+    uint32_t nblocks = (len + S3FS_ZBLOCK - 1) / S3FS_ZBLOCK;
+    uint32_t magic = ZHDR_MAGIC, block = S3FS_ZBLOCK;
+    uint64_t size = len;
+    memcpy(obj, &magic, 4);
+    memcpy(obj + 4, &block, 4);
+    memcpy(obj + 8, &nblocks, 4);
+    memcpy(obj + 12, &size, 8);
+    uint64_t off = hdr;
+    uint32_t i;
+    for (i = 0; i < nblocks; i++) {
+        memcpy(obj + ZHDR_FIXED + i * 8, &off, 8);
+        size_t raw = len - (size_t) i * S3FS_ZBLOCK < S3FS_ZBLOCK ?
+                     len - (size_t) i * S3FS_ZBLOCK : S3FS_ZBLOCK;
+        const uint8_t *src = buf + (size_t) i * S3FS_ZBLOCK;
+        uLongf zlen = compressBound(raw);
+        if (i == 0) {
+            zlen = probe; // already done
+        } else if (compress2(obj + off, &zlen, src, raw, z_level) != Z_OK) {
+            zlen = raw;
+        }
+        if (zlen >= raw) {
+            memcpy(obj + off, src, raw); // incompressible block
+            zlen = raw;
+        }
+        off += zlen;
+    }
+    memcpy(obj + ZHDR_FIXED + nblocks * 8, &off, 8);
+    *out = obj;
+    return off;
+}
+
+int s3fs_zindex_parse(const uint8_t *buf, size_t len, s3fs_zindex_t *ix)
+{
+    uint32_t magic, block, nblocks;
+    uint64_t size;
+    if (len < ZHDR_FIXED) {
+        return -1;
+    }
+    memcpy(&magic, buf, 4);
+    memcpy(&block, buf + 4, 4);
+    memcpy(&nblocks, buf + 8, 4);
+    memcpy(&size, buf + 12, 8);
+    if (magic != ZHDR_MAGIC || block != S3FS_ZBLOCK ||
+        nblocks != (size + S3FS_ZBLOCK - 1) / S3FS_ZBLOCK ||
+        len < s3fs_zheader_size(size)) {
+        return -1;
+    }
+    ix->offsets = malloc((nblocks + 1) * sizeof(uint64_t));
+    if (!ix->offsets) {
+        return -1;
+    }
+    memcpy(ix->offsets, buf + ZHDR_FIXED, (nblocks + 1) * sizeof(uint64_t));
+    ix->size = size;
+    ix->nblocks = nblocks;
+    return 0;
+}
+
+void s3fs_zindex_free(s3fs_zindex_t *ix)
+{
+    free(ix->offsets);
+    ix->offsets = NULL;
+}
+
+void s3fs_zrange(const s3fs_zindex_t *ix, uint64_t start, uint64_t end,
+                 uint64_t *obj_start, uint64_t *obj_end)
+{
+    *obj_start = ix->offsets[start / S3FS_ZBLOCK];
+    *obj_end = ix->offsets[(end + S3FS_ZBLOCK - 1) / S3FS_ZBLOCK];
+}
+
+int s3fs_zdecode(const s3fs_zindex_t *ix, const uint8_t *blocks,
+                 uint64_t start, uint64_t end, uint8_t *out)
+{
+    uint64_t base = ix->offsets[start / S3FS_ZBLOCK];
+    uint8_t *tmp = NULL;
+    uint64_t b;
+    for (b = start / S3FS_ZBLOCK; b * S3FS_ZBLOCK < end; b++) {
+        uint64_t bstart = b * S3FS_ZBLOCK;
+        size_t raw = ix->size - bstart < S3FS_ZBLOCK ? ix->size - bstart : S3FS_ZBLOCK;
+        size_t zlen = ix->offsets[b + 1] - ix->offsets[b];
+        const uint8_t *src = blocks + (ix->offsets[b] - base);
+        const uint8_t *data = src;
+        if (zlen < raw) {
+            uLongf got = raw;
+            if (!tmp && !(tmp = malloc(S3FS_ZBLOCK))) {
+                return -1;
+            }
+            if (uncompress(tmp, &got, src, zlen) != Z_OK || got != raw) {
+                free(tmp);
+                return -1;
+            }
+            data = tmp;
+        } else if (zlen != raw) {
+            free(tmp);
+            return -1;
+        }
+        // copy the part of this block that is in [start, end)
+        uint64_t from = start > bstart ? start - bstart : 0;
+        uint64_t to = end - bstart < raw ? end - bstart : raw;
+        memcpy(out + (bstart + from - start), data + from, to - from);
+    }
+    free(tmp);
+    return 0;
+}
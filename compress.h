@@ -0,0 +1,73 @@
+/*
+ * Compressed object format.
+ *
+ * An object is compressed in independent blocks of S3FS_ZBLOCK bytes,
+ * behind a header that holds the length of the data and the offset of
+ * every block in the object.  Any range of the data can then be read by
+ * fetching the header once and then just the blocks that cover the
+ * range, so ranged gets keep working on compressed objects.  A block
+ * that doesn't get smaller is stored as it is.
+ *
+ * Whether to compress is decided per object, by compressing its first
+ * block: data that doesn't shrink by at least an eighth is stored
+ * unchanged.  Compressed objects are marked by object metadata (see
+ * libs3_wrapper.c), which does the encoding and decoding on the way to
+ * and from s3.
+ */
+#ifndef __S3FS_COMPRESS_H__
+#define __S3FS_COMPRESS_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define S3FS_ZBLOCK (256 * 1024)
+
+// The header of a compressed object.
+typedef struct {
+    uint64_t size;        // length of the data
+    uint32_t nblocks;
+    uint64_t *offsets;    // nblocks + 1 offsets into the object
+} s3fs_zindex_t;
+
+/*
+ * Set the zlib compression level for objects written from now on, 1 to
+ * 9; 0 turns compression off (the default).
+ */
+void s3fs_compress_init(int level);
+
+/*
+ * Compress len bytes of buf if it is worth it.  Returns the length of
+ * the compressed object and sets *out to it (malloc'ed), or returns 0
+ * if the data should be stored as it is.
+ */
+ssize_t s3fs_compress(const uint8_t *buf, size_t len, uint8_t **out);
+
+/*
+ * Length of the header of a compressed object holding size bytes.
+ */
+size_t s3fs_zheader_size(uint64_t size);
+
+/*
+ * Read the header at the start of a compressed object from the len bytes
+ * of buf.  Returns 0 on success and -1 if it isn't a valid header.  The
+ * offsets are malloc'ed; see s3fs_zindex_free.
+ */
+int s3fs_zindex_parse(const uint8_t *buf, size_t len, s3fs_zindex_t *ix);
+
+void s3fs_zindex_free(s3fs_zindex_t *ix);
+
+/*
+ * Range of the object that holds data bytes [start, end).
+ */
+void s3fs_zrange(const s3fs_zindex_t *ix, uint64_t start, uint64_t end,
+                 uint64_t *obj_start, uint64_t *obj_end);
+
+/*
+ * Decompress data bytes [start, end) into out, from blocks read from the
+ * object range given by s3fs_zrange, in blocks.  Returns 0 on success
+ * and -1 if the blocks are corrupt.
+ */
+int s3fs_zdecode(const s3fs_zindex_t *ix, const uint8_t *blocks,
+                 uint64_t start, uint64_t end, uint8_t *out);
+
+#endif // __S3FS_COMPRESS_H__
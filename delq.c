@@ -0,0 +1,349 @@
+/*
+ * delq.c: background deletion of s3 objects.  See delq.h for an overview.
+ *
+ * The journal is a text file of "+key" (queued) and "-key" (deleted or
+ * taken back) lines, with backslash and newline escaped.  It is rewritten
+ * with only the live entries at startup and emptied whenever the queue
+ * drains.  Appends are synced before the deletions they describe are
+ * sent, and a cancellation before the object is created again, so a crash
+ * can at worst leave an object behind, never delete one that was created
+ * again.
+ */
+
+#include "delq.h"
+#include "libs3_wrapper.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DELQ_WORKERS 16
+#define DELQ_HASH_BUCKETS 4096
+
+enum { DEL_QUEUED, DEL_INFLIGHT, DEL_CANCELLED };
+
+typedef struct del_entry {
+    char *key;
+    int state;
+    struct del_entry *hnext;      // hash chain (queued and in-flight only)
+    struct del_entry *next;       // queue order
+} del_entry_t;
+
+static pthread_mutex_t delq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;   // queue grew
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;   // one finished
+static del_entry_t *delq_table[DELQ_HASH_BUCKETS];
+static del_entry_t *delq_head = NULL, *delq_tail = NULL;
+static int delq_live = 0;          // queued or in flight
+static char *delq_bucket = NULL;
+static int journal_fd = -1;
+static int journal_unsynced = 0;
+static int delq_stop = 0;
+static int delq_nworkers = 0;
+static pthread_t delq_workers[DELQ_WORKERS];
+
+
+static unsigned delq_hash(const char *key)
+{
+    unsigned h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % DELQ_HASH_BUCKETS;
+}
+
+static del_entry_t *delq_find(const char *key)
+{
+    del_entry_t *e = delq_table[delq_hash(key)];
+    while (e && strcmp(e->key, key) != 0) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void delq_unhash(del_entry_t *e)
+{
+    del_entry_t **pp = &delq_table[delq_hash(e->key)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    delq_live--;
+}
+
+// Append one journal record.  Called with delq_lock held.
+static void journal_append(char op, const char *key)
+{
+    if (journal_fd < 0) {
+        return;
+    }
+    size_t len = strlen(key);
+    char *line = malloc(2 * len + 3);
+    if (!line) {
+        return;
+    }
+    size_t n = 0;
+    line[n++] = op;
+    for (; *key; key++) {
+        if (*key == '\\' || *key == '\n') {
+            line[n++] = '\\';
+            line[n++] = *key == '\n' ? 'n' : '\\';
+        } else {
+            line[n++] = *key;
+        }
+    }
+    line[n++] = '\n';
+    if (write(journal_fd, line, n) != (ssize_t) n) {
+        fprintf(stderr, "s3fs delq: journal write failed: %s\n",
+                strerror(errno));
+    }
+    journal_unsynced = 1;
+    free(line);
+}
+
+// Queue key.  Called with delq_lock held.
+static int delq_push(const char *key)
+{
+    if (delq_find(key)) {
+        return 0;
+    }
+    del_entry_t *e = calloc(1, sizeof(del_entry_t));
+    if (!e || !(e->key = strdup(key))) {
+        free(e);
+        return -1;
+    }
+    e->state = DEL_QUEUED;
+    unsigned h = delq_hash(key);
+    e->hnext = delq_table[h];
+    delq_table[h] = e;
+    if (delq_tail) {
+        delq_tail->next = e;
+    } else {
+        delq_head = e;
+    }
+    delq_tail = e;
+    delq_live++;
+    return 0;
+}
+
+static void *delq_worker(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&delq_lock);
+    for (;;) {
+        // skip over entries that were taken back
+        while (delq_head && delq_head->state == DEL_CANCELLED) {
+            del_entry_t *e = delq_head;
+            delq_head = e->next;
+            if (!delq_head) {
+                delq_tail = NULL;
+            }
+            free(e->key);
+            free(e);
+        }
+        if (!delq_head) {
+            if (delq_stop) {
+                break;
+            }
+            pthread_cond_wait(&work_cond, &delq_lock);
+            continue;
+        }
+        if (delq_stop && journal_fd >= 0) {
+            break; // the journal keeps the rest for next time
+        }
+        del_entry_t *e = delq_head;
+        delq_head = e->next;
+        if (!delq_head) {
+            delq_tail = NULL;
+        }
+        e->state = DEL_INFLIGHT;
+        int sync = journal_unsynced;
+        journal_unsynced = 0;
+        pthread_mutex_unlock(&delq_lock);
+
+        // the record of this deletion must outlive us before it happens
+        if (sync) {
+            fdatasync(journal_fd);
+        }
+        int rv = s3fs_remove_object(delq_bucket, e->key);
+
+        pthread_mutex_lock(&delq_lock);
+        if (rv < 0) {
+            fprintf(stderr, "s3fs delq: failed to delete %s\n", e->key);
+        }
+        journal_append('-', e->key);
+        delq_unhash(e);
+        if (delq_live == 0 && journal_fd >= 0 && ftruncate(journal_fd, 0) == 0) {
+            journal_unsynced = 0;
+        }
+        pthread_cond_broadcast(&done_cond);
+        free(e->key);
+        free(e);
+    }
+    pthread_mutex_unlock(&delq_lock);
+    return NULL;
+}
+
+// Queue the deletions left in the journal, then rewrite it with just
+// those.  Called before the workers start.
+static void journal_replay(void)
+{
+    struct stat st;
+    if (fstat(journal_fd, &st) < 0 || st.st_size == 0) {
+        return;
+    }
+    char *data = malloc(st.st_size + 1);
+    if (!data || pread(journal_fd, data, st.st_size, 0) != st.st_size) {
+        free(data);
+        return;
+    }
+    data[st.st_size] = '\n';
+    char key[PATH_MAX];
+    char *p = data, *end = data + st.st_size;
+    while (p < end) {
+        char op = *p++;
+        size_t n = 0;
+        while (p < end && *p != '\n') {
+            char c = *p++;
+            if (c == '\\' && p < end) {
+                c = *p++ == 'n' ? '\n' : '\\';
+            }
+            if (n < sizeof(key) - 1) {
+                key[n++] = c;
+            }
+        }
+        p++;
+        key[n] = '\0';
+        if (op == '+') {
+            delq_push(key);
+        } else if (op == '-') {
+            del_entry_t *e = delq_find(key);
+            if (e) {
+                delq_unhash(e);
+                e->state = DEL_CANCELLED;
+            }
+        }
+    }
+    free(data);
+
+    if (ftruncate(journal_fd, 0) == 0) {
+        del_entry_t *e;
+        for (e = delq_head; e; e = e->next) {
+            if (e->state == DEL_QUEUED) {
+                journal_append('+', e->key);
+            }
+        }
+        fdatasync(journal_fd);
+        journal_unsynced = 0;
+    }
+    fprintf(stderr, "s3fs delq: resuming %d deletions\n", delq_live);
+}
+
+
+int s3fs_delq_init(const char *bucket, const char *dir)
+{
+    delq_bucket = strdup(bucket);
+    if (!delq_bucket) {
+        return -1;
+    }
+    if (dir) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/delete.journal", dir);
+        journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+        if (journal_fd < 0) {
+            fprintf(stderr, "s3fs delq: can't open %s: %s\n", path,
+                    strerror(errno));
+        } else {
+            journal_replay();
+        }
+    }
+    delq_stop = 0;
+    while (delq_nworkers < DELQ_WORKERS &&
+           pthread_create(&delq_workers[delq_nworkers], NULL, delq_worker,
+                          NULL) == 0) {
+        delq_nworkers++;
+    }
+    if (delq_nworkers == 0) {
+        s3fs_delq_destroy();
+        return -1;
+    }
+    pthread_mutex_lock(&delq_lock);
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&delq_lock);
+    return 0;
+}
+
+void s3fs_delq_destroy(void)
+{
+    pthread_mutex_lock(&delq_lock);
+    delq_stop = 1;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&delq_lock);
+    while (delq_nworkers > 0) {
+        pthread_join(delq_workers[--delq_nworkers], NULL);
+    }
+
+    // whatever is left is in the journal
+    while (delq_head) {
+        del_entry_t *e = delq_head;
+        delq_head = e->next;
+        if (e->state != DEL_CANCELLED) {
+            delq_unhash(e);
+        }
+        free(e->key);
+        free(e);
+    }
+    delq_tail = NULL;
+    if (journal_fd >= 0) {
+        fdatasync(journal_fd);
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    free(delq_bucket);
+    delq_bucket = NULL;
+}
+
+int s3fs_delq_add(const char *key)
+{
+    pthread_mutex_lock(&delq_lock);
+    if (delq_nworkers == 0 || delq_push(key) < 0) {
+        pthread_mutex_unlock(&delq_lock);
+        return delq_bucket ? s3fs_remove_object(delq_bucket, key) : -1;
+    }
+    journal_append('+', key);
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&delq_lock);
+    return 0;
+}
+
+void s3fs_delq_cancel(const char *key)
+{
+    pthread_mutex_lock(&delq_lock);
+    del_entry_t *e;
+    while ((e = delq_find(key)) && e->state == DEL_INFLIGHT) {
+        pthread_cond_wait(&done_cond, &delq_lock);
+    }
+    int sync = 0;
+    if (e) {
+        delq_unhash(e);
+        e->state = DEL_CANCELLED;
+        journal_append('-', key);
+        if (delq_live == 0 && journal_fd >= 0 && ftruncate(journal_fd, 0) == 0) {
+            journal_unsynced = 0;
+        }
+        sync = journal_fd >= 0;
+    }
+    pthread_mutex_unlock(&delq_lock);
+
+    // the caller creates key next; once a later sync has made the "+key"
+    // durable, a replay must find this record too
+    if (sync) {
+        fdatasync(journal_fd);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * Background deletion of s3 objects.
+ *
+ * Removing a file or directory takes it out of the namespace right away,
+ * but the DELETE of its object is only queued here; a pool of threads
+ * drains the queue in parallel.  The queue is journaled in a local file
+ * (when there is a cache directory to keep it in), so deletions that were
+ * still pending at a crash or unmount are picked up at the next start.
+ *
+ * A key that is created again while its deletion is pending must be
+ * taken back out of the queue first, or the new object would be deleted.
+ *
+ * libs3 has no multi-object delete, so every object is one DELETE.
+ */
+#ifndef __S3FS_DELQ_H__
+#define __S3FS_DELQ_H__
+
+/*
+ * Start deleting in the background from bucket.  If dir is non-NULL the
+ * queue is journaled there, and deletions left in the journal by an
+ * earlier run are queued again.  Returns 0 on success and -1 on failure,
+ * in which case deletions happen synchronously.
+ */
+int s3fs_delq_init(const char *bucket, const char *dir);
+
+/*
+ * Stop the deletion threads.  Deletions still queued stay in the journal
+ * for next time; without a journal they are finished first.
+ */
+void s3fs_delq_destroy(void);
+
+/*
+ * Queue the object key for deletion.  Returns 0, or (if the queue isn't
+ * running) the result of deleting it right away.
+ */
+int s3fs_delq_add(const char *key);
+
+/*
+ * Take key out of the queue before it is created again, waiting for its
+ * deletion to finish if that is already under way.  The cancellation is
+ * in the journal (synced) when this returns.
+ */
+void s3fs_delq_cancel(const char *key);
+
+#endif // __S3FS_DELQ_H__
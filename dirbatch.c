@@ -0,0 +1,651 @@
+/*
+ * dirbatch.c: group commit of directory changes.  See dirbatch.h for an
+ * overview.
+ */
+
+#include "dirbatch.h"
+#include "journal.h"
+#include "metacache.h"
+#include "pack.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define DIR_HASH_BUCKETS 256
+#define PEND_HASH_BUCKETS 256
+#define DIR_MAX_PENDING 4096     // write out early past this many changes
+#define DIR_RETRY_MS 1000        // wait after a failed write out
+
+// One queued change: ent replaces the entry with its name, or (del) the
+// entry with that name goes away.
+typedef struct pend {
+    int del;
+    int seen;                    // scratch, for apply_set
+    s3dirent_t ent;
+    struct pend *hnext;          // hash chain, by name
+    struct pend *next;           // in the order names were first changed
+} pend_t;
+
+typedef struct {
+    pend_t *hash[PEND_HASH_BUCKETS];
+    pend_t *head, *tail;
+    int count;
+    int64_t first_ms;            // when the first change was queued
+} pendset_t;
+
+typedef struct dir_state {
+    char *key;
+    pendset_t *pending;          // queued changes
+    pendset_t *inflight;         // changes being written out
+    int flushing;
+    int waiters;                 // threads waiting to flush
+    int readers;                 // threads in s3fs_dir_get
+    uint64_t flushes;            // bumped whenever a flush finishes
+    int64_t retry_ms;            // earliest time to try again after a failure
+    struct dir_state *hnext;
+} dir_state_t;
+
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dir_cond = PTHREAD_COND_INITIALIZER;  // a flush finished
+static pthread_cond_t commit_cond;                          // wakes the thread
+static dir_state_t *dir_table[DIR_HASH_BUCKETS];
+static char *dir_bucket = NULL;
+static int dir_window_ms = 0;
+static int dir_stop = 0;
+static int dir_thread_running = 0;
+static pthread_t dir_thread;
+
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned key_hash(const char *key)
+{
+    unsigned h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % DIR_HASH_BUCKETS;
+}
+
+// entry names compare without case, like everywhere else in s3fs
+static unsigned name_hash(const char *name)
+{
+    unsigned h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char) tolower((unsigned char) *name++);
+    }
+    return h % PEND_HASH_BUCKETS;
+}
+
+
+static pendset_t *pend_new(void)
+{
+    pendset_t *set = calloc(1, sizeof(pendset_t));
+    if (set) {
+        set->first_ms = now_ms();
+    }
+    return set;
+}
+
+static void pend_free(pendset_t *set)
+{
+    if (!set) {
+        return;
+    }
+    pend_t *p = set->head;
+    while (p) {
+        pend_t *next = p->next;
+        free(p);
+        p = next;
+    }
+    free(set);
+}
+
+static pend_t *pend_find(pendset_t *set, const char *name)
+{
+    pend_t *p = set->hash[name_hash(name)];
+    while (p && strcasecmp(p->ent.name, name) != 0) {
+        p = p->hnext;
+    }
+    return p;
+}
+
+static int pend_upsert(pendset_t *set, int del, const s3dirent_t *ent)
+{
+    pend_t *p = pend_find(set, ent->name);
+    if (!p) {
+        p = calloc(1, sizeof(pend_t));
+        if (!p) {
+            return -ENOMEM;
+        }
+        unsigned h = name_hash(ent->name);
+        p->hnext = set->hash[h];
+        set->hash[h] = p;
+        if (set->tail) {
+            set->tail->next = p;
+        } else {
+            set->head = p;
+        }
+        set->tail = p;
+        set->count++;
+    }
+    p->del = del;
+    p->ent = *ent;
+    return 0;
+}
+
+// Lay the changes in set over the n entries of *dirs, replacing *dirs.
+// Called with dir_lock held (for the scratch marks).
+static int apply_set(s3dirent_t **dirs, ssize_t *n, pendset_t *set)
+{
+    s3dirent_t *out = malloc((*n + set->count) * sizeof(s3dirent_t));
+    if (!out) {
+        return -1;
+    }
+    ssize_t i, k = 0;
+    for (i = 0; i < *n; i++) {
+        pend_t *p = pend_find(set, (*dirs)[i].name);
+        if (!p) {
+            out[k++] = (*dirs)[i];
+        } else {
+            p->seen = 1;
+            if (!p->del) {
+                out[k++] = p->ent;
+            }
+        }
+    }
+    pend_t *p;
+    for (p = set->head; p; p = p->next) {
+        if (!p->seen && !p->del) {
+            out[k++] = p->ent;
+        }
+        p->seen = 0;
+    }
+    free(*dirs);
+    *dirs = out;
+    *n = k;
+    return 0;
+}
+
+
+static dir_state_t *dir_find(const char *key)
+{
+    dir_state_t *s = dir_table[key_hash(key)];
+    while (s && strcmp(s->key, key) != 0) {
+        s = s->hnext;
+    }
+    return s;
+}
+
+static dir_state_t *dir_find_or_add(const char *key)
+{
+    dir_state_t *s = dir_find(key);
+    if (s) {
+        return s;
+    }
+    s = calloc(1, sizeof(dir_state_t));
+    if (!s || !(s->key = strdup(key))) {
+        free(s);
+        return NULL;
+    }
+    unsigned h = key_hash(key);
+    s->hnext = dir_table[h];
+    dir_table[h] = s;
+    return s;
+}
+
+// Free s if nothing refers to it any more.  Called with dir_lock held.
+static void dir_release(dir_state_t *s)
+{
+    if (s->pending || s->inflight || s->flushing || s->waiters || s->readers) {
+        return;
+    }
+    dir_state_t **pp = &dir_table[key_hash(s->key)];
+    while (*pp != s) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = s->hnext;
+    free(s->key);
+    free(s);
+}
+
+// A directory object stores each entry without the unused part of its
+// inline data.
+#define ENT_HEADER offsetof(s3dirent_t, data)
+
+static size_t ent_stored_size(const s3dirent_t *ent)
+{
+    return ENT_HEADER + (ent->inlined ? ent->inline_len : 0);
+}
+
+// Pack the n entries of dirs into a directory object.  Returns its
+// length, or -1.
+static ssize_t encode_dir(const s3dirent_t *dirs, ssize_t n, uint8_t **buf)
+{
+    size_t len = 0;
+    ssize_t i;
+    for (i = 0; i < n; i++) {
+        len += ent_stored_size(&dirs[i]);
+    }
+    uint8_t *out = malloc(len);
+    if (!out) {
+        return -1;
+    }
+    size_t off = 0;
+    for (i = 0; i < n; i++) {
+        size_t size = ent_stored_size(&dirs[i]);
+        memcpy(out + off, &dirs[i], size);
+        off += size;
+    }
+    *buf = out;
+    return len;
+}
+
+// Unpack a directory object.  Returns the number of entries, or -1 if it
+// is malformed.
+static ssize_t decode_dir(const uint8_t *buf, size_t len, s3dirent_t **dirs)
+{
+    ssize_t n = 0, cap = 16;
+    s3dirent_t *out = malloc(cap * sizeof(s3dirent_t));
+    size_t off = 0;
+    while (out && off < len) {
+        if (n == cap) {
+            s3dirent_t *more = realloc(out, 2 * cap * sizeof(s3dirent_t));
+            if (!more) {
+                break;
+            }
+            out = more;
+            cap *= 2;
+        }
+        s3dirent_t *ent = &out[n];
+        if (len - off < ENT_HEADER) {
+            break;
+        }
+        memcpy(ent, buf + off, ENT_HEADER);
+        size_t size = ent_stored_size(ent);
+        if (ent->inline_len > S3FS_INLINE_MAX || len - off < size) {
+            break;
+        }
+        memcpy(ent->data, buf + off + ENT_HEADER, size - ENT_HEADER);
+        off += size;
+        n++;
+    }
+    if (!out || off < len || n == 0) {
+        free(out);
+        return -1;
+    }
+    *dirs = out;
+    return n;
+}
+
+ssize_t s3fs_dir_decode(const uint8_t *buf, size_t len, s3dirent_t **dirs)
+{
+    return decode_dir(buf, len, dirs);
+}
+
+// Read the stored copy of dir.  A copy about to be rewritten (current) is
+// checked with s3 first, so changes made elsewhere aren't overwritten.
+// Returns the number of entries, or -1.
+static ssize_t load_base(const char *dir, s3dirent_t **dirs, int current)
+{
+    uint8_t *buf = NULL;
+    ssize_t size = current ? s3fs_meta_get_current(dir_bucket, dir, &buf)
+                           : s3fs_meta_get(dir_bucket, dir, &buf);
+    ssize_t n = size < 0 ? -1 : decode_dir(buf, size, dirs);
+    free(buf);
+    return n;
+}
+
+// Write out the pending changes of s.  Called with dir_lock held, s not
+// being flushed and s->pending set; returns with dir_lock held.
+static int flush_locked(dir_state_t *s)
+{
+    s->inflight = s->pending;
+    s->pending = NULL;
+    s->flushing = 1;
+    // every change being written out was journaled by now
+    uint64_t seq = s3fs_journal_seq();
+    pthread_mutex_unlock(&dir_lock);
+
+    int rv = -EIO;
+    s3dirent_t *dirs = NULL;
+    ssize_t n = load_base(s->key, &dirs, 1);
+    if (n >= 0) {
+        pthread_mutex_lock(&dir_lock);
+        int applied = apply_set(&dirs, &n, s->inflight);
+        pthread_mutex_unlock(&dir_lock);
+        uint8_t *buf = NULL;
+        // entries may point into packs that aren't stored yet
+        ssize_t len = applied == 0 && s3fs_pack_sync() == 0 ? encode_dir(dirs, n, &buf) : -1;
+        if (len > 0 && s3fs_meta_put(dir_bucket, s->key, buf, len) == len) {
+            s3fs_journal_done_dir(s->key, seq);
+            rv = 0;
+        }
+        free(buf);
+    }
+    free(dirs);
+
+    pthread_mutex_lock(&dir_lock);
+    if (rv < 0) {
+        // keep the changes for another try, under any made since
+        fprintf(stderr, "s3fs dirbatch: failed to write out %s\n", s->key);
+        pendset_t *later = s->pending;
+        s->pending = s->inflight;
+        if (later) {
+            pend_t *p;
+            for (p = later->head; p; p = p->next) {
+                pend_upsert(s->pending, p->del, &p->ent);
+            }
+            pend_free(later);
+        }
+        s->retry_ms = now_ms() + DIR_RETRY_MS;
+    } else {
+        pend_free(s->inflight);
+    }
+    s->inflight = NULL;
+    s->flushing = 0;
+    s->flushes++;
+    pthread_cond_broadcast(&dir_cond);
+    return rv;
+}
+
+// Find a directory whose changes are due to be written out.  Called with
+// dir_lock held.
+static dir_state_t *find_due(int64_t now)
+{
+    int i;
+    for (i = 0; i < DIR_HASH_BUCKETS; i++) {
+        dir_state_t *s;
+        for (s = dir_table[i]; s; s = s->hnext) {
+            if (s->pending && !s->flushing && now >= s->retry_ms &&
+                (s->pending->count >= DIR_MAX_PENDING ||
+                 now - s->pending->first_ms >= dir_window_ms)) {
+                return s;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *commit_thread(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&dir_lock);
+    while (!dir_stop) {
+        // check twice per window, so no change waits much past it
+        int64_t wake = now_ms() + (dir_window_ms > 20 ? dir_window_ms / 2 : 10);
+        struct timespec ts = { wake / 1000, (wake % 1000) * 1000000 };
+        pthread_cond_timedwait(&commit_cond, &dir_lock, &ts);
+        dir_state_t *s;
+        while (!dir_stop && (s = find_due(now_ms()))) {
+            flush_locked(s);
+            dir_release(s);
+        }
+    }
+    pthread_mutex_unlock(&dir_lock);
+    return NULL;
+}
+
+static int queue_change(const char *dir, int del, const s3dirent_t *ent)
+{
+    pthread_mutex_lock(&dir_lock);
+    dir_state_t *s = dir_find_or_add(dir);
+    if (!s) {
+        pthread_mutex_unlock(&dir_lock);
+        return -ENOMEM;
+    }
+    int rv = -ENOMEM;
+    if (s->pending || (s->pending = pend_new())) {
+        rv = pend_upsert(s->pending, del, ent);
+        if (rv == 0) {
+            s3fs_journal_dir(dir, del, ent);
+        }
+        if (s->pending->count >= DIR_MAX_PENDING) {
+            pthread_cond_signal(&commit_cond);
+        }
+        if (s->pending->count == 0) {
+            pend_free(s->pending);
+            s->pending = NULL;
+        }
+    }
+    int now = !dir_thread_running;
+    dir_release(s);
+    pthread_mutex_unlock(&dir_lock);
+    if (rv == 0 && now) {
+        rv = s3fs_dir_flush(dir);
+    }
+    return rv;
+}
+
+
+void s3fs_dir_init(const char *bucket, int window_ms)
+{
+    dir_bucket = strdup(bucket);
+    dir_window_ms = window_ms;
+    if (window_ms <= 0) {
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&commit_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    dir_stop = 0;
+    if (pthread_create(&dir_thread, NULL, commit_thread, NULL) == 0) {
+        dir_thread_running = 1;
+    } else {
+        fprintf(stderr, "s3fs dirbatch: no commit thread, writing through\n");
+    }
+}
+
+void s3fs_dir_destroy(void)
+{
+    if (dir_thread_running) {
+        pthread_mutex_lock(&dir_lock);
+        dir_stop = 1;
+        pthread_cond_signal(&commit_cond);
+        pthread_mutex_unlock(&dir_lock);
+        pthread_join(dir_thread, NULL);
+        dir_thread_running = 0;
+        pthread_cond_destroy(&commit_cond);
+    }
+    s3fs_dir_flush_all();
+    free(dir_bucket);
+    dir_bucket = NULL;
+}
+
+ssize_t s3fs_dir_get(const char *dir, s3dirent_t **dirs)
+{
+    // kept while the object loads, so its flushes can be counted
+    pthread_mutex_lock(&dir_lock);
+    dir_state_t *s = dir_find_or_add(dir);
+    if (!s) {
+        pthread_mutex_unlock(&dir_lock);
+        return -1;
+    }
+    s->readers++;
+    pthread_mutex_unlock(&dir_lock);
+    for (;;) {
+        pthread_mutex_lock(&dir_lock);
+        uint64_t flushes = s->flushes;
+        pthread_mutex_unlock(&dir_lock);
+
+        s3dirent_t *d = NULL;
+        ssize_t n = load_base(dir, &d, 0);
+        pthread_mutex_lock(&dir_lock);
+        if (n >= 0 && flushes != s->flushes) {
+            // a flush may have taken changes out of the queue that our
+            // copy of the object predates
+            pthread_mutex_unlock(&dir_lock);
+            free(d);
+            continue;
+        }
+        int rv = n < 0 ? -1 : 0;
+        if (rv == 0 && s->inflight) {
+            rv = apply_set(&d, &n, s->inflight);
+        }
+        if (rv == 0 && s->pending) {
+            rv = apply_set(&d, &n, s->pending);
+        }
+        s->readers--;
+        dir_release(s);
+        pthread_mutex_unlock(&dir_lock);
+        if (rv < 0) {
+            free(d);
+            return -1;
+        }
+        *dirs = d;
+        return n;
+    }
+}
+
+int s3fs_dir_lookup(const char *dir, const char *name, s3dirent_t *ent)
+{
+    // the newest word on a name is in the queue, if it is there at all
+    pthread_mutex_lock(&dir_lock);
+    dir_state_t *s = dir_find(dir);
+    pend_t *p = NULL;
+    if (s && s->pending) {
+        p = pend_find(s->pending, name);
+    }
+    if (!p && s && s->inflight) {
+        p = pend_find(s->inflight, name);
+    }
+    if (p) {
+        int rv = p->del ? -ENOENT : 0;
+        if (!p->del) {
+            *ent = p->ent;
+        }
+        pthread_mutex_unlock(&dir_lock);
+        return rv;
+    }
+    pthread_mutex_unlock(&dir_lock);
+
+    s3dirent_t *dirs = NULL;
+    ssize_t n = s3fs_dir_get(dir, &dirs);
+    if (n < 0) {
+        return -EIO;
+    }
+    int rv = -ENOENT;
+    ssize_t i;
+    for (i = 0; i < n; i++) {
+        if (strcasecmp(dirs[i].name, name) == 0) {
+            *ent = dirs[i];
+            rv = 0;
+            break;
+        }
+    }
+    free(dirs);
+    return rv;
+}
+
+int s3fs_dir_create(const char *dir, const s3dirent_t *self)
+{
+    uint8_t *buf = NULL;
+    ssize_t len = encode_dir(self, 1, &buf);
+    int rv = len > 0 && s3fs_meta_put(dir_bucket, dir, buf, len) == len ? 0 : -EIO;
+    free(buf);
+    return rv;
+}
+
+int s3fs_dir_put(const char *dir, const s3dirent_t *ent)
+{
+    return queue_change(dir, 0, ent);
+}
+
+int s3fs_dir_del(const char *dir, const char *name)
+{
+    s3dirent_t ent;
+    memset(&ent, 0, sizeof(ent));
+    snprintf(ent.name, sizeof(ent.name), "%s", name);
+    return queue_change(dir, 1, &ent);
+}
+
+int s3fs_dir_flush(const char *dir)
+{
+    pthread_mutex_lock(&dir_lock);
+    dir_state_t *s = dir_find(dir);
+    if (!s) {
+        pthread_mutex_unlock(&dir_lock);
+        return 0;
+    }
+    s->waiters++;
+    while (s->flushing) {
+        pthread_cond_wait(&dir_cond, &dir_lock);
+    }
+    s->waiters--;
+    int rv = 0;
+    if (s->pending) {
+        rv = flush_locked(s);
+    }
+    dir_release(s);
+    pthread_mutex_unlock(&dir_lock);
+    return rv;
+}
+
+int s3fs_dir_flush_all(void)
+{
+    // flushing drops the lock, so collect the names first
+    int count = 0, cap = 0, i;
+    char **keys = NULL;
+    pthread_mutex_lock(&dir_lock);
+    for (i = 0; i < DIR_HASH_BUCKETS; i++) {
+        dir_state_t *s;
+        for (s = dir_table[i]; s; s = s->hnext) {
+            if (count == cap) {
+                int ncap = cap ? cap * 2 : 16;
+                char **n = realloc(keys, ncap * sizeof(char *));
+                if (!n) {
+                    break;
+                }
+                keys = n;
+                cap = ncap;
+            }
+            if ((keys[count] = strdup(s->key))) {
+                count++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dir_lock);
+
+    int rv = 0;
+    for (i = 0; i < count; i++) {
+        if (s3fs_dir_flush(keys[i]) < 0) {
+            rv = -EIO;
+        }
+        free(keys[i]);
+    }
+    free(keys);
+    return rv;
+}
+
+void s3fs_dir_forget(const char *dir)
+{
+    pthread_mutex_lock(&dir_lock);
+    dir_state_t *s = dir_find(dir);
+    if (s) {
+        // let a running write out finish before the object goes away
+        s->waiters++;
+        while (s->flushing) {
+            pthread_cond_wait(&dir_cond, &dir_lock);
+        }
+        s->waiters--;
+        pend_free(s->pending);
+        s->pending = NULL;
+        s3fs_journal_done_dir(dir, s3fs_journal_seq());
+        dir_release(s);
+    }
+    pthread_mutex_unlock(&dir_lock);
+}
@@ -0,0 +1,93 @@
+/*
+ * Group commit of directory changes.
+ *
+ * A directory is one s3 object holding an array of s3dirent_t, so every
+ * entry added or removed used to cost a get and a put of the whole
+ * parent.  Here changes to a directory are queued instead: later changes
+ * to the same name replace earlier ones, and the queue is written out as
+ * one rewrite of the directory object once its oldest change is a few
+ * hundred milliseconds old, when it grows large, or when it is flushed
+ * explicitly (fsyncdir).  Creating thousands of files in one directory
+ * then costs a handful of directory uploads.
+ *
+ * Readers always go through this module, which lays the queued changes
+ * over the stored object, so they see every change as soon as it is made.
+ *
+ * Entries are stored without the unused tail of their inline data (see
+ * s3dirent_t), so a directory object is only as large as what it holds.
+ */
+#ifndef __S3FS_DIRBATCH_H__
+#define __S3FS_DIRBATCH_H__
+
+#include <sys/types.h>
+#include "s3fs.h"
+
+/*
+ * Start committing changes to directories in bucket.  Queued changes
+ * are written out window_ms milliseconds after the first of them; with
+ * a window of 0 every change is written out before it returns.
+ */
+void s3fs_dir_init(const char *bucket, int window_ms);
+
+/*
+ * Write out everything that is queued and stop the commit thread.
+ */
+void s3fs_dir_destroy(void);
+
+/*
+ * Read directory dir, with queued changes applied.  On success *dirs is
+ * a malloc'ed array (entry 0 is ".") and the number of entries is
+ * returned.  Returns -1 if dir doesn't exist or can't be read.
+ */
+ssize_t s3fs_dir_get(const char *dir, s3dirent_t **dirs);
+
+/*
+ * Find entry name of directory dir, with queued changes applied.
+ * Returns 0 and fills in *ent if it exists, -ENOENT if it doesn't, or
+ * -EIO if dir can't be read.
+ */
+int s3fs_dir_lookup(const char *dir, const char *name, s3dirent_t *ent);
+
+/*
+ * Store a new, empty directory dir whose "." entry is self.  This is
+ * written out at once.  Returns 0 on success, or -EIO.
+ */
+int s3fs_dir_create(const char *dir, const s3dirent_t *self);
+
+/*
+ * Queue adding ent to directory dir, replacing any entry with the same
+ * name.  The caller checks that dir exists.  Returns 0 on success, or
+ * -errno.
+ */
+int s3fs_dir_put(const char *dir, const s3dirent_t *ent);
+
+/*
+ * Queue removing entry name from directory dir.  Returns 0 on success,
+ * or -errno.
+ */
+int s3fs_dir_del(const char *dir, const char *name);
+
+/*
+ * Write out the queued changes to dir and wait for them to be stored.
+ * Returns 0 on success, or -EIO.
+ */
+int s3fs_dir_flush(const char *dir);
+
+/*
+ * Same as s3fs_dir_flush, for every directory.
+ */
+int s3fs_dir_flush_all(void);
+
+/*
+ * Throw away the queued changes to dir, which is being removed.
+ */
+void s3fs_dir_forget(const char *dir);
+
+/*
+ * Decode the len bytes of a stored directory object.  On success *dirs
+ * is a malloc'ed array (entry 0 is ".") and the number of entries is
+ * returned.  Returns -1 if they aren't a directory object.
+ */
+ssize_t s3fs_dir_decode(const uint8_t *buf, size_t len, s3dirent_t **dirs);
+
+#endif // __S3FS_DIRBATCH_H__
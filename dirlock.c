@@ -0,0 +1,96 @@
+/*
+ * dirlock.c: striped directory locks.  See dirlock.h for an overview.
+ */
+
+#define _GNU_SOURCE     // for writer-preferring rwlocks
+#include "dirlock.h"
+
+#include <pthread.h>
+
+#define DIRLOCK_STRIPES 1024
+
+static pthread_rwlock_t stripes[DIRLOCK_STRIPES];
+static pthread_rwlock_t tree_lock;
+static pthread_once_t dirlock_once = PTHREAD_ONCE_INIT;
+
+
+// A steady stream of creates must not keep a directory move (or a
+// reader) waiting forever, so waiting writers go first.
+static void dirlock_init(void)
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int i;
+    for (i = 0; i < DIRLOCK_STRIPES; i++) {
+        pthread_rwlock_init(&stripes[i], &attr);
+    }
+    pthread_rwlock_init(&tree_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+static unsigned stripe(const char *dir)
+{
+    pthread_once(&dirlock_once, dirlock_init);
+    unsigned h = 2166136261u;
+    while (*dir) {
+        h = (h ^ (unsigned char) *dir++) * 16777619u;
+    }
+    return h % DIRLOCK_STRIPES;
+}
+
+void s3fs_dirlock_read(const char *dir)
+{
+    pthread_rwlock_rdlock(&stripes[stripe(dir)]);
+}
+
+void s3fs_dirunlock_read(const char *dir)
+{
+    pthread_rwlock_unlock(&stripes[stripe(dir)]);
+}
+
+void s3fs_dirlock_write(const char *dir)
+{
+    unsigned s = stripe(dir);
+    pthread_rwlock_rdlock(&tree_lock);
+    pthread_rwlock_wrlock(&stripes[s]);
+}
+
+void s3fs_dirunlock_write(const char *dir)
+{
+    pthread_rwlock_unlock(&stripes[stripe(dir)]);
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+void s3fs_dirlock_write2(const char *a, const char *b)
+{
+    unsigned sa = stripe(a), sb = stripe(b);
+    pthread_rwlock_rdlock(&tree_lock);
+    // lower stripe first; a shared stripe is only taken once
+    pthread_rwlock_wrlock(&stripes[sa < sb ? sa : sb]);
+    if (sa != sb) {
+        pthread_rwlock_wrlock(&stripes[sa < sb ? sb : sa]);
+    }
+}
+
+void s3fs_dirunlock_write2(const char *a, const char *b)
+{
+    unsigned sa = stripe(a), sb = stripe(b);
+    if (sa != sb) {
+        pthread_rwlock_unlock(&stripes[sb]);
+    }
+    pthread_rwlock_unlock(&stripes[sa]);
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+void s3fs_dirlock_all(void)
+{
+    pthread_once(&dirlock_once, dirlock_init);
+    pthread_rwlock_wrlock(&tree_lock);
+}
+
+void s3fs_dirunlock_all(void)
+{
+    pthread_rwlock_unlock(&tree_lock);
+}
@@ -0,0 +1,44 @@
+/*
+ * Directory locks.
+ *
+ * Changes to a directory (adding, removing or updating entries) take its
+ * lock exclusively; reads of a directory take it shared, so they never
+ * see half of a change.  Locks are striped: directory paths hash onto a
+ * fixed set of reader/writer locks, so unrelated directories rarely
+ * contend and no per-directory state is kept.
+ *
+ * Moving a directory moves everything below it, which can't be covered
+ * by locking individual directories.  Every change therefore also holds
+ * a tree-wide lock shared, and a directory move holds it exclusively.
+ */
+#ifndef __S3FS_DIRLOCK_H__
+#define __S3FS_DIRLOCK_H__
+
+/*
+ * Lock directory dir for reading, and unlock it.
+ */
+void s3fs_dirlock_read(const char *dir);
+void s3fs_dirunlock_read(const char *dir);
+
+/*
+ * Lock directory dir for changing its entries, and unlock it.
+ */
+void s3fs_dirlock_write(const char *dir);
+void s3fs_dirunlock_write(const char *dir);
+
+/*
+ * Lock two directories for changing (either may be the same as the
+ * other), and unlock them.  The locks are always taken in the same
+ * order, so threads locking the same pair can't deadlock.
+ */
+void s3fs_dirlock_write2(const char *a, const char *b);
+void s3fs_dirunlock_write2(const char *a, const char *b);
+
+/*
+ * Keep every other change out, for moving a directory, and let them
+ * back in.  Readers are not held up.
+ */
+void s3fs_dirlock_all(void);
+void s3fs_dirunlock_all(void);
+
+#endif // __S3FS_DIRLOCK_H__
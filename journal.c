@@ -0,0 +1,507 @@
+/*
+ * journal.c: the local write-ahead journal.  See journal.h for an
+ * overview.
+ *
+ * The journal is a sequence of records, each a header (magic, CRC-32 of
+ * the rest, position, type and payload length) and a payload of a number,
+ * a NUL-terminated name and then any data, in host byte order.  A torn
+ * or corrupt record ends the journal: records are appended in order, so
+ * nothing after it can have been acknowledged.
+ *
+ * A table in memory counts, for each directory and file, the position of
+ * its last record that isn't done yet; when the table empties, so does
+ * the journal.  At startup the records still needed are copied to a new
+ * journal, which replaces the old one before they are replayed.
+ */
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#define JOURNAL_MAGIC 0x4a463353      // "S3FJ"
+#define JOURNAL_HASH_BUCKETS 1024
+
+enum { REC_DIR_PUT = 1, REC_DIR_DEL, REC_DATA, REC_DONE_DIR, REC_DONE_DATA };
+enum { LIVE_DIR, LIVE_DATA };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;         // of everything after it
+    uint64_t seq;
+    uint32_t type;
+    uint32_t len;         // payload bytes
+} rec_header_t;
+
+// A record read back at startup; name and data point into the journal
+typedef struct {
+    uint64_t seq, arg;
+    uint32_t type;
+    const char *name;
+    const uint8_t *data;
+    size_t len;
+} rec_t;
+
+typedef struct live {
+    int kind;
+    char *name;
+    uint64_t seq;         // last record not done yet
+    struct live *next;
+} live_t;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;   // a sync finished
+static live_t *live_table[JOURNAL_HASH_BUCKETS];
+static int live_count = 0;
+static int journal_fd = -1;
+static char journal_path[PATH_MAX];
+static uint64_t last_seq = 0;
+static uint64_t synced_seq = 0;
+static int syncing = 0;
+
+
+static unsigned live_hash(int kind, const char *name)
+{
+    unsigned h = 5381 + kind;
+    while (*name) {
+        h = h * 33 + (unsigned char) *name++;
+    }
+    return h % JOURNAL_HASH_BUCKETS;
+}
+
+static live_t **live_find(int kind, const char *name)
+{
+    live_t **pp = &live_table[live_hash(kind, name)];
+    while (*pp && ((*pp)->kind != kind || strcmp((*pp)->name, name) != 0)) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static void live_note(int kind, const char *name, uint64_t seq)
+{
+    live_t **pp = live_find(kind, name);
+    if (*pp) {
+        (*pp)->seq = seq;
+        return;
+    }
+    live_t *l = malloc(sizeof(live_t));
+    if (!l || !(l->name = strdup(name))) {
+        // without an entry the journal is never emptied, which is safe
+        free(l);
+        live_count++;
+        return;
+    }
+    l->kind = kind;
+    l->seq = seq;
+    l->next = NULL;
+    *pp = l;
+    live_count++;
+}
+
+// Stop journaling after a failed write: later records could never be
+// read back past the broken one.  Called with journal_lock held.
+static void journal_fail(const char *what)
+{
+    fprintf(stderr, "s3fs journal: %s failed: %s; journaling stops\n", what,
+            strerror(errno));
+    close(journal_fd);
+    journal_fd = -1;
+    pthread_cond_broadcast(&sync_cond);
+}
+
+// Append a record.  Returns its position, or 0.  Called with journal_lock
+// held.
+static uint64_t append(int fd, uint64_t seq, uint32_t type, uint64_t arg,
+                       const char *name, const void *data, size_t len)
+{
+    rec_header_t h;
+    h.magic = JOURNAL_MAGIC;
+    h.seq = seq;
+    h.type = type;
+    h.len = sizeof(arg) + strlen(name) + 1 + len;
+    struct iovec iov[4] = {
+        { &h, sizeof(h) },
+        { &arg, sizeof(arg) },
+        { (void *) name, strlen(name) + 1 },
+        { (void *) data, len },
+    };
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *) &h.seq, sizeof(h) - offsetof(rec_header_t, seq));
+    // (crc32 with a NULL buffer would restart the checksum)
+    int i, iovcnt = len ? 4 : 3;
+    for (i = 1; i < iovcnt; i++) {
+        crc = crc32(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+    h.crc = crc;
+    ssize_t total = sizeof(h) + h.len;
+    return writev(fd, iov, iovcnt) == total ? seq : 0;
+}
+
+static uint64_t journal_append(uint32_t type, uint64_t arg, const char *name,
+                               const void *data, size_t len)
+{
+    uint64_t seq = 0;
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) {
+        seq = append(journal_fd, last_seq + 1, type, arg, name, data, len);
+        if (seq) {
+            last_seq = seq;
+            live_note(type == REC_DATA ? LIVE_DATA : LIVE_DIR, name, seq);
+        } else {
+            journal_fail("write");
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return seq;
+}
+
+static void journal_done(int kind, const char *name, uint64_t seq)
+{
+    pthread_mutex_lock(&journal_lock);
+    live_t **pp = live_find(kind, name);
+    live_t *l = *pp;
+    if (journal_fd >= 0 && l) {
+        if (l->seq <= seq) {
+            *pp = l->next;
+            free(l->name);
+            free(l);
+            live_count--;
+        }
+        if (live_count == 0 && ftruncate(journal_fd, 0) == 0) {
+            // nothing in it is needed, so nothing waits for it either
+            synced_seq = last_seq;
+            pthread_cond_broadcast(&sync_cond);
+        } else if (append(journal_fd, last_seq + 1,
+                          kind == LIVE_DATA ? REC_DONE_DATA : REC_DONE_DIR,
+                          seq, name, NULL, 0)) {
+            last_seq++;
+        } else {
+            journal_fail("write");
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+
+// Parse the records in the len bytes of buf, up to the first bad one.
+// Returns their number, with *recs malloc'ed.
+static size_t parse(const uint8_t *buf, size_t len, rec_t **recs)
+{
+    size_t n = 0, cap = 0, off = 0;
+    rec_t *out = NULL;
+    while (len - off >= sizeof(rec_header_t)) {
+        rec_header_t h;
+        memcpy(&h, buf + off, sizeof(h));
+        const uint8_t *p = buf + off + sizeof(h);
+        if (h.magic != JOURNAL_MAGIC || h.len > len - off - sizeof(h) ||
+            h.len < sizeof(uint64_t) + 1 ||
+            !memchr(p + sizeof(uint64_t), '\0', h.len - sizeof(uint64_t))) {
+            break;
+        }
+        uLong crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, buf + off + offsetof(rec_header_t, seq),
+                    sizeof(h) - offsetof(rec_header_t, seq) + h.len);
+        if ((uint32_t) crc != h.crc) {
+            break;
+        }
+        if (n == cap) {
+            size_t ncap = cap ? 2 * cap : 64;
+            rec_t *more = realloc(out, ncap * sizeof(rec_t));
+            if (!more) {
+                break;
+            }
+            out = more;
+            cap = ncap;
+        }
+        rec_t *r = &out[n++];
+        r->seq = h.seq;
+        r->type = h.type;
+        memcpy(&r->arg, p, sizeof(uint64_t));
+        r->name = (const char *) p + sizeof(uint64_t);
+        size_t head = sizeof(uint64_t) + strlen(r->name) + 1;
+        r->data = p + head;
+        r->len = h.len - head;
+        off += sizeof(h) + h.len;
+    }
+    *recs = out;
+    return n;
+}
+
+// Clear the type of the records that aren't needed any more: something
+// later marks them done, or (for file contents) supersedes them.  Goes
+// backwards, noting in a table what the later records said about each
+// name.
+static int drop_unneeded(rec_t *recs, size_t n)
+{
+    typedef struct seen {
+        const char *name;
+        uint64_t dir_done, data_done;
+        int data_later;
+        struct seen *next;
+    } seen_t;
+    seen_t **table = calloc(JOURNAL_HASH_BUCKETS, sizeof(seen_t *));
+    seen_t *pool = malloc((n ? n : 1) * sizeof(seen_t));
+    if (!table || !pool) {
+        free(table);
+        free(pool);
+        return -1;
+    }
+    size_t used = 0, i = n;
+    while (i-- > 0) {
+        rec_t *r = &recs[i];
+        seen_t **pp = &table[live_hash(0, r->name)];
+        while (*pp && strcmp((*pp)->name, r->name) != 0) {
+            pp = &(*pp)->next;
+        }
+        seen_t *e = *pp;
+        if (!e) {
+            e = *pp = &pool[used++];
+            memset(e, 0, sizeof(*e));
+            e->name = r->name;
+        }
+        switch (r->type) {
+        case REC_DONE_DIR:
+            e->dir_done = r->arg > e->dir_done ? r->arg : e->dir_done;
+            r->type = 0;
+            break;
+        case REC_DONE_DATA:
+            e->data_done = r->arg > e->data_done ? r->arg : e->data_done;
+            r->type = 0;
+            break;
+        case REC_DATA:
+            if (e->data_later || r->seq <= e->data_done) {
+                r->type = 0;
+            }
+            e->data_later = 1;
+            break;
+        case REC_DIR_PUT:
+        case REC_DIR_DEL:
+            if (r->seq <= e->dir_done) {
+                r->type = 0;
+            }
+            break;
+        default:
+            r->type = 0;
+        }
+    }
+    free(table);
+    free(pool);
+    return 0;
+}
+
+void s3fs_journal_replay(s3fs_journal_dir_fn dir_fn, s3fs_journal_data_fn data_fn)
+{
+    struct stat st;
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd < 0 || fstat(journal_fd, &st) < 0 || st.st_size == 0) {
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    uint8_t *buf = malloc(st.st_size);
+    rec_t *recs = NULL;
+    size_t n = 0, i, kept = 0;
+    int read = buf && pread(journal_fd, buf, st.st_size, 0) == st.st_size;
+    if (read) {
+        n = parse(buf, st.st_size, &recs);
+    }
+    if (!dir_fn && !data_fn) {
+        n = 0;
+    } else if (!read || drop_unneeded(recs, n) < 0) {
+        // leave the journal as it is for next time, and don't add to it
+        fprintf(stderr, "s3fs journal: can't read back %s\n", journal_path);
+        close(journal_fd);
+        journal_fd = -1;
+        pthread_mutex_unlock(&journal_lock);
+        free(recs);
+        free(buf);
+        return;
+    }
+
+    // copy what is still needed to a new journal, renumbered, and put it
+    // in place of the old one
+    char path[PATH_MAX + 4];
+    snprintf(path, sizeof(path), "%s.new", journal_path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    int ok = fd >= 0;
+    for (i = 0; ok && i < n; i++) {
+        if (!recs[i].type) {
+            continue;
+        }
+        recs[i].seq = ++kept;
+        ok = append(fd, kept, recs[i].type, recs[i].arg, recs[i].name,
+                    recs[i].data, recs[i].len) == kept;
+    }
+    if (ok && fdatasync(fd) == 0 && rename(path, journal_path) == 0) {
+        close(journal_fd);
+        journal_fd = fd;
+        last_seq = synced_seq = kept;
+        for (i = 0; i < n; i++) {
+            if (recs[i].type) {
+                live_note(recs[i].type == REC_DATA ? LIVE_DATA : LIVE_DIR,
+                          recs[i].name, recs[i].seq);
+            }
+        }
+    } else {
+        // replay, but leave the old journal as it is for next time, and
+        // don't add to it
+        fprintf(stderr, "s3fs journal: can't compact %s; journaling stops\n",
+                journal_path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        close(journal_fd);
+        journal_fd = -1;
+        for (kept = 0, i = 0; i < n; i++) {
+            kept += recs[i].type != 0;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    fprintf(stderr, "s3fs journal: replaying %zu changes\n", kept);
+    for (i = 0; i < n; i++) {
+        rec_t *r = &recs[i];
+        if (r->type == REC_DATA) {
+            if (data_fn(r->name, r->data, r->len, r->arg) < 0) {
+                fprintf(stderr, "s3fs journal: dropped the contents of %s\n", r->name);
+            }
+            journal_done(LIVE_DATA, r->name, r->seq);
+        } else if (r->type == REC_DIR_PUT || r->type == REC_DIR_DEL) {
+            s3dirent_t ent;
+            memset(&ent, 0, sizeof(ent));
+            memcpy(&ent, r->data, r->len < sizeof(ent) ? r->len : sizeof(ent));
+            // redone changes are journaled again, and done when written out
+            if (dir_fn(r->name, r->type == REC_DIR_DEL, &ent) < 0) {
+                fprintf(stderr, "s3fs journal: dropped a change to %s\n", r->name);
+                journal_done(LIVE_DIR, r->name, r->seq);
+            }
+        }
+    }
+    free(recs);
+    free(buf);
+}
+
+
+int s3fs_journal_init(const char *dir)
+{
+    snprintf(journal_path, sizeof(journal_path), "%s/write.journal", dir);
+    journal_fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (journal_fd < 0) {
+        fprintf(stderr, "s3fs journal: can't open %s: %s\n", journal_path,
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void s3fs_journal_destroy(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    while (syncing) {
+        pthread_cond_wait(&sync_cond, &journal_lock);
+    }
+    if (journal_fd >= 0) {
+        fdatasync(journal_fd);
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    int i;
+    for (i = 0; i < JOURNAL_HASH_BUCKETS; i++) {
+        while (live_table[i]) {
+            live_t *l = live_table[i];
+            live_table[i] = l->next;
+            free(l->name);
+            free(l);
+        }
+    }
+    live_count = 0;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int s3fs_journal_enabled(void)
+{
+    return journal_fd >= 0;
+}
+
+uint64_t s3fs_journal_dir(const char *dir, int del, const s3dirent_t *ent)
+{
+    return journal_append(del ? REC_DIR_DEL : REC_DIR_PUT, 0, dir, ent, sizeof(*ent));
+}
+
+uint64_t s3fs_journal_data(const char *key, const uint8_t *data,
+                           size_t stored, off_t size)
+{
+    // past the limit, the contents go to s3 instead; once they are all
+    // there, nothing in the journal is needed and it is emptied
+    struct stat st;
+    pthread_mutex_lock(&journal_lock);
+    int full = journal_fd >= 0 && fstat(journal_fd, &st) == 0 &&
+               st.st_size + stored > S3FS_JOURNAL_MAX_BYTES;
+    pthread_mutex_unlock(&journal_lock);
+    if (full) {
+        return 0;
+    }
+    return journal_append(REC_DATA, size, key, data, stored);
+}
+
+uint64_t s3fs_journal_seq(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = last_seq;
+    pthread_mutex_unlock(&journal_lock);
+    return seq;
+}
+
+void s3fs_journal_done_dir(const char *dir, uint64_t seq)
+{
+    journal_done(LIVE_DIR, dir, seq);
+}
+
+void s3fs_journal_done_data(const char *key, uint64_t seq)
+{
+    journal_done(LIVE_DATA, key, seq);
+}
+
+int s3fs_journal_sync(uint64_t seq)
+{
+    pthread_mutex_lock(&journal_lock);
+    int rv = 0;
+    while (synced_seq < seq) {
+        if (journal_fd < 0) {
+            rv = -1;
+            break;
+        }
+        if (syncing) {
+            pthread_cond_wait(&sync_cond, &journal_lock);
+            continue;
+        }
+        // lead a sync for everything written so far; whoever arrives
+        // meanwhile waits for the next one
+        uint64_t target = last_seq;
+        int fd = journal_fd;
+        syncing = 1;
+        pthread_mutex_unlock(&journal_lock);
+        int synced = fdatasync(fd) == 0;
+        pthread_mutex_lock(&journal_lock);
+        syncing = 0;
+        if (synced && target > synced_seq) {
+            synced_seq = target;
+        } else if (!synced && journal_fd >= 0) {
+            journal_fail("fdatasync");
+        }
+        pthread_cond_broadcast(&sync_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return rv;
+}
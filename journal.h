@@ -0,0 +1,84 @@
+/*
+ * Local write-ahead journal.
+ *
+ * fsync doesn't have to wait for s3.  The staged contents of the file
+ * are appended to a journal in the cache directory instead, and fsync
+ * returns once the journal is on disk; the upload still happens when the
+ * file is closed.  Directory changes queued by dirbatch are journaled as
+ * they are made, so a crash doesn't lose them either.  Concurrent fsyncs
+ * share one fdatasync of the journal (group commit).
+ *
+ * Once a change is stored in s3, a later record marks it done.  The
+ * journal is emptied whenever nothing in it is still needed, and changes
+ * left in it by a crash are replayed into s3 at the next mount.
+ */
+#ifndef __S3FS_JOURNAL_H__
+#define __S3FS_JOURNAL_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "s3fs.h"
+
+#define S3FS_JOURNAL_MAX_DATA (64 * 1024 * 1024) // larger files are uploaded on fsync
+#define S3FS_JOURNAL_MAX_BYTES (4 * S3FS_JOURNAL_MAX_DATA) // and past this, all are
+
+/*
+ * Journal to dir/write.journal from now on.  Returns 0 on success and -1
+ * on failure, in which case nothing is journaled.
+ */
+int s3fs_journal_init(const char *dir);
+
+/*
+ * Sync and close the journal.
+ */
+void s3fs_journal_destroy(void);
+
+int s3fs_journal_enabled(void);
+
+/*
+ * Replay what an earlier run left in the journal, in the order it was
+ * journaled: dir_fn redoes a directory change (like s3fs_dir_put or, if
+ * del, s3fs_dir_del) and data_fn stores the contents of a file (stored
+ * bytes of data, followed by a hole up to size).  Each returns 0 on
+ * success and -1 if the change no longer applies; either way it is done
+ * with.  With NULL callbacks, the changes are discarded instead.  Call
+ * once, after s3fs_journal_init.
+ */
+typedef int (*s3fs_journal_dir_fn)(const char *dir, int del, const s3dirent_t *ent);
+typedef int (*s3fs_journal_data_fn)(const char *key, const uint8_t *data,
+                                    size_t stored, off_t size);
+
+void s3fs_journal_replay(s3fs_journal_dir_fn dir_fn, s3fs_journal_data_fn data_fn);
+
+/*
+ * Journal a change to directory dir (ent replaces the entry with its
+ * name, or if del the entry with that name goes away), or the contents
+ * of the file key.  Returns the record's position, to pass to
+ * s3fs_journal_sync, or 0 if the journal is off or the record couldn't
+ * be written.  File contents aren't journaled once the journal would grow
+ * past S3FS_JOURNAL_MAX_BYTES: every fsync then uploads, which lets the
+ * journal empty out instead of holding a copy of the file per fsync.
+ */
+uint64_t s3fs_journal_dir(const char *dir, int del, const s3dirent_t *ent);
+uint64_t s3fs_journal_data(const char *key, const uint8_t *data,
+                           size_t stored, off_t size);
+
+/*
+ * The position of the last record.
+ */
+uint64_t s3fs_journal_seq(void);
+
+/*
+ * Mark the records for directory dir, or for the file key, up to
+ * position seq as done: they are stored in s3 (or no longer matter).
+ */
+void s3fs_journal_done_dir(const char *dir, uint64_t seq);
+void s3fs_journal_done_data(const char *key, uint64_t seq);
+
+/*
+ * Wait until every record up to position seq is on disk.  Returns 0 on
+ * success and -1 on failure.
+ */
+int s3fs_journal_sync(uint64_t seq);
+
+#endif // __S3FS_JOURNAL_H__
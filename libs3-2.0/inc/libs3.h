@@ -359,6 +359,7 @@ typedef enum
     S3StatusHttpErrorForbidden                              ,
     S3StatusHttpErrorNotFound                               ,
     S3StatusHttpErrorConflict                               ,
+    S3StatusHttpErrorNotModified                            ,
     S3StatusHttpErrorUnknown
 } S3Status;
 
@@ -630,6 +631,34 @@ typedef struct S3AclGrant
 } S3AclGrant;
 
 
+/**
+ * Deadlines for requests, in milliseconds.  A deadline of 0 is set
+ * automatically, from the latencies of recent requests; a negative one
+ * is not enforced.  A request that misses a deadline fails with
+ * S3StatusConnectionFailed, which is retryable.
+ **/
+typedef struct S3RequestDeadlines
+{
+    /**
+     * To connect to the server, name lookup and TLS handshake included
+     **/
+    int connectMs;
+
+    /**
+     * From the start of a get, head or delete to the first byte of the
+     * response.  This one is checked about once a second.
+     **/
+    int firstByteMs;
+
+    /**
+     * For the whole request.  The automatic one is only set for requests
+     * whose size is known, from the upload or download rates seen
+     * recently; puts get none until some uploads have been seen.
+     **/
+    int totalMs;
+} S3RequestDeadlines;
+
+
 /**
  * A context for working with objects within a bucket.  A bucket context holds
  * all information necessary for working with a bucket, and may be used
@@ -669,6 +698,12 @@ typedef struct S3BucketContext
      *  The Amazon Secret Access Key to use for access to the bucket
      **/
     const char *secretAccessKey;
+
+    /**
+     * Deadlines for requests made with this bucket context.  If NULL, all
+     * of them are set automatically.
+     **/
+    const S3RequestDeadlines *deadlines;
 } S3BucketContext;
 
 
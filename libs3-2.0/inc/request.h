@@ -156,6 +156,14 @@ typedef struct Request
     // This is set to nonzero after the properties callback has been made
     int propertiesCallbackMade;
 
+    // When the request started (monotonic milliseconds), and how long it
+    // may wait for the first byte of the response (negative if forever)
+    int64_t startMs;
+    int64_t firstByteDeadlineMs;
+
+    // Set once the first byte of the response is in
+    int firstByteSeen;
+
     // Parser of errors
     ErrorParser errorParser;
 } Request;
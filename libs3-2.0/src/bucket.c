@@ -140,7 +140,8 @@ void S3_test_bucket(S3Protocol protocol, S3UriStyle uriStyle,
           protocol,                                   // protocol
           uriStyle,                                   // uriStyle
           accessKeyId,                                // accessKeyId
-          secretAccessKey },                          // secretAccessKey
+          secretAccessKey,                            // secretAccessKey
+          0 },                                        // deadlines
         0,                                            // key
         0,                                            // queryParams
         "location",                                   // subResource
@@ -278,7 +279,8 @@ void S3_create_bucket(S3Protocol protocol, const char *accessKeyId,
           protocol,                                   // protocol
           S3UriStylePath,                             // uriStyle
           accessKeyId,                                // accessKeyId
-          secretAccessKey },                          // secretAccessKey
+          secretAccessKey,                            // secretAccessKey
+          0 },                                        // deadlines
         0,                                            // key
         0,                                            // queryParams
         0,                                            // subResource
@@ -361,7 +363,8 @@ void S3_delete_bucket(S3Protocol protocol, S3UriStyle uriStyle,
           protocol,                                   // protocol
           uriStyle,                                   // uriStyle
           accessKeyId,                                // accessKeyId
-          secretAccessKey },                          // secretAccessKey
+          secretAccessKey,                            // secretAccessKey
+          0 },                                        // deadlines
         0,                                            // key
         0,                                            // queryParams
         0,                                            // subResource
@@ -720,7 +723,8 @@ void S3_list_bucket(const S3BucketContext *bucketContext, const char *prefix,
           bucketContext->protocol,                    // protocol
           bucketContext->uriStyle,                    // uriStyle
           bucketContext->accessKeyId,                 // accessKeyId
-          bucketContext->secretAccessKey },           // secretAccessKey
+          bucketContext->secretAccessKey,             // secretAccessKey
+          bucketContext->deadlines },                 // deadlines
         0,                                            // key
         queryParams[0] ? queryParams : 0,             // queryParams
         0,                                            // subResource
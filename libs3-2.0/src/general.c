@@ -176,6 +176,7 @@ const char *S3_get_status_name(S3Status status)
         handlecase(HttpErrorForbidden);
         handlecase(HttpErrorNotFound);
         handlecase(HttpErrorConflict);
+        handlecase(HttpErrorNotModified);
         handlecase(HttpErrorUnknown);
     }
 
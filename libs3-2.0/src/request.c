@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include "request.h"
 #include "request_context.h"
 #include "response_headers_handler.h"
@@ -49,6 +50,41 @@ static int requestStackCountG;
 char defaultHostNameG[S3_MAX_HOSTNAME_SIZE];
 
 
+// Deadlines that aren't given are set to DEADLINE_FACTOR times the 99th
+// percentile of the latencies of the last LATENCY_SAMPLES successful
+// requests, within bounds.  Until enough requests have been seen, the
+// upper bounds are used.
+#define LATENCY_SAMPLES 256
+#define LATENCY_MIN_SAMPLES 32
+#define DEADLINE_FACTOR 4
+#define CONNECT_DEADLINE_MIN_MS 1000
+#define CONNECT_DEADLINE_MAX_MS 10000
+#define FIRST_BYTE_DEADLINE_MIN_MS 2000
+#define FIRST_BYTE_DEADLINE_MAX_MS 15000
+// transfers smaller than this say more about latency than about rate
+#define TRANSFER_SAMPLE_MIN_BYTES (256 * 1024)
+
+typedef struct LatencyStats
+{
+    int64_t samples[LATENCY_SAMPLES];
+    uint64_t count;
+    // DEADLINE_FACTOR times the 99th percentile, or -1 if not known yet
+    int64_t deadline;
+} LatencyStats;
+
+static pthread_mutex_t latencyMutexG = PTHREAD_MUTEX_INITIALIZER;
+
+static LatencyStats connectLatencyG = { { 0 }, 0, -1 };
+
+static LatencyStats firstByteLatencyG = { { 0 }, 0, -1 };
+
+// In milliseconds per MiB transferred; uploads and downloads go at their
+// own rates
+static LatencyStats uploadLatencyG = { { 0 }, 0, -1 };
+
+static LatencyStats downloadLatencyG = { { 0 }, 0, -1 };
+
+
 typedef struct RequestComputedValues
 {
     // All x-amz- headers, in normalized form (i.e. NAME: VALUE, no other ws)
@@ -108,6 +144,61 @@ typedef struct RequestComputedValues
 } RequestComputedValues;
 
 
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x < y) ? -1 : (x > y);
+}
+
+
+static void latency_add(LatencyStats *stats, int64_t ms)
+{
+    pthread_mutex_lock(&latencyMutexG);
+    stats->samples[stats->count++ % LATENCY_SAMPLES] = ms;
+    // Recompute every few samples; it needs a sort
+    if ((stats->count >= LATENCY_MIN_SAMPLES) && !(stats->count % 16)) {
+        int64_t sorted[LATENCY_SAMPLES];
+        int n = (stats->count < LATENCY_SAMPLES) ? 
+            (int) stats->count : LATENCY_SAMPLES;
+        memcpy(sorted, stats->samples, n * sizeof(int64_t));
+        qsort(sorted, n, sizeof(int64_t), &compare_int64);
+        stats->deadline = DEADLINE_FACTOR * sorted[(n * 99) / 100];
+    }
+    pthread_mutex_unlock(&latencyMutexG);
+}
+
+
+// The deadline to use given the one asked for (see S3RequestDeadlines):
+// -1 for none, else in milliseconds.  An automatic one is kept within
+// [min, max], and is max until it is known; if max is 0, it is -1
+// instead.
+static int64_t deadline(int given, LatencyStats *stats, int64_t min,
+                        int64_t max)
+{
+    if (given) {
+        return (given < 0) ? -1 : given;
+    }
+    pthread_mutex_lock(&latencyMutexG);
+    int64_t ms = stats->deadline;
+    pthread_mutex_unlock(&latencyMutexG);
+    if (ms < 0) {
+        return max ? max : -1;
+    }
+    if (ms < min) {
+        ms = min;
+    }
+    return (max && (ms > max)) ? max : ms;
+}
+
+
 // Called whenever we detect that the request headers have been completely
 // processed; which happens either when we get our first read/write callback,
 // or the request is finished being procesed.  Returns nonzero on success,
@@ -155,6 +246,8 @@ static size_t curl_header_func(void *ptr, size_t size, size_t nmemb,
 
     int len = size * nmemb;
 
+    request->firstByteSeen = 1;
+
     response_headers_handler_add
         (&(request->responseHeadersHandler), (char *) ptr, len);
 
@@ -162,6 +255,28 @@ static size_t curl_header_func(void *ptr, size_t size, size_t nmemb,
 }
 
 
+// Aborts a request still waiting for its response past its deadline
+static int curl_progress_func(void *data, curl_off_t dltotal,
+                              curl_off_t dlnow, curl_off_t ultotal,
+                              curl_off_t ulnow)
+{
+    Request *request = (Request *) data;
+
+    (void) dltotal;
+    (void) dlnow;
+    (void) ultotal;
+    (void) ulnow;
+
+    if (!request->firstByteSeen &&
+        ((now_ms() - request->startMs) > request->firstByteDeadlineMs)) {
+        request->status = S3StatusConnectionFailed;
+        return 1;
+    }
+
+    return 0;
+}
+
+
 static size_t curl_read_func(void *ptr, size_t size, size_t nmemb, void *data)
 {
     Request *request = (Request *) data;
@@ -831,8 +946,73 @@ static S3Status setup_curl(Request *request,
     // library, which we do not do yet.
     curl_easy_setopt_safe(CURLOPT_NOSIGNAL, 1);
 
-    // Turn off Curl's built-in progress meter
-    curl_easy_setopt_safe(CURLOPT_NOPROGRESS, 1);
+    // Work out the deadlines.  The first byte of the response to a put or
+    // copy can take as long as the request does, so those have none.
+    const S3RequestDeadlines *given = params->bucketContext.deadlines;
+    S3RequestDeadlines none = { 0, 0, 0 };
+    if (!given) {
+        given = &none;
+    }
+    int64_t connectMs = deadline(given->connectMs, &connectLatencyG,
+                                 CONNECT_DEADLINE_MIN_MS,
+                                 CONNECT_DEADLINE_MAX_MS);
+    int64_t firstByteMs = deadline(given->firstByteMs, &firstByteLatencyG,
+                                   FIRST_BYTE_DEADLINE_MIN_MS,
+                                   FIRST_BYTE_DEADLINE_MAX_MS);
+    // The size of the transfer, if known, and the rate it goes at
+    int64_t size = -1;
+    LatencyStats *rate = &downloadLatencyG;
+    request->firstByteDeadlineMs = -1;
+    switch (params->httpRequestType) {
+    case HttpRequestTypeGET:
+        if (params->byteCount) {
+            size = params->byteCount;
+        }
+        request->firstByteDeadlineMs = firstByteMs;
+        break;
+    case HttpRequestTypeHEAD:
+    case HttpRequestTypeDELETE:
+        size = 0;
+        request->firstByteDeadlineMs = firstByteMs;
+        break;
+    case HttpRequestTypePUT:
+        size = params->toS3CallbackTotalSize;
+        rate = &uploadLatencyG;
+        break;
+    default: // HttpRequestTypeCOPY takes as long as the object is big
+        break;
+    }
+    // An automatic total deadline is the time to get going, plus the time
+    // to move size bytes at the slowest rate seen lately.  A put has none
+    // until uploads have been seen: nothing else says how long the reply
+    // to one may take.
+    int64_t totalMs = (given->totalMs < 0) ? -1 : given->totalMs;
+    if (!given->totalMs && (size >= 0)) {
+        int64_t msPerMiB = deadline(0, rate, 0, 0);
+        if ((!size && (rate != &uploadLatencyG)) || (msPerMiB >= 0)) {
+            totalMs = ((connectMs > 0) ? connectMs : 0) +
+                ((firstByteMs > 0) ? firstByteMs : 0) +
+                (size ? (size * msPerMiB) / (1024 * 1024) : 0);
+        }
+    }
+
+    if (connectMs > 0) {
+        curl_easy_setopt_safe(CURLOPT_CONNECTTIMEOUT_MS, (long) connectMs);
+    }
+    if (totalMs > 0) {
+        curl_easy_setopt_safe(CURLOPT_TIMEOUT_MS, (long) totalMs);
+    }
+
+    // Curl's progress callback, with its built-in progress meter turned
+    // off, checks the first byte deadline
+    if (request->firstByteDeadlineMs >= 0) {
+        curl_easy_setopt_safe(CURLOPT_XFERINFOFUNCTION, &curl_progress_func);
+        curl_easy_setopt_safe(CURLOPT_XFERINFODATA, request);
+        curl_easy_setopt_safe(CURLOPT_NOPROGRESS, 0);
+    }
+    else {
+        curl_easy_setopt_safe(CURLOPT_NOPROGRESS, 1);
+    }
 
     // xxx todo - support setting the proxy for Curl to use (can't use https
     // for proxies though)
@@ -861,11 +1041,13 @@ static S3Status setup_curl(Request *request,
     curl_easy_setopt_safe(CURLOPT_USERAGENT, userAgentG);
 
     // Set the low speed limit and time; we abort transfers that stay at
-    // less than 1K per second for more than 15 seconds.
-    // xxx todo - make these configurable
+    // less than 1K per second for as long as a first byte may take.  This
+    // catches stalls in transfers with no total deadline.
     // xxx todo - allow configurable max send and receive speed
     curl_easy_setopt_safe(CURLOPT_LOW_SPEED_LIMIT, 1024);
-    curl_easy_setopt_safe(CURLOPT_LOW_SPEED_TIME, 15);
+    curl_easy_setopt_safe(CURLOPT_LOW_SPEED_TIME,
+                          (firstByteMs > 0) ? (long) (firstByteMs + 999) / 1000
+                          : 15L);
 
     // Append standard headers
 #define append_standard_header(fieldName)                               \
@@ -1026,6 +1208,10 @@ static S3Status request_get(const RequestParams *params,
     response_headers_handler_initialize(&(request->responseHeadersHandler));
 
     request->propertiesCallbackMade = 0;
+
+    request->startMs = now_ms();
+
+    request->firstByteSeen = 0;
     
     error_parser_initialize(&(request->errorParser));
 
@@ -1208,6 +1394,46 @@ void request_perform(const RequestParams *params, S3RequestContext *context)
 }
 
 
+// Feeds the latencies of a successful request into the automatic
+// deadlines
+static void request_sample_latencies(Request *request)
+{
+    CURL *curl = request->curl;
+    long connects = 0;
+    double connect = 0, appConnect = 0, startTransfer = 0, preTransfer = 0;
+    double total = 0;
+    curl_off_t down = 0, up = 0;
+    if ((curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK) ||
+        (curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect) != CURLE_OK) ||
+        (curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appConnect) != CURLE_OK) ||
+        (curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &preTransfer) != CURLE_OK) ||
+        (curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &startTransfer) != CURLE_OK) ||
+        (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total) != CURLE_OK) ||
+        (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &down) != CURLE_OK) ||
+        (curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &up) != CURLE_OK)) {
+        return;
+    }
+
+    // A reused connection says nothing about connecting
+    if (connects > 0) {
+        latency_add(&connectLatencyG, (int64_t)
+                    (1000 * ((appConnect > connect) ? appConnect : connect)));
+    }
+    // Only gets, heads and deletes wait for the first byte alone
+    if (request->firstByteDeadlineMs >= 0) {
+        latency_add(&firstByteLatencyG, (int64_t) (1000 * startTransfer));
+    }
+    if (up >= TRANSFER_SAMPLE_MIN_BYTES) {
+        latency_add(&uploadLatencyG, (int64_t)
+                    ((1000 * (total - preTransfer) * 1024 * 1024) / up));
+    }
+    if (down >= TRANSFER_SAMPLE_MIN_BYTES) {
+        latency_add(&downloadLatencyG, (int64_t)
+                    ((1000 * (total - preTransfer) * 1024 * 1024) / down));
+    }
+}
+
+
 void request_finish(Request *request)
 {
     // If we haven't detected this already, we now know that the headers are
@@ -1237,6 +1463,10 @@ void request_finish(Request *request)
             case 301:
                 request->status = S3StatusErrorPermanentRedirect;
                 break;
+            case 304:
+                // a conditional get found the object unchanged
+                request->status = S3StatusHttpErrorNotModified;
+                break;
             case 307:
                 request->status = S3StatusHttpErrorMovedTemporarily;
                 break;
@@ -1280,6 +1510,10 @@ void request_finish(Request *request)
         }
     }
 
+    if (request->status == S3StatusOK) {
+        request_sample_latencies(request);
+    }
+
     (*(request->completeCallback))
         (request->status, &(request->errorParser.s3ErrorDetails),
          request->callbackData);
@@ -1204,7 +1204,8 @@ static void list_bucket(const char *bucketName, const char *prefix,
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3ListBucketHandler listBucketHandler =
@@ -1324,7 +1325,8 @@ static void delete_object(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3ResponseHandler responseHandler =
@@ -1585,7 +1587,8 @@ static void put_object(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3PutProperties putProperties =
@@ -1772,7 +1775,8 @@ static void copy_object(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3PutProperties putProperties =
@@ -1952,7 +1956,8 @@ static void get_object(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3GetConditions getConditions =
@@ -2026,7 +2031,8 @@ static void head_object(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3ResponseHandler responseHandler =
@@ -2105,7 +2111,8 @@ static void generate_query_string(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     char buffer[S3_MAX_AUTHENTICATED_QUERY_STRING_SIZE];
@@ -2207,7 +2214,8 @@ void get_acl(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3ResponseHandler responseHandler =
@@ -2370,7 +2378,8 @@ void set_acl(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3ResponseHandler responseHandler =
@@ -2462,7 +2471,8 @@ void get_logging(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3ResponseHandler responseHandler =
@@ -2628,7 +2638,8 @@ void set_logging(int argc, char **argv, int optindex)
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        0
     };
 
     S3ResponseHandler responseHandler =
@@ -166,7 +166,8 @@ void S3_list_service(S3Protocol protocol, const char *accessKeyId,
           protocol,                                   // protocol
           S3UriStylePath,                             // uriStyle
           accessKeyId,                                // accessKeyId
-          secretAccessKey },                          // secretAccessKey
+          secretAccessKey,                            // secretAccessKey
+          0 },                                        // deadlines
         0,                                            // key
         0,                                            // queryParams
         0,                                            // subResource
@@ -328,7 +328,8 @@ void S3_get_server_access_logging(const S3BucketContext *bucketContext,
           bucketContext->protocol,                    // protocol
           bucketContext->uriStyle,                    // uriStyle
           bucketContext->accessKeyId,                 // accessKeyId
-          bucketContext->secretAccessKey },           // secretAccessKey
+          bucketContext->secretAccessKey,             // secretAccessKey
+          bucketContext->deadlines },                 // deadlines
         0,                                            // key
         0,                                            // queryParams
         "logging",                                    // subResource
@@ -532,7 +533,8 @@ void S3_set_server_access_logging(const S3BucketContext *bucketContext,
           bucketContext->protocol,                    // protocol
           bucketContext->uriStyle,                    // uriStyle
           bucketContext->accessKeyId,                 // accessKeyId
-          bucketContext->secretAccessKey },           // secretAccessKey
+          bucketContext->secretAccessKey,             // secretAccessKey
+          bucketContext->deadlines },                 // deadlines
         0,                                            // key
         0,                                            // queryParams
         "logging",                                    // subResource
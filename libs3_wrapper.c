@@ -40,6 +40,7 @@
  **/
 
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,6 +55,9 @@
 
 // include forward declarations
 #include "libs3_wrapper.h"
+#include "chunk.h"
+#include "compress.h"
+#include "segment.h"
 
 
 // Some Unix stuff (to work around Windows issues)
@@ -65,8 +69,10 @@
 int __s3fs_test_bucket(const char *bucketName);
 int __s3fs_clear_bucket(const char *bucketName);
 int __s3fs_remove_object(const char *bucketName, const char *key);
-ssize_t __s3fs_get_object(const char *bucketName, const char *key, uint8_t **buf, ssize_t start_byte, ssize_t byte_count);
-ssize_t __s3fs_put_object(const char *bucketName, const char *key, const uint8_t *buf, ssize_t contentLength); 
+int __s3fs_head_object(const char *bucketName, const char *key, s3fs_object_info_t *info);
+int __s3fs_copy_object(const char *bucketName, const char *srcKey, const char *dstKey, s3fs_object_info_t *info, const S3NameValue *meta, int metaCount);
+ssize_t __s3fs_get_object(const char *bucketName, const char *key, uint8_t **buf, ssize_t start_byte, ssize_t byte_count, const char *ifNotMatchTag, s3fs_object_info_t *info);
+ssize_t __s3fs_put_object(const char *bucketName, const char *key, const uint8_t *buf, ssize_t contentLength, s3fs_object_info_t *info, const S3NameValue *meta, int metaCount); 
 
 
 // Command-line options, saved as globals ------------------------------------
@@ -83,29 +89,62 @@ static int retriesG = 5;
 static const char *accessKeyIdG = 0;
 static const char *secretAccessKeyG = 0;
 
+// Request deadlines; zeros let libs3 set them from observed latencies
+static S3RequestDeadlines deadlinesG = { 0, 0, 0 };
 
-// Request results, saved as globals -----------------------------------------
 
-static int statusG = 0;
-static char errorDetailsG[4096] = { 0 };
+// Request results -----------------------------------------------------------
 
+// Requests run concurrently, so each one keeps its own outcome.  The
+// callback data of every request starts with one of these, which is how
+// the common callbacks below find it.
+typedef struct request_status
+{
+    S3Status status;
+    int retries;
+    int retrySleepInterval;
+    int responded;             // the response has started (a 2xx one)
+    int done;                  // the request has completed
+    char errorDetails[4096];
+} request_status;
 
+// Conditional get outcomes
+static uint64_t revalidateHitsG = 0;
+static uint64_t revalidateMissesG = 0;
 
-// Option prefixes -----------------------------------------------------------
+// Gets served by a transfer another get had in flight
+static uint64_t sharedGetsG = 0;
 
-// s3fs Global lock
 
-static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void s3fs_lock() {
-    pthread_mutex_lock(&global_lock);
-}
+// libs3 is initialized once, on first use, and shared by all requests
+static pthread_once_t initOnceG = PTHREAD_ONCE_INIT;
 
-void s3fs_unlock() {
-    pthread_mutex_unlock(&global_lock);
-}
+// Object metadata marking an encoded object, the length of its data, and
+// the number of objects using a chunk
+#define META_CODEC "s3fs-codec"
+#define META_SIZE "s3fs-size"
+#define META_REFS "s3fs-refs"
+#define CODEC_ZBLOCK "zblock"
+#define CODEC_CHUNKS "chunks"
+#define CODEC_SEGMENTS "segments"
+
+// Chunk reference counts are updated under one of these, by hash
+#define CHUNK_LOCKS 64
+static pthread_mutex_t chunkLocksG[CHUNK_LOCKS];
+
+// Objects are changed under one of these, by key, while appends are on
+#define OBJECT_LOCKS 256
+static pthread_mutex_t objectLocksG[OBJECT_LOCKS];
+
+// __s3fs_head_object's answer for an object that doesn't exist
+#define HEAD_MISSING (-2)
 
-// --------------------------------------------------------
+// Concurrent DELETEs while clearing a bucket
+#define CLEAR_WORKERS 16
+
+
+// Option prefixes -----------------------------------------------------------
 
 
 #define LOCATION_PREFIX "location="
@@ -181,7 +220,13 @@ int s3fs_init_credentials() {
     return 0;
 }
 
-static void S3_init()
+void s3fs_deadlines_init(int connect_ms, int first_byte_ms, int total_ms) {
+    deadlinesG.connectMs = connect_ms;
+    deadlinesG.firstByteMs = first_byte_ms;
+    deadlinesG.totalMs = total_ms;
+}
+
+static void S3_init_once()
 {
     S3Status status;
     const char *hostname = getenv("S3_HOSTNAME");
@@ -192,27 +237,47 @@ static void S3_init()
                 S3_get_status_name(status));
         exit(-1);
     }
+    int i;
+    for (i = 0; i < CHUNK_LOCKS; i++) {
+        pthread_mutex_init(&chunkLocksG[i], NULL);
+    }
+    for (i = 0; i < OBJECT_LOCKS; i++) {
+        pthread_mutex_init(&objectLocksG[i], NULL);
+    }
+}
+
+static void S3_init()
+{
+    pthread_once(&initOnceG, &S3_init_once);
+}
+
+static void request_status_init(request_status *rs)
+{
+    rs->status = S3StatusOK;
+    rs->retries = retriesG;
+    // Start out with a 1 second sleep before retrying
+    rs->retrySleepInterval = 1 * SLEEP_UNITS_PER_SECOND;
+    rs->responded = rs->done = 0;
+    rs->errorDetails[0] = '\0';
 }
 
-static void printError()
+static void printError(const request_status *rs)
 {
-    if (statusG < S3StatusErrorAccessDenied) {
-        fprintf(stderr, "\nERROR: %s\n", S3_get_status_name(statusG));
+    if (rs->status < S3StatusErrorAccessDenied) {
+        fprintf(stderr, "\nERROR: %s\n", S3_get_status_name(rs->status));
     }
     else {
-        fprintf(stderr, "\nERROR: %s\n", S3_get_status_name(statusG));
-        fprintf(stderr, "%s\n", errorDetailsG);
+        fprintf(stderr, "\nERROR: %s\n", S3_get_status_name(rs->status));
+        fprintf(stderr, "%s\n", rs->errorDetails);
     }
 }
 
-static int should_retry()
+static int should_retry(request_status *rs)
 {
-    if (retriesG--) {
-        // Sleep before next retry; start out with a 1 second sleep
-        static int retrySleepInterval = 1 * SLEEP_UNITS_PER_SECOND;
-        sleep(retrySleepInterval);
+    if (rs->retries--) {
+        sleep(rs->retrySleepInterval);
         // Next sleep 1 second longer
-        retrySleepInterval++;
+        rs->retrySleepInterval++;
         return 1;
     }
 
@@ -226,7 +291,7 @@ static int should_retry()
 static S3Status responsePropertiesCallback
     (const S3ResponseProperties *properties, void *callbackData)
 {
-    (void) callbackData;
+    ((request_status *) callbackData)->responded = 1;
 
     if (!showResponsePropertiesG) {
         return S3StatusOK;
@@ -264,40 +329,279 @@ static S3Status responsePropertiesCallback
     return S3StatusOK;
 }
 
+// Copy the interesting response properties into an s3fs_object_info_t
+static void recordObjectInfo(s3fs_object_info_t *info,
+                             const S3ResponseProperties *properties)
+{
+    snprintf(info->etag, sizeof(info->etag), "%s", 
+             properties->eTag ? properties->eTag : "");
+    info->last_modified = properties->lastModified;
+    info->content_length = properties->contentLength;
+    info->codec = S3FS_CODEC_NONE;
+    info->refs = 0;
+    int i;
+    for (i = 0; i < properties->metaDataCount; i++) {
+        const char *name = properties->metaData[i].name;
+        const char *value = properties->metaData[i].value;
+        if (!strcmp(name, META_CODEC)) {
+            info->codec = !strcmp(value, CODEC_ZBLOCK) ? S3FS_CODEC_ZBLOCK :
+                          !strcmp(value, CODEC_CHUNKS) ? S3FS_CODEC_CHUNKS :
+                          !strcmp(value, CODEC_SEGMENTS) ? S3FS_CODEC_SEGMENTS :
+                          S3FS_CODEC_NONE;
+        } else if (!strcmp(name, META_REFS)) {
+            info->refs = strtoull(value, NULL, 10);
+        }
+    }
+    // report the length of the data, not of what is stored
+    for (i = 0; info->codec && i < properties->metaDataCount; i++) {
+        if (!strcmp(properties->metaData[i].name, META_SIZE)) {
+            info->content_length = strtoull(properties->metaData[i].value, NULL, 10);
+        }
+    }
+}
+
+static void clearObjectInfo(s3fs_object_info_t *info)
+{
+    info->etag[0] = '\0';
+    info->last_modified = -1;
+    info->content_length = 0;
+    info->codec = S3FS_CODEC_NONE;
+    info->refs = 0;
+}
+
+// Fill in meta with the metadata of an object stored with codec, holding
+// size bytes of data and used by refs objects (if it is a chunk, else 0);
+// vals holds the values.  Returns the number of entries.
+static int objectMeta(S3NameValue *meta, char vals[][32], int codec,
+                      uint64_t size, uint64_t refs)
+{
+    int n = 0;
+    if (codec != S3FS_CODEC_NONE) {
+        meta[n].name = META_CODEC;
+        meta[n++].value = codec == S3FS_CODEC_ZBLOCK ? CODEC_ZBLOCK :
+                          codec == S3FS_CODEC_CHUNKS ? CODEC_CHUNKS : CODEC_SEGMENTS;
+        snprintf(vals[0], 32, "%llu", (unsigned long long) size);
+        meta[n].name = META_SIZE;
+        meta[n++].value = vals[0];
+    }
+    if (refs) {
+        snprintf(vals[1], 32, "%llu", (unsigned long long) refs);
+        meta[n].name = META_REFS;
+        meta[n++].value = vals[1];
+    }
+    return n;
+}
+
+// object indexes ------------------------------------------------------------
+
+// A ranged get of an encoded object needs the object's index to know
+// what to fetch: the block offsets of a compressed object, or the
+// manifest of a chunked or segmented one.  The indexes of recently used
+// objects are kept here as they are stored, direct-mapped by key, each
+// with the ETag of the object it was read from: a get that comes back
+// with another ETag means the object has changed and its index is stale.
+#define INDEX_CACHE_SLOTS 256
+
+typedef struct {
+    char *key;
+    char etag[S3FS_ETAG_MAX];
+    int codec;
+    uint8_t *index;
+    size_t len;
+} index_slot;
+
+static index_slot indexCacheG[INDEX_CACHE_SLOTS];
+static pthread_mutex_t indexLockG = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t key_hash(const char *key)
+{
+    uint32_t h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h;
+}
+
+static index_slot *index_slot_for(const char *key)
+{
+    return &indexCacheG[key_hash(key) % INDEX_CACHE_SLOTS];
+}
+
+// Copy the cached index of key into *index (malloc'ed, *len bytes), its
+// codec into *codec and its ETag into etag.  Returns -1 if key has no
+// cached index.
+static int index_get(const char *key, char *etag, int *codec,
+                     uint8_t **index, size_t *len)
+{
+    int rv = -1;
+    pthread_mutex_lock(&indexLockG);
+    index_slot *slot = index_slot_for(key);
+    if (slot->key && !strcmp(slot->key, key) && (*index = malloc(slot->len))) {
+        memcpy(*index, slot->index, slot->len);
+        *len = slot->len;
+        *codec = slot->codec;
+        strcpy(etag, slot->etag);
+        rv = 0;
+    }
+    pthread_mutex_unlock(&indexLockG);
+    return rv;
+}
+
+// Cache a copy of the len bytes of index of key, as of ETag etag
+static void index_put(const char *key, const char *etag, int codec,
+                      const uint8_t *index, size_t len)
+{
+    uint8_t *copy = malloc(len);
+    char *k = strdup(key);
+    if (!copy || !k) {
+        free(copy);
+        free(k);
+        return;
+    }
+    memcpy(copy, index, len);
+    pthread_mutex_lock(&indexLockG);
+    index_slot *slot = index_slot_for(key);
+    free(slot->key);
+    free(slot->index);
+    slot->key = k;
+    snprintf(slot->etag, sizeof(slot->etag), "%s", etag);
+    slot->codec = codec;
+    slot->index = copy;
+    slot->len = len;
+    pthread_mutex_unlock(&indexLockG);
+}
+
+static void index_drop(const char *key)
+{
+    pthread_mutex_lock(&indexLockG);
+    index_slot *slot = index_slot_for(key);
+    if (slot->key && !strcmp(slot->key, key)) {
+        free(slot->key);
+        free(slot->index);
+        slot->key = NULL;
+        slot->index = NULL;
+    }
+    pthread_mutex_unlock(&indexLockG);
+}
+
+// An object that may be segmented is only changed under its lock, so
+// that merging its segments can't race with appends or rewrites.  Only
+// needed while appends are on; returns the lock to unlock, or NULL.
+static pthread_mutex_t *lock_object(const char *key)
+{
+    if (!s3fs_segment_enabled()) {
+        return NULL;
+    }
+    S3_init();
+    pthread_mutex_t *lock = &objectLocksG[key_hash(key) % OBJECT_LOCKS];
+    pthread_mutex_lock(lock);
+    return lock;
+}
+
+static void unlock_object(pthread_mutex_t *lock)
+{
+    if (lock) {
+        pthread_mutex_unlock(lock);
+    }
+}
+
+// gets in flight ------------------------------------------------------------
+
+// Concurrent gets of the same data (bucket, key, range and If-None-Match
+// ETag) share one transfer: the first one in makes the request, and the
+// others wait for it and get copies of what it read.  A get only joins a
+// transfer that started after the object was last changed here, so it
+// never sees data older than a put it has seen complete.
+#define FLIGHT_SLOTS 256
+
+typedef struct flight {
+    char *bucket, *key, *etag;
+    ssize_t start, count;
+    int linked;                  // in the table, open to new gets
+    int done;
+    int waiters;
+    ssize_t rv;
+    uint8_t *buf;                // a copy of the data for the waiters
+    s3fs_object_info_t info;
+    pthread_cond_t cond;
+    struct flight *next;
+} flight;
+
+static flight *flightsG[FLIGHT_SLOTS];
+static pthread_mutex_t flightLockG = PTHREAD_MUTEX_INITIALIZER;
+
+static void flight_unlink(flight *f)
+{
+    flight **pp = &flightsG[key_hash(f->key) % FLIGHT_SLOTS];
+    while (*pp != f) {
+        pp = &(*pp)->next;
+    }
+    *pp = f->next;
+    f->linked = 0;
+}
+
+static void flight_free(flight *f)
+{
+    pthread_cond_destroy(&f->cond);
+    free(f->bucket);
+    free(f->key);
+    free(f->etag);
+    free(f->buf);
+    free(f);
+}
+
+// key is being changed: gets from now on don't join transfers of it
+// that are already in flight
+static void flight_forget(const char *key)
+{
+    pthread_mutex_lock(&flightLockG);
+    flight *f = flightsG[key_hash(key) % FLIGHT_SLOTS];
+    while (f) {
+        flight *next = f->next;
+        if (!strcmp(f->key, key)) {
+            flight_unlink(f);
+        }
+        f = next;
+    }
+    pthread_mutex_unlock(&flightLockG);
+}
+
 // response complete callback ------------------------------------------------
 
 // This callback does the same thing for every request type: saves the status
-// and error stuff in global variables
+// and error stuff in the request's request_status
 static void responseCompleteCallback(S3Status status,
                                      const S3ErrorDetails *error, 
                                      void *callbackData)
 {
-    (void) callbackData;
+    request_status *rs = (request_status *) callbackData;
+    char *errorDetails = rs->errorDetails;
 
-    statusG = status;
+    rs->status = status;
+    rs->done = 1;
     // Compose the error details message now, although we might not use it.
     // Can't just save a pointer to [error] since it's not guaranteed to last
     // beyond this callback
     int len = 0;
     if (error && error->message) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), sizeof(rs->errorDetails) - len,
                         "  Message: %s\n", error->message);
     }
     if (error && error->resource) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), sizeof(rs->errorDetails) - len,
                         "  Resource: %s\n", error->resource);
     }
     if (error && error->furtherDetails) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), sizeof(rs->errorDetails) - len,
                         "  Further Details: %s\n", error->furtherDetails);
     }
     if (error && error->extraDetailsCount) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), sizeof(rs->errorDetails) - len,
                         "%s", "  Extra Details:\n");
         int i;
         for (i = 0; i < error->extraDetailsCount; i++) {
-            len += snprintf(&(errorDetailsG[len]), 
-                            sizeof(errorDetailsG) - len, "    %s: %s\n", 
+            len += snprintf(&(errorDetails[len]), 
+                            sizeof(rs->errorDetails) - len, "    %s: %s\n", 
                             error->extraDetails[i].name,
                             error->extraDetails[i].value);
         }
@@ -305,16 +609,202 @@ static void responseCompleteCallback(S3Status status,
 }
 
 
+// hedged requests -----------------------------------------------------------
+
+// A get or head with no response yet by the time most have one (the
+// HEDGE_PERCENTILE of recent times to a response) is sent again, on
+// another connection.  Whichever of the two completes first is used and
+// the other is aborted.  Hedges are capped at a share of all requests,
+// so a backend that is slow across the board isn't sent twice the load.
+#define HEDGE_SAMPLES 256         // response times kept
+#define HEDGE_MIN_SAMPLES 32      // before any request is hedged
+#define HEDGE_PERCENTILE 95
+#define HEDGE_MAX_WAIT_MS 1000    // longest poll for I/O
+
+static int hedgeBudgetG = 0;      // percent of requests, 0 = no hedging
+static int64_t hedgeSamplesG[HEDGE_SAMPLES];   // in ms
+static uint64_t hedgeSampledG = 0;
+static int64_t hedgeAfterG = -1;  // ms without a response before hedging
+static uint64_t hedgeRequestsG = 0, hedgesG = 0, hedgeWinsG = 0;
+static pthread_mutex_t hedgeLockG = PTHREAD_MUTEX_INITIALIZER;
+
+// What run_hedged sends: a get if get is set, else a head
+typedef struct {
+    S3BucketContext *bucket;
+    const char *key;
+    S3GetConditions *conditions;
+    uint64_t start, count;
+    S3GetObjectHandler *get;
+    S3ResponseHandler *head;
+} hedged_request;
+
+void s3fs_hedge_init(int budget_percent)
+{
+    hedgeBudgetG = budget_percent > 0 ? budget_percent : 0;
+}
+
+void s3fs_hedge_stats(uint64_t *hedged, uint64_t *won)
+{
+    pthread_mutex_lock(&hedgeLockG);
+    *hedged = hedgesG;
+    *won = hedgeWinsG;
+    pthread_mutex_unlock(&hedgeLockG);
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int compare_ms(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// A request took ms to get a response; the threshold is worked out anew
+// every few samples
+static void hedge_sample(int64_t ms)
+{
+    pthread_mutex_lock(&hedgeLockG);
+    hedgeSamplesG[hedgeSampledG++ % HEDGE_SAMPLES] = ms;
+    if (hedgeSampledG >= HEDGE_MIN_SAMPLES && hedgeSampledG % 16 == 0) {
+        int64_t sorted[HEDGE_SAMPLES];
+        size_t n = hedgeSampledG < HEDGE_SAMPLES ? hedgeSampledG : HEDGE_SAMPLES;
+        memcpy(sorted, hedgeSamplesG, n * sizeof(int64_t));
+        qsort(sorted, n, sizeof(int64_t), compare_ms);
+        hedgeAfterG = sorted[n * HEDGE_PERCENTILE / 100];
+    }
+    pthread_mutex_unlock(&hedgeLockG);
+}
+
+// Count a hedge, unless that would go over the budget
+static int hedge_allowed(void)
+{
+    pthread_mutex_lock(&hedgeLockG);
+    int ok = hedgesG * 100 < (uint64_t) hedgeBudgetG * hedgeRequestsG;
+    if (ok) {
+        hedgesG++;
+    }
+    pthread_mutex_unlock(&hedgeLockG);
+    return ok;
+}
+
+static void issue(S3RequestContext *rc, const hedged_request *r, void *callbackData)
+{
+    if (r->get) {
+        S3_get_object(r->bucket, r->key, r->conditions, r->start, r->count,
+                      rc, r->get, callbackData);
+    } else {
+        S3_head_object(r->bucket, r->key, rc, r->head, callbackData);
+    }
+}
+
+// Run one attempt of request r, with callback data primary, hedged with
+// callback data backup.  Both start with a request_status.  The outcome
+// ends up in primary's status; returns 1 if the data that goes with it
+// is backup's.
+static int run_hedged(const hedged_request *r, void *primary, void *backup)
+{
+    request_status *p = primary, *b = backup;
+    S3RequestContext *rc;
+    if (!hedgeBudgetG || S3_create_request_context(&rc) != S3StatusOK) {
+        issue(NULL, r, primary);
+        return 0;
+    }
+    pthread_mutex_lock(&hedgeLockG);
+    hedgeRequestsG++;
+    int64_t after = hedgeAfterG;
+    pthread_mutex_unlock(&hedgeLockG);
+
+    p->responded = p->done = 0;
+    request_status_init(b);
+    int64_t start = now_ms();
+    int sent = 0, sampled = 0, winner = -1;
+    issue(rc, r, primary);
+    for (;;) {
+        int remaining;
+        if (S3_runonce_request_context(rc, &remaining) != S3StatusOK) {
+            break;
+        }
+        int64_t elapsed = now_ms() - start;
+        if (p->responded && !sampled) {
+            hedge_sample(elapsed);
+            sampled = 1;
+        }
+        // a failure only wins if the other one has failed too
+        if (p->done && (p->status == S3StatusOK || !sent || b->done)) {
+            winner = 0;
+            break;
+        }
+        if (sent && b->done && (b->status == S3StatusOK || p->done)) {
+            winner = 1;
+            break;
+        }
+        if (!sent && !p->responded && after >= 0 && elapsed >= after) {
+            if (hedge_allowed()) {
+                issue(rc, r, backup);
+                sent = 1;
+                continue;
+            }
+            after = -1;
+        }
+        if (remaining == 0) {
+            break;
+        }
+
+        fd_set readFds, writeFds, exceptFds;
+        int maxFd = -1;
+        FD_ZERO(&readFds);
+        FD_ZERO(&writeFds);
+        FD_ZERO(&exceptFds);
+        if (S3_get_request_context_fdsets(rc, &readFds, &writeFds, &exceptFds,
+                                          &maxFd) != S3StatusOK) {
+            break;
+        }
+        int64_t wait = S3_get_request_context_timeout(rc);
+        if (wait < 0 || wait > HEDGE_MAX_WAIT_MS) {
+            wait = HEDGE_MAX_WAIT_MS;
+        }
+        if (!sent && !p->responded && after >= 0 && after - elapsed < wait) {
+            wait = after > elapsed ? after - elapsed : 0;
+        }
+        struct timeval tv = { wait / 1000, (wait % 1000) * 1000 };
+        select(maxFd + 1, &readFds, &writeFds, &exceptFds, &tv);
+    }
+    if (winner == 1 && !sampled) {
+        // the time the slow one would have taken is at least this
+        hedge_sample(now_ms() - start);
+    }
+    // aborts whichever is still running
+    S3_destroy_request_context(rc);
+
+    if (winner < 0 && !p->done) {
+        p->status = S3StatusInternalError;
+    }
+    if (winner == 1) {
+        p->status = b->status;
+        memcpy(p->errorDetails, b->errorDetails, sizeof(p->errorDetails));
+        pthread_mutex_lock(&hedgeLockG);
+        hedgeWinsG++;
+        pthread_mutex_unlock(&hedgeLockG);
+    }
+    return winner == 1;
+}
+
+
 int s3fs_test_bucket(const char *bucketName) {
-    s3fs_lock();
     int rv = __s3fs_test_bucket(bucketName);
-    s3fs_unlock();
     return rv;
 }
 
 int __s3fs_test_bucket(const char *bucketName)
 {
     S3_init();
+    request_status rs;
+    request_status_init(&rs);
 
     S3ResponseHandler responseHandler =
     {
@@ -325,13 +815,13 @@ int __s3fs_test_bucket(const char *bucketName)
     do {
         S3_test_bucket(protocolG, uriStyleG, accessKeyIdG, secretAccessKeyG,
                        0, bucketName, sizeof(locationConstraint),
-                       locationConstraint, 0, &responseHandler, 0);
-    } while (S3_status_is_retryable(statusG) && should_retry());
+                       locationConstraint, 0, &responseHandler, &rs);
+    } while (S3_status_is_retryable(rs.status) && should_retry(&rs));
 
     const char *reason = "Unknown";
-    int result = statusG == S3StatusOK ? 1 : 0;
+    int result = rs.status == S3StatusOK ? 1 : 0;
 
-    switch (statusG) {
+    switch (rs.status) {
     case S3StatusOK:
         // bucket exists
         reason = locationConstraint[0] ? locationConstraint : "USA";
@@ -348,8 +838,6 @@ int __s3fs_test_bucket(const char *bucketName)
 
     fprintf(stderr, "S3 test_bucket: %s\n", reason);
 
-    S3_deinitialize();
-
     return result;
 }
 
@@ -364,6 +852,7 @@ struct node {
 
 typedef struct traverse_bucket_callback_data
 {
+    request_status status;
     int isTruncated;
     char nextMarker[1024];
     int keyCount;
@@ -419,12 +908,39 @@ static S3Status traverseBucketCallback(int isTruncated, const char *nextMarker,
 // (Makes sense, right?  Instead of listing, we just remove everything :-)
 
 int s3fs_clear_bucket(const char *bucketName) {
-    s3fs_lock();
     int rv = __s3fs_clear_bucket(bucketName);
-    s3fs_unlock();
     return rv;
 }
 
+// The keys left to delete, shared by the threads clearing a bucket
+typedef struct clear_work {
+    const char *bucketName;
+    struct node *next;
+    int failed;
+    pthread_mutex_t lock;
+} clear_work;
+
+static void *clear_worker(void *arg) {
+    clear_work *w = arg;
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        struct node *el = w->next;
+        if (el) {
+            w->next = el->next;
+        }
+        pthread_mutex_unlock(&w->lock);
+        if (!el) {
+            break;
+        }
+        if (__s3fs_remove_object(w->bucketName, el->key) < 0) {
+            pthread_mutex_lock(&w->lock);
+            w->failed = 1;
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return NULL;
+}
+
 int __s3fs_clear_bucket(const char *bucketName) {
     S3_init();
 
@@ -438,7 +954,8 @@ int __s3fs_clear_bucket(const char *bucketName) {
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        &deadlinesG
     };
 
     S3ListBucketHandler listBucketHandler =
@@ -453,34 +970,40 @@ int __s3fs_clear_bucket(const char *bucketName) {
     data.keyCount = 0;
     data.keylist = NULL;
     data.allDetails = allDetails;
+    request_status_init(&data.status);
 
     do {
         data.isTruncated = 0;
         do {
             S3_list_bucket(&bucketContext, prefix, data.nextMarker,
                            delimiter, maxkeys, 0, &listBucketHandler, &data);
-        } while (S3_status_is_retryable(statusG) && should_retry());
-        if (statusG != S3StatusOK) {
+        } while (S3_status_is_retryable(data.status.status) && should_retry(&data.status));
+        if (data.status.status != S3StatusOK) {
             break;
         }
     } while (data.isTruncated && (!maxkeys || (data.keyCount < maxkeys)));
 
-    int rv = statusG == S3StatusOK ? 0 : -1;
-
-    S3_deinitialize();
+    int rv = data.status.status == S3StatusOK ? 0 : -1;
 
     struct node *klist = data.keylist;
 
-    // try to remove objects
-    if (rv == 0) {
-        while (klist) {
-            struct node *el = klist;
-            int thisrv = __s3fs_remove_object(bucketName, el->key);
-            if (thisrv < 0) {
-                rv = -1;
-            }
-            klist = klist->next;
+    // try to remove objects, each DELETE mostly waiting on s3, so several
+    // at a time; the calling thread takes a share of the work too
+    if (rv == 0 && klist) {
+        clear_work w = { bucketName, klist, 0 };
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_t workers[CLEAR_WORKERS - 1];
+        int n = 0;
+        while (n < CLEAR_WORKERS - 1 && n < data.keyCount - 1 &&
+               pthread_create(&workers[n], NULL, clear_worker, &w) == 0) {
+            n++;
         }
+        clear_worker(&w);
+        while (n > 0) {
+            pthread_join(workers[--n], NULL);
+        }
+        pthread_mutex_destroy(&w.lock);
+        rv = w.failed ? -1 : 0;
     }
 
     // free keylist
@@ -495,16 +1018,266 @@ int __s3fs_clear_bucket(const char *bucketName) {
     return rv;
 }
 
+// chunk store ---------------------------------------------------------------
+
+// A chunk is stored once however many objects use it, and counts its
+// uses in its metadata.  A bucket is only written by one mount, so the
+// counts are kept right by updating them under a lock: a HEAD, then a
+// copy of the chunk onto itself with the new count.  The last use
+// removes the chunk.
+
+static ssize_t put_compressed(const char *bucketName, const char *key,
+                              const uint8_t *buf, ssize_t contentLength,
+                              s3fs_object_info_t *info, uint64_t refs);
+
+static int hash_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, S3FS_CHUNK_HASH);
+}
+
+// Remove from the n sorted hashes those among the m sorted hashes of
+// other.  Returns how many are left.
+static ssize_t hash_minus(uint8_t *hashes, ssize_t n, const uint8_t *other, ssize_t m)
+{
+    ssize_t i, kept = 0;
+    for (i = 0; i < n; i++) {
+        uint8_t *h = hashes + i * S3FS_CHUNK_HASH;
+        if (!m || !bsearch(h, other, m, S3FS_CHUNK_HASH, hash_cmp)) {
+            memmove(hashes + kept++ * S3FS_CHUNK_HASH, h, S3FS_CHUNK_HASH);
+        }
+    }
+    return kept;
+}
+
+// Set the use count of the chunk key, described by *info, to refs
+static int chunk_set_refs(const char *bucketName, const char *key,
+                          const s3fs_object_info_t *info, uint64_t refs)
+{
+    S3NameValue meta[3];
+    char vals[2][32];
+    int n = objectMeta(meta, vals, info->codec, info->content_length, refs);
+    return __s3fs_copy_object(bucketName, key, key, NULL, meta, n);
+}
+
+// Add a use of the chunk with hash, storing the len bytes of data as the
+// chunk if it isn't stored yet (data is NULL if it must be stored
+// already).  Returns 0 on success and -1 on failure.
+static int chunk_ref(const char *bucketName, const uint8_t *hash,
+                     const uint8_t *data, size_t len)
+{
+    char key[S3FS_CHUNK_KEY_MAX];
+    s3fs_chunk_key(hash, key, sizeof(key));
+    S3_init();
+    pthread_mutex_t *lock = &chunkLocksG[hash[0] % CHUNK_LOCKS];
+    pthread_mutex_lock(lock);
+    s3fs_object_info_t info;
+    int rv = __s3fs_head_object(bucketName, key, &info);
+    if (rv == 0) {
+        rv = chunk_set_refs(bucketName, key, &info, info.refs + 1);
+    } else if (rv == HEAD_MISSING && data) {
+        rv = put_compressed(bucketName, key, data, len, NULL, 1) < 0 ? -1 : 0;
+    } else {
+        rv = -1;
+    }
+    pthread_mutex_unlock(lock);
+    return rv;
+}
+
+// Drop a use of each of the n chunks with hashes
+static void chunk_unref(const char *bucketName, const uint8_t *hashes, ssize_t n)
+{
+    ssize_t i;
+    S3_init();
+    for (i = 0; i < n; i++) {
+        const uint8_t *hash = hashes + i * S3FS_CHUNK_HASH;
+        char key[S3FS_CHUNK_KEY_MAX];
+        s3fs_chunk_key(hash, key, sizeof(key));
+        pthread_mutex_t *lock = &chunkLocksG[hash[0] % CHUNK_LOCKS];
+        pthread_mutex_lock(lock);
+        s3fs_object_info_t info;
+        if (__s3fs_head_object(bucketName, key, &info) == 0) {
+            if (info.refs <= 1) {
+                index_drop(key);
+                __s3fs_remove_object(bucketName, key);
+            } else {
+                chunk_set_refs(bucketName, key, &info, info.refs - 1);
+            }
+        }
+        pthread_mutex_unlock(lock);
+    }
+}
+
+// What an object refers to: the distinct chunks it uses (sorted), and the
+// segments it is made of (none if segments.count is 0)
+typedef struct {
+    uint8_t *hashes;
+    ssize_t nhashes;
+    s3fs_manifest_t segments;
+} object_refs;
+
+// Whether objects may refer to others at all
+static int tracking_refs(void)
+{
+    return s3fs_chunk_enabled() || s3fs_segment_enabled();
+}
+
+// Find what key refers to.  Returns 0 on success (with nothing found if
+// key is neither chunked nor segmented, or doesn't exist) and -1 on
+// failure.
+static int load_refs(const char *bucketName, const char *key, object_refs *r)
+{
+    memset(r, 0, sizeof(*r));
+    s3fs_object_info_t info;
+    int rv = __s3fs_head_object(bucketName, key, &info);
+    if (rv != 0 || (info.codec != S3FS_CODEC_CHUNKS &&
+                    info.codec != S3FS_CODEC_SEGMENTS)) {
+        return rv == 0 || rv == HEAD_MISSING ? 0 : -1;
+    }
+    uint8_t *buf = NULL;
+    ssize_t len = __s3fs_get_object(bucketName, key, &buf, 0, 0, NULL, &info);
+    if (len < 0) {
+        return -1;
+    }
+    s3fs_manifest_t m;
+    rv = s3fs_manifest_parse(buf, len, &m);
+    free(buf);
+    if (rv < 0) {
+        // changed since the HEAD, or corrupt
+        return info.codec == S3FS_CODEC_CHUNKS || info.codec == S3FS_CODEC_SEGMENTS ? -1 : 0;
+    }
+    if (info.codec == S3FS_CODEC_SEGMENTS) {
+        r->segments = m;
+        return 0;
+    }
+    r->nhashes = s3fs_manifest_hashes(&m, &r->hashes);
+    s3fs_manifest_free(&m);
+    return r->nhashes < 0 ? -1 : 0;
+}
+
+static int remove_encoded(const char *bucketName, const char *key);
+
+// An object that referred to r is gone: its chunks lose a use, except
+// the nkeep sorted hashes in keep, and its segments are removed
+static void release_refs(const char *bucketName, object_refs *r,
+                         const uint8_t *keep, ssize_t nkeep)
+{
+    r->nhashes = hash_minus(r->hashes, r->nhashes, keep, nkeep);
+    chunk_unref(bucketName, r->hashes, r->nhashes);
+    uint32_t i;
+    for (i = 0; i < r->segments.count; i++) {
+        char key[S3FS_CHUNK_KEY_MAX];
+        s3fs_segment_key(r->segments.chunks[i].hash, key, sizeof(key));
+        remove_encoded(bucketName, key);
+    }
+}
+
+static void free_refs(object_refs *r)
+{
+    free(r->hashes);
+    s3fs_manifest_free(&r->segments);
+}
+
+// Store buf as chunks and a manifest.  The n old hashes are the chunks
+// of the object being replaced, which already count it; the other
+// chunks get a new use, and are uploaded if they aren't stored yet.  On
+// success sets *hashes to the distinct chunks now used, and their number
+// to *nhashes.
+static ssize_t put_chunked(const char *bucketName, const char *key,
+                           const uint8_t *buf, ssize_t contentLength,
+                           s3fs_object_info_t *info, const uint8_t *old,
+                           ssize_t nold, uint8_t **hashes, ssize_t *nhashes)
+{
+    s3fs_manifest_t m;
+    if (s3fs_chunk_split(buf, contentLength, &m) < 0) {
+        return -1;
+    }
+    ssize_t n = s3fs_manifest_hashes(&m, hashes);
+    if (n < 0) {
+        s3fs_manifest_free(&m);
+        return -1;
+    }
+    uint8_t *add = malloc(n * S3FS_CHUNK_HASH);
+    char *done = calloc(n ? n : 1, 1);
+    ssize_t nadd = 0, rv = add && done ? 0 : -1;
+    if (add) {
+        memcpy(add, *hashes, n * S3FS_CHUNK_HASH);
+        nadd = hash_minus(add, n, old, nold);
+    }
+
+    uint32_t i;
+    for (i = 0; rv == 0 && nadd && i < m.count; i++) {
+        uint8_t *h = bsearch(m.chunks[i].hash, add, nadd, S3FS_CHUNK_HASH, hash_cmp);
+        if (h && !done[(h - add) / S3FS_CHUNK_HASH]) {
+            uint64_t start = s3fs_chunk_start(&m, i);
+            rv = chunk_ref(bucketName, h, buf + start, m.chunks[i].end - start);
+            done[(h - add) / S3FS_CHUNK_HASH] = rv == 0;
+        }
+    }
+
+    s3fs_object_info_t local;
+    if (!info) {
+        info = &local;
+    }
+    if (rv == 0) {
+        uint8_t *manifest = NULL;
+        size_t len = s3fs_manifest_encode(&m, &manifest);
+        S3NameValue meta[3];
+        char vals[2][32];
+        int nmeta = objectMeta(meta, vals, S3FS_CODEC_CHUNKS, contentLength, 0);
+        rv = len ? __s3fs_put_object(bucketName, key, manifest, len, info, meta, nmeta) : -1;
+        if (rv >= 0 && info->etag[0]) {
+            index_put(key, info->etag, S3FS_CODEC_CHUNKS, manifest, len);
+        }
+        free(manifest);
+    }
+
+    if (rv < 0) {
+        // give back the uses taken
+        ssize_t k;
+        for (k = 0; k < nadd; k++) {
+            if (done[k]) {
+                chunk_unref(bucketName, add + k * S3FS_CHUNK_HASH, 1);
+            }
+        }
+        free(*hashes);
+        *hashes = NULL;
+        n = 0;
+    } else {
+        info->codec = S3FS_CODEC_CHUNKS;
+        rv = contentLength;
+    }
+    *nhashes = n;
+    free(add);
+    free(done);
+    s3fs_manifest_free(&m);
+    return rv;
+}
+
 // put object ----------------------------------------------------------------
 
 typedef struct put_object_callback_data
 {
+    request_status status;
     const uint8_t *data;
     uint64_t contentLength, originalContentLength;
     int written;
     int noStatus;
+    s3fs_object_info_t *info;
 } put_object_callback_data;
 
+static S3Status putObjectPropertiesCallback
+    (const S3ResponseProperties *properties, void *callbackData)
+{
+    put_object_callback_data *data = 
+        (put_object_callback_data *) callbackData;
+
+    if (data->info) {
+        recordObjectInfo(data->info, properties);
+    }
+
+    return responsePropertiesCallback(properties, callbackData);
+}
+
 
 int putObjectDataCallback(int bufferSize, char *buffer,
                                  void *callbackData)
@@ -540,14 +1313,90 @@ int putObjectDataCallback(int bufferSize, char *buffer,
     return ret;
 }
 
+// Put an object, compressed if that is worth it.  refs is its use count
+// if it is a chunk, else 0.
+static ssize_t put_compressed(const char *bucketName, const char *key,
+                              const uint8_t *buf, ssize_t contentLength,
+                              s3fs_object_info_t *info, uint64_t refs)
+{
+    S3NameValue meta[3];
+    char vals[2][32];
+    uint8_t *z = NULL;
+    ssize_t zlen = s3fs_compress(buf, contentLength, &z);
+    if (zlen <= 0) {
+        int n = objectMeta(meta, vals, S3FS_CODEC_NONE, contentLength, refs);
+        return __s3fs_put_object(bucketName, key, buf, contentLength, info, meta, n);
+    }
+
+    s3fs_object_info_t local;
+    if (!info) {
+        info = &local;
+    }
+    int n = objectMeta(meta, vals, S3FS_CODEC_ZBLOCK, contentLength, refs);
+    ssize_t rv = __s3fs_put_object(bucketName, key, z, zlen, info, meta, n);
+    if (rv >= 0) {
+        // the next ranged get needn't fetch the index
+        if (info->etag[0]) {
+            index_put(key, info->etag, S3FS_CODEC_ZBLOCK, z,
+                      s3fs_zheader_size(contentLength));
+        }
+        info->codec = S3FS_CODEC_ZBLOCK;
+        rv = contentLength;
+    }
+    free(z);
+    return rv;
+}
+
+// Put an object, chunked or compressed if that is worth it
+static ssize_t put_encoded(const char *bucketName, const char *key,
+                           const uint8_t *buf, ssize_t contentLength,
+                           s3fs_object_info_t *info)
+{
+    index_drop(key);
+    flight_forget(key);
+    if (!tracking_refs()) {
+        return put_compressed(bucketName, key, buf, contentLength, info, 0);
+    }
+
+    // what the object being replaced refers to is released, apart from
+    // the chunks the new one uses too (if it can't be found, it is left
+    // alone)
+    object_refs old;
+    uint8_t *cur = NULL;
+    ssize_t ncur = 0;
+    if (load_refs(bucketName, key, &old) < 0) {
+        memset(&old, 0, sizeof(old));
+    }
+    ssize_t rv = s3fs_chunk_wanted(contentLength) ?
+        put_chunked(bucketName, key, buf, contentLength, info,
+                    old.hashes, old.nhashes, &cur, &ncur) :
+        put_compressed(bucketName, key, buf, contentLength, info, 0);
+    if (rv >= 0) {
+        release_refs(bucketName, &old, cur, ncur);
+    }
+    free_refs(&old);
+    free(cur);
+    return rv;
+}
+
 ssize_t s3fs_put_object(const char *bucketName, const char *key, const uint8_t *buf, ssize_t contentLength) {
-    s3fs_lock();
-    ssize_t rv = __s3fs_put_object(bucketName, key, buf, contentLength);
-    s3fs_unlock();
+    pthread_mutex_t *lock = lock_object(key);
+    ssize_t rv = put_encoded(bucketName, key, buf, contentLength, NULL);
+    unlock_object(lock);
     return rv;
 }
 
-ssize_t __s3fs_put_object(const char *bucketName, const char *key, const uint8_t *buf, ssize_t contentLength)
+ssize_t s3fs_put_object_info(const char *bucketName, const char *key,
+                             const uint8_t *buf, ssize_t contentLength,
+                             s3fs_object_info_t *info) {
+    pthread_mutex_t *lock = lock_object(key);
+    ssize_t rv = put_encoded(bucketName, key, buf, contentLength, info);
+    unlock_object(lock);
+    return rv;
+}
+
+// meta is the object's metadata, metaCount entries
+ssize_t __s3fs_put_object(const char *bucketName, const char *key, const uint8_t *buf, ssize_t contentLength, s3fs_object_info_t *info, const S3NameValue *meta, int metaCount)
 {
     const char *cacheControl = 0, *contentType = 0, *md5 = 0;
     const char *contentDispositionFilename = 0, *contentEncoding = 0;
@@ -557,13 +1406,15 @@ ssize_t __s3fs_put_object(const char *bucketName, const char *key, const uint8_t
     S3NameValue metaProperties[S3_MAX_METADATA_COUNT];
     int noStatus = 0;
 
+    for (metaPropertiesCount = 0; metaPropertiesCount < metaCount; metaPropertiesCount++) {
+        metaProperties[metaPropertiesCount] = meta[metaPropertiesCount];
+    }
+
     put_object_callback_data data;
     memset(&data, 0, sizeof(put_object_callback_data));
-    data.data = buf;
-    // data.gb = 0;
+    request_status_init(&data.status);
     data.noStatus = noStatus;
-
-    data.contentLength = data.originalContentLength = contentLength;
+    data.info = info;
 
     S3_init();
     
@@ -574,7 +1425,8 @@ ssize_t __s3fs_put_object(const char *bucketName, const char *key, const uint8_t
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        &deadlinesG
     };
 
     S3PutProperties putProperties =
@@ -592,37 +1444,59 @@ ssize_t __s3fs_put_object(const char *bucketName, const char *key, const uint8_t
 
     S3PutObjectHandler putObjectHandler =
     {
-        { &responsePropertiesCallback, &responseCompleteCallback },
+        { &putObjectPropertiesCallback, &responseCompleteCallback },
         &putObjectDataCallback
     };
 
     do {
+        // every attempt sends the whole object again
+        data.data = buf;
+        data.written = 0;
+        data.contentLength = data.originalContentLength = contentLength;
+        if (info) {
+            clearObjectInfo(info);
+        }
         S3_put_object(&bucketContext, key, contentLength, &putProperties, 0,
                       &putObjectHandler, &data);
-    } while (S3_status_is_retryable(statusG) && should_retry());
+    } while (S3_status_is_retryable(data.status.status) && should_retry(&data.status));
 
     int result = data.written;
 
-    if (statusG != S3StatusOK) {
-        printError();
+    if (data.status.status != S3StatusOK) {
+        printError(&data.status);
         result = -1;
     }
     else if (data.contentLength) {
         fprintf(stderr, "\nERROR: Failed to read remaining %llu bytes from "
                 "input\n", (unsigned long long) data.contentLength);
     }
-
-    S3_deinitialize();
     return result;
 }
 
 // get object ----------------------------------------------------------------
 
 struct get_callback_data {
+    request_status status;
     uint8_t *buf;
     ssize_t bytes_read;
+    s3fs_object_info_t *info;
 };
 
+// Record the properties of the object being read (if the caller asked for
+// them), then fall through to the common properties callback.
+static S3Status getObjectPropertiesCallback
+    (const S3ResponseProperties *properties, void *callbackData)
+{
+    struct get_callback_data *get_context = 
+        (struct get_callback_data*)callbackData;
+
+    if (get_context->info) {
+        recordObjectInfo(get_context->info, properties);
+    }
+
+    return responsePropertiesCallback(properties, callbackData);
+}
+
 S3Status getObjectDataCallback(int bufferSize, const char *buffer,
                                void *callbackData) {
     struct get_callback_data *get_context = (struct get_callback_data*)callbackData;
@@ -655,26 +1529,386 @@ S3Status getObjectDataCallback(int bufferSize, const char *buffer,
 }
 
 
+// A get that finds the object changed under its cached index
+#define INDEX_STALE (-3)
+
+// Read data bytes [start_byte, start_byte + byte_count) of a compressed
+// object, given its header (hdr, len bytes) as of ETag etag.  obj is the
+// whole object if it has been read already (hdr is then its start), else
+// NULL; cached tells whether hdr came from the index cache.
+static ssize_t get_compressed(const char *bucketName, const char *key,
+                              const char *etag, const uint8_t *hdr, size_t len,
+                              const uint8_t *obj, int cached,
+                              uint64_t start, ssize_t byte_count,
+                              const char *ifNotMatch, uint8_t **buf,
+                              s3fs_object_info_t *info)
+{
+    s3fs_zindex_t ix;
+    if (s3fs_zindex_parse(hdr, len, &ix) < 0 ||
+        (obj && ix.offsets[ix.nblocks] != len)) {
+        fprintf(stderr, "ERROR: corrupt compressed object %s\n", key);
+        return -1;
+    }
+    if (!cached && etag[0]) {
+        index_put(key, etag, S3FS_CODEC_ZBLOCK, hdr, s3fs_zheader_size(ix.size));
+    }
+
+    uint64_t end = byte_count ? start + byte_count : ix.size;
+    if (end > ix.size) {
+        end = ix.size;
+    }
+    if (start >= end) {
+        s3fs_zindex_free(&ix);
+        return -1;
+    }
+    uint64_t obj_start, obj_end;
+    s3fs_zrange(&ix, start, end, &obj_start, &obj_end);
+    uint8_t *blocks = NULL;
+    if (!obj) {
+        // only the blocks that hold the range
+        ssize_t rv = __s3fs_get_object(bucketName, key, &blocks, obj_start,
+                                       obj_end - obj_start, ifNotMatch, info);
+        if (rv < 0) {
+            s3fs_zindex_free(&ix);
+            return rv;
+        }
+        if (strcmp(info->etag, etag) || (uint64_t) rv != obj_end - obj_start) {
+            free(blocks);
+            s3fs_zindex_free(&ix);
+            return INDEX_STALE;
+        }
+    }
+    uint8_t *out = malloc(end - start);
+    int rv = out ? s3fs_zdecode(&ix, obj ? obj + obj_start : blocks, start, end, out) : -1;
+    free(blocks);
+    s3fs_zindex_free(&ix);
+    if (rv < 0) {
+        fprintf(stderr, "ERROR: corrupt compressed object %s\n", key);
+        free(out);
+        return -1;
+    }
+    info->content_length = end - start;
+    info->codec = S3FS_CODEC_ZBLOCK;
+    *buf = out;
+    return end - start;
+}
+
+// Same for a chunked or segmented object, given its manifest.  Chunks
+// and segments are never rewritten, so a cached manifest is checked
+// against the object with a conditional get of it, and the pieces it
+// lists are read as they are.  A piece that can't be read may have been
+// merged away since the manifest was read, so that is retried as a stale
+// manifest.
+static ssize_t get_pieces(const char *bucketName, const char *key, int codec,
+                          const char *etag, const uint8_t *manifest,
+                          size_t len, int cached,
+                          uint64_t start, ssize_t byte_count,
+                          const char *ifNotMatch, uint8_t **buf,
+                          s3fs_object_info_t *info)
+{
+    if (cached) {
+        uint8_t *fresh = NULL;
+        ssize_t rv = __s3fs_get_object(bucketName, key, &fresh, 0, 0, etag, info);
+        if (rv >= 0) {
+            free(fresh);
+            return INDEX_STALE;
+        } else if (rv != S3FS_NOT_MODIFIED) {
+            return rv;
+        }
+        snprintf(info->etag, sizeof(info->etag), "%s", etag);
+        if (ifNotMatch && !strcmp(ifNotMatch, etag)) {
+            return S3FS_NOT_MODIFIED;
+        }
+    }
+    s3fs_manifest_t m;
+    if (s3fs_manifest_parse(manifest, len, &m) < 0) {
+        fprintf(stderr, "ERROR: corrupt manifest %s\n", key);
+        return -1;
+    }
+    if (!cached && etag[0]) {
+        index_put(key, etag, codec, manifest, len);
+    }
+
+    uint64_t end = byte_count ? start + byte_count : m.size;
+    if (end > m.size) {
+        end = m.size;
+    }
+    uint8_t *out = start < end ? malloc(end - start) : NULL;
+    if (!out) {
+        s3fs_manifest_free(&m);
+        return -1;
+    }
+    uint32_t i;
+    for (i = s3fs_manifest_find(&m, start); i < m.count && s3fs_chunk_start(&m, i) < end; i++) {
+        uint64_t piece_start = s3fs_chunk_start(&m, i);
+        uint64_t from = start > piece_start ? start - piece_start : 0;
+        uint64_t to = (end < m.chunks[i].end ? end : m.chunks[i].end) - piece_start;
+        char piece[S3FS_CHUNK_KEY_MAX];
+        if (codec == S3FS_CODEC_CHUNKS) {
+            s3fs_chunk_key(m.chunks[i].hash, piece, sizeof(piece));
+        } else {
+            s3fs_segment_key(m.chunks[i].hash, piece, sizeof(piece));
+        }
+        uint8_t *data = NULL;
+        ssize_t rv = s3fs_get_object(bucketName, piece, &data, from, to - from);
+        if (rv != (ssize_t) (to - from)) {
+            if (rv >= 0) {
+                free(data);
+            }
+            free(out);
+            s3fs_manifest_free(&m);
+            return INDEX_STALE;
+        }
+        memcpy(out + (piece_start + from - start), data, to - from);
+        free(data);
+    }
+    s3fs_manifest_free(&m);
+    info->content_length = end - start;
+    info->codec = codec;
+    *buf = out;
+    return end - start;
+}
+
+// Fetch the index of the object described by *info: the header of a
+// compressed object, or the manifest of a chunked or segmented one
+static int fetch_index(const char *bucketName, const char *key,
+                       const s3fs_object_info_t *info, uint8_t **index,
+                       size_t *len)
+{
+    s3fs_object_info_t got;
+    ssize_t want = info->codec == S3FS_CODEC_ZBLOCK ?
+                   (ssize_t) s3fs_zheader_size(info->content_length) : 0;
+    ssize_t rv = __s3fs_get_object(bucketName, key, index, 0, want, NULL, &got);
+    if (rv < 0) {
+        return -1;
+    }
+    if (strcmp(got.etag, info->etag) || got.codec != info->codec) {
+        free(*index);
+        return -1;
+    }
+    *len = rv;
+    return 0;
+}
+
+// Get an object, or a range of it, decoding as needed.  An object whose
+// index isn't cached is read as it is, which is all it takes unless it
+// turns out to be encoded.  Otherwise only what holds the range is read.
+static ssize_t get_decoded(const char *bucketName, const char *key, uint8_t **buf,
+                           ssize_t start_byte, ssize_t byte_count,
+                           const char *ifNotMatch, s3fs_object_info_t *info)
+{
+    s3fs_object_info_t local;
+    if (!info) {
+        info = &local;
+    }
+    int whole = start_byte == 0 && byte_count == 0;
+
+    // a second try if the object changed under a cached index
+    int attempt;
+    for (attempt = 0; attempt < 2; attempt++) {
+        char etag[S3FS_ETAG_MAX];
+        int codec, cached = 0;
+        uint8_t *index = NULL, *obj = NULL;
+        size_t len = 0;
+        if (!whole && index_get(key, etag, &codec, &index, &len) == 0) {
+            cached = 1;
+        } else {
+            ssize_t rv = __s3fs_get_object(bucketName, key, &obj, start_byte,
+                                           byte_count, ifNotMatch, info);
+            if (rv == -1 && !whole && __s3fs_head_object(bucketName, key, info) == 0 &&
+                info->codec) {
+                // the range may lie past the end of what is stored
+            } else if (rv < 0 || !info->codec) {
+                if (rv >= 0) {
+                    *buf = obj;
+                }
+                return rv;
+            }
+            codec = info->codec;
+            snprintf(etag, sizeof(etag), "%s", info->etag);
+            if (whole) {
+                len = rv;
+            } else {
+                // what was read is no use without the index
+                free(obj);
+                obj = NULL;
+                if (fetch_index(bucketName, key, info, &index, &len) < 0) {
+                    continue;
+                }
+            }
+        }
+
+        ssize_t rv;
+        if (codec == S3FS_CODEC_CHUNKS || codec == S3FS_CODEC_SEGMENTS) {
+            rv = get_pieces(bucketName, key, codec, etag, obj ? obj : index, len,
+                            cached, start_byte, byte_count, ifNotMatch, buf, info);
+        } else {
+            rv = get_compressed(bucketName, key, etag, obj ? obj : index, len, obj,
+                                cached, start_byte, byte_count, ifNotMatch, buf, info);
+        }
+        free(index);
+        free(obj);
+        if (rv != INDEX_STALE) {
+            return rv;
+        }
+        index_drop(key);
+    }
+    fprintf(stderr, "ERROR: can't read %s: its parts keep changing or are gone\n", key);
+    return -1;
+}
+
+// get_decoded, sharing the transfer with concurrent identical gets (see
+// "gets in flight" above)
+static ssize_t get_shared(const char *bucketName, const char *key, uint8_t **buf,
+                          ssize_t start_byte, ssize_t byte_count,
+                          const char *ifNotMatch, s3fs_object_info_t *info)
+{
+    pthread_mutex_lock(&flightLockG);
+    flight **slot = &flightsG[key_hash(key) % FLIGHT_SLOTS];
+    flight *f;
+    for (f = *slot; f; f = f->next) {
+        if (!strcmp(f->key, key) && !strcmp(f->bucket, bucketName) &&
+            f->start == start_byte && f->count == byte_count &&
+            (f->etag && ifNotMatch ? !strcmp(f->etag, ifNotMatch) : f->etag == ifNotMatch)) {
+            break;
+        }
+    }
+
+    if (f) {
+        f->waiters++;
+        while (!f->done) {
+            pthread_cond_wait(&f->cond, &flightLockG);
+        }
+        f->waiters--;
+        ssize_t rv = f->rv;
+        uint8_t *data = NULL;
+        if (rv > 0 && f->buf) {
+            // the last one out takes the leader's copy
+            if (f->waiters == 0) {
+                data = f->buf;
+                f->buf = NULL;
+            } else if ((data = malloc(rv))) {
+                memcpy(data, f->buf, rv);
+            }
+        }
+        if (info && rv != -1) {
+            *info = f->info;
+        }
+        if (f->waiters == 0) {
+            flight_free(f);
+        }
+        pthread_mutex_unlock(&flightLockG);
+        if (rv > 0 && !data) {
+            // out of memory for a copy: read it alone
+            return get_decoded(bucketName, key, buf, start_byte, byte_count,
+                               ifNotMatch, info);
+        }
+        if (rv >= 0) {
+            __sync_fetch_and_add(&sharedGetsG, 1);
+            *buf = data;
+        }
+        return rv;
+    }
+
+    f = calloc(1, sizeof(flight));
+    if (f && (!(f->bucket = strdup(bucketName)) || !(f->key = strdup(key)) ||
+              (ifNotMatch && !(f->etag = strdup(ifNotMatch))))) {
+        free(f->bucket);
+        free(f->key);
+        free(f);
+        f = NULL;
+    }
+    if (!f) {
+        pthread_mutex_unlock(&flightLockG);
+        return get_decoded(bucketName, key, buf, start_byte, byte_count,
+                           ifNotMatch, info);
+    }
+    f->start = start_byte;
+    f->count = byte_count;
+    pthread_cond_init(&f->cond, NULL);
+    f->next = *slot;
+    *slot = f;
+    f->linked = 1;
+    pthread_mutex_unlock(&flightLockG);
+
+    s3fs_object_info_t local;
+    if (!info) {
+        info = &local;
+    }
+    ssize_t rv = get_decoded(bucketName, key, buf, start_byte, byte_count,
+                             ifNotMatch, info);
+
+    pthread_mutex_lock(&flightLockG);
+    if (f->linked) {
+        flight_unlink(f);
+    }
+    f->done = 1;
+    f->rv = rv;
+    f->info = *info;
+    if (f->waiters == 0) {
+        flight_free(f);
+    } else {
+        if (rv > 0 && (f->buf = malloc(rv))) {
+            memcpy(f->buf, *buf, rv);
+        }
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&flightLockG);
+    return rv;
+}
+
 ssize_t s3fs_get_object(const char *bucketName, const char *key, uint8_t **buf, 
                         ssize_t start_byte, ssize_t byte_count) {
-    s3fs_lock();
-    ssize_t rv = __s3fs_get_object(bucketName, key, buf, start_byte, byte_count);
-    s3fs_unlock();
+    ssize_t rv = get_shared(bucketName, key, buf, start_byte, byte_count, NULL, NULL);
     return rv;
 }
 
+ssize_t s3fs_get_object_info(const char *bucketName, const char *key, 
+                             uint8_t **buf, ssize_t start_byte, 
+                             ssize_t byte_count, s3fs_object_info_t *info) {
+    ssize_t rv = get_shared(bucketName, key, buf, start_byte, byte_count, NULL, info);
+    return rv;
+}
+
+ssize_t s3fs_get_object_if_changed(const char *bucketName, const char *key,
+                                   uint8_t **buf, ssize_t start_byte,
+                                   ssize_t byte_count, const char *etag,
+                                   s3fs_object_info_t *info) {
+    ssize_t rv = get_shared(bucketName, key, buf, start_byte, byte_count, 
+                            (etag && etag[0]) ? etag : NULL, info);
+    if (etag && etag[0]) {
+        if (rv == S3FS_NOT_MODIFIED) {
+            __sync_fetch_and_add(&revalidateHitsG, 1);
+        } else {
+            __sync_fetch_and_add(&revalidateMissesG, 1);
+        }
+    }
+    return rv;
+}
+
+void s3fs_revalidation_stats(uint64_t *hits, uint64_t *misses) {
+    *hits = __sync_fetch_and_add(&revalidateHitsG, 0);
+    *misses = __sync_fetch_and_add(&revalidateMissesG, 0);
+}
+
+uint64_t s3fs_shared_get_stats(void) {
+    return __sync_fetch_and_add(&sharedGetsG, 0);
+}
+
 ssize_t __s3fs_get_object(const char *bucketName, const char *key, uint8_t **buf, 
-                        ssize_t start_byte, ssize_t byte_count) {
+                        ssize_t start_byte, ssize_t byte_count,
+                        const char *ifNotMatchTag, s3fs_object_info_t *info) {
 
     int64_t ifModifiedSince = -1, ifNotModifiedSince = -1;
-    const char *ifMatch = 0, *ifNotMatch = 0;
+    const char *ifMatch = 0, *ifNotMatch = ifNotMatchTag;
     uint64_t startByte = start_byte, byteCount = byte_count;
 
     S3_init();
 
     struct get_callback_data get_context;
+    request_status_init(&get_context.status);
     get_context.buf = NULL;
-    get_context.bytes_read = 0;
+    get_context.info = info;
     
     S3BucketContext bucketContext =
     {
@@ -683,7 +1917,8 @@ ssize_t __s3fs_get_object(const char *bucketName, const char *key, uint8_t **buf
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        &deadlinesG
     };
 
     S3GetConditions getConditions =
@@ -696,41 +1931,282 @@ ssize_t __s3fs_get_object(const char *bucketName, const char *key, uint8_t **buf
 
     S3GetObjectHandler getObjectHandler =
     {
-        { &responsePropertiesCallback, &responseCompleteCallback },
+        { &getObjectPropertiesCallback, &responseCompleteCallback },
         &getObjectDataCallback
     };
 
+    hedged_request request =
+    {
+        &bucketContext, key, &getConditions, startByte, byteCount,
+        &getObjectHandler, 0
+    };
+    struct get_callback_data hedge;
+    s3fs_object_info_t hedgeInfo;
+
     do {
-        S3_get_object(&bucketContext, key, &getConditions, startByte,
-                      byteCount, 0, &getObjectHandler, &get_context);
-    } while (S3_status_is_retryable(statusG) && should_retry());
+        // drop whatever a failed attempt managed to read
+        free(get_context.buf);
+        get_context.buf = NULL;
+        get_context.bytes_read = 0;
+        if (info) {
+            clearObjectInfo(info);
+        }
+        hedge.buf = NULL;
+        hedge.bytes_read = 0;
+        hedge.info = info ? &hedgeInfo : NULL;
+        clearObjectInfo(&hedgeInfo);
+        if (run_hedged(&request, &get_context, &hedge)) {
+            free(get_context.buf);
+            get_context.buf = hedge.buf;
+            get_context.bytes_read = hedge.bytes_read;
+            if (info) {
+                *info = hedgeInfo;
+            }
+        } else {
+            free(hedge.buf);
+        }
+    } while (S3_status_is_retryable(get_context.status.status) && should_retry(&get_context.status));
 
     ssize_t status = get_context.bytes_read;
-    if (statusG != S3StatusOK) {
+    if (get_context.status.status == S3StatusHttpErrorNotModified) {
+        status = S3FS_NOT_MODIFIED;
+        free(get_context.buf);
+    } else if (get_context.status.status != S3StatusOK) {
         status = -1;
         if (get_context.buf) {
             free (get_context.buf);
         }
-        printError();
+        printError(&get_context.status);
     } else {
         *buf = get_context.buf; 
     }
 
-    S3_deinitialize();
-
     return status;
 }
 
 
-int s3fs_remove_object(const char *bucketName, const char *key) {
-    s3fs_lock();
+// head object ---------------------------------------------------------------
+
+struct head_callback_data {
+    request_status status;
+    s3fs_object_info_t *info;
+};
+
+static S3Status headObjectPropertiesCallback
+    (const S3ResponseProperties *properties, void *callbackData)
+{
+    recordObjectInfo(((struct head_callback_data *) callbackData)->info,
+                     properties);
+
+    return responsePropertiesCallback(properties, callbackData);
+}
+
+int s3fs_head_object(const char *bucketName, const char *key,
+                     s3fs_object_info_t *info) {
+    int rv = __s3fs_head_object(bucketName, key, info);
+    if (rv < 0) {
+        rv = rv == HEAD_MISSING ? -ENOENT : -1;
+    }
+    return rv;
+}
+
+int __s3fs_head_object(const char *bucketName, const char *key,
+                       s3fs_object_info_t *info) {
+    S3_init();
+    struct head_callback_data data;
+    request_status_init(&data.status);
+    data.info = info;
+    clearObjectInfo(info);
+
+    S3BucketContext bucketContext =
+    {
+        0,
+        bucketName,
+        protocolG,
+        uriStyleG,
+        accessKeyIdG,
+        secretAccessKeyG,
+        &deadlinesG
+    };
+
+    S3ResponseHandler responseHandler =
+    { 
+        &headObjectPropertiesCallback,
+        &responseCompleteCallback
+    };
+
+    hedged_request request = { &bucketContext, key, 0, 0, 0, 0, &responseHandler };
+    struct head_callback_data hedge;
+    s3fs_object_info_t hedgeInfo;
+    hedge.info = &hedgeInfo;
+
+    do {
+        clearObjectInfo(&hedgeInfo);
+        if (run_hedged(&request, &data, &hedge)) {
+            *info = hedgeInfo;
+        }
+    } while (S3_status_is_retryable(data.status.status) && should_retry(&data.status));
+
+    int result = data.status.status == S3StatusOK ? 0 :
+                 data.status.status == S3StatusHttpErrorNotFound ? HEAD_MISSING : -1;
+
+    // a missing object is an expected answer, not an error
+    if ((data.status.status != S3StatusOK) &&
+        (data.status.status != S3StatusHttpErrorNotFound)) {
+        printError(&data.status);
+    }
+
+    return result;
+}
+
+
+// copy object ---------------------------------------------------------------
+
+static int copy_segments(const char *bucketName, const char *dstKey,
+                         const s3fs_manifest_t *segs, s3fs_object_info_t *info);
+
+// Copy an object, along with what it refers to
+static int copy_encoded(const char *bucketName, const char *srcKey,
+                        const char *dstKey, s3fs_object_info_t *info)
+{
+    index_drop(dstKey);
+    flight_forget(dstKey);
+    if (!tracking_refs()) {
+        return __s3fs_copy_object(bucketName, srcKey, dstKey, info, NULL, 0);
+    }
+
+    // the copy is one more use of the source's chunks, and gets segments
+    // of its own; what the object it replaces refers to is released
+    object_refs src, dst;
+    if (load_refs(bucketName, srcKey, &src) < 0) {
+        return -1;
+    }
+    if (load_refs(bucketName, dstKey, &dst) < 0) {
+        memset(&dst, 0, sizeof(dst));
+    }
+    int rv;
+    if (src.segments.count) {
+        rv = copy_segments(bucketName, dstKey, &src.segments, info);
+    } else {
+        ssize_t taken = 0;
+        while (taken < src.nhashes &&
+               chunk_ref(bucketName, src.hashes + taken * S3FS_CHUNK_HASH, NULL, 0) == 0) {
+            taken++;
+        }
+        rv = taken == src.nhashes ?
+             __s3fs_copy_object(bucketName, srcKey, dstKey, info, NULL, 0) : -1;
+        if (rv < 0) {
+            chunk_unref(bucketName, src.hashes, taken);
+        }
+    }
+    if (rv == 0) {
+        release_refs(bucketName, &dst, NULL, 0);
+    }
+    free_refs(&src);
+    free_refs(&dst);
+    return rv;
+}
+
+int s3fs_copy_object(const char *bucketName, const char *srcKey,
+                     const char *dstKey, s3fs_object_info_t *info) {
+    // take the two locks in order, or just one if they are the same
+    pthread_mutex_t *first = NULL, *second = NULL;
+    if (s3fs_segment_enabled()) {
+        uint32_t a = key_hash(srcKey) % OBJECT_LOCKS, b = key_hash(dstKey) % OBJECT_LOCKS;
+        first = lock_object(a <= b ? srcKey : dstKey);
+        if (a != b) {
+            second = lock_object(a <= b ? dstKey : srcKey);
+        }
+    }
+    int rv = copy_encoded(bucketName, srcKey, dstKey, info);
+    unlock_object(second);
+    unlock_object(first);
+    return rv;
+}
+
+// meta replaces the source's metadata if it is non-NULL
+int __s3fs_copy_object(const char *bucketName, const char *srcKey,
+                       const char *dstKey, s3fs_object_info_t *info,
+                       const S3NameValue *meta, int metaCount) {
+    S3_init();
+    request_status rs;
+    request_status_init(&rs);
+
+    S3BucketContext bucketContext =
+    {
+        0,
+        bucketName,
+        protocolG,
+        uriStyleG,
+        accessKeyIdG,
+        secretAccessKeyG,
+        &deadlinesG
+    };
+
+    S3ResponseHandler responseHandler =
+    { 
+        &responsePropertiesCallback,
+        &responseCompleteCallback
+    };
+
+    int64_t lastModified = -1;
+    char etag[S3FS_ETAG_MAX];
+
+    S3PutProperties putProperties =
+    {
+        0, 0, 0, 0, 0, -1, S3CannedAclPrivate, metaCount, meta
+    };
+
+    // without put properties the copy keeps the source's metadata
+    do {
+        S3_copy_object(&bucketContext, srcKey, 0, dstKey,
+                       meta ? &putProperties : 0, &lastModified,
+                       sizeof(etag), etag, 0, &responseHandler, &rs);
+    } while (S3_status_is_retryable(rs.status) && should_retry(&rs));
+
+    int result = rs.status == S3StatusOK ? 0 : -1;
+
+    if (rs.status != S3StatusOK) {
+        printError(&rs);
+    } else if (info) {
+        snprintf(info->etag, sizeof(info->etag), "%s", etag);
+        info->last_modified = lastModified;
+        info->content_length = 0;
+    }
+
+    return result;
+}
+
+
+// Remove an object, and release what it refers to
+static int remove_encoded(const char *bucketName, const char *key)
+{
+    index_drop(key);
+    flight_forget(key);
+    object_refs r;
+    int found = tracking_refs() && load_refs(bucketName, key, &r) == 0;
     int rv = __s3fs_remove_object(bucketName, key);
-    s3fs_unlock();
+    if (found) {
+        if (rv == 0) {
+            release_refs(bucketName, &r, NULL, 0);
+        }
+        free_refs(&r);
+    }
+    return rv;
+}
+
+int s3fs_remove_object(const char *bucketName, const char *key) {
+    pthread_mutex_t *lock = lock_object(key);
+    int rv = remove_encoded(bucketName, key);
+    unlock_object(lock);
     return rv;
 }
 
 int __s3fs_remove_object(const char *bucketName, const char *key) {
     S3_init();
+    request_status rs;
+    request_status_init(&rs);
+
     S3BucketContext bucketContext =
     {
         0,
@@ -738,7 +2214,8 @@ int __s3fs_remove_object(const char *bucketName, const char *key) {
         protocolG,
         uriStyleG,
         accessKeyIdG,
-        secretAccessKeyG
+        secretAccessKeyG,
+        &deadlinesG
     };
 
     S3ResponseHandler responseHandler =
@@ -748,17 +2225,221 @@ int __s3fs_remove_object(const char *bucketName, const char *key) {
     };
 
     do {
-        S3_delete_object(&bucketContext, key, 0, &responseHandler, 0);
-    } while (S3_status_is_retryable(statusG) && should_retry());
+        S3_delete_object(&bucketContext, key, 0, &responseHandler, &rs);
+    } while (S3_status_is_retryable(rs.status) && should_retry(&rs));
 
-    int result = statusG == S3StatusOK ? 0 : -1;
+    int result = rs.status == S3StatusOK ? 0 : -1;
 
-    if ((statusG != S3StatusOK) &&
-        (statusG != S3StatusErrorPreconditionFailed)) {
-        printError();
+    if ((rs.status != S3StatusOK) &&
+        (rs.status != S3StatusErrorPreconditionFailed)) {
+        printError(&rs);
     }
 
-    S3_deinitialize();
-
     return result;    
 }
+
+// append segments -----------------------------------------------------------
+
+// Store segment list m as the index of key
+static int put_index(const char *bucketName, const char *key,
+                     const s3fs_manifest_t *m, s3fs_object_info_t *info)
+{
+    s3fs_object_info_t local;
+    if (!info) {
+        info = &local;
+    }
+    uint8_t *manifest = NULL;
+    size_t len = s3fs_manifest_encode(m, &manifest);
+    if (len == 0) {
+        return -1;
+    }
+    S3NameValue meta[3];
+    char vals[2][32];
+    int n = objectMeta(meta, vals, S3FS_CODEC_SEGMENTS, m->size, 0);
+    index_drop(key);
+    flight_forget(key);
+    ssize_t rv = __s3fs_put_object(bucketName, key, manifest, len, info, meta, n);
+    if (rv >= 0) {
+        if (info->etag[0]) {
+            index_put(key, info->etag, S3FS_CODEC_SEGMENTS, manifest, len);
+        }
+        info->codec = S3FS_CODEC_SEGMENTS;
+        info->content_length = m->size;
+    }
+    free(manifest);
+    return rv < 0 ? -1 : 0;
+}
+
+// Remove the segments [from, to) of m
+static void remove_segments(const char *bucketName, const s3fs_manifest_t *m,
+                            uint32_t from, uint32_t to)
+{
+    for (; from < to; from++) {
+        char key[S3FS_CHUNK_KEY_MAX];
+        s3fs_segment_key(m->chunks[from].hash, key, sizeof(key));
+        remove_encoded(bucketName, key);
+    }
+}
+
+// Store dstKey as a copy of the object with segments segs, giving it
+// copies of the segments, so that the two objects share none
+static int copy_segments(const char *bucketName, const char *dstKey,
+                         const s3fs_manifest_t *segs, s3fs_object_info_t *info)
+{
+    s3fs_manifest_t m = { segs->size, 0, malloc(segs->count * sizeof(s3fs_chunk_t)) };
+    if (!m.chunks) {
+        return -1;
+    }
+    int rv = 0;
+    while (rv == 0 && m.count < segs->count) {
+        s3fs_chunk_t *c = &m.chunks[m.count];
+        char from[S3FS_CHUNK_KEY_MAX], to[S3FS_CHUNK_KEY_MAX];
+        s3fs_segment_key(segs->chunks[m.count].hash, from, sizeof(from));
+        s3fs_segment_id(dstKey, s3fs_chunk_start(segs, m.count), c->hash);
+        s3fs_segment_key(c->hash, to, sizeof(to));
+        c->end = segs->chunks[m.count].end;
+        rv = copy_encoded(bucketName, from, to, NULL);
+        if (rv == 0) {
+            m.count++;
+        }
+    }
+    if (rv == 0) {
+        rv = put_index(bucketName, dstKey, &m, info);
+    }
+    if (rv < 0) {
+        remove_segments(bucketName, &m, 0, m.count);
+    }
+    s3fs_manifest_free(&m);
+    return rv;
+}
+
+ssize_t s3fs_append_object(const char *bucketName, const char *key,
+                           const uint8_t *buf, ssize_t len, off_t offset,
+                           s3fs_object_info_t *info)
+{
+    if (!s3fs_segment_enabled() || len <= 0 || offset <= 0) {
+        return -1;
+    }
+    pthread_mutex_t *lock = lock_object(key);
+    s3fs_object_info_t cur;
+    if (__s3fs_head_object(bucketName, key, &cur) != 0 ||
+        cur.content_length != (uint64_t) offset) {
+        unlock_object(lock);
+        return -1;
+    }
+
+    // the segments so far; an object that isn't segmented yet is moved
+    // to a first segment as a whole (if it was chunked, the segment uses
+    // its chunks from now on, and the object's own uses are released)
+    object_refs old;
+    s3fs_manifest_t m = { 0, 0, NULL };
+    uint32_t added = 0;
+    ssize_t rv = -1;
+    if (load_refs(bucketName, key, &old) < 0) {
+        unlock_object(lock);
+        return -1;
+    }
+    if (old.segments.count) {
+        m = old.segments;
+        old.segments.count = 0;
+        old.segments.chunks = NULL;
+    } else if ((m.chunks = malloc(sizeof(s3fs_chunk_t)))) {
+        char first[S3FS_CHUNK_KEY_MAX];
+        s3fs_segment_id(key, 0, m.chunks[0].hash);
+        s3fs_segment_key(m.chunks[0].hash, first, sizeof(first));
+        m.chunks[0].end = offset;
+        m.size = offset;
+        if (copy_encoded(bucketName, key, first, NULL) == 0) {
+            m.count = added = 1;
+        }
+    }
+
+    s3fs_chunk_t *grown = m.count && m.size == (uint64_t) offset ?
+        realloc(m.chunks, (m.count + 1) * sizeof(s3fs_chunk_t)) : NULL;
+    if (grown) {
+        char tail[S3FS_CHUNK_KEY_MAX];
+        s3fs_chunk_t *c = &grown[m.count];
+        m.chunks = grown;
+        s3fs_segment_id(key, offset, c->hash);
+        s3fs_segment_key(c->hash, tail, sizeof(tail));
+        c->end = offset + len;
+        if (put_encoded(bucketName, tail, buf, len, NULL) == len) {
+            m.count++;
+            m.size += len;
+            added++;
+            if (put_index(bucketName, key, &m, info) == 0) {
+                release_refs(bucketName, &old, NULL, 0);
+                rv = len;
+            }
+        }
+    }
+    if (rv < 0) {
+        remove_segments(bucketName, &m, m.count - added, m.count);
+    }
+    uint32_t count = m.count;
+    free_refs(&old);
+    s3fs_manifest_free(&m);
+    unlock_object(lock);
+
+    if (rv >= 0 && count > (uint32_t) s3fs_segment_max()) {
+        s3fs_segment_merge_later(key);
+    }
+    return rv;
+}
+
+int s3fs_merge_segments(const char *bucketName, const char *key)
+{
+    pthread_mutex_t *lock = lock_object(key);
+    object_refs r;
+    int rv = load_refs(bucketName, key, &r);
+    s3fs_manifest_t *m = &r.segments;
+    if (rv < 0 || m->count < 2) {
+        free_refs(&r);
+        unlock_object(lock);
+        return rv;
+    }
+
+    // merge the trailing run of segments that outweighs the segment
+    // before it, as in a log-structured merge: each byte is rewritten a
+    // logarithmic number of times however many appends there are
+    uint32_t n = m->count, i = n;
+    uint64_t run = 0;
+    while (i > 0) {
+        uint64_t seg = m->chunks[i - 1].end - s3fs_chunk_start(m, i - 1);
+        if (n - i >= 2 && seg > run) {
+            break;
+        }
+        run += seg;
+        i--;
+    }
+    uint64_t from = s3fs_chunk_start(m, i);
+    uint8_t *data = NULL;
+    ssize_t len = get_decoded(bucketName, key, &data, from, m->size - from, NULL, NULL);
+    if (len != (ssize_t) (m->size - from)) {
+        rv = -1;
+    } else if (i == 0) {
+        // all of them: the object stops being segmented, which releases
+        // the segments
+        rv = put_encoded(bucketName, key, data, len, NULL) == len ? 0 : -1;
+    } else {
+        s3fs_chunk_t c = m->chunks[i];
+        char merged[S3FS_CHUNK_KEY_MAX];
+        s3fs_segment_id(key, from, m->chunks[i].hash);
+        s3fs_segment_key(m->chunks[i].hash, merged, sizeof(merged));
+        m->chunks[i].end = m->size;
+        m->count = i + 1;
+        rv = put_encoded(bucketName, merged, data, len, NULL) == len ? 0 : -1;
+        if (rv == 0 && (rv = put_index(bucketName, key, m, NULL)) < 0) {
+            remove_encoded(bucketName, merged);
+        }
+        // the old segments are gone (on success) or kept (on failure)
+        m->chunks[i] = c;
+        if (rv == 0) {
+            remove_segments(bucketName, m, i, n);
+        }
+    }
+    free(data);
+    free_refs(&r);
+    unlock_object(lock);
+    return rv;
+}
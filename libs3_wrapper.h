@@ -23,6 +23,29 @@
  */
 int s3fs_init_credentials();
 
+/*
+ * Set the deadlines of requests, in milliseconds: to connect, to the first
+ * byte of the response to a get, head or delete, and for a whole request.
+ * A request that misses one fails, and is retried like one that lost its
+ * connection.  A deadline of 0 (the default) is set by libs3 from the
+ * latencies of recent requests; a negative one turns it off.
+ */
+void s3fs_deadlines_init(int connect_ms, int first_byte_ms, int total_ms);
+
+/*
+ * Hedge gets and heads: one that has had no response by the time 95% of
+ * recent ones had theirs is sent a second time, and the first to complete
+ * is used.  At most budget_percent percent of requests are hedged; 0
+ * (the default) turns hedging off.
+ */
+void s3fs_hedge_init(int budget_percent);
+
+/*
+ * Report the number of requests hedged so far, and how many of those the
+ * second request won.
+ */
+void s3fs_hedge_stats(uint64_t *hedged, uint64_t *won);
+
 /*
  * Given a bucket name, test whether we can access the bucket on s3.  This
  * function returns 0 on success and -1 on error.  There is also a reason
@@ -32,7 +55,7 @@ int s3fs_test_bucket(const char *bucket);
 
 /* 
  * Clear *all* objects out of a bucket.  Totally destructive, so be
- * careful.
+ * careful.  The objects are deleted by several requests at a time.
  * Returns 0 on success and -1 on failure.
  */
 int s3fs_clear_bucket(const char *bucket);  
@@ -50,10 +73,89 @@ int s3fs_clear_bucket(const char *bucket);
  * Returns the number of bytes read, or -1 on error.  If the object contains
  * 0 bytes, *buf will point to NULL, and the return value will be 0.  Thus
  * a return value of 0 or greater means *success*.
+ *
+ * Concurrent gets of the same range of the same object (with the same
+ * ETag, for s3fs_get_object_if_changed) share a single transfer, each
+ * getting its own copy of the data; see s3fs_shared_get_stats.
  */
 ssize_t s3fs_get_object(const char *bucket, const char *key, uint8_t **buf, 
                         ssize_t start_byte, ssize_t byte_count);
 
+/*
+ * Object properties, as reported by s3 in the response headers of a request.
+ * etag is the (quoted) ETag header value, or an empty string if none was
+ * returned.  last_modified is in seconds since the epoch, or -1 if unknown.
+ * content_length is the length of the response body, which for a ranged
+ * get is the length of the range rather than of the whole object.
+ *
+ * Objects may be stored compressed (see compress.h), as a list of
+ * deduplicated chunks (see chunk.h) or as a list of append segments (see
+ * segment.h).  That is invisible to callers: data
+ * is encoded on put and decoded on get, and content_length counts the
+ * data rather than the stored bytes.  codec tells how the object is
+ * stored, and refs is the number of objects using a chunk (for chunks
+ * only).
+ */
+#define S3FS_ETAG_MAX 128
+
+#define S3FS_CODEC_NONE 0
+#define S3FS_CODEC_ZBLOCK 1
+#define S3FS_CODEC_CHUNKS 2
+#define S3FS_CODEC_SEGMENTS 3
+
+typedef struct {
+    char etag[S3FS_ETAG_MAX];
+    int64_t last_modified;
+    uint64_t content_length;
+    int codec;
+    uint64_t refs;
+} s3fs_object_info_t;
+
+/*
+ * Same as s3fs_get_object, but also fills in *info with the properties
+ * of the object that was read (if info is non-NULL).
+ */
+ssize_t s3fs_get_object_info(const char *bucket, const char *key, 
+                             uint8_t **buf, ssize_t start_byte, 
+                             ssize_t byte_count, s3fs_object_info_t *info);
+
+/*
+ * Conditional get: same as s3fs_get_object_info, but if etag is non-NULL
+ * and non-empty the object is only transferred if its ETag no longer
+ * matches (If-None-Match).  If the object is unchanged, S3FS_NOT_MODIFIED
+ * is returned, *buf is left alone and no data is transferred.
+ *
+ * Every conditional get counts as a revalidation hit (unchanged) or miss
+ * (changed, or gone); see s3fs_revalidation_stats.
+ */
+#define S3FS_NOT_MODIFIED (-2)
+
+ssize_t s3fs_get_object_if_changed(const char *bucket, const char *key,
+                                   uint8_t **buf, ssize_t start_byte,
+                                   ssize_t byte_count, const char *etag,
+                                   s3fs_object_info_t *info);
+
+/*
+ * Report the number of conditional gets that found the object unchanged
+ * (hits) or changed (misses) so far.
+ */
+void s3fs_revalidation_stats(uint64_t *hits, uint64_t *misses);
+
+/*
+ * Return the number of gets so far that were served by another get's
+ * transfer rather than one of their own.
+ */
+uint64_t s3fs_shared_get_stats(void);
+
+/*
+ * Fetch the properties of an object without transferring its data.
+ * On success *info describes the object (content_length is the full
+ * object length) and 0 is returned.  Returns -ENOENT if the object doesn't
+ * exist and -1 on any other error.
+ */
+int s3fs_head_object(const char *bucket, const char *key,
+                     s3fs_object_info_t *info);
+
 /* 
  * Write a full object to s3.  The object is written to the given bucket,
  * with the given key.  Only writing of complete files/objects is
@@ -68,6 +170,25 @@ ssize_t s3fs_get_object(const char *bucket, const char *key, uint8_t **buf,
 ssize_t s3fs_put_object(const char *bucket, const char *key, 
                         const uint8_t *buf, ssize_t byte_count); 
 
+/*
+ * Same as s3fs_put_object, but also fills in *info (if non-NULL) with the
+ * properties of the new object (in particular, its ETag).
+ */
+ssize_t s3fs_put_object_info(const char *bucket, const char *key,
+                             const uint8_t *buf, ssize_t byte_count,
+                             s3fs_object_info_t *info);
+
+/*
+ * Copy the object srckey to dstkey within the bucket.  The copy is done
+ * by s3 itself, so no object data passes through this host.  On success
+ * *info (if non-NULL) describes the new object (content_length is not
+ * reported and is set to 0) and 0 is returned.  Returns -1 on failure.
+ *
+ * s3 only copies objects of up to 5 GB in a single request.
+ */
+int s3fs_copy_object(const char *bucket, const char *srckey,
+                     const char *dstkey, s3fs_object_info_t *info);
+
 /* 
  * Remove a given object from the given bucket.
  *
@@ -75,4 +196,24 @@ ssize_t s3fs_put_object(const char *bucket, const char *key,
  */ 
 int s3fs_remove_object(const char *bucket, const char *key);
 
+/*
+ * Append byte_count bytes from buf to the object, which must be offset
+ * bytes long (offset > 0).  Only the new bytes are uploaded, as a segment
+ * of the object (see segment.h).  Returns byte_count on success and -1 on
+ * failure, in which case the object is unchanged; -1 is also returned if
+ * appends are off, or the object isn't offset bytes long, and the caller
+ * should write the whole object instead.
+ */
+ssize_t s3fs_append_object(const char *bucket, const char *key,
+                           const uint8_t *buf, ssize_t byte_count,
+                           off_t offset, s3fs_object_info_t *info);
+
+/*
+ * Merge the most recent segments of a segmented object, or all of them if
+ * they outweigh the rest, in which case the object is stored whole again.
+ * Called by the segment merger.  Returns 0 on success (or if there was
+ * nothing to merge) and -1 on failure.
+ */
+int s3fs_merge_segments(const char *bucket, const char *key);
+
 #endif // __LIBS3_WRAPPER_H__
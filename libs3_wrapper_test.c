@@ -11,7 +11,288 @@
 #include <stdlib.h>
 #include <string.h>
 #include "libs3_wrapper.h"
+#include "chunk.h"
+#include "compress.h"
 #include "s3fs.h" // for environment strings to look for
+#include "segment.h"
+
+// Fill buf with len bytes that don't compress
+static void fill_random(uint8_t *buf, size_t len, uint32_t seed) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+// Fill buf with len bytes of text that compresses well
+static void fill_text(uint8_t *buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        buf[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44] + (i / 4096) % 3;
+    }
+}
+
+// Get [start, start + len) of key and compare it with expected.  Returns
+// 0 if it matches.
+static int check_range(const char *s3bucket, const char *key, const uint8_t *expected,
+                       size_t start, size_t len) {
+    uint8_t *got = NULL;
+    ssize_t rv = s3fs_get_object(s3bucket, key, &got, start, len);
+    int bad = rv != (ssize_t) len || memcmp(got, expected + start, len) != 0;
+    free(got);
+    return bad ? -1 : 0;
+}
+
+/*
+ * Chunked objects: splitting and the manifest format offline, then a
+ * chunked put read back in ranges, a second put of nearly the same data
+ * sharing its chunks, and removal deleting the chunks no object uses.
+ */
+static void test_chunks(const char *s3bucket) {
+    const size_t len = 1024 * 1024;
+    uint8_t *data = malloc(len), *data2 = malloc(len);
+    s3fs_manifest_t m, m2, parsed;
+    uint8_t *enc = NULL;
+    size_t enclen;
+    uint32_t i, j;
+    int bad = 0;
+
+    s3fs_chunk_init(64 * 1024);
+    fill_random(data, len, 1);
+    memcpy(data2, data, len);
+    memset(data2 + len / 2, 'x', 100); // a local change
+
+    if (s3fs_chunk_split(data, len, &m) < 0 || s3fs_chunk_split(data2, len, &m2) < 0) {
+        printf("Failure in s3fs_chunk_split\n");
+        return;
+    }
+    bad = m.size != len || m.count < 2 || m.chunks[m.count - 1].end != len;
+    for (i = 1; i < m.count; i++) {
+        bad |= m.chunks[i].end <= m.chunks[i - 1].end;
+    }
+    // only the chunks around the change differ
+    uint32_t shared = 0;
+    for (i = 0; i < m2.count; i++) {
+        for (j = 0; j < m.count; j++) {
+            if (memcmp(m2.chunks[i].hash, m.chunks[j].hash, S3FS_CHUNK_HASH) == 0) {
+                shared++;
+                break;
+            }
+        }
+    }
+    bad |= shared + 3 < m.count || shared == m.count;
+    if (bad) {
+        printf("s3fs_chunk_split chunks don't look right (%u chunks, %u shared)\n",
+               m.count, shared);
+    } else {
+        printf("Successfully split data into %u chunks (s3fs_chunk_split)\n", m.count);
+    }
+
+    enclen = s3fs_manifest_encode(&m, &enc);
+    if (enclen == 0 || s3fs_manifest_parse(enc, enclen, &parsed) < 0) {
+        printf("Failure in s3fs_manifest_encode/s3fs_manifest_parse\n");
+    } else {
+        bad = parsed.size != m.size || parsed.count != m.count;
+        for (i = 0; !bad && i < m.count; i++) {
+            bad = parsed.chunks[i].end != m.chunks[i].end ||
+                memcmp(parsed.chunks[i].hash, m.chunks[i].hash, S3FS_CHUNK_HASH) != 0;
+        }
+        if (bad) {
+            printf("Parsed manifest doesn't match the encoded one?!\n");
+        } else if (s3fs_manifest_parse(enc, enclen - 1, &m2) == 0) {
+            printf("Unexpected success parsing a truncated manifest\n");
+            s3fs_manifest_free(&m2);
+        } else {
+            printf("Successfully round-tripped a manifest (s3fs_manifest_encode)\n");
+        }
+        s3fs_manifest_free(&parsed);
+    }
+    free(enc);
+
+    // a chunked put, read back in ranges that straddle chunk boundaries
+    s3fs_object_info_t info;
+    uint8_t *retrieved = NULL;
+    ssize_t rv = s3fs_put_object(s3bucket, "chunked", data, len);
+    if (rv != (ssize_t) len) {
+        printf("Failure in chunked s3fs_put_object\n");
+    } else {
+        rv = s3fs_get_object_info(s3bucket, "chunked", &retrieved, 0, 0, &info);
+        bad = rv != (ssize_t) len || info.codec != S3FS_CODEC_CHUNKS ||
+            memcmp(retrieved, data, len) != 0;
+        free(retrieved);
+        retrieved = NULL;
+        for (i = 0; !bad && i + 1 < m.count; i++) {
+            bad = check_range(s3bucket, "chunked", data, m.chunks[i].end - 1000, 3000) < 0;
+        }
+        if (bad) {
+            printf("Chunked object doesn't read back right?!\n");
+        } else {
+            printf("Successfully read a chunked object back in ranges\n");
+        }
+    }
+
+    // the same data again only adds the chunks around the change
+    char first[S3FS_CHUNK_KEY_MAX], changed[S3FS_CHUNK_KEY_MAX];
+    s3fs_chunk_key(m.chunks[0].hash, first, sizeof(first));
+    j = s3fs_manifest_find(&m, len / 2);
+    s3fs_chunk_key(m.chunks[j].hash, changed, sizeof(changed));
+    rv = s3fs_put_object(s3bucket, "chunked.2", data2, len);
+    if (rv != (ssize_t) len || check_range(s3bucket, "chunked.2", data2, 0, len) < 0) {
+        printf("Failure putting a second chunked object\n");
+    } else if (s3fs_head_object(s3bucket, first, &info) < 0 || info.refs != 2) {
+        printf("Shared chunk isn't used by both objects?!\n");
+    } else {
+        printf("Successfully shared chunks between two objects\n");
+    }
+
+    // and removing them drops the chunks once nothing uses them
+    s3fs_remove_object(s3bucket, "chunked");
+    bad = s3fs_head_object(s3bucket, first, &info) < 0 || info.refs != 1 ||
+        s3fs_head_object(s3bucket, changed, &info) == 0;
+    s3fs_remove_object(s3bucket, "chunked.2");
+    bad |= s3fs_head_object(s3bucket, first, &info) == 0;
+    if (bad) {
+        printf("Chunks weren't released on removal?!\n");
+    } else {
+        printf("Successfully removed chunks no longer used\n");
+    }
+
+    s3fs_manifest_free(&m);
+    s3fs_manifest_free(&m2);
+    free(data);
+    free(data2);
+    s3fs_chunk_init(0);
+}
+
+/*
+ * Compressed objects: the block format offline, with an incompressible
+ * block among compressible ones, then a compressed put read back in
+ * ranges that cross block boundaries.
+ */
+static void test_compression(const char *s3bucket) {
+    const size_t len = 3 * S3FS_ZBLOCK + 1000;
+    uint8_t *data = malloc(len), *out = malloc(len);
+    uint8_t *z = NULL;
+    s3fs_zindex_t ix;
+    uint64_t obj_start, obj_end;
+    int bad = 0;
+
+    s3fs_compress_init(6);
+    fill_text(data, len);
+    fill_random(data + S3FS_ZBLOCK, S3FS_ZBLOCK, 2);
+
+    ssize_t zlen = s3fs_compress(data, len, &z);
+    if (zlen <= 0 || s3fs_zindex_parse(z, zlen, &ix) < 0) {
+        printf("Failure in s3fs_compress/s3fs_zindex_parse\n");
+    } else {
+        // each range starts and ends in a different block
+        const size_t ranges[][2] = {
+            { 0, len }, { S3FS_ZBLOCK - 10, S3FS_ZBLOCK + 10 },
+            { S3FS_ZBLOCK + 5, 2 * S3FS_ZBLOCK + 5 }, { 2 * S3FS_ZBLOCK - 1, len },
+        };
+        size_t r;
+        bad = ix.size != len || ix.nblocks != 4 || (size_t) zlen >= len;
+        for (r = 0; !bad && r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+            s3fs_zrange(&ix, ranges[r][0], ranges[r][1], &obj_start, &obj_end);
+            bad = obj_end > (uint64_t) zlen ||
+                s3fs_zdecode(&ix, z + obj_start, ranges[r][0], ranges[r][1], out) < 0 ||
+                memcmp(out, data + ranges[r][0], ranges[r][1] - ranges[r][0]) != 0;
+        }
+        if (bad) {
+            printf("Compressed data doesn't decode right?!\n");
+        } else {
+            printf("Successfully compressed and decoded ranges (s3fs_compress)\n");
+        }
+        s3fs_zindex_free(&ix);
+    }
+    free(z);
+    z = NULL;
+    fill_random(out, len, 3);
+    if (s3fs_compress(out, len, &z) != 0) {
+        printf("Incompressible data was compressed?!\n");
+        free(z);
+    }
+
+    s3fs_object_info_t info;
+    uint8_t *retrieved = NULL;
+    fill_text(data, len);
+    ssize_t rv = s3fs_put_object(s3bucket, "compressed", data, len);
+    if (rv != (ssize_t) len) {
+        printf("Failure in compressed s3fs_put_object\n");
+    } else {
+        rv = s3fs_get_object_info(s3bucket, "compressed", &retrieved, 0, 0, &info);
+        bad = rv != (ssize_t) len || info.codec != S3FS_CODEC_ZBLOCK ||
+            memcmp(retrieved, data, len) != 0 ||
+            check_range(s3bucket, "compressed", data, S3FS_ZBLOCK - 100, 200) < 0 ||
+            check_range(s3bucket, "compressed", data, 10, 2 * S3FS_ZBLOCK) < 0 ||
+            check_range(s3bucket, "compressed", data, 3 * S3FS_ZBLOCK - 1, 1001) < 0;
+        free(retrieved);
+        if (bad) {
+            printf("Compressed object doesn't read back right?!\n");
+        } else {
+            printf("Successfully read a compressed object back in ranges\n");
+        }
+        s3fs_remove_object(s3bucket, "compressed");
+    }
+
+    free(data);
+    free(out);
+    s3fs_compress_init(0);
+}
+
+/*
+ * Appends: several appends to a plain object read back as one, an append
+ * at the wrong offset refused, and the same contents after merging the
+ * segments.
+ */
+static void test_appends(const char *s3bucket) {
+    const char *parts[] = { "a log line\n", "another line\n", "and a third\n", "last\n" };
+    char expected[256] = "";
+    size_t len, i;
+    int bad = 0;
+
+    s3fs_segment_init(s3bucket, 100);
+    strcat(expected, parts[0]);
+    len = strlen(expected);
+    if (s3fs_put_object(s3bucket, "appended", (const uint8_t *) expected, len) != (ssize_t) len) {
+        printf("Failure putting an object to append to\n");
+        s3fs_segment_destroy();
+        return;
+    }
+    for (i = 1; !bad && i < sizeof(parts) / sizeof(parts[0]); i++) {
+        size_t n = strlen(parts[i]);
+        bad = s3fs_append_object(s3bucket, "appended", (const uint8_t *) parts[i], n,
+                                 len, NULL) != (ssize_t) n;
+        strcat(expected, parts[i]);
+        len += n;
+    }
+    if (bad || check_range(s3bucket, "appended", (const uint8_t *) expected, 0, len) < 0) {
+        printf("Appended object doesn't read back right?!\n");
+    } else {
+        printf("Successfully appended to an object (s3fs_append_object)\n");
+    }
+
+    if (s3fs_append_object(s3bucket, "appended", (const uint8_t *) "x", 1, len - 1, NULL) >= 0) {
+        printf("Unexpected success appending at the wrong offset\n");
+    } else if (check_range(s3bucket, "appended", (const uint8_t *) expected, 0, len) < 0) {
+        printf("Refused append changed the object?!\n");
+    } else {
+        printf("Got expected failure appending at the wrong offset\n");
+    }
+
+    if (s3fs_merge_segments(s3bucket, "appended") < 0) {
+        printf("Failure in s3fs_merge_segments\n");
+    } else if (check_range(s3bucket, "appended", (const uint8_t *) expected, 0, len) < 0 ||
+               check_range(s3bucket, "appended", (const uint8_t *) expected, 5, len - 10) < 0) {
+        printf("Merged object doesn't read back right?!\n");
+    } else {
+        printf("Successfully merged segments (s3fs_merge_segments)\n");
+    }
+
+    s3fs_remove_object(s3bucket, "appended");
+    s3fs_segment_destroy();
+}
 
 int main(int argc, char **argv) {
 
@@ -21,6 +302,11 @@ int main(int argc, char **argv) {
      *  - Clear the bucket
      *  - Create an object
      *  - Get the object and verify it
+ *  - Copy the object and verify the copy
+     *  - Chunked objects: split, manifest format, ranged gets, shared
+     *    chunks, and chunks dropped on removal
+     *  - Compressed objects: block format, and ranged gets across blocks
+     *  - Appends to an object, a refused append, and merged segments
      *  - Remove the object
      *  - Try to get the object again, it should fail.
      *  - Done.
@@ -93,7 +379,48 @@ int main(int argc, char **argv) {
     // memory.  no leakage!
     if (retrieved_object) {
         free (retrieved_object);
+        retrieved_object = NULL;
+    }
+
+    // a conditional get with the object's current ETag should send no data
+    s3fs_object_info_t info;
+    rv = s3fs_get_object_info(s3bucket, test_key, &retrieved_object, 0, 0, &info);
+    if (retrieved_object) {
+        free (retrieved_object);
+        retrieved_object = NULL;
     }
+    if (rv < 0 || !info.etag[0]) {
+        printf("Failure in s3fs_get_object_info\n");
+    } else {
+        rv = s3fs_get_object_if_changed(s3bucket, test_key, &retrieved_object, 0, 0, info.etag, &info);
+        if (rv == S3FS_NOT_MODIFIED) {
+            printf("Got expected not-modified result (s3fs_get_object_if_changed)\n");
+        } else {
+            printf("Unexpected return value from s3fs_get_object_if_changed: %zd\n", rv);
+            free(retrieved_object);
+            retrieved_object = NULL;
+        }
+    }
+
+    // a server-side copy should read back the same
+    const char *copy_key = "thekey.copy";
+    if (s3fs_copy_object(s3bucket, test_key, copy_key, NULL) < 0) {
+        printf("Failure in s3fs_copy_object\n");
+    } else {
+        rv = s3fs_get_object(s3bucket, copy_key, &retrieved_object, 0, 0);
+        if (rv == object_length && strcmp((const char *)retrieved_object, test_object) == 0) {
+            printf("Successfully copied test object (s3fs_copy_object)\n");
+        } else {
+            printf("Copied object doesn't match the original?!\n");
+        }
+        free(retrieved_object);
+        retrieved_object = NULL;
+        s3fs_remove_object(s3bucket, copy_key);
+    }
+
+    test_chunks(s3bucket);
+    test_compression(s3bucket);
+    test_appends(s3bucket);
 
     if (s3fs_remove_object(s3bucket, test_key) < 0) {
         printf("Failure to remove test object (s3fs_remove_object)\n");
@@ -0,0 +1,618 @@
+/*
+ * manifest.c: the namespace manifest.  See manifest.h for an overview.
+ *
+ * The manifest and its delta have the same format: a header (magic,
+ * CRC-32 of the rest, generation and record count) and then one record
+ * per directory object, a fixed part (lengths) followed by the key, the
+ * ETag and the object, unpadded, in host byte order.  A removed object
+ * has a record with length -1 and no data.  Each manifest written gets
+ * the next generation, and a delta is only used with the manifest of its
+ * own generation.
+ *
+ * A table in memory has every key that is in the manifest or has changed
+ * since, and the change itself until it is folded into the manifest.
+ */
+
+#include "manifest.h"
+#include "dirbatch.h"
+#include "libs3_wrapper.h"
+#include "metacache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define MANIFEST_MAGIC 0x4e463353       // "S3FN"
+#define MANIFEST_HASH_BUCKETS 4096
+#define MANIFEST_FOLD_MIN (256 * 1024)  // smaller deltas are never folded
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;         // of everything after the header
+    uint64_t gen;
+    uint32_t count;
+    uint32_t unused;
+} mf_header_t;
+
+typedef struct {
+    uint32_t key_len;
+    uint32_t etag_len;
+    int64_t len;          // -1 if the object was removed
+} mf_record_t;
+
+typedef struct mf_entry {
+    char *key;
+    int in_base;          // the stored manifest has it
+    int in_new;           // the manifest being written has it
+    int dirty;            // changed since the manifest was written
+    uint64_t version;     // of its last change
+    uint8_t *data;        // the change, while dirty
+    ssize_t len;          // -1 if removed
+    char etag[S3FS_ETAG_MAX];
+    struct mf_entry *next;
+} mf_entry_t;
+
+// A growing buffer; failed is set, and the contents dropped, if it can't grow
+typedef struct {
+    uint8_t *p;
+    size_t len, cap;
+    int failed;
+} mf_buf_t;
+
+typedef void (*mf_visit_fn)(const char *key, const char *etag, const uint8_t *data,
+                            ssize_t len, void *arg);
+
+static pthread_mutex_t mf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mf_cond = PTHREAD_COND_INITIALIZER;   // wakes the thread
+static mf_entry_t *mf_table[MANIFEST_HASH_BUCKETS];
+static char *mf_bucket = NULL;
+static int mf_interval = 0;
+static uint64_t mf_gen = 0;          // of the stored manifest, 0 if none
+static size_t mf_base_bytes = 0;     // size of the stored manifest
+static uint64_t mf_version = 0;      // of the last change
+static uint64_t mf_saved = 0;        // last change in the stored delta
+static int mf_stop = 0;
+static int mf_running = 0;
+static pthread_t mf_thread;
+
+
+static unsigned mf_hash(const char *key)
+{
+    unsigned h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % MANIFEST_HASH_BUCKETS;
+}
+
+static mf_entry_t **mf_find(const char *key)
+{
+    mf_entry_t **pp = &mf_table[mf_hash(key)];
+    while (*pp && strcmp((*pp)->key, key) != 0) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static mf_entry_t *mf_find_or_add(const char *key)
+{
+    mf_entry_t **pp = mf_find(key);
+    if (!*pp) {
+        mf_entry_t *e = calloc(1, sizeof(mf_entry_t));
+        if (!e || !(e->key = strdup(key))) {
+            free(e);
+            return NULL;
+        }
+        *pp = e;
+    }
+    return *pp;
+}
+
+// Record a change to e.  Takes ownership of data.
+static void mf_set(mf_entry_t *e, uint8_t *data, ssize_t len, const char *etag)
+{
+    free(e->data);
+    e->data = data;
+    e->len = len;
+    snprintf(e->etag, sizeof(e->etag), "%s", etag ? etag : "");
+    e->dirty = 1;
+    e->version = ++mf_version;
+}
+
+static void buf_put(mf_buf_t *b, const void *data, size_t len)
+{
+    if (b->failed || len == 0) {
+        return;
+    }
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        uint8_t *p = realloc(b->p, cap);
+        if (!p) {
+            free(b->p);
+            memset(b, 0, sizeof(*b));
+            b->failed = 1;
+            return;
+        }
+        b->p = p;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+}
+
+static void buf_start(mf_buf_t *b, uint64_t gen)
+{
+    mf_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = MANIFEST_MAGIC;
+    h.gen = gen;
+    buf_put(b, &h, sizeof(h));
+}
+
+static void buf_record(mf_buf_t *b, const char *key, const char *etag,
+                       const uint8_t *data, ssize_t len)
+{
+    mf_record_t r;
+    r.key_len = strlen(key);
+    r.etag_len = strlen(etag);
+    r.len = len;
+    buf_put(b, &r, sizeof(r));
+    buf_put(b, key, r.key_len);
+    buf_put(b, etag, r.etag_len);
+    if (len > 0) {
+        buf_put(b, data, len);
+    }
+    if (!b->failed) {
+        ((mf_header_t *) b->p)->count++;
+    }
+}
+
+// Seal the header of a buffer started by buf_start.  Returns 0, or -1 if
+// the buffer couldn't be filled.
+static int buf_finish(mf_buf_t *b)
+{
+    if (b->failed) {
+        return -1;
+    }
+    mf_header_t *h = (mf_header_t *) b->p;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if (b->len > sizeof(*h)) {
+        crc = crc32(crc, b->p + sizeof(*h), b->len - sizeof(*h));
+    }
+    h->crc = crc;
+    return 0;
+}
+
+// Check the header of the len bytes at buf and set *gen from it.  Returns
+// 0 if they are a whole manifest or delta, and -1 otherwise.
+static int mf_check(const uint8_t *buf, size_t len, uint64_t *gen)
+{
+    mf_header_t h;
+    if (!buf || len < sizeof(h)) {
+        return -1;
+    }
+    memcpy(&h, buf, sizeof(h));
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if (len > sizeof(h)) {
+        crc = crc32(crc, buf + sizeof(h), len - sizeof(h));
+    }
+    if (h.magic != MANIFEST_MAGIC || (uint32_t) crc != h.crc) {
+        return -1;
+    }
+    *gen = h.gen;
+    return 0;
+}
+
+// Call fn for each record of a manifest or delta checked by mf_check.
+// Returns 0, or -1 if a record is malformed (the records before it have
+// been visited).
+static int mf_parse(const uint8_t *buf, size_t len, mf_visit_fn fn, void *arg)
+{
+    size_t off = sizeof(mf_header_t);
+    char key[PATH_MAX], etag[S3FS_ETAG_MAX];
+    while (off < len) {
+        mf_record_t r;
+        if (len - off < sizeof(r)) {
+            return -1;
+        }
+        memcpy(&r, buf + off, sizeof(r));
+        off += sizeof(r);
+        size_t data_len = r.len > 0 ? (size_t) r.len : 0;
+        if (r.key_len >= PATH_MAX || r.etag_len >= S3FS_ETAG_MAX || r.len < -1 ||
+            len - off < r.key_len + r.etag_len ||
+            len - off - r.key_len - r.etag_len < data_len) {
+            return -1;
+        }
+        memcpy(key, buf + off, r.key_len);
+        key[r.key_len] = '\0';
+        memcpy(etag, buf + off + r.key_len, r.etag_len);
+        etag[r.etag_len] = '\0';
+        off += r.key_len + r.etag_len;
+        fn(key, etag, buf + off, r.len, arg);
+        off += data_len;
+    }
+    return 0;
+}
+
+static uint8_t *mf_copy(const uint8_t *data, ssize_t len)
+{
+    if (len <= 0) {
+        return NULL;
+    }
+    uint8_t *copy = malloc(len);
+    if (copy) {
+        memcpy(copy, data, len);
+    }
+    return copy;
+}
+
+
+// loading ------------------------------------------------------------------
+
+// A delta record: the change is stored already, and kept for the next delta
+static void load_change(const char *key, const char *etag, const uint8_t *data,
+                        ssize_t len, void *arg)
+{
+    (void) arg;
+    uint8_t *copy = mf_copy(data, len);
+    mf_entry_t *e = mf_find_or_add(key);
+    if (!e || (len > 0 && !copy)) {
+        // without the change, the object just isn't loaded from the
+        // manifest; keep it out of the next one too
+        free(copy);
+        if (e) {
+            mf_set(e, NULL, -1, NULL);
+        }
+        return;
+    }
+    mf_set(e, copy, len, etag);
+    if (len >= 0) {
+        s3fs_meta_preload(key, data, len, etag);
+    }
+}
+
+// A manifest record, unless a change in the delta replaces it
+static void load_object(const char *key, const char *etag, const uint8_t *data,
+                        ssize_t len, void *arg)
+{
+    (void) arg;
+    mf_entry_t *e = mf_find_or_add(key);
+    if (e) {
+        e->in_base = 1;
+    }
+    if (len >= 0 && (!e || !e->dirty)) {
+        s3fs_meta_preload(key, data, len, etag);
+    }
+}
+
+// Returns 1 if a manifest was loaded
+static int load(void)
+{
+    uint8_t *base = NULL, *delta = NULL;
+    uint64_t gen, delta_gen;
+    ssize_t base_len = s3fs_get_object(mf_bucket, S3FS_MANIFEST_KEY, &base, 0, 0);
+    if (base_len < 0 || mf_check(base, base_len, &gen) < 0 || gen == 0) {
+        free(base);
+        return 0;
+    }
+    ssize_t delta_len = s3fs_get_object(mf_bucket, S3FS_MANIFEST_DELTA_KEY, &delta, 0, 0);
+    pthread_mutex_lock(&mf_lock);
+    if (delta_len >= 0 && mf_check(delta, delta_len, &delta_gen) == 0 && delta_gen == gen) {
+        mf_parse(delta, delta_len, load_change, NULL);
+    }
+    // what came from the delta is stored already
+    mf_saved = mf_version;
+    mf_parse(base, base_len, load_object, NULL);
+    mf_gen = gen;
+    mf_base_bytes = base_len;
+    pthread_mutex_unlock(&mf_lock);
+    free(base);
+    free(delta);
+    fprintf(stderr, "s3fs manifest: loaded generation %llu\n", (unsigned long long) gen);
+    return 1;
+}
+
+
+// checkpoints ----------------------------------------------------------------
+
+// Encode the records of a new manifest or delta.  Called with mf_lock held.
+static void encode_changes(mf_buf_t *b)
+{
+    int i;
+    for (i = 0; i < MANIFEST_HASH_BUCKETS; i++) {
+        mf_entry_t *e;
+        for (e = mf_table[i]; e; e = e->next) {
+            if (e->dirty) {
+                buf_record(b, e->key, e->etag, e->data, e->len);
+            }
+        }
+    }
+}
+
+// A record of the manifest being replaced: kept unless it has changed
+static void keep_object(const char *key, const char *etag, const uint8_t *data,
+                        ssize_t len, void *arg)
+{
+    mf_buf_t *b = arg;
+    mf_entry_t *e = mf_find_or_add(key);
+    if (!e) {
+        b->failed = 1;
+        return;
+    }
+    if (!e->dirty && len >= 0 && !e->in_new) {
+        buf_record(b, key, etag, data, len);
+        e->in_new = 1;
+    }
+}
+
+// Walk the tree from the root and return a manifest of every directory
+// object in it, for the first manifest of a bucket
+static int crawl(mf_buf_t *out)
+{
+    char **queue = malloc(sizeof(char *));
+    size_t head = 0, tail = 0, cap = 1;
+    if (!queue || !(queue[tail++] = strdup("/"))) {
+        free(queue);
+        return -1;
+    }
+    buf_start(out, 0);
+    int rv = 0;
+    while (head < tail && rv == 0) {
+        char *dir = queue[head++];
+        uint8_t *data = NULL;
+        s3fs_object_info_t info;
+        ssize_t len = s3fs_get_object_info(mf_bucket, dir, &data, 0, 0, &info);
+        s3dirent_t *ents = NULL;
+        ssize_t n = len < 0 ? -1 : s3fs_dir_decode(data, len, &ents);
+        if (n < 0) {
+            // a directory removed meanwhile just isn't in the manifest, but
+            // without a root there is no tree
+            rv = strcmp(dir, "/") == 0 ? -1 : 0;
+        } else {
+            buf_record(out, dir, info.etag, data, len);
+        }
+        ssize_t i;
+        for (i = 1; i < n && rv == 0; i++) {
+            if (ents[i].type != 'D') {
+                continue;
+            }
+            if (tail == cap) {
+                char **more = realloc(queue, 2 * cap * sizeof(char *));
+                if (!more) {
+                    rv = -1;
+                    break;
+                }
+                queue = more;
+                cap *= 2;
+            }
+            size_t size = strlen(dir) + strlen(ents[i].name) + 2;
+            if (!(queue[tail] = malloc(size))) {
+                rv = -1;
+                break;
+            }
+            snprintf(queue[tail++], size, "%s/%s", strcmp(dir, "/") ? dir : "",
+                     ents[i].name);
+        }
+        free(ents);
+        free(data);
+    }
+    while (tail > 0) {
+        free(queue[--tail]);
+    }
+    free(queue);
+    return rv == 0 ? buf_finish(out) : -1;
+}
+
+// Write a new manifest: the records of the current one (or of the tree,
+// if there is none yet) with the changes folded in
+static int fold(void)
+{
+    mf_buf_t old = { NULL, 0, 0, 0 }, b = { NULL, 0, 0, 0 };
+    uint64_t gen = mf_gen, old_gen;
+    if (gen) {
+        ssize_t len = s3fs_get_object(mf_bucket, S3FS_MANIFEST_KEY, &old.p, 0, 0);
+        old.len = len < 0 ? 0 : len;
+        if (len < 0 || mf_check(old.p, old.len, &old_gen) < 0 || old_gen != gen) {
+            fprintf(stderr, "s3fs manifest: can't read generation %llu\n",
+                    (unsigned long long) gen);
+            free(old.p);
+            return -1;
+        }
+    } else if (crawl(&old) < 0) {
+        fprintf(stderr, "s3fs manifest: can't walk the tree\n");
+        free(old.p);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mf_lock);
+    uint64_t version = mf_version;
+    buf_start(&b, gen + 1);
+    int rv = mf_parse(old.p, old.len, keep_object, &b);
+    int i;
+    mf_entry_t *e, **pp;
+    for (i = 0; i < MANIFEST_HASH_BUCKETS; i++) {
+        for (e = mf_table[i]; e; e = e->next) {
+            if (e->dirty && e->len >= 0) {
+                buf_record(&b, e->key, e->etag, e->data, e->len);
+                e->in_new = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mf_lock);
+    free(old.p);
+    rv = rv == 0 && buf_finish(&b) == 0 &&
+         s3fs_put_object(mf_bucket, S3FS_MANIFEST_KEY, b.p, b.len) == (ssize_t) b.len ? 0 : -1;
+
+    pthread_mutex_lock(&mf_lock);
+    for (i = 0; i < MANIFEST_HASH_BUCKETS; i++) {
+        pp = &mf_table[i];
+        while ((e = *pp)) {
+            if (rv == 0) {
+                e->in_base = e->in_new;
+                if (e->dirty && e->version <= version) {
+                    e->dirty = 0;
+                    free(e->data);
+                    e->data = NULL;
+                }
+            }
+            e->in_new = 0;
+            if (!e->in_base && !e->dirty) {
+                *pp = e->next;
+                free(e->key);
+                free(e->data);
+                free(e);
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+    if (rv == 0) {
+        // the delta of the old manifest is void; what changed since is
+        // for the next one
+        mf_gen = gen + 1;
+        mf_base_bytes = b.len;
+        mf_saved = version;
+    }
+    pthread_mutex_unlock(&mf_lock);
+    free(b.p);
+    return rv;
+}
+
+// Store the changes since the manifest, as the delta or folded into a new
+// manifest once they are large
+static void checkpoint(void)
+{
+    pthread_mutex_lock(&mf_lock);
+    if (mf_gen && mf_version == mf_saved) {
+        pthread_mutex_unlock(&mf_lock);
+        return;
+    }
+    mf_buf_t b = { NULL, 0, 0, 0 };
+    uint64_t version = mf_version, gen = mf_gen;
+    if (gen) {
+        buf_start(&b, gen);
+        encode_changes(&b);
+    }
+    pthread_mutex_unlock(&mf_lock);
+
+    if (!gen || b.failed ||
+        (b.len > MANIFEST_FOLD_MIN && b.len > mf_base_bytes / 2)) {
+        free(b.p);
+        fold();
+        return;
+    }
+    if (buf_finish(&b) == 0 &&
+        s3fs_put_object(mf_bucket, S3FS_MANIFEST_DELTA_KEY, b.p, b.len) == (ssize_t) b.len) {
+        pthread_mutex_lock(&mf_lock);
+        if (mf_gen == gen && mf_saved < version) {
+            mf_saved = version;
+        }
+        pthread_mutex_unlock(&mf_lock);
+    }
+    free(b.p);
+}
+
+static void *checkpoint_thread(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&mf_lock);
+    while (!mf_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += mf_interval;
+        while (!mf_stop &&
+               pthread_cond_timedwait(&mf_cond, &mf_lock, &until) != ETIMEDOUT)
+            ;
+        if (mf_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&mf_lock);
+        checkpoint();
+        pthread_mutex_lock(&mf_lock);
+    }
+    pthread_mutex_unlock(&mf_lock);
+    return NULL;
+}
+
+
+int s3fs_manifest_init(const char *bucket, int interval)
+{
+    if (interval <= 0 || !(mf_bucket = strdup(bucket))) {
+        return 0;
+    }
+    mf_interval = interval;
+    int loaded = load();
+    mf_stop = 0;
+    mf_running = pthread_create(&mf_thread, NULL, checkpoint_thread, NULL) == 0;
+    return loaded;
+}
+
+void s3fs_manifest_destroy(void)
+{
+    if (!mf_bucket) {
+        return;
+    }
+    if (mf_running) {
+        pthread_mutex_lock(&mf_lock);
+        mf_stop = 1;
+        pthread_cond_signal(&mf_cond);
+        pthread_mutex_unlock(&mf_lock);
+        pthread_join(mf_thread, NULL);
+        mf_running = 0;
+    }
+    checkpoint();
+
+    int i;
+    for (i = 0; i < MANIFEST_HASH_BUCKETS; i++) {
+        while (mf_table[i]) {
+            mf_entry_t *e = mf_table[i];
+            mf_table[i] = e->next;
+            free(e->key);
+            free(e->data);
+            free(e);
+        }
+    }
+    free(mf_bucket);
+    mf_bucket = NULL;
+    mf_gen = mf_base_bytes = 0;
+    mf_version = mf_saved = 0;
+}
+
+void s3fs_manifest_note(const char *key, const uint8_t *data, ssize_t len,
+                        const char *etag)
+{
+    if (!mf_bucket) {
+        return;
+    }
+    uint8_t *copy = mf_copy(data, len);
+    pthread_mutex_lock(&mf_lock);
+    mf_entry_t **pp = mf_find(key);
+    mf_entry_t *e = *pp;
+    if (len >= 0 && (!copy && len > 0)) {
+        // can't keep the new object, so keep the old one out instead
+        len = -1;
+    }
+    if (len < 0 && (!e || !e->in_base)) {
+        // not in the manifest, so nothing to take out of it
+        if (e) {
+            *pp = e->next;
+            free(e->key);
+            free(e->data);
+            free(e);
+            mf_version++;
+        }
+    } else if (e || (e = mf_find_or_add(key))) {
+        mf_set(e, len < 0 ? NULL : copy, len, etag);
+        copy = NULL;
+    }
+    pthread_mutex_unlock(&mf_lock);
+    free(copy);
+}
@@ -0,0 +1,53 @@
+/*
+ * Namespace manifest.
+ *
+ * A new mount normally fetches each directory object the first time it
+ * looks at it, which costs short-lived mounts (mount, read a few files,
+ * exit) a GET per directory on the way.  In manifest mode the directory
+ * objects of the whole tree are also kept in a single manifest object,
+ * and a mount loads them all into the metadata cache at start.
+ *
+ * The manifest is checkpointed incrementally: directory objects written
+ * since the manifest was last rewritten are collected in a delta object,
+ * which is stored every few seconds.  Once the delta grows large it is
+ * folded into a new manifest.  Loading the namespace therefore takes two
+ * GETs, one for the manifest and one for the delta.
+ *
+ * Loaded objects are served like any cached ones, and revalidated by
+ * ETag once they are older than the cache's TTL.  The manifest only has
+ * to be as fresh as the last checkpoint.  A directory that isn't in it
+ * is just fetched.
+ */
+#ifndef __S3FS_MANIFEST_H__
+#define __S3FS_MANIFEST_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define S3FS_MANIFEST_KEY "/.s3fs-manifest"
+#define S3FS_MANIFEST_DELTA_KEY "/.s3fs-manifest-delta"
+
+/*
+ * Load the manifest of bucket into the metadata cache, and checkpoint
+ * every interval seconds from now on; interval 0 leaves manifest mode
+ * off.  If the bucket has no manifest yet, the first checkpoint builds
+ * one by walking the tree.  Call after s3fs_dir_init.  Returns 1 if a
+ * manifest was loaded and 0 otherwise.
+ */
+int s3fs_manifest_init(const char *bucket, int interval);
+
+/*
+ * Store a last checkpoint and stop checkpointing.  Directory changes
+ * must be written out first (see s3fs_dir_flush_all).
+ */
+void s3fs_manifest_destroy(void);
+
+/*
+ * Note that the directory object key was written (len bytes of data,
+ * with ETag etag), or that it was removed or is no longer known (data
+ * NULL and len -1).  The metadata cache reports these.
+ */
+void s3fs_manifest_note(const char *key, const uint8_t *data, ssize_t len,
+                        const char *etag);
+
+#endif // __S3FS_MANIFEST_H__
@@ -0,0 +1,611 @@
+/*
+ * metacache.c: in-memory cache of directory objects, revalidated by ETag.
+ * See metacache.h for an overview.
+ *
+ * The snapshot is a header, the bucket name and then one record per
+ * entry, least recently used first: a fixed part (lengths, ETag and
+ * modification time) followed by the key and the object, padded to 8
+ * bytes.  Loaded entries point into the mapped file instead of copying
+ * their objects out of it.
+ */
+
+#include "metacache.h"
+#include "libs3_wrapper.h"
+#include "manifest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define META_HASH_BUCKETS 1024
+#define META_MAX_ENTRIES 8192
+#define OPEN_SLOTS 4096
+#define SNAP_MAGIC 0x4d463353       // "S3FM"
+#define SNAP_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t crc;         // CRC-32 of everything after the header
+    uint32_t bucket_len;
+} snap_header_t;
+
+typedef struct {
+    uint32_t key_len;     // without the NUL that follows the key
+    uint32_t len;
+    int64_t last_modified;
+    char etag[S3FS_ETAG_MAX];
+} snap_record_t;
+
+typedef struct meta_entry {
+    char *key;
+    uint8_t *data;
+    ssize_t len;
+    char etag[S3FS_ETAG_MAX];
+    int64_t last_modified;
+    time_t checked;                   // when the data was last known current
+    int mapped;                       // data is in the snapshot, not malloc'ed
+    int unverified;                   // from the snapshot or the manifest,
+                                      // not revalidated yet
+    struct meta_entry *hnext;         // hash chain
+    struct meta_entry *prev, *next;   // LRU list
+} meta_entry_t;
+
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static meta_entry_t *meta_table[META_HASH_BUCKETS];
+static meta_entry_t *meta_lru_head = NULL, *meta_lru_tail = NULL;
+static int meta_count = 0;
+static int meta_ttl = 0;
+
+// Ticks on every put or invalidation; meta_fence holds the tick of the
+// last one in each hash bucket, so a fetch can tell that what it got may
+// be older than what was put since it began
+static uint64_t meta_clock = 0;
+static uint64_t meta_fence[META_HASH_BUCKETS];
+
+// The loaded snapshot, and the thread revalidating what came from it
+static void *snap_map = NULL;
+static size_t snap_size = 0;
+static char *snap_bucket = NULL;
+static char **snap_keys = NULL;
+static int snap_nkeys = 0;
+static pthread_t snap_thread;
+static int snap_running = 0;
+static int snap_stop = 0;
+
+// Version seen at the last open of a file.  Direct mapped: a collision
+// just forgets the older file, which costs it its kernel page cache once.
+typedef struct {
+    char *key;
+    char etag[S3FS_ETAG_MAX];
+    int64_t last_modified;
+} open_version_t;
+
+static open_version_t open_versions[OPEN_SLOTS];
+
+
+static unsigned meta_hash(const char *key)
+{
+    unsigned h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % META_HASH_BUCKETS;
+}
+
+static unsigned open_slot(const char *key)
+{
+    unsigned h = 2166136261u;
+    while (*key) {
+        h = (h ^ (unsigned char) *key++) * 16777619u;
+    }
+    return h % OPEN_SLOTS;
+}
+
+static meta_entry_t *meta_find(const char *key)
+{
+    meta_entry_t *e = meta_table[meta_hash(key)];
+    while (e && strcmp(e->key, key) != 0) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void meta_lru_unlink(meta_entry_t *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        meta_lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        meta_lru_tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void meta_lru_push(meta_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = meta_lru_head;
+    if (meta_lru_head) {
+        meta_lru_head->prev = e;
+    }
+    meta_lru_head = e;
+    if (!meta_lru_tail) {
+        meta_lru_tail = e;
+    }
+}
+
+static void meta_drop(meta_entry_t *e)
+{
+    meta_entry_t **pp = &meta_table[meta_hash(e->key)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    meta_lru_unlink(e);
+    meta_count--;
+    if (!e->mapped) {
+        free(e->data);
+    }
+    free(e->key);
+    free(e);
+}
+
+// Replace (or add) the cached copy of key.  Takes ownership of data.
+static void meta_store(const char *key, uint8_t *data, ssize_t len,
+                       const s3fs_object_info_t *info)
+{
+    meta_entry_t *e = meta_find(key);
+    if (len > 0 && !data) {
+        // out of memory copying the object: just stop caching it
+        if (e) {
+            meta_drop(e);
+        }
+        return;
+    }
+    if (e) {
+        if (!e->mapped) {
+            free(e->data);
+        }
+        meta_lru_unlink(e);
+    } else {
+        e = calloc(1, sizeof(meta_entry_t));
+        if (!e || !(e->key = strdup(key))) {
+            free(e);
+            free(data);
+            return;
+        }
+        unsigned h = meta_hash(key);
+        e->hnext = meta_table[h];
+        meta_table[h] = e;
+        meta_count++;
+    }
+    e->data = data;
+    e->len = len;
+    e->mapped = e->unverified = 0;
+    snprintf(e->etag, sizeof(e->etag), "%s", info->etag);
+    e->last_modified = info->last_modified;
+    e->checked = time(NULL);
+    meta_lru_push(e);
+
+    while (meta_count > META_MAX_ENTRIES && meta_lru_tail != e) {
+        meta_drop(meta_lru_tail);
+    }
+}
+
+static uint8_t *meta_copy(const uint8_t *data, ssize_t len)
+{
+    if (len <= 0) {
+        return NULL;
+    }
+    uint8_t *copy = malloc(len);
+    if (copy) {
+        memcpy(copy, data, len);
+    }
+    return copy;
+}
+
+
+void s3fs_meta_init(int ttl)
+{
+    meta_ttl = ttl;
+}
+
+static void snap_stop_thread(void)
+{
+    if (!snap_running) {
+        return;
+    }
+    pthread_mutex_lock(&meta_lock);
+    snap_stop = 1;
+    pthread_mutex_unlock(&meta_lock);
+    pthread_join(snap_thread, NULL);
+    snap_running = 0;
+}
+
+void s3fs_meta_destroy(void)
+{
+    snap_stop_thread();
+    pthread_mutex_lock(&meta_lock);
+    while (meta_lru_head) {
+        meta_drop(meta_lru_head);
+    }
+    int i;
+    for (i = 0; i < OPEN_SLOTS; i++) {
+        free(open_versions[i].key);
+        open_versions[i].key = NULL;
+    }
+    for (i = 0; i < snap_nkeys; i++) {
+        free(snap_keys[i]);
+    }
+    free(snap_keys);
+    snap_keys = NULL;
+    snap_nkeys = 0;
+    free(snap_bucket);
+    snap_bucket = NULL;
+    if (snap_map) {
+        munmap(snap_map, snap_size);
+        snap_map = NULL;
+    }
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// Fetch key from s3, or just revalidate our copy if we have one with
+// etag, and update the cache.  Same contract as s3fs_meta_get.
+static ssize_t meta_fetch(const char *bucket, const char *key,
+                          const char *etag, uint8_t **buf)
+{
+    meta_entry_t *e;
+    uint8_t *data = NULL;
+    s3fs_object_info_t info;
+    pthread_mutex_lock(&meta_lock);
+    uint64_t start = meta_clock;
+    pthread_mutex_unlock(&meta_lock);
+    ssize_t len = s3fs_get_object_if_changed(bucket, key, &data, 0, 0, etag,
+                                             &info);
+    if (len == S3FS_NOT_MODIFIED) {
+        pthread_mutex_lock(&meta_lock);
+        e = meta_find(key);
+        if (e && strcmp(e->etag, etag) == 0) {
+            e->checked = time(NULL);
+            e->unverified = 0;
+            len = e->len;
+            *buf = meta_copy(e->data, len);
+            pthread_mutex_unlock(&meta_lock);
+            return (len > 0 && !*buf) ? -1 : len;
+        }
+        pthread_mutex_unlock(&meta_lock);
+        // our copy was replaced or dropped meanwhile; fetch it for real
+        len = s3fs_get_object_info(bucket, key, &data, 0, 0, &info);
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    // after a put or invalidation of key (or a key sharing its fence)
+    // since the fetch began, the cache already has something newer
+    if (meta_fence[meta_hash(key)] <= start) {
+        if (len < 0) {
+            e = meta_find(key);
+            if (e) {
+                meta_drop(e);
+            }
+        } else {
+            meta_store(key, meta_copy(data, len), len, &info);
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    if (len >= 0) {
+        *buf = data;
+    }
+    return len;
+}
+
+ssize_t s3fs_meta_get(const char *bucket, const char *key, uint8_t **buf)
+{
+    char etag[S3FS_ETAG_MAX] = "";
+    pthread_mutex_lock(&meta_lock);
+    meta_entry_t *e = meta_find(key);
+    if (e) {
+        meta_lru_unlink(e);
+        meta_lru_push(e);
+        // what came from the snapshot is served until the revalidation
+        // thread gets to it
+        if ((e->unverified && e->mapped) || time(NULL) - e->checked < meta_ttl) {
+            ssize_t len = e->len;
+            *buf = meta_copy(e->data, len);
+            pthread_mutex_unlock(&meta_lock);
+            return (len > 0 && !*buf) ? -1 : len;
+        }
+        snprintf(etag, sizeof(etag), "%s", e->etag);
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    return meta_fetch(bucket, key, etag, buf);
+}
+
+ssize_t s3fs_meta_get_current(const char *bucket, const char *key,
+                              uint8_t **buf)
+{
+    char etag[S3FS_ETAG_MAX] = "";
+    pthread_mutex_lock(&meta_lock);
+    meta_entry_t *e = meta_find(key);
+    if (e) {
+        meta_lru_unlink(e);
+        meta_lru_push(e);
+        snprintf(etag, sizeof(etag), "%s", e->etag);
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    return meta_fetch(bucket, key, etag, buf);
+}
+
+ssize_t s3fs_meta_put(const char *bucket, const char *key,
+                      const uint8_t *buf, ssize_t len)
+{
+    s3fs_object_info_t info;
+    ssize_t rv = s3fs_put_object_info(bucket, key, buf, len, &info);
+
+    int stored = rv == len && info.etag[0];
+    pthread_mutex_lock(&meta_lock);
+    meta_fence[meta_hash(key)] = ++meta_clock;
+    if (stored) {
+        meta_store(key, meta_copy(buf, len), len, &info);
+    } else {
+        meta_entry_t *e = meta_find(key);
+        if (e) {
+            meta_drop(e);
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    s3fs_manifest_note(key, stored ? buf : NULL, stored ? len : -1, info.etag);
+    return rv;
+}
+
+int s3fs_meta_remove(const char *bucket, const char *key)
+{
+    s3fs_meta_invalidate(key);
+    return s3fs_remove_object(bucket, key);
+}
+
+int s3fs_meta_note_open(const char *key, const s3fs_object_info_t *info)
+{
+    if (!info->etag[0]) {
+        return 0;
+    }
+    pthread_mutex_lock(&meta_lock);
+    open_version_t *v = &open_versions[open_slot(key)];
+    int same = v->key && strcmp(v->key, key) == 0 &&
+               strcmp(v->etag, info->etag) == 0 &&
+               v->last_modified == info->last_modified;
+    if (!same) {
+        if (!v->key || strcmp(v->key, key) != 0) {
+            free(v->key);
+            v->key = strdup(key);
+        }
+        snprintf(v->etag, sizeof(v->etag), "%s", info->etag);
+        v->last_modified = info->last_modified;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return same;
+}
+
+void s3fs_meta_invalidate(const char *key)
+{
+    pthread_mutex_lock(&meta_lock);
+    meta_fence[meta_hash(key)] = ++meta_clock;
+    meta_entry_t *e = meta_find(key);
+    if (e) {
+        meta_drop(e);
+    }
+    open_version_t *v = &open_versions[open_slot(key)];
+    if (v->key && strcmp(v->key, key) == 0) {
+        free(v->key);
+        v->key = NULL;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    s3fs_manifest_note(key, NULL, -1, NULL);
+}
+
+void s3fs_meta_preload(const char *key, const uint8_t *data, ssize_t len,
+                       const char *etag)
+{
+    pthread_mutex_lock(&meta_lock);
+    if (!meta_find(key)) {
+        s3fs_object_info_t info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.etag, sizeof(info.etag), "%s", etag);
+        meta_store(key, meta_copy(data, len), len, &info);
+        // served for ttl like anything fetched, but only s3 itself can say
+        // whether it is still current
+        meta_entry_t *e = meta_find(key);
+        if (e) {
+            e->unverified = 1;
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// Revalidate what came from the snapshot, most recently used first
+static void *snap_revalidate(void *arg)
+{
+    (void) arg;
+    int i = snap_nkeys;
+    while (i-- > 0) {
+        char etag[S3FS_ETAG_MAX];
+        pthread_mutex_lock(&meta_lock);
+        if (snap_stop) {
+            pthread_mutex_unlock(&meta_lock);
+            break;
+        }
+        meta_entry_t *e = meta_find(snap_keys[i]);
+        int unverified = e && e->unverified;
+        if (unverified) {
+            snprintf(etag, sizeof(etag), "%s", e->etag);
+        }
+        pthread_mutex_unlock(&meta_lock);
+        uint8_t *data = NULL;
+        if (unverified && meta_fetch(snap_bucket, snap_keys[i], etag, &data) >= 0) {
+            free(data);
+        }
+    }
+    return NULL;
+}
+
+int s3fs_meta_load(const char *bucket, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    // only good once: after a crash there is no snapshot rather than an
+    // old one
+    unlink(path);
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(snap_header_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    size_t size = st.st_size;
+    const uint8_t *p = map;
+    snap_header_t h;
+    memcpy(&h, p, sizeof(h));
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if (size > sizeof(h)) {
+        crc = crc32(crc, p + sizeof(h), size - sizeof(h));
+    }
+    size_t off = sizeof(h) + SNAP_ALIGN(h.bucket_len);
+    if (h.magic != SNAP_MAGIC || (uint32_t) crc != h.crc ||
+        h.count > META_MAX_ENTRIES || h.bucket_len != strlen(bucket) ||
+        off > size || memcmp(p + sizeof(h), bucket, h.bucket_len) != 0 ||
+        !(snap_keys = calloc(h.count ? h.count : 1, sizeof(char *))) ||
+        !(snap_bucket = strdup(bucket))) {
+        fprintf(stderr, "s3fs metacache: ignoring snapshot %s\n", path);
+        free(snap_keys);
+        snap_keys = NULL;
+        munmap(map, size);
+        return -1;
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    snap_map = map;
+    snap_size = size;
+    uint32_t i;
+    for (i = 0; i < h.count; i++) {
+        snap_record_t r;
+        if (size - off < sizeof(r)) {
+            break;
+        }
+        memcpy(&r, p + off, sizeof(r));
+        const char *key = (const char *) p + off + sizeof(r);
+        size_t rec_len = SNAP_ALIGN(sizeof(r) + r.key_len + 1 + (size_t) r.len);
+        if (rec_len > size - off || key[r.key_len] != '\0' ||
+            strlen(key) != r.key_len || r.etag[S3FS_ETAG_MAX - 1] != '\0' ||
+            meta_find(key)) {
+            break;
+        }
+        meta_entry_t *e = calloc(1, sizeof(meta_entry_t));
+        if (!e || !(e->key = strdup(key)) || !(snap_keys[snap_nkeys] = strdup(key))) {
+            if (e) {
+                free(e->key);
+            }
+            free(e);
+            break;
+        }
+        snap_nkeys++;
+        e->data = r.len ? (uint8_t *) key + r.key_len + 1 : NULL;
+        e->len = r.len;
+        e->mapped = e->unverified = 1;
+        memcpy(e->etag, r.etag, sizeof(e->etag));
+        e->last_modified = r.last_modified;
+        e->checked = time(NULL);
+        unsigned hash = meta_hash(key);
+        e->hnext = meta_table[hash];
+        meta_table[hash] = e;
+        meta_count++;
+        meta_lru_push(e);
+        off += rec_len;
+    }
+    snap_stop = 0;
+    pthread_mutex_unlock(&meta_lock);
+
+    fprintf(stderr, "s3fs metacache: loaded %d objects from %s\n", snap_nkeys, path);
+    snap_running = snap_nkeys &&
+                   pthread_create(&snap_thread, NULL, snap_revalidate, NULL) == 0;
+    return 0;
+}
+
+int s3fs_meta_save(const char *bucket, const char *path)
+{
+    snap_stop_thread();
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        return -1;
+    }
+    static const uint8_t zeros[8];
+    snap_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAP_MAGIC;
+    h.bucket_len = strlen(bucket);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    size_t pad = SNAP_ALIGN(h.bucket_len) - h.bucket_len;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(bucket, 1, h.bucket_len, f) == h.bucket_len &&
+             fwrite(zeros, 1, pad, f) == pad;
+    crc = crc32(crc, (const Bytef *) bucket, h.bucket_len);
+    crc = crc32(crc, zeros, pad);
+
+    // least recently used first, so loading it in order rebuilds the LRU
+    pthread_mutex_lock(&meta_lock);
+    meta_entry_t *e;
+    for (e = meta_lru_tail; ok && e; e = e->prev) {
+        snap_record_t r;
+        memset(&r, 0, sizeof(r));
+        r.key_len = strlen(e->key);
+        r.len = e->len;
+        r.last_modified = e->last_modified;
+        snprintf(r.etag, sizeof(r.etag), "%s", e->etag);
+        size_t used = sizeof(r) + r.key_len + 1 + e->len;
+        pad = SNAP_ALIGN(used) - used;
+        ok = fwrite(&r, sizeof(r), 1, f) == 1 &&
+             fwrite(e->key, 1, r.key_len + 1, f) == r.key_len + 1 &&
+             fwrite(e->data ? e->data : zeros, 1, e->len, f) == (size_t) e->len &&
+             fwrite(zeros, 1, pad, f) == pad;
+        crc = crc32(crc, (const Bytef *) &r, sizeof(r));
+        crc = crc32(crc, (const Bytef *) e->key, r.key_len + 1);
+        if (e->len) {
+            crc = crc32(crc, e->data, e->len);
+        }
+        crc = crc32(crc, zeros, pad);
+        h.count++;
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    h.crc = crc;
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1 &&
+         fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "s3fs metacache: can't write snapshot %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * In-memory cache of small metadata objects (directory objects).
+ *
+ * Cached objects are served directly for ttl seconds after they were
+ * last fetched or validated.  After that, the next lookup revalidates
+ * the object with a conditional get on its ETag, so an unchanged object
+ * costs a 304 with no body instead of a full transfer.  Writes and
+ * removals made through this module keep the cache up to date.
+ *
+ * The cache can be saved to a local snapshot at unmount and loaded back
+ * at the next mount, so a restarted file system doesn't have to fetch
+ * every directory again.  Loaded objects are served right away, and a
+ * background thread revalidates them one by one.
+ *
+ * Objects written or invalidated here are reported to the namespace
+ * manifest (see manifest.h).
+ */
+#ifndef __S3FS_METACACHE_H__
+#define __S3FS_METACACHE_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "libs3_wrapper.h"
+
+/*
+ * Set how long (in seconds) a cached object is trusted before it is
+ * revalidated.  0 revalidates on every lookup.
+ */
+void s3fs_meta_init(int ttl);
+
+/*
+ * Free all cached objects.
+ */
+void s3fs_meta_destroy(void);
+
+/*
+ * Write the cached objects of bucket to a snapshot at path.  Call when
+ * nothing else uses the cache any more.  Returns 0 on success and -1 on
+ * failure.
+ */
+int s3fs_meta_save(const char *bucket, const char *path);
+
+/*
+ * Load the snapshot at path, if there is one and it is of bucket, and
+ * start revalidating what is in it.  The snapshot file is removed, so it
+ * can't be trusted after a crash has made it stale.  Call once, after
+ * s3fs_meta_init.  Returns 0 on success and -1 otherwise.
+ */
+int s3fs_meta_load(const char *bucket, const char *path);
+
+/*
+ * Same contract as s3fs_get_object for a whole object: on success *buf
+ * is a malloc'ed copy of the object (NULL if it is empty) and the object
+ * length is returned; -1 is returned on error.
+ */
+ssize_t s3fs_meta_get(const char *bucket, const char *key, uint8_t **buf);
+
+/*
+ * Same as s3fs_meta_get, but the cached copy is always revalidated with a
+ * conditional get first, however recently it was checked or wherever it
+ * came from.  For reading an object that is about to be rewritten.
+ */
+ssize_t s3fs_meta_get_current(const char *bucket, const char *key,
+                              uint8_t **buf);
+
+/*
+ * Same contract as s3fs_put_object; the cache is updated on success.
+ */
+ssize_t s3fs_meta_put(const char *bucket, const char *key,
+                      const uint8_t *buf, ssize_t len);
+
+/*
+ * Same contract as s3fs_remove_object; the object is dropped from the
+ * cache.
+ */
+int s3fs_meta_remove(const char *bucket, const char *key);
+
+/*
+ * Record that key was opened while s3 held the version described by info.
+ * Returns 1 if the previous open of key saw the same version (same ETag
+ * and modification time), so data the kernel cached then is still good.
+ */
+int s3fs_meta_note_open(const char *key, const s3fs_object_info_t *info);
+
+/*
+ * Drop key (including what was seen at its last open) from the cache
+ * without touching s3.
+ */
+void s3fs_meta_invalidate(const char *key);
+
+/*
+ * Cache len bytes of data as the object key, with ETag etag, unless key
+ * is cached already.  It is served for ttl seconds as if just fetched,
+ * but s3fs_meta_get_current still revalidates it.
+ */
+void s3fs_meta_preload(const char *key, const uint8_t *data, ssize_t len,
+                       const char *etag);
+
+#endif // __S3FS_METACACHE_H__
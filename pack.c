@@ -0,0 +1,784 @@
+/*
+ * pack.c: packing of small files into shared pack objects.  See pack.h
+ * for an overview.
+ */
+
+#include "pack.h"
+#include "delq.h"
+#include "dirbatch.h"
+#include "dirlock.h"
+#include "libs3_wrapper.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define PACK_TARGET (8 * 1024 * 1024)  // upload a pack once it is this big
+#define PACK_REPACK_SECS 60             // how often the repacker looks
+#define PACK_REPACK_DEAD PACK_TARGET    // dead bytes worth a repack
+#define PACK_INFO_BUCKETS 1024
+#define LEDGER_MAGIC 0x4c463353         // "S3FL"
+#define LEDGER_KEY "/.s3fs-packs/ledger"
+
+// A pack that is still in memory: the current one, or one waiting to be
+// uploaded.
+typedef struct pack_buf {
+    uint64_t id;
+    uint8_t *data;
+    size_t len, cap;
+    int uploading;
+    struct pack_buf *next;
+} pack_buf_t;
+
+// What is known about a pack: how big it is, how much of it is dead and
+// which directories had members put in them (its index, so the repacker
+// only has to look there).
+typedef struct pack_info {
+    uint64_t id;
+    uint64_t size;               // of the stored pack, or 0 if not known
+    uint64_t dead;
+    char **dirs;
+    int ndirs, cap;
+    int dirs_lost;               // a directory couldn't be noted
+    struct pack_info *next;      // hash chain
+} pack_info_t;
+
+// A pack being repacked, with its whole contents.
+typedef struct {
+    uint64_t id;
+    uint8_t *data;
+    size_t len;
+} repack_t;
+
+// The ledger object keeps the pack infos across mounts: a header and then
+// per pack a ledger_record_t followed by its directories, each a length
+// and the name, unpadded, in host byte order.
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;                // of everything after the header
+    uint32_t count;
+    uint32_t unused;
+} ledger_header_t;
+
+typedef struct {
+    uint64_t id, size, dead;
+    uint32_t ndirs;
+    uint32_t dirs_lost;
+} ledger_record_t;
+
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pack_cond = PTHREAD_COND_INITIALIZER;     // an upload finished
+static pthread_cond_t repack_cond = PTHREAD_COND_INITIALIZER;   // wakes the repacker
+static pack_buf_t *pack_cur = NULL;
+static pack_buf_t *sealed_head = NULL, *sealed_tail = NULL;     // by id
+static pack_info_t *pack_infos[PACK_INFO_BUCKETS];
+static uint64_t dead_total = 0;
+static uint64_t pack_moves = 0;         // bumped whenever members move
+static int ledger_dirty = 0;
+static uint64_t pack_next_id = 0;
+static char *pack_bucket = NULL;
+static int repack_stop = 0;
+static int repack_running = 0;
+static pthread_t repack_thread;
+
+
+static void pack_key(uint64_t id, char *key, size_t size)
+{
+    snprintf(key, size, "/.s3fs-packs/%016llx", (unsigned long long) id);
+}
+
+// The info of pack id, or where it would go.  Called with pack_lock held.
+static pack_info_t **info_find(uint64_t id)
+{
+    pack_info_t **pp = &pack_infos[id % PACK_INFO_BUCKETS];
+    while (*pp && (*pp)->id != id) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+// The info of pack id, made if there is none yet; NULL if out of memory.
+// Called with pack_lock held.
+static pack_info_t *info_get(uint64_t id)
+{
+    pack_info_t **pp = info_find(id);
+    if (!*pp && (*pp = calloc(1, sizeof(pack_info_t)))) {
+        (*pp)->id = id;
+    }
+    return *pp;
+}
+
+static void info_free(pack_info_t *info)
+{
+    int i;
+    for (i = 0; i < info->ndirs; i++) {
+        free(info->dirs[i]);
+    }
+    free(info->dirs);
+    free(info);
+}
+
+// Note that dir has members of info's pack.  Called with pack_lock held.
+static void info_add_dir(pack_info_t *info, const char *dir)
+{
+    int i;
+    for (i = info->ndirs - 1; i >= 0; i--) { // most likely the last one
+        if (strcmp(info->dirs[i], dir) == 0) {
+            return;
+        }
+    }
+    if (info->ndirs == info->cap) {
+        int cap = info->cap ? info->cap * 2 : 4;
+        char **more = realloc(info->dirs, cap * sizeof(char *));
+        if (!more) {
+            info->dirs_lost = 1;
+            return;
+        }
+        info->dirs = more;
+        info->cap = cap;
+    }
+    if (!(info->dirs[info->ndirs] = strdup(dir))) {
+        info->dirs_lost = 1;
+        return;
+    }
+    info->ndirs++;
+}
+
+// Move the current pack to the upload queue.  Called with pack_lock held.
+static void seal_current(void)
+{
+    if (!pack_cur) {
+        return;
+    }
+    if (sealed_tail) {
+        sealed_tail->next = pack_cur;
+    } else {
+        sealed_head = pack_cur;
+    }
+    sealed_tail = pack_cur;
+    pack_cur = NULL;
+}
+
+// Upload sealed packs up to id upto, trying each at most once.  Called
+// with pack_lock held; returns with it held.
+static int upload_sealed(uint64_t upto)
+{
+    for (;;) {
+        pack_buf_t *p = sealed_head;
+        while (p && p->uploading) {
+            p = p->next;
+        }
+        if (!p || p->id > upto) {
+            // only other threads' uploads are left
+            if (sealed_head && sealed_head->id <= upto) {
+                uint64_t id = sealed_head->id;
+                pthread_cond_wait(&pack_cond, &pack_lock);
+                if (sealed_head && sealed_head->id == id && !sealed_head->uploading) {
+                    return -EIO; // theirs failed
+                }
+                continue;
+            }
+            return 0;
+        }
+        p->uploading = 1;
+        pthread_mutex_unlock(&pack_lock);
+        char key[64];
+        pack_key(p->id, key, sizeof(key));
+        int ok = s3fs_put_object(pack_bucket, key, p->data, p->len) == (ssize_t) p->len;
+        pthread_mutex_lock(&pack_lock);
+        p->uploading = 0;
+        pthread_cond_broadcast(&pack_cond);
+        if (!ok) {
+            fprintf(stderr, "s3fs pack: failed to upload %s\n", key);
+            return -EIO;
+        }
+        pack_info_t *info = info_get(p->id);
+        if (info) {
+            info->size = p->len;
+            ledger_dirty = 1;
+        }
+        pack_buf_t **pp = &sealed_head;
+        while (*pp != p) {
+            pp = &(*pp)->next;
+        }
+        *pp = p->next;
+        if (sealed_tail == p) {
+            pack_buf_t *q = sealed_head;
+            while (q && q->next) {
+                q = q->next;
+            }
+            sealed_tail = q;
+        }
+        free(p->data);
+        free(p);
+    }
+}
+
+int s3fs_pack_add(const char *dir, const void *data, size_t len, uint64_t *id,
+                 uint64_t *offset)
+{
+    pthread_mutex_lock(&pack_lock);
+    if (pack_cur && pack_cur->len + len > PACK_TARGET) {
+        // this writer pays for the upload, so memory use stays bounded; a
+        // pack that fails to upload is tried again at the next sync
+        seal_current();
+        upload_sealed(sealed_tail->id);
+    }
+    if (!pack_cur) {
+        pack_cur = calloc(1, sizeof(pack_buf_t));
+        if (pack_cur) {
+            pack_cur->id = pack_next_id++;
+        }
+    }
+    if (pack_cur && pack_cur->len + len > pack_cur->cap) {
+        size_t cap = pack_cur->cap ? pack_cur->cap : 64 * 1024;
+        while (cap < pack_cur->len + len) {
+            cap *= 2;
+        }
+        uint8_t *more = realloc(pack_cur->data, cap);
+        if (more) {
+            pack_cur->data = more;
+            pack_cur->cap = cap;
+        }
+    }
+    pack_info_t *info = pack_cur ? info_get(pack_cur->id) : NULL;
+    if (!info || pack_cur->len + len > pack_cur->cap) {
+        pthread_mutex_unlock(&pack_lock);
+        return -1;
+    }
+    info_add_dir(info, dir);
+    ledger_dirty = 1;
+    memcpy(pack_cur->data + pack_cur->len, data, len);
+    *id = pack_cur->id;
+    *offset = pack_cur->len;
+    pack_cur->len += len;
+    pthread_mutex_unlock(&pack_lock);
+    return 0;
+}
+
+int s3fs_pack_sync(void)
+{
+    pthread_mutex_lock(&pack_lock);
+    seal_current();
+    int rv = sealed_tail ? upload_sealed(sealed_tail->id) : 0;
+    pthread_mutex_unlock(&pack_lock);
+    return rv;
+}
+
+int s3fs_pack_read(uint64_t id, uint64_t offset, size_t len, uint8_t **data)
+{
+    pthread_mutex_lock(&pack_lock);
+    pack_buf_t *p = pack_cur && pack_cur->id == id ? pack_cur : sealed_head;
+    while (p && p->id != id) {
+        p = p->next;
+    }
+    if (p) {
+        // not uploaded yet
+        int rv = -1;
+        *data = malloc(len ? len : 1);
+        if (*data && offset + len <= p->len) {
+            memcpy(*data, p->data + offset, len);
+            rv = 0;
+        }
+        pthread_mutex_unlock(&pack_lock);
+        return rv;
+    }
+    pthread_mutex_unlock(&pack_lock);
+
+    char key[64];
+    pack_key(id, key, sizeof(key));
+    *data = NULL;
+    ssize_t got = s3fs_get_object(pack_bucket, key, data, offset, len);
+    if (got != (ssize_t) len) {
+        free(*data);
+        return -1;
+    }
+    return 0;
+}
+
+void s3fs_pack_release(uint64_t id, size_t len)
+{
+    pthread_mutex_lock(&pack_lock);
+    pack_info_t *info = info_get(id);
+    if (info) {
+        info->dead += len;
+        dead_total += len;
+        ledger_dirty = 1;
+        if (dead_total >= PACK_REPACK_DEAD) {
+            pthread_cond_signal(&repack_cond);
+        }
+    }
+    pthread_mutex_unlock(&pack_lock);
+}
+
+void s3fs_pack_moved(uint64_t id, const char *dir)
+{
+    pthread_mutex_lock(&pack_lock);
+    pack_info_t *info = info_get(id);
+    if (info) {
+        info_add_dir(info, dir);
+        ledger_dirty = 1;
+    }
+    pack_moves++;
+    pthread_mutex_unlock(&pack_lock);
+}
+
+void s3fs_pack_moved_tree(const char *from, const char *to)
+{
+    size_t len = strlen(from);
+    pthread_mutex_lock(&pack_lock);
+    int b;
+    for (b = 0; b < PACK_INFO_BUCKETS; b++) {
+        pack_info_t *info;
+        for (info = pack_infos[b]; info; info = info->next) {
+            int i;
+            for (i = 0; i < info->ndirs; i++) {
+                char *dir = info->dirs[i];
+                if (strncmp(dir, from, len) != 0 ||
+                    (dir[len] != '\0' && dir[len] != '/')) {
+                    continue;
+                }
+                size_t dlen = strlen(to) + strlen(dir + len) + 1;
+                char *moved = malloc(dlen);
+                if (!moved) {
+                    info->dirs_lost = 1;
+                    continue;
+                }
+                snprintf(moved, dlen, "%s%s", to, dir + len);
+                free(dir);
+                info->dirs[i] = moved;
+            }
+        }
+    }
+    pack_moves++;
+    ledger_dirty = 1;
+    pthread_mutex_unlock(&pack_lock);
+}
+
+
+// Encode the pack infos as the ledger.  Called with pack_lock held;
+// returns NULL if out of memory.
+static uint8_t *ledger_encode(size_t *len)
+{
+    ledger_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = LEDGER_MAGIC;
+    size_t size = sizeof(h);
+    int b, i;
+    pack_info_t *info;
+    for (b = 0; b < PACK_INFO_BUCKETS; b++) {
+        for (info = pack_infos[b]; info; info = info->next) {
+            size += sizeof(ledger_record_t);
+            for (i = 0; i < info->ndirs; i++) {
+                size += sizeof(uint32_t) + strlen(info->dirs[i]);
+            }
+            h.count++;
+        }
+    }
+    uint8_t *buf = malloc(size);
+    if (!buf) {
+        return NULL;
+    }
+    size_t off = sizeof(h);
+    for (b = 0; b < PACK_INFO_BUCKETS; b++) {
+        for (info = pack_infos[b]; info; info = info->next) {
+            ledger_record_t r;
+            memset(&r, 0, sizeof(r));
+            r.id = info->id;
+            r.size = info->size;
+            r.dead = info->dead;
+            r.ndirs = info->ndirs;
+            r.dirs_lost = info->dirs_lost;
+            memcpy(buf + off, &r, sizeof(r));
+            off += sizeof(r);
+            for (i = 0; i < info->ndirs; i++) {
+                uint32_t dlen = strlen(info->dirs[i]);
+                memcpy(buf + off, &dlen, sizeof(dlen));
+                memcpy(buf + off + sizeof(dlen), info->dirs[i], dlen);
+                off += sizeof(dlen) + dlen;
+            }
+        }
+    }
+    h.crc = crc32(crc32(0L, Z_NULL, 0), buf + sizeof(h), size - sizeof(h));
+    memcpy(buf, &h, sizeof(h));
+    *len = size;
+    return buf;
+}
+
+// Store the ledger if it changed since it was last stored
+static void ledger_save(void)
+{
+    pthread_mutex_lock(&pack_lock);
+    size_t len = 0;
+    uint8_t *buf = ledger_dirty ? ledger_encode(&len) : NULL;
+    if (buf) {
+        ledger_dirty = 0;
+    }
+    pthread_mutex_unlock(&pack_lock);
+    if (buf && s3fs_put_object(pack_bucket, LEDGER_KEY, buf, len) != (ssize_t) len) {
+        fprintf(stderr, "s3fs pack: failed to store the ledger\n");
+        pthread_mutex_lock(&pack_lock);
+        ledger_dirty = 1;
+        pthread_mutex_unlock(&pack_lock);
+    }
+    free(buf);
+}
+
+// Load what earlier mounts knew about the packs.  Called before anything
+// else uses the packs.
+static void ledger_load(void)
+{
+    uint8_t *buf = NULL;
+    ssize_t len = s3fs_get_object(pack_bucket, LEDGER_KEY, &buf, 0, 0);
+    ledger_header_t h;
+    if (len < (ssize_t) sizeof(h)) {
+        free(buf);
+        return;
+    }
+    memcpy(&h, buf, sizeof(h));
+    if (h.magic != LEDGER_MAGIC ||
+        h.crc != crc32(crc32(0L, Z_NULL, 0), buf + sizeof(h), len - sizeof(h))) {
+        fprintf(stderr, "s3fs pack: ignoring a damaged ledger\n");
+        free(buf);
+        return;
+    }
+    size_t off = sizeof(h);
+    uint32_t n;
+    for (n = 0; n < h.count && len - off >= sizeof(ledger_record_t); n++) {
+        ledger_record_t r;
+        memcpy(&r, buf + off, sizeof(r));
+        off += sizeof(r);
+        pack_info_t *info = info_get(r.id);
+        if (!info) {
+            break;
+        }
+        info->size = r.size;
+        info->dead = r.dead;
+        info->dirs_lost = r.dirs_lost;
+        dead_total += r.dead;
+        uint32_t i;
+        for (i = 0; i < r.ndirs; i++) {
+            uint32_t dlen;
+            char dir[PATH_MAX];
+            if (len - off < sizeof(dlen)) {
+                break;
+            }
+            memcpy(&dlen, buf + off, sizeof(dlen));
+            if (dlen >= sizeof(dir) || len - off - sizeof(dlen) < dlen) {
+                break;
+            }
+            memcpy(dir, buf + off + sizeof(dlen), dlen);
+            dir[dlen] = '\0';
+            off += sizeof(dlen) + dlen;
+            info_add_dir(info, dir);
+        }
+        if (i < r.ndirs) {
+            info->dirs_lost = 1;
+            break;
+        }
+    }
+    free(buf);
+}
+
+
+// Move the members of the n packs in old that directory dir refers to
+// into the current pack, under dir's lock; each entry is read under the
+// lock, so it is only rewritten if it still points at the old pack.  With
+// children, dir's subdirectories are added to *children.  Returns 0, or
+// -1 if dir couldn't be read or rewritten.
+static int repack_dir(const char *dir, repack_t *old, int n, char ***children,
+                      int *nchildren)
+{
+    s3fs_dirlock_write(dir);
+    s3dirent_t *dirs = NULL;
+    ssize_t entries = s3fs_dir_get(dir, &dirs);
+    int rv = entries < 0 ? -1 : 0;
+    ssize_t i;
+    for (i = 1; i < entries && rv == 0; i++) { // skip "."
+        s3dirent_t *ent = &dirs[i];
+        if (ent->type == 'D') {
+            if (!children) {
+                continue;
+            }
+            char child[PATH_MAX];
+            char **more = realloc(*children, (*nchildren + 1) * sizeof(char *));
+            if (!more || snprintf(child, sizeof(child), "%s/%s",
+                                  strcmp(dir, "/") ? dir : "", ent->name) >= (int) sizeof(child) ||
+                !(more[*nchildren] = strdup(child))) {
+                if (more) {
+                    *children = more;
+                }
+                rv = -1;
+            } else {
+                *children = more;
+                (*nchildren)++;
+            }
+            continue;
+        }
+        if (!ent->packed) {
+            continue;
+        }
+        int k;
+        for (k = 0; k < n && old[k].id != ent->pack_id; k++)
+            ;
+        if (k == n) {
+            continue;
+        }
+        uint64_t id, offset, from = ent->pack_id;
+        if (ent->pack_offset + ent->size > old[k].len ||
+            s3fs_pack_add(dir, old[k].data + ent->pack_offset, ent->size, &id, &offset) < 0) {
+            rv = -1;
+        } else {
+            ent->pack_id = id;
+            ent->pack_offset = offset;
+            rv = s3fs_dir_put(dir, ent);
+            // the old copy is as good as released
+            s3fs_pack_release(rv == 0 ? from : id, ent->size);
+        }
+    }
+    s3fs_dirunlock_write(dir);
+    free(dirs);
+    return rv;
+}
+
+// Repack from every directory below dir, each under its own lock.
+static int repack_walk(const char *dir, repack_t *old, int n)
+{
+    char **children = NULL;
+    int nchildren = 0, i;
+    int rv = repack_dir(dir, old, n, &children, &nchildren);
+    for (i = 0; i < nchildren; i++) {
+        if (rv == 0) {
+            rv = repack_walk(children[i], old, n);
+        }
+        free(children[i]);
+    }
+    free(children);
+    return rv;
+}
+
+// Is pack id still in memory?  Called with pack_lock held.
+static int buffered(uint64_t id)
+{
+    pack_buf_t *p = sealed_head;
+    while (p && p->id != id) {
+        p = p->next;
+    }
+    return p || (pack_cur && pack_cur->id == id);
+}
+
+// Copy the live members of mostly dead packs to the current pack and
+// delete the old packs.  Only the directories in the packs' indexes are
+// visited.  A pack is deleted once all of it is known to be dead, or when
+// a walk of the whole tree found nothing else and no member moved
+// meanwhile (the index can miss a directory, and an earlier mount may have
+// died before it stored the ledger).
+static void repack(void)
+{
+    // the packs worth the trouble, by the dead space known so far
+    pthread_mutex_lock(&pack_lock);
+    uint64_t *ids = NULL;
+    int nids = 0, b;
+    pack_info_t *info;
+    for (b = 0; b < PACK_INFO_BUCKETS; b++) {
+        for (info = pack_infos[b]; info; info = info->next) {
+            if (info->dead > 0 && (info->size == 0 || info->dead * 2 >= info->size) &&
+                !buffered(info->id)) {
+                uint64_t *more = realloc(ids, (nids + 1) * sizeof(uint64_t));
+                if (!more) {
+                    break;
+                }
+                ids = more;
+                ids[nids++] = info->id;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pack_lock);
+
+    repack_t *old = NULL;
+    int n = 0, k;
+    for (k = 0; k < nids; k++) {
+        char key[64];
+        pack_key(ids[k], key, sizeof(key));
+        s3fs_object_info_t oinfo;
+        int known = s3fs_head_object(pack_bucket, key, &oinfo) == 0;
+        pthread_mutex_lock(&pack_lock);
+        pack_info_t **pp = info_find(ids[k]);
+        int worth = 0;
+        if (*pp && !known) {
+            // gone already
+            info = *pp;
+            *pp = info->next;
+            dead_total -= info->dead < dead_total ? info->dead : dead_total;
+            info_free(info);
+            ledger_dirty = 1;
+        } else if (*pp) {
+            (*pp)->size = oinfo.content_length;
+            worth = (*pp)->dead * 2 >= (*pp)->size;
+        }
+        pthread_mutex_unlock(&pack_lock);
+        uint8_t *data = NULL;
+        ssize_t len = -1;
+        repack_t *more = NULL;
+        if (worth && (more = realloc(old, (n + 1) * sizeof(repack_t))) &&
+            (len = s3fs_get_object(pack_bucket, key, &data, 0, 0)) >= 0) {
+            old = more;
+            old[n].id = ids[k];
+            old[n].data = data;
+            old[n].len = len;
+            n++;
+        } else if (more) {
+            old = more;
+        }
+    }
+    free(ids);
+
+    // visit what the indexes name
+    char **dirs = NULL;
+    int ndirs = 0, lost = 0, i;
+    pthread_mutex_lock(&pack_lock);
+    uint64_t moves = pack_moves;
+    for (k = 0; k < n; k++) {
+        info = *info_find(old[k].id);
+        lost |= !info || info->dirs_lost;
+        for (i = 0; info && i < info->ndirs; i++) {
+            char **more = realloc(dirs, (ndirs + 1) * sizeof(char *));
+            if (!more || !(more[ndirs] = strdup(info->dirs[i]))) {
+                if (more) {
+                    dirs = more;
+                }
+                lost = 1;
+                break;
+            }
+            dirs = more;
+            ndirs++;
+        }
+    }
+    pthread_mutex_unlock(&pack_lock);
+    for (i = 0; i < ndirs; i++) {
+        // one that is gone had its members moved or released
+        repack_dir(dirs[i], old, n, NULL, NULL);
+        free(dirs[i]);
+    }
+    free(dirs);
+
+    // and only walk the tree for what the indexes didn't account for
+    int walked = 0, done = 0;
+    pthread_mutex_lock(&pack_lock);
+    for (k = 0; k < n; k++) {
+        info = *info_find(old[k].id);
+        lost |= !info || info->dead < info->size;
+    }
+    pthread_mutex_unlock(&pack_lock);
+    if (n > 0 && lost) {
+        walked = repack_walk("/", old, n) == 0;
+    }
+    pthread_mutex_lock(&pack_lock);
+    for (k = 0; k < n; k++) {
+        info = *info_find(old[k].id);
+        if (info && (info->dead >= info->size || (walked && pack_moves == moves))) {
+            old[k].len = 0; // marks it done
+            done++;
+        }
+    }
+    pthread_mutex_unlock(&pack_lock);
+
+    // the old packs go once no stored directory refers to them
+    if (done > 0 && s3fs_dir_flush_all() == 0) {
+        for (k = 0; k < n; k++) {
+            if (old[k].len) {
+                continue;
+            }
+            char key[64];
+            pack_key(old[k].id, key, sizeof(key));
+            s3fs_delq_add(key);
+            pthread_mutex_lock(&pack_lock);
+            pack_info_t **pp = info_find(old[k].id);
+            if ((info = *pp)) {
+                *pp = info->next;
+                dead_total -= info->dead < dead_total ? info->dead : dead_total;
+                info_free(info);
+                ledger_dirty = 1;
+            }
+            pthread_mutex_unlock(&pack_lock);
+        }
+        fprintf(stderr, "s3fs pack: repacked %d packs\n", done);
+    } else if (n > done) {
+        fprintf(stderr, "s3fs pack: repacking %d packs failed, will retry\n", n - done);
+    }
+    for (k = 0; k < n; k++) {
+        free(old[k].data);
+    }
+    free(old);
+    ledger_save();
+}
+
+static void *repack_main(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&pack_lock);
+    while (!repack_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += PACK_REPACK_SECS;
+        pthread_cond_timedwait(&repack_cond, &pack_lock, &ts);
+        if (repack_stop) {
+            break;
+        }
+        int due = dead_total >= PACK_REPACK_DEAD;
+        pthread_mutex_unlock(&pack_lock);
+        if (due) {
+            repack();
+        } else {
+            ledger_save();
+        }
+        pthread_mutex_lock(&pack_lock);
+    }
+    pthread_mutex_unlock(&pack_lock);
+    return NULL;
+}
+
+
+void s3fs_pack_init(const char *bucket)
+{
+    pack_bucket = strdup(bucket);
+    // ids only grow, across mounts too
+    pack_next_id = (uint64_t) time(NULL) << 20;
+    ledger_load();
+    repack_stop = 0;
+    repack_running = pthread_create(&repack_thread, NULL, repack_main, NULL) == 0;
+}
+
+void s3fs_pack_destroy(void)
+{
+    if (repack_running) {
+        pthread_mutex_lock(&pack_lock);
+        repack_stop = 1;
+        pthread_cond_signal(&repack_cond);
+        pthread_mutex_unlock(&pack_lock);
+        pthread_join(repack_thread, NULL);
+        repack_running = 0;
+    }
+    if (s3fs_pack_sync() < 0) {
+        fprintf(stderr, "s3fs pack: small files were lost at unmount\n");
+    }
+    ledger_save();
+    int b;
+    for (b = 0; b < PACK_INFO_BUCKETS; b++) {
+        pack_info_t *info;
+        while ((info = pack_infos[b])) {
+            pack_infos[b] = info->next;
+            info_free(info);
+        }
+    }
+    dead_total = 0;
+    pack_moves = 0;
+    ledger_dirty = 0;
+    free(pack_bucket);
+    pack_bucket = NULL;
+}
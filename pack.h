@@ -0,0 +1,73 @@
+/*
+ * Packing of small files into shared pack objects.
+ *
+ * A small file that has no object of its own (see s3dirent_t) and is too
+ * big to keep in its directory entry is appended to the current pack, an
+ * in-memory buffer that is uploaded as one object once it is large
+ * enough or before any directory is written out.  The file's directory
+ * entry records which pack holds it and at what offset; that is the
+ * pack's index, and reading the file is a ranged get of the pack.
+ * Thousands of small files then cost a handful of PUTs.
+ *
+ * A member replaced or removed leaves dead space behind in its pack.  A
+ * background repacker copies the live members of mostly dead packs into
+ * the current pack, points their entries at the copies and deletes the
+ * old packs.  Each pack also keeps the list of directories it has members
+ * in, so the repacker only visits those, one directory lock at a time.
+ * The dead space and directory lists are stored in a ledger object next
+ * to the packs, so they survive a remount.
+ */
+#ifndef __S3FS_PACK_H__
+#define __S3FS_PACK_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * Start packing into bucket, and start the repacker.
+ */
+void s3fs_pack_init(const char *bucket);
+
+/*
+ * Stop the repacker and upload the current pack.
+ */
+void s3fs_pack_destroy(void);
+
+/*
+ * Append len bytes of data, a member whose entry is in directory dir, to
+ * the current pack.  On success sets *id and *offset to where they were
+ * put and returns 0; returns -1 on failure.  The data is readable at
+ * once, but only stored in s3 after the next s3fs_pack_sync.
+ */
+int s3fs_pack_add(const char *dir, const void *data, size_t len, uint64_t *id,
+                  uint64_t *offset);
+
+/*
+ * Upload every pack filled so far.  Anything that refers to a pack must
+ * not be stored before this succeeds.  Returns 0 on success, or -EIO.
+ */
+int s3fs_pack_sync(void);
+
+/*
+ * Read the member of pack id at offset, len bytes long.  On success *data
+ * is a malloc'ed copy and 0 is returned; returns -1 on failure.
+ */
+int s3fs_pack_read(uint64_t id, uint64_t offset, size_t len, uint8_t **data);
+
+/*
+ * Note that the member of pack id that was len bytes long is no longer
+ * referred to, so the repacker can reclaim the space.
+ */
+void s3fs_pack_release(uint64_t id, size_t len);
+
+/*
+ * Note that an entry of a member of pack id was moved to directory dir.
+ */
+void s3fs_pack_moved(uint64_t id, const char *dir);
+
+/*
+ * Note that directory from, with everything below it, was renamed to to.
+ */
+void s3fs_pack_moved_tree(const char *from, const char *to);
+
+#endif // __S3FS_PACK_H__
@@ -0,0 +1,420 @@
+/*
+ * prefetch.c: subtree and file prefetch.  See prefetch.h for an overview.
+ */
+
+#include "prefetch.h"
+#include "dirbatch.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PREFETCH_MAX_WORKERS 64
+#define PREFETCH_MAX_QUEUED 4096
+#define PREFETCH_HASH_BUCKETS 1024
+#define PREFETCH_LISTINGS 64          // directories whose file order is known
+#define PREFETCH_SUCCESSORS 4096      // files whose successor is known
+#define PREFETCH_INFOS 1024           // properties fetched ahead of opens
+
+typedef struct pf_entry {
+    char *key;
+    int file;                        // a file, rather than a directory
+    int depth;                       // levels to fetch, this one included
+    int queued;                      // in the stack, rather than being fetched
+    struct pf_entry *hnext;          // hash chain
+    struct pf_entry *prev, *next;    // stack, top first
+} pf_entry_t;
+
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;   // stack grew
+static pf_entry_t *pf_table[PREFETCH_HASH_BUCKETS];
+static pf_entry_t *pf_top = NULL, *pf_bottom = NULL;
+static int pf_queued = 0;
+static int pf_depth = 0;
+static int pf_files = 0;
+static s3fs_prefetch_file_fn pf_file_fn = NULL;
+static int pf_stop = 0;
+static int pf_nworkers = 0;
+static pthread_t pf_workers[PREFETCH_MAX_WORKERS];
+
+// The files of a recently opened directory, in listing order.  Direct
+// mapped, like the two tables below: a collision forgets the older one.
+typedef struct {
+    char *dir;
+    char **names;
+    int count;
+    int last;                        // index of the last one opened, or -1
+    int ahead;                       // index of the last one queued
+} pf_listing_t;
+
+// The file opened after key, the last time key was opened
+typedef struct {
+    char *key;
+    char *next;
+} pf_successor_t;
+
+typedef struct {
+    char *key;
+    s3fs_object_info_t info;
+} pf_info_t;
+
+static pf_listing_t pf_listings[PREFETCH_LISTINGS];
+static pf_successor_t pf_successors[PREFETCH_SUCCESSORS];
+static pf_info_t pf_infos[PREFETCH_INFOS];
+static char *pf_last_open = NULL;
+
+
+static unsigned pf_hash(const char *key)
+{
+    unsigned h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % PREFETCH_HASH_BUCKETS;
+}
+
+static unsigned pf_slot(const char *key, unsigned slots)
+{
+    unsigned h = 2166136261u;
+    while (*key) {
+        h = (h ^ (unsigned char) *key++) * 16777619u;
+    }
+    return h % slots;
+}
+
+static pf_entry_t **pf_find(const char *key)
+{
+    pf_entry_t **pp = &pf_table[pf_hash(key)];
+    while (*pp && strcmp((*pp)->key, key) != 0) {
+        pp = &(*pp)->hnext;
+    }
+    return pp;
+}
+
+static void pf_unstack(pf_entry_t *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        pf_top = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        pf_bottom = e->prev;
+    }
+    e->prev = e->next = NULL;
+    e->queued = 0;
+    pf_queued--;
+}
+
+static void pf_free(pf_entry_t *e)
+{
+    pf_entry_t **pp = pf_find(e->key);
+    *pp = e->hnext;
+    free(e->key);
+    free(e);
+}
+
+// Push entry name of dir, a file or a subdirectory to fetch depth levels
+// of.  Called with pf_lock held.
+static void pf_push(const char *dir, const char *name, int file, int depth)
+{
+    size_t size = strlen(dir) + strlen(name) + 2;
+    char *key = malloc(size);
+    if (!key) {
+        return;
+    }
+    snprintf(key, size, "%s/%s", strcmp(dir, "/") ? dir : "", name);
+    pf_entry_t **pp = pf_find(key);
+    pf_entry_t *e = *pp;
+    if (e) {
+        // queued or being fetched already; a queued one moves to the top
+        free(key);
+        if (e->depth < depth) {
+            e->depth = depth;
+        }
+        if (!e->queued) {
+            return;
+        }
+        pf_unstack(e);
+    } else {
+        if (!(e = calloc(1, sizeof(pf_entry_t)))) {
+            free(key);
+            return;
+        }
+        e->key = key;
+        e->file = file;
+        e->depth = depth;
+        *pp = e;
+    }
+    e->next = pf_top;
+    if (pf_top) {
+        pf_top->prev = e;
+    } else {
+        pf_bottom = e;
+    }
+    pf_top = e;
+    e->queued = 1;
+    pf_queued++;
+    if (pf_queued > PREFETCH_MAX_QUEUED) {
+        pf_entry_t *old = pf_bottom;
+        pf_unstack(old);
+        pf_free(old);
+    }
+    pthread_cond_signal(&pf_cond);
+}
+
+static void listing_clear(pf_listing_t *l)
+{
+    int i;
+    for (i = 0; i < l->count; i++) {
+        free(l->names[i]);
+    }
+    free(l->names);
+    free(l->dir);
+    memset(l, 0, sizeof(*l));
+}
+
+// Remember the order of the files among the n entries of dir.  Called
+// with pf_lock held.
+static void listing_note(const char *dir, const s3dirent_t *dirs, ssize_t n)
+{
+    pf_listing_t *l = &pf_listings[pf_slot(dir, PREFETCH_LISTINGS)];
+    if (l->dir && strcmp(l->dir, dir) == 0 && l->count > 0) {
+        // listed again while being read: keep the position if it still
+        // matches
+        ssize_t i, files = 0;
+        for (i = 1; i < n; i++) {
+            files += dirs[i].type == 'F';
+        }
+        if (files == l->count) {
+            return;
+        }
+    }
+    listing_clear(l);
+    l->last = l->ahead = -1;
+    if (!(l->dir = strdup(dir)) || !(l->names = malloc(n * sizeof(char *)))) {
+        listing_clear(l);
+        return;
+    }
+    ssize_t i;
+    for (i = 1; i < n; i++) {
+        if (dirs[i].type == 'F') {
+            if (!(l->names[l->count] = strdup(dirs[i].name))) {
+                listing_clear(l);
+                return;
+            }
+            l->count++;
+        }
+    }
+}
+
+// Queue the subdirectories among the n entries of dir.  Called with
+// pf_lock held.
+static void pf_push_children(const char *dir, const s3dirent_t *dirs, ssize_t n,
+                             int depth)
+{
+    // backwards, so that the first is fetched first
+    ssize_t i;
+    for (i = n - 1; i >= 1; i--) {
+        if (dirs[i].type == 'D') {
+            pf_push(dir, dirs[i].name, 0, depth);
+        }
+    }
+}
+
+static void *pf_worker(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&pf_lock);
+    for (;;) {
+        while (!pf_stop && !pf_top) {
+            pthread_cond_wait(&pf_cond, &pf_lock);
+        }
+        if (pf_stop) {
+            break;
+        }
+        pf_entry_t *e = pf_top;
+        pf_unstack(e);
+        pthread_mutex_unlock(&pf_lock);
+
+        // reading a directory is enough to cache it
+        s3dirent_t *dirs = NULL;
+        ssize_t n = 0;
+        if (e->file) {
+            pf_file_fn(e->key);
+        } else {
+            n = s3fs_dir_get(e->key, &dirs);
+        }
+
+        pthread_mutex_lock(&pf_lock);
+        if (n > 0 && e->depth > 1 && !pf_stop) {
+            pf_push_children(e->key, dirs, n, e->depth - 1);
+        }
+        free(dirs);
+        pf_free(e);
+    }
+    pthread_mutex_unlock(&pf_lock);
+    return NULL;
+}
+
+
+void s3fs_prefetch_init(int depth, int files, int workers,
+                        s3fs_prefetch_file_fn file_fn)
+{
+    if ((depth <= 0 && files <= 0) || workers <= 0) {
+        return;
+    }
+    pf_depth = depth > 0 ? depth : 0;
+    pf_files = files > 0 && file_fn ? files : 0;
+    pf_file_fn = file_fn;
+    pf_stop = 0;
+    if (workers > PREFETCH_MAX_WORKERS) {
+        workers = PREFETCH_MAX_WORKERS;
+    }
+    while (pf_nworkers < workers &&
+           pthread_create(&pf_workers[pf_nworkers], NULL, pf_worker, NULL) == 0) {
+        pf_nworkers++;
+    }
+}
+
+void s3fs_prefetch_destroy(void)
+{
+    pthread_mutex_lock(&pf_lock);
+    pf_stop = 1;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+    while (pf_nworkers > 0) {
+        pthread_join(pf_workers[--pf_nworkers], NULL);
+    }
+    while (pf_top) {
+        pf_entry_t *e = pf_top;
+        pf_unstack(e);
+        pf_free(e);
+    }
+    int i;
+    for (i = 0; i < PREFETCH_LISTINGS; i++) {
+        listing_clear(&pf_listings[i]);
+    }
+    for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+        free(pf_successors[i].key);
+        free(pf_successors[i].next);
+        pf_successors[i].key = pf_successors[i].next = NULL;
+    }
+    for (i = 0; i < PREFETCH_INFOS; i++) {
+        free(pf_infos[i].key);
+        pf_infos[i].key = NULL;
+    }
+    free(pf_last_open);
+    pf_last_open = NULL;
+    pf_depth = pf_files = 0;
+}
+
+void s3fs_prefetch_dir(const char *dir, const s3dirent_t *dirs, ssize_t n)
+{
+    pthread_mutex_lock(&pf_lock);
+    if (pf_nworkers > 0 && !pf_stop && pf_depth > 0) {
+        pf_push_children(dir, dirs, n, pf_depth);
+    }
+    if (pf_nworkers > 0 && !pf_stop && pf_files > 0) {
+        listing_note(dir, dirs, n);
+    }
+    pthread_mutex_unlock(&pf_lock);
+}
+
+void s3fs_prefetch_open(const char *key)
+{
+    const char *slash = strrchr(key, '/');
+    if (!slash || pf_files <= 0) {
+        return;
+    }
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", slash == key ? 1 : (int) (slash - key), key);
+    const char *name = slash + 1;
+
+    pthread_mutex_lock(&pf_lock);
+    if (pf_nworkers == 0 || pf_stop) {
+        pthread_mutex_unlock(&pf_lock);
+        return;
+    }
+    // opened in listing order: queue the files after it
+    pf_listing_t *l = &pf_listings[pf_slot(dir, PREFETCH_LISTINGS)];
+    if (l->dir && strcmp(l->dir, dir) == 0) {
+        int i = l->last + 1;
+        if (i >= l->count || strcmp(l->names[i], name) != 0) {
+            for (i = 0; i < l->count && strcmp(l->names[i], name) != 0; i++)
+                ;
+        }
+        if (i < l->count) {
+            if (l->last >= 0 && i == l->last + 1) {
+                int to = i + pf_files < l->count ? i + pf_files : l->count - 1;
+                int from = l->ahead >= i ? l->ahead + 1 : i + 1;
+                // backwards, so that the next one is fetched first
+                int j;
+                for (j = to; j >= from; j--) {
+                    pf_push(dir, l->names[j], 1, 1);
+                }
+                if (to > l->ahead) {
+                    l->ahead = to;
+                }
+            } else {
+                l->ahead = i;
+            }
+            l->last = i;
+        }
+    }
+
+    // and whatever followed it last time, after noting what follows what
+    if (pf_last_open && strcmp(pf_last_open, key) != 0) {
+        pf_successor_t *s = &pf_successors[pf_slot(pf_last_open, PREFETCH_SUCCESSORS)];
+        char *next = strdup(key);
+        if (next) {
+            free(s->key);
+            free(s->next);
+            s->key = pf_last_open;
+            s->next = next;
+            pf_last_open = NULL;
+        }
+    }
+    pf_successor_t *s = &pf_successors[pf_slot(key, PREFETCH_SUCCESSORS)];
+    if (s->key && strcmp(s->key, key) == 0) {
+        const char *next_slash = strrchr(s->next, '/');
+        char next_dir[PATH_MAX];
+        snprintf(next_dir, sizeof(next_dir), "%.*s",
+                 next_slash == s->next ? 1 : (int) (next_slash - s->next), s->next);
+        pf_push(next_dir, next_slash + 1, 1, 1);
+    }
+    free(pf_last_open);
+    pf_last_open = strdup(key);
+    pthread_mutex_unlock(&pf_lock);
+}
+
+void s3fs_prefetch_keep_info(const char *key, const s3fs_object_info_t *info)
+{
+    pthread_mutex_lock(&pf_lock);
+    pf_info_t *p = &pf_infos[pf_slot(key, PREFETCH_INFOS)];
+    if (!p->key || strcmp(p->key, key) != 0) {
+        free(p->key);
+        p->key = strdup(key);
+    }
+    p->info = *info;
+    pthread_mutex_unlock(&pf_lock);
+}
+
+int s3fs_prefetch_take_info(const char *key, s3fs_object_info_t *info)
+{
+    int rv = -1;
+    pthread_mutex_lock(&pf_lock);
+    pf_info_t *p = &pf_infos[pf_slot(key, PREFETCH_INFOS)];
+    if (p->key && strcmp(p->key, key) == 0) {
+        *info = p->info;
+        free(p->key);
+        p->key = NULL;
+        rv = 0;
+    }
+    pthread_mutex_unlock(&pf_lock);
+    return rv;
+}
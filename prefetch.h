@@ -0,0 +1,70 @@
+/*
+ * Subtree prefetch.
+ *
+ * Tree walks (find, du, rsync) open a directory, list it and then go
+ * into each subdirectory in turn, every step waiting for one fetch of a
+ * directory object.  Here opening a directory queues its subdirectories
+ * for a pool of threads, which fetch them into the metadata cache ahead
+ * of the walk, and theirs in turn down to a set depth.  The walk then
+ * finds what it needs cached, at the pace of many requests in flight
+ * rather than one round trip after another.
+ *
+ * Files are prefetched the same way.  Jobs that read a directory of
+ * files in listing order (data shards, assets) wait once per file for
+ * its first bytes.  When consecutive opens in a directory follow the
+ * order of its listing, the next few files are fetched ahead of their
+ * opens.  So is the file that followed this one the last time it was
+ * opened, which catches repeated access sequences that don't follow the
+ * listing.
+ *
+ * The queue is a stack, so what was asked for last (the subdirectories
+ * a depth-first walk needs next, or the next files) is fetched first.
+ * When it is full the oldest requests are dropped.
+ */
+#ifndef __S3FS_PREFETCH_H__
+#define __S3FS_PREFETCH_H__
+
+#include <sys/types.h>
+#include "s3fs.h"
+#include "libs3_wrapper.h"
+
+/*
+ * Fetch the start of the file key ahead of its open, for example into
+ * the data cache.
+ */
+typedef void (*s3fs_prefetch_file_fn)(const char *key);
+
+/*
+ * Prefetch depth levels of subdirectories below each opened directory,
+ * and up to files files ahead of the ones opened, with file_fn.  Up to
+ * workers fetches run at a time.  A depth or files of 0 disables that
+ * kind of prefetching.
+ */
+void s3fs_prefetch_init(int depth, int files, int workers,
+                        s3fs_prefetch_file_fn file_fn);
+
+/*
+ * Stop the prefetch threads, dropping what is still queued.
+ */
+void s3fs_prefetch_destroy(void);
+
+/*
+ * Directory dir, with the n entries dirs (as from s3fs_dir_get), was
+ * opened: queue its subdirectories, and remember the order of its files.
+ */
+void s3fs_prefetch_dir(const char *dir, const s3dirent_t *dirs, ssize_t n);
+
+/*
+ * The file key was opened: queue the files likely to be opened next.
+ */
+void s3fs_prefetch_open(const char *key);
+
+/*
+ * Keep info, the properties of key as fetched by a file_fn, for its open
+ * to take with s3fs_prefetch_take_info.  Returns 0 and fills in *info if
+ * there are some (the caller checks they are still current), or -1.
+ */
+void s3fs_prefetch_keep_info(const char *key, const s3fs_object_info_t *info);
+int s3fs_prefetch_take_info(const char *key, s3fs_object_info_t *info);
+
+#endif // __S3FS_PREFETCH_H__
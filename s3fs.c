@@ -2,16 +2,30 @@
 /* This code is based on the fine code written by Joseph Pfeiffer for his
   fuse system tutorial. */
 
-#include "s3fs.h"
+#include "s3fs_ops.h"
 #include "libs3_wrapper.h"
+#include "cache.h"
+#include "cache_io.h"
+#include "chunk.h"
+#include "compress.h"
+#include "delq.h"
+#include "dirbatch.h"
+#include "dirlock.h"
+#include "journal.h"
+#include "manifest.h"
+#include "metacache.h"
+#include "pack.h"
+#include "prefetch.h"
+#include "segment.h"
+#include "writeback.h"
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,7 +33,45 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 
-#define GET_PRIVATE_DATA ((s3context_t *) fuse_get_context()->private_data)
+#define GET_PRIVATE_DATA (s3fs_context)
+#define GET_FILE(fi) ((s3fs_file_t *) (uintptr_t) (fi)->fh)
+#define GET_WRITEBACK(fi) (GET_FILE(fi)->wb)
+// a small file has no object of its own: it is kept in its directory
+// entry or in a pack
+#define IS_SMALL(ent) ((ent).inlined || (ent).packed)
+
+#define S3FS_IO_WORKERS 4
+#define S3FS_MAX_IO (128 * 1024) // largest single read/write from the kernel
+#define S3FS_RENAME_WORKERS 8     // concurrent copies in a directory rename
+
+// per-open state, in fi->fh
+typedef struct {
+   s3fs_wb_t *wb;            // write-back handle, shared by all opens
+   pthread_mutex_t lock;     // protects the cache descriptors
+   uint64_t cache_gen;       // cached copy that cache_fds[ncache_fds-1] reads
+   int *cache_fds;           // handed to FUSE for zero-copy reads; kept
+   int ncache_fds;           // open until release, as FUSE may still use them
+   off_t size;               // file size at open
+   off_t stored;             // object length at open; the rest is a hole
+} s3fs_file_t;
+
+// set once in main; the low-level interface has no fuse_get_context()
+s3context_t *s3fs_context = NULL;
+
+// largest file that is kept without an object of its own
+static size_t small_max(const s3context_t *ctx) {
+   return ctx->pack_max > ctx->inline_max ? ctx->pack_max : ctx->inline_max;
+}
+
+static void prefetch_file(const char *path);
+
+// Where the metadata cache is saved between mounts
+static void snapshot_path(const s3context_t *ctx, char *path, size_t size) {
+   snprintf(path, size, "%s/meta.snapshot", ctx->cachedir);
+}
+
+static int replay_dir(const char *dir, int del, const s3dirent_t *ent);
+static int replay_data(const char *path, const uint8_t *data, size_t stored, off_t size);
 
 /*
 * For each function below, if you need to return an error,
@@ -42,12 +94,20 @@
 void *fs_init(struct fuse_conn_info *conn)
 {
    fprintf(stderr, "fs_init --- initializing file system.\n");
+   // take large writes in one callback, and let data move by splice
+   if (conn->capable & FUSE_CAP_BIG_WRITES) {
+       conn->want |= FUSE_CAP_BIG_WRITES;
+   }
+   conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                                  FUSE_CAP_SPLICE_MOVE);
+   conn->max_write = S3FS_MAX_IO;
+   conn->max_readahead = S3FS_CACHE_BLOCK;
    s3context_t *ctx = GET_PRIVATE_DATA;
    char* s3bucket = (char*)ctx;
-   s3fs_clear_bucket(s3bucket);
    s3dirent_t root_dir;
+   memset(&root_dir, 0, sizeof(root_dir));
    root_dir.type = 'D';
-   root_dir.name = ".";
+   snprintf(root_dir.name, sizeof(root_dir.name), ".");
    char* key = "/";
 root_dir.protection = S_IFDIR;
 root_dir.type = 'D';
@@ -58,7 +118,49 @@ root_dir.size = 0;
 root_dir.last_access = time(NULL);
 root_dir.mod_time = time(NULL);
 root_dir.status_change = time(NULL);
-   s3fs_put_object(s3bucket, key, (uint8_t*)&root_dir, sizeof(s3dirent_t)); 
+   s3fs_meta_init(ctx->revalidate_secs);
+   if (ctx->cachedir[0]) {
+       char snapshot[PATH_MAX];
+       snapshot_path(ctx, snapshot, sizeof(snapshot));
+       if (ctx->clear_bucket) {
+           unlink(snapshot);
+       } else {
+           s3fs_meta_load(s3bucket, snapshot);
+       }
+   }
+   s3fs_pack_init(s3bucket);
+   s3fs_segment_init(s3bucket, ctx->append_segments);
+   s3fs_dir_init(s3bucket, ctx->dir_commit_ms);
+   int manifest = s3fs_manifest_init(s3bucket, ctx->manifest_secs);
+   // a bucket mounted before keeps its contents; only an empty one needs
+   // a root, and one HEAD (or the manifest) tells which this is
+   s3fs_object_info_t root_info;
+   int root = ctx->clear_bucket ? -ENOENT :
+              manifest ? 0 : s3fs_head_object(s3bucket, key, &root_info);
+   if (root == -ENOENT) {
+       fprintf(stderr, "fs_init --- creating the root directory.\n");
+       s3fs_dir_create(key, &root_dir);
+   } else if (root < 0) {
+       fprintf(stderr, "fs_init --- can't check the root directory; leaving it alone.\n");
+   }
+   s3fs_io_init(S3FS_IO_WORKERS);
+   s3fs_prefetch_init(ctx->prefetch_depth, ctx->prefetch_files,
+                      ctx->prefetch_threads, prefetch_file);
+   if (ctx->cachedir[0]) {
+       if (s3fs_cache_init(ctx->cachedir, ctx->cache_max_bytes) == 0 &&
+           s3fs_wb_init(ctx->cachedir) < 0) {
+           fprintf(stderr, "fs_init --- cache directory name too long for spill files.\n");
+       }
+   }
+   s3fs_delq_init(s3bucket, ctx->cachedir[0] ? ctx->cachedir : NULL);
+   if (ctx->journal && ctx->cachedir[0] && s3fs_journal_init(ctx->cachedir) == 0) {
+       // what an earlier run journaled went with the rest of the bucket
+       if (ctx->clear_bucket) {
+           s3fs_journal_replay(NULL, NULL);
+       } else {
+           s3fs_journal_replay(replay_dir, replay_data);
+       }
+   }
    return ctx;
 }
 
@@ -68,6 +170,34 @@ root_dir.status_change = time(NULL);
 */
 void fs_destroy(void *userdata) {
    fprintf(stderr, "fs_destroy --- shutting down file system.\n");
+   uint64_t hits, misses;
+   s3fs_revalidation_stats(&hits, &misses);
+   fprintf(stderr, "fs_destroy --- revalidations: %llu unchanged, %llu changed\n",
+           (unsigned long long)hits, (unsigned long long)misses);
+   fprintf(stderr, "fs_destroy --- gets sharing a transfer: %llu\n",
+           (unsigned long long)s3fs_shared_get_stats());
+   uint64_t hedged, won;
+   s3fs_hedge_stats(&hedged, &won);
+   fprintf(stderr, "fs_destroy --- hedged requests: %llu, %llu won by the hedge\n",
+           (unsigned long long)hedged, (unsigned long long)won);
+   s3fs_prefetch_destroy();
+   s3fs_segment_destroy();
+   s3fs_pack_destroy();
+   // the last checkpoint of the manifest needs every directory written out
+   s3fs_dir_flush_all();
+   s3fs_manifest_destroy();
+   s3fs_dir_destroy();
+   s3fs_delq_destroy();
+   s3fs_journal_destroy();
+   s3context_t *ctx = userdata;
+   if (ctx->cachedir[0]) {
+       char snapshot[PATH_MAX];
+       snapshot_path(ctx, snapshot, sizeof(snapshot));
+       s3fs_meta_save(ctx->s3bucket, snapshot);
+   }
+   s3fs_meta_destroy();
+   s3fs_cache_destroy();
+   s3fs_io_destroy();
    free(userdata);
 }
 
@@ -81,63 +211,55 @@ void fs_destroy(void *userdata) {
 
 int fs_getattr(const char *path, struct stat *statbuf) {
    fprintf(stderr, "fs_getattr(path=\"%s\")\n", path);
-   s3context_t *ctx = GET_PRIVATE_DATA;
-char* s3bucket = (char*)ctx;
-s3dirent_t* dirs = NULL;
-s3dirent_t* more_dirs = NULL;
-   ssize_t size = s3fs_get_object(s3bucket, path, (uint8_t**)&dirs, 0, 0);
-   if (size<0) {
-       printf("This object does not exist\n");
-free(dirs);
-return -ENOENT;
-}
 char* copy_path_1 = strdup(path);
 char* copy_path_2 = strdup(path);
 char* directory = dirname(copy_path_1);
 char* base = basename(copy_path_2);
-   size = s3fs_get_object(s3bucket, directory, (uint8_t**)&more_dirs, 0, 0);
-if (size < 0) {
-free(dirs);
-free(copy_path_1);
-free(copy_path_2);
-free(more_dirs);
-return -EIO;
-}
-int entries = size/sizeof(s3dirent_t);
-printf("ENTRIES = %d\n", entries);
-int i=0;
-for(;i<entries;i++) {
-if ( strcasecmp(more_dirs[i].name, base) == 0) {
-if (more_dirs[i].type == 'F') {
-printf("found the file! & doing stat for file!\n");
-statbuf->st_mode = more_dirs[i].protection;
-statbuf->st_uid = more_dirs[i].user_id;
-   	 statbuf->st_nlink = more_dirs[i].hard_links;
-statbuf->st_size = more_dirs[i].size;
-statbuf->st_atime = more_dirs[i].last_access;
-statbuf->st_mtime = more_dirs[i].mod_time;
-statbuf->st_ctime = more_dirs[i].status_change;
+   int rv = fs_getattr_child(directory, base, path, statbuf);
 free(copy_path_1);
 free(copy_path_2);
-free(more_dirs);
-free(dirs);
-return 0;
+   return rv;
 }
-}	
-}
-printf("doing stat for a directory!\n");
-statbuf->st_mode = dirs[0].protection;
-statbuf->st_uid = dirs[0].user_id;
-   statbuf->st_nlink = dirs[0].hard_links;
-statbuf->st_size = dirs[0].size;
-statbuf->st_atime = dirs[0].last_access;
-statbuf->st_mtime = dirs[0].mod_time;
-statbuf->st_ctime = dirs[0].status_change;
-free(dirs);
-free(copy_path_1);
-free(copy_path_2);
-free(more_dirs);
-return 0;
+
+/*
+* Get file attributes for path, which is entry base of directory.
+* Callers that already know the parent and name (the low-level
+* interface) come straight here.
+*/
+int fs_getattr_child(const char *directory, const char *base, const char *path,
+                     struct stat *statbuf) {
+   s3dirent_t ent;
+   // files are described by their parent's entry, so their data is never
+   // fetched just to stat them
+   s3fs_dirlock_read(directory);
+   int rv = s3fs_dir_lookup(directory, base, &ent);
+   s3fs_dirunlock_read(directory);
+   if (rv == -EIO || (rv == -ENOENT && strcmp(path, "/") != 0)) {
+       return -ENOENT;
+   }
+   if (rv < 0 || ent.type != 'F') {
+       // a directory is described by the "." entry of its own object
+       s3fs_dirlock_read(path);
+       rv = s3fs_dir_lookup(path, ".", &ent);
+       s3fs_dirunlock_read(path);
+       if (rv < 0) {
+           printf("This object does not exist\n");
+           return -ENOENT;
+       }
+   }
+   statbuf->st_mode = ent.protection;
+   statbuf->st_uid = ent.user_id;
+   statbuf->st_nlink = ent.hard_links;
+   statbuf->st_size = ent.size;
+   statbuf->st_atime = ent.last_access;
+   statbuf->st_mtime = ent.mod_time;
+   statbuf->st_ctime = ent.status_change;
+   // an open file may have unflushed changes to its size
+   off_t staged;
+   if (ent.type == 'F' && s3fs_wb_staged_size(path, &staged) == 0) {
+       statbuf->st_size = staged;
+   }
+   return 0;
 }
 
 
@@ -149,15 +271,14 @@ return 0;
 */
 int fs_opendir(const char *path, struct fuse_file_info *fi) {
    fprintf(stderr, "fs_opendir(path=\"%s\")\n", path);
-   s3context_t *ctx = GET_PRIVATE_DATA;
-   char* s3bucket = (char*)ctx;
 s3dirent_t* dirs = NULL;
-   ssize_t size = s3fs_get_object(s3bucket, path, (uint8_t**)&dirs, 0, 0);
-   if (size>=0){
+   ssize_t entries = s3fs_dir_get(path, &dirs);
+   if (entries>=0){
+       // a walk of the tree will want the subdirectories next
+       s3fs_prefetch_dir(path, dirs, entries);
 free(dirs);
 return 0;
 }
-free(dirs);
 return -EIO;
 }
 
@@ -171,11 +292,13 @@ int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
 {
    fprintf(stderr, "fs_readdir(path=\"%s\", buf=%p, offset=%d)\n",
          path, buf, (int)offset);
-   s3context_t *ctx = GET_PRIVATE_DATA;
-   char* s3bucket = (char*)ctx;
 s3dirent_t* dirs_to_read = NULL;
-   ssize_t size = s3fs_get_object(s3bucket, path, (uint8_t**)&dirs_to_read, 0, 0);
-int entries = size/sizeof(s3dirent_t);
+   s3fs_dirlock_read(path);
+   ssize_t entries = s3fs_dir_get(path, &dirs_to_read);
+   s3fs_dirunlock_read(path);
+if (entries < 0) {
+return -EIO;
+}
 int i=0;
 for (;i<entries;i++) {
 if (filler(buf,dirs_to_read[i].name,NULL,0) != 0) {
@@ -197,6 +320,20 @@ int fs_releasedir(const char *path, struct fuse_file_info *fi) {
 }
 
 
+/*
+* Synchronize directory contents: write out changes to the directory
+* that are still queued.
+*/
+int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+   fprintf(stderr, "fs_fsyncdir(path=\"%s\")\n", path);
+   // journaled changes are as good as written out
+   if (s3fs_journal_enabled() && s3fs_journal_sync(s3fs_journal_seq()) == 0) {
+       return 0;
+   }
+   return s3fs_dir_flush(path) < 0 ? -EIO : 0;
+}
+
+
 /* 
 * Create a new directory.
 *
@@ -205,117 +342,95 @@ int fs_releasedir(const char *path, struct fuse_file_info *fi) {
 * correct directory type bits (for setting in the metadata)
 * use mode|S_IFDIR.
 */
-int fs_mkdir(const char *path, mode_t mode) {
+static int mkdir_locked(const char *path, mode_t mode) {
    fprintf(stderr, "fs_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
-   s3context_t *ctx = GET_PRIVATE_DATA;
-   char* s3bucket = (char*)ctx;
    mode |= S_IFDIR;
-s3dirent_t* init_dirs = NULL;
-// check if the directory already exists
-   ssize_t size = s3fs_get_object(s3bucket, path, (uint8_t**)&init_dirs, 0, 0);
-if (size >= 0) {
+   char* copy_path_1 = strdup(path);
+   char* copy_path_2 = strdup(path);
+   char* directory = dirname(copy_path_1);
+   char* base = basename(copy_path_2);
+   // check if the directory already exists
+   s3dirent_t new_dir_obj;
+   int rv = s3fs_dir_lookup(directory, base, &new_dir_obj);
+   if (rv == 0) {
        printf("This Directory Already Exists!\n");
-free(init_dirs);
-return -EIO;
-}
-// put a new object
-s3dirent_t new_dir_obj;
-new_dir_obj.name = ".";
-new_dir_obj.type = 'D';
-new_dir_obj.protection = mode;
-new_dir_obj.user_id = getuid();
-new_dir_obj.group_id = getgid();
-new_dir_obj.hard_links = 0;
-new_dir_obj.size = 0;
-new_dir_obj.last_access = time(NULL);
-new_dir_obj.mod_time = time(NULL);
-new_dir_obj.status_change = time(NULL);
-   s3fs_put_object(s3bucket, path, (uint8_t*)&new_dir_obj, sizeof(s3dirent_t) );
-// add to end of directory
-printf("JUST ADDED NEW OBJECT WITH KEY %s\n", path);
-s3dirent_t* dirs = NULL;
-char* copy_path_1 = strdup(path);
-char* copy_path_2 = strdup(path);
-char* directory = dirname(copy_path_1);
-printf("DIRECTORY = %s\n", directory);
-char* base = basename(copy_path_2);
-printf("BASE = %s\n", base);
-   size = s3fs_get_object(s3bucket, directory, (uint8_t**)&dirs, 0, 0);
-if (size < 0) {
-free(init_dirs);
-free(copy_path_1);
-free(copy_path_2);
-free(dirs);
-return -EIO;
+       rv = -EEXIST;
+   } else if (rv == -ENOENT) {
+       // put a new object
+       memset(&new_dir_obj, 0, sizeof(new_dir_obj));
+       snprintf(new_dir_obj.name, sizeof(new_dir_obj.name), ".");
+       new_dir_obj.type = 'D';
+       new_dir_obj.protection = mode;
+       new_dir_obj.user_id = getuid();
+       new_dir_obj.group_id = getgid();
+       new_dir_obj.hard_links = 0;
+       new_dir_obj.size = 0;
+       new_dir_obj.last_access = time(NULL);
+       new_dir_obj.mod_time = time(NULL);
+       new_dir_obj.status_change = time(NULL);
+       s3fs_delq_cancel(path);
+       if (s3fs_dir_create(path, &new_dir_obj) < 0) {
+           rv = -EIO;
+       } else {
+           // add to the parent directory
+           snprintf(new_dir_obj.name, sizeof(new_dir_obj.name), "%s", base);
+           rv = s3fs_dir_put(directory, &new_dir_obj);
+       }
+   }
+   free(copy_path_1);
+   free(copy_path_2);
+   return rv;
 }
-int entries = size/sizeof(s3dirent_t);
-printf("NEW ENTRIES mkdir %d\n", entries);
-s3dirent_t new_dirent;
-new_dirent.name = base;
-s3dirent_t new_arr[entries+1];
-int i=0;
-for(;i<entries;i++) {
-printf("ADDING TO NEW ARR %s at %d\n", dirs[i].name, i);
-new_arr[i] = dirs[i];
-}
-new_arr[i] = new_dirent;
-printf("ADDING TO NEW ARR %s at %d\n", new_dirent.name, i);
-s3fs_put_object(s3bucket, directory, (uint8_t*)&new_arr, sizeof(s3dirent_t)*(entries+1));
-//missing frees
-free(init_dirs);
-   return 0;
+
+int fs_mkdir(const char *path, mode_t mode) {
+   char* copy_path = strdup(path);
+   char* directory = dirname(copy_path);
+   s3fs_dirlock_write(directory);
+   int rv = mkdir_locked(path, mode);
+   s3fs_dirunlock_write(directory);
+   free(copy_path);
+   return rv;
 }
 
 
 /*
 * Remove a directory. 
 */
-int fs_rmdir(const char *path) {
+static int rmdir_locked(const char *path) {
    fprintf(stderr, "fs_rmdir(path=\"%s\")\n", path);
-   s3context_t *ctx = GET_PRIVATE_DATA;
-   char* s3bucket = (char*)ctx;
-s3dirent_t* dirs_r = NULL;
-   ssize_t s = s3fs_get_object(s3bucket, path, (uint8_t**)&dirs_r, 0, 0);
-if (s<0) {
-free(dirs_r);
-return -EIO; // directory does not exist
-}
-int e = s/sizeof(s3dirent_t);
-if (e>1)
-{
-free(dirs_r);
-return -EIO; // there is more than one thing in this 
-}
-char* cpy_path_1 = strdup(path);
-char* cpy_path_2 = strdup(path);
-char* d = dirname(cpy_path_1);
-char* b = basename(cpy_path_2);
-s3dirent_t* dirs_rem = NULL;
-   ssize_t size = s3fs_get_object(s3bucket, d, (uint8_t**)&dirs_rem, 0, 0);
-if (size<0) {
-free(dirs_r);
-return -EIO; // directory does not exist
-}
-int entries = size/sizeof(s3dirent_t);
-printf("NUM ENTRIES IN REMOVE IS %d\n", entries);
-s3dirent_t arr[entries-1];
-int i=0;
-int k=0;
-for (;i<entries;i++) {
-       printf("NAME? in remove %s\n", dirs_rem[i].name);
-printf("base name is %s\n", b);
-if (strcasecmp(dirs_rem[i].name,b) != 0) {
-printf("NOT THE SAME!\n");
-arr[k] = dirs_rem[i];
-k++;
-}
-}
-printf("ADDING TO NEW ARR IN REM\n");
-s3fs_put_object(s3bucket, d, (uint8_t*)&arr, ((sizeof(s3dirent_t))*(entries-1)));
-printf("REMOVING OBJECT (PATH) %s\n", path);
-s3fs_remove_object(s3bucket, path);
-free(dirs_r);	
-return 0;
+   s3dirent_t* dirs_r = NULL;
+   ssize_t e = s3fs_dir_get(path, &dirs_r);
+   free(dirs_r);
+   if (e < 0) {
+       return -ENOENT; // directory does not exist
+   }
+   if (e > 1) {
+       return -ENOTEMPTY; // there is more than "." in it
+   }
+   char* cpy_path_1 = strdup(path);
+   char* cpy_path_2 = strdup(path);
+   char* d = dirname(cpy_path_1);
+   char* b = basename(cpy_path_2);
+   int rv = s3fs_dir_del(d, b);
+   if (rv == 0) {
+       printf("REMOVING OBJECT (PATH) %s\n", path);
+       s3fs_dir_forget(path);
+       s3fs_meta_invalidate(path);
+       s3fs_delq_add(path);
+   }
+   free(cpy_path_1);
+   free(cpy_path_2);
+   return rv;
+}
+
+int fs_rmdir(const char *path) {
+   char* copy_path = strdup(path);
+   char* directory = dirname(copy_path);
+   s3fs_dirlock_write2(directory, path);
+   int rv = rmdir_locked(path);
+   s3fs_dirunlock_write2(directory, path);
+   free(copy_path);
+   return rv;
 }
 
 
@@ -331,60 +446,113 @@ return 0;
 * nodes.  You *only* need to handle creation of regular
 * files here.  (See the man page for mknod (2).)
 */
-int fs_mknod(const char *path, mode_t mode, dev_t dev) {
+static int mknod_locked(const char *path, mode_t mode, dev_t dev) {
    fprintf(stderr, "fs_mknod(path=\"%s\", mode=0%3o)\n", path, mode);
    s3context_t *ctx = GET_PRIVATE_DATA;
    char* s3bucket = (char*)ctx;
-s3dirent_t* dirs = NULL;
-ssize_t size = s3fs_get_object(s3bucket, path, (uint8_t**)&dirs, 0, 0);
-if (size >= 0) {
+   char* copy_path_1 = strdup(path);
+   char* copy_path_2 = strdup(path);
+   char* directory = dirname(copy_path_1);
+   char* base = basename(copy_path_2);
+   s3dirent_t file_obj;
+   int rv = s3fs_dir_lookup(directory, base, &file_obj);
+   if (rv == 0) {
        printf("This File Already Exists!\n");
-return -EIO;
-}
-char* copy_path_1 = strdup(path);
-char* copy_path_2 = strdup(path);
-char* directory = dirname(copy_path_1);
-printf("DIRECTORY = %s\n", directory);
-char* base = basename(copy_path_2);
-printf("BASE = %s\n", base);
-// PUT a new file object containing empty content
-FILE* f = fopen(base,"a+");
-   if ( s3fs_put_object(s3bucket, path, (uint8_t*)f, sizeof(f) ) < 0 ) {
-return -EIO;
+       rv = -EEXIST;
+   } else if (rv == -ENOENT) {
+       // PUT a new file object containing empty content, unless small
+       // files are kept elsewhere
+       int small = small_max(ctx) > 0;
+       s3fs_cache_invalidate(path);
+       s3fs_meta_invalidate(path);
+       if (!small) {
+           s3fs_delq_cancel(path);
+       }
+       if (!small && s3fs_put_object(s3bucket, path, NULL, 0) < 0) {
+           rv = -EIO;
+       } else {
+           // add to the parent directory
+           memset(&file_obj, 0, sizeof(file_obj));
+           snprintf(file_obj.name, sizeof(file_obj.name), "%s", base);
+           file_obj.type = 'F';
+           file_obj.protection = mode;
+           file_obj.user_id = getuid();
+           file_obj.group_id = getgid();
+           file_obj.hard_links = 0;
+           file_obj.size = 0;
+           file_obj.last_access = time(0);
+           file_obj.mod_time = time(0);
+           file_obj.status_change = time(0);
+           file_obj.inlined = small; // empty, so it fits in the entry
+           rv = s3fs_dir_put(directory, &file_obj);
+       }
+   }
+   free(copy_path_1);
+   free(copy_path_2);
+   return rv;
 }
-printf("JUST ADDED NEW FILE OBJECT WITH KEY %s\n", path);
-// add to end of directory
-   size = s3fs_get_object(s3bucket, directory, (uint8_t**)&dirs, 0, 0);
-if (size < 0) {
-return -EIO;
+
+int fs_mknod(const char *path, mode_t mode, dev_t dev) {
+   char* copy_path = strdup(path);
+   char* directory = dirname(copy_path);
+   s3fs_dirlock_write(directory);
+   int rv = mknod_locked(path, mode, dev);
+   s3fs_dirunlock_write(directory);
+   free(copy_path);
+   return rv;
 }
-int entries = size/sizeof(s3dirent_t);
-printf("NUM ENTRIES mknod %d\n", entries);
-s3dirent_t file_obj;
-file_obj.name = base;
-file_obj.type = 'F';
-file_obj.protection = mode;
-file_obj.user_id = getuid();
-file_obj.group_id = getgid();
-file_obj.hard_links = 0;
-file_obj.size = sizeof(f);
-file_obj.last_access = time(0);
-file_obj.mod_time = time(0);
-file_obj.status_change = time(0);
-
-s3dirent_t new_arr[entries+1];
-int i=0;
-for(;i<entries;i++) {
-printf("ADDING TO NEW ARR %s at %d\n", dirs[i].name, i);
-new_arr[i] = dirs[i];
+
+
+/*
+* Look up the entry for path in its parent directory.  Returns 0, or
+* -ENOENT.
+*/
+static int get_entry(const char *path, s3dirent_t *ent) {
+   char* copy_path_1 = strdup(path);
+   char* copy_path_2 = strdup(path);
+   char* directory = dirname(copy_path_1);
+   char* base = basename(copy_path_2);
+   s3fs_dirlock_read(directory);
+   int rv = s3fs_dir_lookup(directory, base, ent);
+   s3fs_dirunlock_read(directory);
+   free(copy_path_1);
+   free(copy_path_2);
+   return rv < 0 ? -ENOENT : 0;
 }
-new_arr[i] = file_obj;
-printf("ADDING TO NEW NEW ARR %s at %d\n", file_obj.name, i);
-s3fs_put_object(s3bucket, directory, (uint8_t*)&new_arr, sizeof(s3dirent_t)*(entries+1));
-   return 0;
+
+
+/*
+* Stage the contents of the small file described by ent in wb.
+*/
+static int stage_small(s3fs_wb_t *wb, const s3dirent_t *ent) {
+   if (ent->inlined) {
+       return s3fs_wb_stage_small(wb, ent->data, ent->inline_len);
+   }
+   uint8_t *data = NULL;
+   if (s3fs_pack_read(ent->pack_id, ent->pack_offset, ent->size, &data) < 0) {
+       return -EIO;
+   }
+   int rv = s3fs_wb_stage_small(wb, data, ent->size);
+   free(data);
+   return rv;
 }
 
 
+/*
+* Use the properties of path that prefetch_file fetched ahead of this open,
+* if they are still current: every change to the file drops its cached
+* copy, so they are as long as that copy has their ETag and was checked
+* recently.  Returns 1 if *info was filled in so.
+*/
+static int prefetched_info(s3context_t *ctx, const char *path, s3fs_object_info_t *info) {
+   char etag[S3FS_ETAG_MAX];
+   time_t checked;
+   return s3fs_prefetch_take_info(path, info) == 0 &&
+          s3fs_cache_etag(path, etag, sizeof(etag), &checked) &&
+          strcmp(etag, info->etag) == 0 &&
+          time(NULL) - checked < ctx->revalidate_secs;
+}
+
 /* 
 * File open operation
 * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
@@ -401,15 +569,139 @@ int fs_open(const char *path, struct fuse_file_info *fi) {
    fprintf(stderr, "fs_open(path\"%s\")\n", path);
    s3context_t *ctx = GET_PRIVATE_DATA;
    char* s3bucket = (char*)ctx;
-s3dirent_t* f_dirs = NULL;
-   ssize_t size = s3fs_get_object(s3bucket, path, (uint8_t**)&f_dirs, 0, 0);
-   if (size>=0){
-return 0;
-}
+   s3fs_object_info_t info;
+   struct stat st;
+   s3dirent_t ent;
+   if (get_entry(path, &ent) < 0) {
+       return -EIO;
+   }
+   // a small file has no object to look at
+   int small = ent.type == 'F' && IS_SMALL(ent);
+   if (!small && ((!prefetched_info(ctx, path, &info) &&
+                   s3fs_head_object(s3bucket, path, &info) < 0) ||
+                  fs_getattr(path, &st) < 0)) {
 return -EIO;    
 }
+   s3fs_file_t *f = calloc(1, sizeof(s3fs_file_t));
+   if (!f) {
+       return -ENOMEM;
+   }
+   f->size = small ? ent.size : st.st_size;
+   f->stored = small ? ent.size : info.content_length;
+   f->wb = s3fs_wb_open(path, f->size, f->stored);
+   if (!f->wb) {
+       free(f);
+       return -ENOMEM;
+   }
+   if (small && stage_small(f->wb, &ent) < 0) {
+       s3fs_wb_release(f->wb);
+       free(f);
+       return -EIO;
+   }
+   pthread_mutex_init(&f->lock, NULL);
+   fi->fh = (uintptr_t)f;
+   // pages the kernel cached at the last open are still good if the
+   // object hasn't changed since
+   fi->keep_cache = small ? 0 : s3fs_meta_note_open(path, &info);
+   s3fs_prefetch_open(path);
+   return 0;
+}
 
 
+/*
+* Make sure the cache can serve size bytes at offset of path, fetching
+* whole cache blocks if not.  Returns S3FS_NOT_MODIFIED if the cached copy
+* is current (force skips that check), otherwise the number of bytes
+* fetched into *data, starting at *start, or -EIO.
+*/
+static ssize_t fetch_range(s3context_t *ctx, const char *path, size_t size,
+                           off_t offset, int force, uint8_t **data, off_t *start) {
+   char* s3bucket = (char*)ctx;
+   // fetch whole cache blocks so the cache can keep them
+   *start = offset;
+   size_t count = size;
+   if (s3fs_cache_enabled()) {
+       *start = offset - (offset % S3FS_CACHE_BLOCK);
+       off_t end = offset + size;
+       end = ((end + S3FS_CACHE_BLOCK - 1) / S3FS_CACHE_BLOCK) * S3FS_CACHE_BLOCK;
+       count = end - *start;
+   }
+   s3fs_object_info_t info;
+   ssize_t got;
+   char etag[S3FS_ETAG_MAX];
+   time_t checked;
+   if (!force && s3fs_cache_etag(path, etag, sizeof(etag), &checked)) {
+       got = S3FS_NOT_MODIFIED;
+       if (time(NULL) - checked >= ctx->revalidate_secs) {
+           // an unchanged object costs a 304 with no data
+           got = s3fs_get_object_if_changed(s3bucket, path, data, *start, count, etag, &info);
+           if (got == S3FS_NOT_MODIFIED) {
+               s3fs_cache_validated(path, etag);
+           }
+       }
+       if (got == S3FS_NOT_MODIFIED) {
+           return got;
+       }
+   } else {
+       got = s3fs_get_object_info(s3bucket, path, data, *start, count, &info);
+   }
+   if (got < 0) {
+       printf("This path does not exist!\n");
+       return -EIO;
+   }
+   if (s3fs_cache_enabled()) {
+       s3fs_cache_fill(path, info.etag, *data, got, *start, (size_t)got < count);
+   }
+   return got;
+}
+
+/*
+* Fetch the first cache block of path ahead of its open (see prefetch.h),
+* and keep its properties for fs_open to use.
+*/
+static void prefetch_file(const char *path) {
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   char* s3bucket = (char*)ctx;
+   s3fs_object_info_t info;
+   s3dirent_t ent;
+   if (!s3fs_cache_enabled() || get_entry(path, &ent) < 0 || ent.type != 'F' ||
+       IS_SMALL(ent) || s3fs_head_object(s3bucket, path, &info) < 0) {
+       return;
+   }
+   if (info.content_length > 0) {
+       uint8_t* data = NULL;
+       off_t start;
+       size_t size = info.content_length < S3FS_CACHE_BLOCK ?
+                     info.content_length : S3FS_CACHE_BLOCK;
+       ssize_t got = fetch_range(ctx, path, size, 0, 0, &data, &start);
+       free(data);
+       if (got < 0 && got != S3FS_NOT_MODIFIED) {
+           return;
+       }
+   }
+   s3fs_prefetch_keep_info(path, &info);
+}
+
+/*
+* A file can extend past the end of its object (see fs_truncate), and that
+* hole reads as zeros.  Split a read of size bytes at offset into the part
+* that is stored in the object and the part of the hole after it.
+*/
+static void split_hole(const s3fs_file_t *f, size_t size, off_t offset,
+                       size_t *stored, size_t *zeros) {
+   off_t end = offset + size;
+   *stored = size;
+   *zeros = 0;
+   if (!f || end <= f->stored) {
+       return;
+   }
+   *stored = offset < f->stored ? f->stored - offset : 0;
+   off_t hole_end = end < f->size ? end : f->size;
+   if (hole_end > offset + (off_t)*stored) {
+       *zeros = hole_end - (offset + *stored);
+   }
+}
+
 /* 
 * Read data from an open file
 *
@@ -421,14 +713,170 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
    fprintf(stderr, "fs_read(path=\"%s\", buf=%p, size=%d, offset=%d)\n",
          path, buf, (int)size, (int)offset);
    s3context_t *ctx = GET_PRIVATE_DATA;
-   char* s3bucket = (char*)ctx;
-s3dirent_t* read_f_dirs = NULL;
-ssize_t size_obj = s3fs_get_object(s3bucket, path, (uint8_t**)&buf, offset, size);
-if (size_obj<0){
-return -EIO;
-printf("This path does not exist!");
+   // unflushed writes live in the write-back spill file
+   ssize_t n = fi->fh ? s3fs_wb_read(GET_WRITEBACK(fi), buf, size, offset) : -1;
+   if (n >= 0) {
+       return n;
+   }
+   size_t zeros;
+   split_hole(fi->fh ? GET_FILE(fi) : NULL, size, offset, &size, &zeros);
+   memset(buf + size, 0, zeros);
+   if (size == 0) {
+       return zeros;
+   }
+   uint8_t* data = NULL;
+   off_t start;
+   ssize_t got = fetch_range(ctx, path, size, offset, 0, &data, &start);
+   if (got == S3FS_NOT_MODIFIED) {
+       n = s3fs_cache_read(path, (uint8_t*)buf, size, offset);
+       if (n >= 0) {
+           return (size_t)n == size ? n + zeros : n;
+       }
+       got = fetch_range(ctx, path, size, offset, 1, &data, &start);
+   }
+   if (got < 0) {
+       return -EIO;
+   }
+   n = 0;
+   if (got > offset - start) {
+       n = got - (offset - start);
+       if ((size_t)n > size) {
+           n = size;
+       }
+       memcpy(buf, data + (offset - start), n);
+   }
+   free(data);
+   return (size_t)n == size ? n + zeros : n;
 }
-return 0;
+
+/*
+* Point *bufp at size bytes at offset of the cached copy of path, without
+* copying them.  Returns 0 on success and -1 on a cache miss.
+*/
+static int cache_read_buf(s3fs_file_t *f, const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset) {
+   size_t len;
+   int fd = -1;
+   pthread_mutex_lock(&f->lock);
+   uint64_t gen = f->cache_gen;
+   int rv = s3fs_cache_read_fd(path, size, offset, &gen, &fd, &len);
+   if (rv == 0 && gen != f->cache_gen) {
+       int *fds = realloc(f->cache_fds, (f->ncache_fds + 1) * sizeof(int));
+       if (!fds) {
+           close(fd);
+           rv = -1;
+       } else {
+           f->cache_fds = fds;
+           f->cache_fds[f->ncache_fds++] = fd;
+           f->cache_gen = gen;
+       }
+   }
+   if (rv == 0) {
+       fd = f->cache_fds[f->ncache_fds - 1];
+   }
+   pthread_mutex_unlock(&f->lock);
+   if (rv < 0) {
+       return -1;
+   }
+   struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+   if (!bv) {
+       return -1;
+   }
+   *bv = FUSE_BUFVEC_INIT(len);
+   bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+   bv->buf[0].fd = fd;
+   bv->buf[0].pos = offset;
+   *bufp = bv;
+   return 0;
+}
+
+/*
+* Read data from an open file without copying it: staged and cached data
+* are handed to FUSE as file descriptors, so they can be spliced straight
+* into the kernel.
+*/
+int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                struct fuse_file_info *fi) {
+   fprintf(stderr, "fs_read_buf(path=\"%s\", size=%d, offset=%d)\n",
+         path, (int)size, (int)offset);
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   s3fs_file_t *f = GET_FILE(fi);
+   struct fuse_bufvec *bv;
+   // unflushed writes live in the write-back spill file
+   int fd;
+   ssize_t n = s3fs_wb_read_fd(f->wb, size, offset, &fd);
+   if (n >= 0) {
+       bv = malloc(sizeof(struct fuse_bufvec));
+       if (!bv) {
+           return -ENOMEM;
+       }
+       *bv = FUSE_BUFVEC_INIT(n);
+       bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+       bv->buf[0].fd = fd;
+       bv->buf[0].pos = offset;
+       *bufp = bv;
+       return 0;
+   }
+   size_t stored, zeros;
+   split_hole(f, size, offset, &stored, &zeros);
+   if (zeros) {
+       // holes are rare enough to take the copying path
+       char *hole = malloc(size);
+       if (!hole) {
+           return -ENOMEM;
+       }
+       int rv = fs_read(path, hole, size, offset, fi);
+       if (rv < 0) {
+           free(hole);
+           return rv;
+       }
+       bv = malloc(sizeof(struct fuse_bufvec));
+       if (!bv) {
+           free(hole);
+           return -ENOMEM;
+       }
+       *bv = FUSE_BUFVEC_INIT(rv);
+       bv->buf[0].mem = hole;
+       *bufp = bv;
+       return 0;
+   }
+   uint8_t* data = NULL;
+   off_t start;
+   ssize_t got = fetch_range(ctx, path, size, offset, 0, &data, &start);
+   if (got == S3FS_NOT_MODIFIED) {
+       if (cache_read_buf(f, path, bufp, size, offset) == 0) {
+           return 0;
+       }
+       got = fetch_range(ctx, path, size, offset, 1, &data, &start);
+   }
+   if (got < 0) {
+       return -EIO;
+   }
+   // freshly fetched blocks are now in the cache (and the page cache)
+   if (s3fs_cache_enabled() && cache_read_buf(f, path, bufp, size, offset) == 0) {
+       free(data);
+       return 0;
+   }
+   n = 0;
+   if (got > offset - start) {
+       n = got - (offset - start);
+       if ((size_t)n > size) {
+           n = size;
+       }
+       if (offset > start) {
+           memmove(data, data + (offset - start), n);
+       }
+   }
+   bv = malloc(sizeof(struct fuse_bufvec));
+   if (!bv) {
+       free(data);
+       return -ENOMEM;
+   }
+   // FUSE frees a memory buffer when it is done with it
+   *bv = FUSE_BUFVEC_INIT(n);
+   bv->buf[0].mem = data;
+   *bufp = bv;
+   return 0;
 }
 
 
@@ -442,14 +890,108 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset, struc
    fprintf(stderr, "fs_write(path=\"%s\", buf=%p, size=%d, offset=%d)\n",
          path, buf, (int)size, (int)offset);
    s3context_t *ctx = GET_PRIVATE_DATA;
-char* s3bucket = (char*)ctx;
-FILE* f = NULL;
-ssize_t size_obj = s3fs_get_object(s3bucket, path, (uint8_t**)&f, offset, size);
-if (size_obj<0){
-return -EIO;
+   char* s3bucket = (char*)ctx;
+   return s3fs_wb_write(GET_WRITEBACK(fi), s3bucket, buf, size, offset);
+}
+
+// Copies the data of a write_buf request into the spill file.
+static ssize_t write_bufvec(int fd, off_t offset, void *arg) {
+   struct fuse_bufvec *src = (struct fuse_bufvec *)arg;
+   struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+   dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+   dst.buf[0].fd = fd;
+   dst.buf[0].pos = offset;
+   return fuse_buf_copy(&dst, src, 0);
+}
+
+/*
+* Write data to an open file from a FUSE buffer, which may be a pipe the
+* data can be spliced from.
+*/
+int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                 struct fuse_file_info *fi) {
+   fprintf(stderr, "fs_write_buf(path=\"%s\", size=%d, offset=%d)\n",
+         path, (int)fuse_buf_size(buf), (int)offset);
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   char* s3bucket = (char*)ctx;
+   if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+       return s3fs_wb_write(GET_WRITEBACK(fi), s3bucket, buf->buf[0].mem,
+                            buf->buf[0].size, offset);
+   }
+   return s3fs_wb_write_with(GET_WRITEBACK(fi), s3bucket, offset, write_bufvec, buf);
+}
+
+
+/*
+* Update the size and modification time recorded for path in its
+* parent directory.  data is the contents of a small file, to be kept in
+* the entry if they fit and in a pack if not, or NULL if the file is in
+* its own object.
+*/
+static int update_parent_entry(const char *s3bucket, const char *path, off_t size,
+                               const void *data) {
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   uint64_t pack_id = 0, pack_offset = 0;
+   int packed = data && size > ctx->inline_max;
+   char* copy_path_1 = strdup(path);
+   char* copy_path_2 = strdup(path);
+   char* directory = dirname(copy_path_1);
+   char* base = basename(copy_path_2);
+   if (packed && s3fs_pack_add(directory, data, size, &pack_id, &pack_offset) < 0) {
+       free(copy_path_1);
+       free(copy_path_2);
+       return -EIO;
+   }
+   s3dirent_t ent;
+   s3fs_dirlock_write(directory);
+   int rv = s3fs_dir_lookup(directory, base, &ent);
+   if (rv < 0 && packed) {
+       s3fs_pack_release(pack_id, size); // removed meanwhile
+   }
+   if (rv == 0) {
+       if (ent.packed) {
+           s3fs_pack_release(ent.pack_id, ent.size);
+       }
+       ent.size = size;
+       ent.inlined = data && !packed;
+       ent.inline_len = ent.inlined ? size : 0;
+       if (ent.inlined) {
+           memcpy(ent.data, data, size);
+       }
+       ent.packed = packed;
+       ent.pack_id = pack_id;
+       ent.pack_offset = pack_offset;
+       ent.mod_time = time(NULL);
+       ent.status_change = ent.mod_time;
+       rv = s3fs_dir_put(directory, &ent);
+   }
+   s3fs_dirunlock_write(directory);
+   free(copy_path_1);
+   free(copy_path_2);
+   return rv < 0 ? -EIO : 0;
 }
-fseek(f,offset,SEEK_SET);
-fwrite(buf,1,size,f);
+
+
+/*
+* Flush an open file: upload any data written since the last flush.
+* Called on each close() of a file descriptor for the file.
+*/
+int fs_flush(const char *path, struct fuse_file_info *fi) {
+   fprintf(stderr, "fs_flush(path=\"%s\")\n", path);
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   char* s3bucket = (char*)ctx;
+   off_t size = 0;
+   void *small = NULL;
+   int rv = s3fs_wb_flush(GET_WRITEBACK(fi), s3bucket, &size, &small, small_max(ctx));
+   if (rv < 0) {
+       return -EIO;
+   }
+   if (rv > 0) {
+       s3fs_cache_invalidate(path);
+       rv = update_parent_entry(s3bucket, path, size, small);
+       free(small);
+       return rv;
+   }
    return 0;
 }
 
@@ -469,100 +1011,534 @@ fwrite(buf,1,size,f);
 */
 int fs_release(const char *path, struct fuse_file_info *fi) {
    fprintf(stderr, "fs_release(path=\"%s\")\n", path);
-   //s3context_t *ctx = GET_PRIVATE_DATA;
-   //return -EIO;
-return 0;
+   s3fs_file_t *f = GET_FILE(fi);
+   if (f) {
+       fs_flush(path, fi);
+       s3fs_wb_release(f->wb);
+       int i;
+       for (i = 0; i < f->ncache_fds; i++) {
+           close(f->cache_fds[i]);
+       }
+       free(f->cache_fds);
+       pthread_mutex_destroy(&f->lock);
+       free(f);
+       fi->fh = 0;
+   }
+   return 0;
 }
 
 
 /*
-* Rename a file.
+* Synchronize file contents: journal the file (and whatever directory
+* changes are queued) locally, or if there is no journal, upload the file
+* and then write out its entry in the parent directory.
 */
-int fs_rename(const char *path, const char *newpath) {
-   fprintf(stderr, "fs_rename(fpath=\"%s\", newpath=\"%s\")\n", path, newpath);
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+   fprintf(stderr, "fs_fsync(path=\"%s\")\n", path);
    s3context_t *ctx = GET_PRIVATE_DATA;
-char* s3bucket = (char*)ctx;
-FILE* f = NULL;
-s3dirent_t* more_dirs = NULL;
-   ssize_t size = s3fs_get_object(s3bucket, path, (uint8_t**)&f, 0, 0);
-   if (size<0) {
-       printf("This object does not exist\n");
-return -ENOENT;
-}
-s3fs_remove_object(s3bucket,path);
-s3fs_put_object(s3bucket, path, (uint8_t*)f, sizeof(f));
-char* copy_path_1 = strdup(path);
-char* copy_path_2 = strdup(path);
-char* directory = dirname(copy_path_1);
-char* base = basename(copy_path_2);
-char* copy_new_path = strdup(newpath);
-char* newbase = basename(copy_new_path);
-   size = s3fs_get_object(s3bucket, directory, (uint8_t**)&more_dirs, 0, 0);
-if (size < 0) {
-return -EIO;
+   char* s3bucket = (char*)ctx;
+   uint64_t seq;
+   if (s3fs_journal_enabled() &&
+       s3fs_wb_journal(GET_WRITEBACK(fi), s3bucket, &seq) == 0 &&
+       s3fs_journal_sync(seq) == 0) {
+       return 0;
+   }
+   int rv = fs_flush(path, fi);
+   if (rv == 0) {
+       char* copy_path = strdup(path);
+       rv = s3fs_dir_flush(dirname(copy_path)) < 0 ? -EIO : 0;
+       free(copy_path);
+   }
+   return rv;
 }
-int entries = size/sizeof(s3dirent_t);
-printf("ENTRIES = %d\n", entries);
-int i=0;
-for(;i<entries;i++) {
-if ( strcasecmp(more_dirs[i].name,base) == 0) {
-more_dirs[i].name = newbase;
+
+
+/*
+* Journal replay (see journal.h): redo a directory change that an
+* earlier mount journaled, unless the directory is gone or the entry
+* points into a pack that never got stored.
+*/
+static int replay_dir(const char *dir, int del, const s3dirent_t *ent) {
+   s3dirent_t self;
+   if (s3fs_dir_lookup(dir, ".", &self) < 0) {
+       return -1;
+   }
+   if (del) {
+       return s3fs_dir_del(dir, ent->name) < 0 ? -1 : 0;
+   }
+   uint8_t *data = NULL;
+   if (ent->packed && s3fs_pack_read(ent->pack_id, ent->pack_offset, ent->size, &data) < 0) {
+       return -1;
+   }
+   free(data);
+   if (s3fs_dir_put(dir, ent) < 0) {
+       return -1;
+   }
+   if (ent->packed) {
+       s3fs_pack_moved(ent->pack_id, dir);
+   }
+   return 0;
+}
+
+/*
+* Journal replay: store the contents of a file that an earlier mount
+* journaled on fsync, if the file still exists, the same way a flush
+* would.
+*/
+static int replay_data(const char *path, const uint8_t *data, size_t stored, off_t size) {
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   char* s3bucket = (char*)ctx;
+   s3dirent_t ent;
+   if (get_entry(path, &ent) < 0 || ent.type != 'F') {
+       return -1;
+   }
+   // nothing of the old contents is needed, so the handle starts empty
+   s3fs_wb_t *wb = s3fs_wb_open(path, size, 0);
+   if (!wb) {
+       return -1;
+   }
+   off_t flushed = 0;
+   void *small = NULL;
+   int rv = -1;
+   if ((stored == 0 ||
+        s3fs_wb_write(wb, s3bucket, (const char *)data, stored, 0) == (ssize_t)stored) &&
+       s3fs_wb_truncate(wb, s3bucket, size) == 0) {
+       rv = s3fs_wb_flush(wb, s3bucket, &flushed, &small, small_max(ctx));
+   }
+   if (rv > 0) {
+       s3fs_cache_invalidate(path);
+       rv = update_parent_entry(s3bucket, path, flushed, small);
+   }
+   free(small);
+   s3fs_wb_release(wb);
+   return rv < 0 ? -1 : 0;
+}
+
+
+/*
+* Objects to copy or remove during a rename.  The requests are spread
+* over a few threads, since each one is mostly waiting on s3.
+*/
+typedef struct {
+   const char *s3bucket;
+   char **src;
+   char **dst;               // NULL to remove src instead of copying it
+   int count;
+   int next;
+   int failed;
+   pthread_mutex_t lock;
+} key_batch_t;
+
+static void *key_batch_worker(void *arg) {
+   key_batch_t *b = arg;
+   for (;;) {
+       pthread_mutex_lock(&b->lock);
+       int i = b->next++;
+       pthread_mutex_unlock(&b->lock);
+       if (i >= b->count) {
+           break;
+       }
+       int rv = b->dst ? s3fs_copy_object(b->s3bucket, b->src[i], b->dst[i], NULL)
+                       : s3fs_remove_object(b->s3bucket, b->src[i]);
+       if (rv < 0) {
+           pthread_mutex_lock(&b->lock);
+           b->failed = 1;
+           pthread_mutex_unlock(&b->lock);
+       }
+   }
+   return NULL;
 }
+
+/*
+* Copy src[i] to dst[i] (or remove src[i], if dst is NULL) for each of
+* the count keys.  Returns 0 if every request succeeded, -1 otherwise.
+*/
+static int run_key_batch(const char *s3bucket, char **src, char **dst, int count) {
+   key_batch_t b = { s3bucket, src, dst, count, 0, 0 };
+   pthread_mutex_init(&b.lock, NULL);
+   pthread_t workers[S3FS_RENAME_WORKERS];
+   int n = 0;
+   // the calling thread takes a share of the work too
+   while (n < S3FS_RENAME_WORKERS - 1 && n < count - 1 &&
+          pthread_create(&workers[n], NULL, key_batch_worker, &b) == 0) {
+       n++;
+   }
+   key_batch_worker(&b);
+   while (n > 0) {
+       pthread_join(workers[--n], NULL);
+   }
+   pthread_mutex_destroy(&b.lock);
+   return b.failed ? -1 : 0;
 }
-s3fs_put_object(s3bucket, directory, (uint8_t*)more_dirs, sizeof(more_dirs));
-   return -EIO;
+
+static void free_keys(char **keys, int count) {
+   int i;
+   for (i = 0; i < count; i++) {
+       free(keys[i]);
+   }
+   free(keys);
 }
 
+static int add_key(char ***keys, int *count, int *cap, char *key) {
+   if (!key) {
+       return -1;
+   }
+   if (*count == *cap) {
+       int ncap = *cap ? *cap * 2 : 16;
+       char **n = realloc(*keys, ncap * sizeof(char*));
+       if (!n) {
+           free(key);
+           return -1;
+       }
+       *keys = n;
+       *cap = ncap;
+   }
+   (*keys)[(*count)++] = key;
+   return 0;
+}
 
 /*
-* Remove a file.
+* Add the keys of directory path and of everything below it to *keys.
 */
-int fs_unlink(const char *path) {
-   fprintf(stderr, "fs_unlink(path=\"%s\")\n", path);
-       s3context_t *ctx = GET_PRIVATE_DATA;
-char* cpy_path_1 = strdup(path);
-char* cpy_path_2 = strdup(path);
-char* d = dirname(cpy_path_1);
-char* b = basename(cpy_path_2);
+static int collect_tree(const char *s3bucket, const char *path,
+                        char ***keys, int *count, int *cap) {
+   if (add_key(keys, count, cap, strdup(path)) < 0) {
+       return -1;
+   }
+   s3dirent_t* dirs = NULL;
+   ssize_t entries = s3fs_dir_get(path, &dirs);
+   if (entries < 0) {
+       return -1;
+   }
+   int rv = 0;
+   int i = 1; // skip "."
+   for (; i < entries && rv == 0; i++) {
+       char child[PATH_MAX];
+       if (snprintf(child, sizeof(child), "%s/%s", path, dirs[i].name) >= (int)sizeof(child)) {
+           rv = -1;
+       } else if (dirs[i].type == 'D') {
+           rv = collect_tree(s3bucket, child, keys, count, cap);
+       } else if (!IS_SMALL(dirs[i])) {
+           // a small file's entry moves along with the directory object
+           rv = add_key(keys, count, cap, strdup(child));
+       }
+   }
+   free(dirs);
+   return rv;
+}
+
+/*
+* Rename a file or directory.  Objects are copied by s3 itself and the
+* originals removed afterwards, so no file data passes through here; a
+* directory's objects are copied in parallel.  Moving a directory needs
+* every other change kept out (whole_tree); without that, -EAGAIN is
+* returned for a directory.
+*/
+static int rename_locked(const char *path, const char *newpath, int whole_tree) {
+   fprintf(stderr, "fs_rename(fpath=\"%s\", newpath=\"%s\")\n", path, newpath);
+   s3context_t *ctx = GET_PRIVATE_DATA;
    char* s3bucket = (char*)ctx;
-s3dirent_t* dirs_rem = NULL;
-   ssize_t size = s3fs_get_object(s3bucket, d, (uint8_t**)&dirs_rem, 0, 0);
-if (size<0) {
-return -EIO; // directory does not exist
+   size_t len = strlen(path);
+   if (strcmp(path, newpath) == 0) {
+       return 0;
+   }
+   if (strncmp(newpath, path, len) == 0 && newpath[len] == '/') {
+       return -EINVAL; // can't move a directory below itself
+   }
+   char* copy_path_1 = strdup(path);
+   char* copy_path_2 = strdup(path);
+   char* copy_new_path_1 = strdup(newpath);
+   char* copy_new_path_2 = strdup(newpath);
+   char* directory = dirname(copy_path_1);
+   char* base = basename(copy_path_2);
+   char* newdirectory = dirname(copy_new_path_1);
+   char* newbase = basename(copy_new_path_2);
+   int same_dir = strcmp(directory, newdirectory) == 0;
+   char **src = NULL, **dst = NULL;
+   int count = 0, cap = 0, i;
+   int undo = 0, moved_open = 0;
+   int rv = -EIO;
+
+   s3dirent_t moved, target;
+   int from = s3fs_dir_lookup(directory, base, &moved);
+   if (from < 0) {
+       rv = -ENOENT;
+       goto out;
+   }
+   int to = s3fs_dir_lookup(newdirectory, newbase, &target);
+   if (to == -EIO) {
+       rv = -ENOENT;
+       goto out;
+   }
+   // a name that only changes case is the same entry
+   int replace = to == 0 && !(same_dir && strcasecmp(base, newbase) == 0);
+   int is_dir = moved.type == 'D';
+   if (is_dir && !whole_tree) {
+       rv = -EAGAIN;
+       goto out;
+   }
+   if (replace) {
+       if (target.type == 'D') {
+           s3dirent_t* victim = NULL;
+           ssize_t ventries = s3fs_dir_get(newpath, &victim);
+           free(victim);
+           if (!is_dir) {
+               rv = -EISDIR;
+               goto out;
+           }
+           if (ventries > 1) {
+               rv = -ENOTEMPTY;
+               goto out;
+           }
+       } else if (is_dir) {
+           rv = -ENOTDIR;
+           goto out;
+       }
+       // the empty directory being replaced may still have queued removals
+       s3fs_dir_forget(newpath);
+   }
+
+   // copy everything to its new key; a replaced target is overwritten
+   if (is_dir) {
+       // the copies must include changes still queued below path
+       s3fs_dir_flush_all();
+       if (collect_tree(s3bucket, path, &src, &count, &cap) < 0) {
+           goto out;
+       }
+   } else if (!IS_SMALL(moved) && add_key(&src, &count, &cap, strdup(path)) < 0) {
+       goto out;
+   }
+   dst = calloc(count ? count : 1, sizeof(char*));
+   if (!dst) {
+       goto out;
+   }
+   for (i = 0; i < count; i++) {
+       size_t dlen = strlen(newpath) + strlen(src[i] + len) + 1;
+       if (!(dst[i] = malloc(dlen))) {
+           goto out;
+       }
+       snprintf(dst[i], dlen, "%s%s", newpath, src[i] + len);
+       s3fs_delq_cancel(dst[i]);
+   }
+   // files still open follow the move, so their next flush goes to the copy
+   if (s3fs_wb_rename(path, newpath) < 0) {
+       goto out;
+   }
+   moved_open = 1;
+   undo = !replace;
+   if (run_key_batch(s3bucket, src, dst, count) < 0) {
+       goto out;
+   }
+
+   // then point the parent directories at the copies
+   snprintf(moved.name, sizeof(moved.name), "%s", newbase);
+   moved.status_change = time(NULL);
+   if (s3fs_dir_del(directory, base) < 0 || s3fs_dir_put(newdirectory, &moved) < 0) {
+       goto out;
+   }
+   undo = 0;
+   rv = 0;
+   if (is_dir) {
+       s3fs_pack_moved_tree(path, newpath);
+   } else if (moved.packed) {
+       s3fs_pack_moved(moved.pack_id, newdirectory);
+   }
+   s3fs_journal_done_data(path, s3fs_journal_seq());
+   if (replace && target.type == 'F' && target.packed) {
+       s3fs_pack_release(target.pack_id, target.size);
+   } else if (replace && target.type == 'F' && !target.inlined && IS_SMALL(moved)) {
+       // no copy overwrote the replaced object, so it has to go
+       s3fs_delq_add(newpath);
+       s3fs_cache_invalidate(newpath);
+       s3fs_meta_invalidate(newpath);
+   }
+
+   // and only drop the originals once that is stored
+   if (s3fs_dir_flush(newdirectory) == 0 && s3fs_dir_flush(directory) == 0) {
+       for (i = 0; i < count; i++) {
+           s3fs_delq_add(src[i]);
+           s3fs_dir_forget(src[i]);
+       }
+   } else {
+       fprintf(stderr, "fs_rename: keeping the originals of %s for now\n", path);
+   }
+
+out:
+   if (rv < 0 && undo) {
+       // don't leave half a copy behind
+       for (i = 0; i < count && dst[i]; i++)
+           ;
+       run_key_batch(s3bucket, dst, NULL, i);
+   }
+   if (rv < 0 && moved_open) {
+       s3fs_wb_rename(newpath, path);
+   }
+   for (i = 0; i < count; i++) {
+       s3fs_cache_invalidate(src[i]);
+       s3fs_meta_invalidate(src[i]);
+       if (dst && dst[i]) {
+           s3fs_cache_invalidate(dst[i]);
+           s3fs_meta_invalidate(dst[i]);
+       }
+   }
+   free_keys(src, count);
+   free_keys(dst, dst ? count : 0);
+   free(copy_path_1);
+   free(copy_path_2);
+   free(copy_new_path_1);
+   free(copy_new_path_2);
+   return rv;
 }
-int entries = size/sizeof(s3dirent_t);
-s3dirent_t arr[entries-1];
-int i=0;
-int k=0;
-for (;i<entries;i++) {
-if (strcasecmp(dirs_rem[i].name,b) != 0) {
-arr[k] = dirs_rem[i];
-k++;
+
+int fs_rename(const char *path, const char *newpath) {
+   char* copy_path = strdup(path);
+   char* copy_new_path = strdup(newpath);
+   char* directory = dirname(copy_path);
+   char* newdirectory = dirname(copy_new_path);
+   // moving a file only changes its two parents
+   s3fs_dirlock_write2(directory, newdirectory);
+   int rv = rename_locked(path, newpath, 0);
+   s3fs_dirunlock_write2(directory, newdirectory);
+   if (rv == -EAGAIN) {
+       s3fs_dirlock_all();
+       rv = rename_locked(path, newpath, 1);
+       s3fs_dirunlock_all();
+   }
+   free(copy_path);
+   free(copy_new_path);
+   return rv;
 }
+
+
+/*
+* Remove a file.
+*/
+static int unlink_locked(const char *path) {
+   fprintf(stderr, "fs_unlink(path=\"%s\")\n", path);
+   char* cpy_path_1 = strdup(path);
+   char* cpy_path_2 = strdup(path);
+   char* d = dirname(cpy_path_1);
+   char* b = basename(cpy_path_2);
+   s3dirent_t ent;
+   int rv = s3fs_dir_lookup(d, b, &ent);
+   if (rv == -EIO) {
+       rv = -ENOENT; // directory does not exist
+   } else if (rv == 0 && ent.type == 'D') {
+       rv = -EISDIR;
+   } else if (rv == 0) {
+       rv = s3fs_dir_del(d, b);
+   }
+   if (rv == 0) {
+       if (ent.packed) {
+           s3fs_pack_release(ent.pack_id, ent.size);
+       } else if (!ent.inlined) {
+           s3fs_delq_add(path);
+       }
+       s3fs_cache_invalidate(path);
+       s3fs_meta_invalidate(path);
+       // journaled contents of the file don't matter any more
+       s3fs_journal_done_data(path, s3fs_journal_seq());
+   }
+   free(cpy_path_1);
+   free(cpy_path_2);
+   return rv;
 }
-s3fs_put_object(s3bucket, d, (uint8_t*)&arr, ((sizeof(s3dirent_t))*(entries-1)));
-s3fs_remove_object(s3bucket, path);	
-return 0;
+
+int fs_unlink(const char *path) {
+   char* copy_path = strdup(path);
+   char* directory = dirname(copy_path);
+   s3fs_dirlock_write(directory);
+   int rv = unlink_locked(path);
+   s3fs_dirunlock_write(directory);
+   free(copy_path);
+   return rv;
 }
 /*
-* Change the size of a file.
+* Change the size of a file.  Truncating to zero is one empty put, and
+* shrinking fetches only the bytes that are kept.  Extending a file only
+* records its new size: the end of the file becomes a hole that reads as
+* zeros and is never uploaded.  If the file is open, the change is made
+* to its write-back copy and reaches s3 when that is flushed.
 */
 int fs_truncate(const char *path, off_t newsize) {
    fprintf(stderr, "fs_truncate(path=\"%s\", newsize=%d)\n", path, (int)newsize);
-   //s3context_t *ctx = GET_PRIVATE_DATA;
-   return -EIO;
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   char* s3bucket = (char*)ctx;
+   struct stat st;
+   int rv = fs_getattr(path, &st);
+   if (rv < 0) {
+       return rv;
+   }
+   if (S_ISDIR(st.st_mode)) {
+       return -EISDIR;
+   }
+   s3fs_wb_t *wb = s3fs_wb_get(path);
+   s3dirent_t ent;
+   if (!wb && get_entry(path, &ent) == 0 && IS_SMALL(ent)) {
+       // a small file is staged from where it is kept, and may outgrow it
+       wb = s3fs_wb_open(path, ent.size, ent.size);
+       if (!wb) {
+           return -ENOMEM;
+       }
+       if (stage_small(wb, &ent) < 0) {
+           s3fs_wb_release(wb);
+           return -EIO;
+       }
+   }
+   if (wb) {
+       rv = s3fs_wb_truncate(wb, s3bucket, newsize);
+       if (!s3fs_wb_release_shared(wb)) {
+           // every open was closed meanwhile, so nobody else will flush it
+           off_t size;
+           void *small = NULL;
+           int flushed = rv == 0 ? s3fs_wb_flush(wb, s3bucket, &size, &small,
+                                                 small_max(ctx)) : 0;
+           if (flushed > 0) {
+               s3fs_cache_invalidate(path);
+               rv = update_parent_entry(s3bucket, path, size, small);
+           }
+           free(small);
+           s3fs_wb_release(wb);
+       }
+       return rv;
+   }
+   if (newsize < st.st_size) {
+       s3fs_object_info_t info;
+       uint8_t *data = NULL;
+       ssize_t kept = 0;
+       if (newsize > 0) {
+           if (s3fs_head_object(s3bucket, path, &info) < 0) {
+               return -EIO;
+           }
+           if ((uint64_t)newsize >= info.content_length) {
+               // the cut is in the hole; the object stays as it is
+               return update_parent_entry(s3bucket, path, newsize, NULL);
+           }
+           kept = s3fs_get_object(s3bucket, path, &data, 0, newsize);
+           if (kept < 0) {
+               return -EIO;
+           }
+       }
+       ssize_t put = s3fs_put_object(s3bucket, path, data, kept);
+       free(data);
+       s3fs_cache_invalidate(path);
+       if (put != kept) {
+           return -EIO;
+       }
+   }
+   return update_parent_entry(s3bucket, path, newsize, NULL);
 }
 
 
 /*
-* Change the size of an open file.  Very similar to fs_truncate (and,
-* depending on your implementation), you could possibly treat it the
-* same as fs_truncate.
+* Change the size of an open file.  Only its write-back copy changes
+* until the file is flushed.
 */
 int fs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
    fprintf(stderr, "fs_ftruncate(path=\"%s\", offset=%d)\n", path, (int)offset);
-   //s3context_t *ctx = GET_PRIVATE_DATA;
-   return -EIO;
+   s3context_t *ctx = GET_PRIVATE_DATA;
+   char* s3bucket = (char*)ctx;
+   return s3fs_wb_truncate(GET_WRITEBACK(fi), s3bucket, offset);
 }
 
 
@@ -601,9 +1577,9 @@ struct fuse_operations s3fs_ops = {
  .read        = fs_read,       // read contents from an open file
  .write       = fs_write,      // write contents to an open file
  .statfs      = NULL,          // file sys stat: not implemented
- .flush       = NULL,          // flush file to stable storage: not implemented
+ .flush       = fs_flush,      // flush file to stable storage
  .release     = fs_release,    // release/close file
- .fsync       = NULL,          // sync file to disk: not implemented
+ .fsync       = fs_fsync,      // sync file to s3
  .setxattr    = NULL,          // not implemented
  .getxattr    = NULL,          // not implemented
  .listxattr   = NULL,          // not implemented
@@ -611,13 +1587,15 @@ struct fuse_operations s3fs_ops = {
  .opendir     = fs_opendir,    // open directory entry
  .readdir     = fs_readdir,    // read directory entry
  .releasedir  = fs_releasedir, // release/close directory
- .fsyncdir    = NULL,          // sync dirent to disk: not implemented
+ .fsyncdir    = fs_fsyncdir,   // write out queued directory changes
  .init        = fs_init,       // initialize filesystem
  .destroy     = fs_destroy,    // cleanup/destroy filesystem
  .access      = fs_access,     // check access permissions for a file
  .create      = NULL,          // not implemented
  .ftruncate   = fs_ftruncate,  // truncate the file
- .fgetattr    = NULL           // not implemented
+ .fgetattr    = NULL,          // not implemented
+ .write_buf   = fs_write_buf,  // write from a FUSE buffer (splice)
+ .read_buf    = fs_read_buf,   // read into a FUSE buffer (zero-copy)
 };
 
 
@@ -654,15 +1632,102 @@ int main(int argc, char *argv[]) {
    }
    strncpy((*stateinfo).s3bucket, s3bucket, BUFFERSIZE);
 
+   // the local data cache is optional
+   char *cachedir = getenv(S3CACHEDIR);
+   if (cachedir) {
+       // names of files in it are built from it, so it can't be cut short
+       if (strlen(cachedir) >= BUFFERSIZE) {
+           fprintf(stderr, "%s is too long\n", S3CACHEDIR);
+           return -1;
+       }
+       strncpy((*stateinfo).cachedir, cachedir, BUFFERSIZE - 1);
+       char *cachemb = getenv(S3CACHESIZE);
+       uint64_t mb = cachemb ? strtoull(cachemb, NULL, 10) : S3FS_DEFAULT_CACHE_MB;
+       (*stateinfo).cache_max_bytes = mb * 1024 * 1024;
+   }
+   char *revalidate = getenv(S3REVALIDATE);
+   (*stateinfo).revalidate_secs = revalidate ? atoi(revalidate) : S3FS_DEFAULT_REVALIDATE_SECS;
+   char *dir_commit = getenv(S3DIRCOMMIT);
+   (*stateinfo).dir_commit_ms = dir_commit ? atoi(dir_commit) : S3FS_DEFAULT_DIR_COMMIT_MS;
+   char *inline_bytes = getenv(S3INLINE);
+   int inline_max = inline_bytes ? atoi(inline_bytes) : 0;
+   (*stateinfo).inline_max = inline_max < 0 ? 0 :
+                             inline_max > S3FS_INLINE_MAX ? S3FS_INLINE_MAX : inline_max;
+   char *pack_bytes = getenv(S3PACK);
+   int pack_max = pack_bytes ? atoi(pack_bytes) : 0;
+   (*stateinfo).pack_max = pack_max < 0 ? 0 :
+                           pack_max > S3FS_PACK_MAX ? S3FS_PACK_MAX : pack_max;
+   char *compress_level = getenv(S3COMPRESS);
+   s3fs_compress_init(compress_level ? atoi(compress_level) : 0);
+   char *chunk_kb = getenv(S3CHUNK);
+   s3fs_chunk_init(chunk_kb ? strtoull(chunk_kb, NULL, 10) * 1024 : 0);
+   char *hedge = getenv(S3HEDGE);
+   s3fs_hedge_init(hedge ? atoi(hedge) : 0);
+   char *connect_ms = getenv(S3CONNECTMS);
+   char *first_byte_ms = getenv(S3FIRSTBYTEMS);
+   char *total_ms = getenv(S3TOTALMS);
+   s3fs_deadlines_init(connect_ms ? atoi(connect_ms) : 0,
+                       first_byte_ms ? atoi(first_byte_ms) : 0,
+                       total_ms ? atoi(total_ms) : 0);
+   char *append_segments = getenv(S3APPEND);
+   (*stateinfo).append_segments = append_segments ? atoi(append_segments) : 0;
+   char *journal = getenv(S3JOURNAL);
+   (*stateinfo).journal = journal ? atoi(journal) : 0;
+   char *manifest = getenv(S3MANIFEST);
+   (*stateinfo).manifest_secs = manifest ? atoi(manifest) : 0;
+   char *prefetch_depth = getenv(S3PREFETCHDEPTH);
+   (*stateinfo).prefetch_depth = prefetch_depth ? atoi(prefetch_depth) : 0;
+   char *prefetch_files = getenv(S3PREFETCHFILES);
+   (*stateinfo).prefetch_files = prefetch_files ? atoi(prefetch_files) : 0;
+   char *prefetch_threads = getenv(S3PREFETCHTHREADS);
+   (*stateinfo).prefetch_threads = prefetch_threads ? atoi(prefetch_threads) :
+                                   S3FS_DEFAULT_PREFETCH_THREADS;
+
+   // let the kernel cache attributes and lookups for as long as we trust
+   // our own metadata cache; options given on the command line still win
+   char *attr_timeout = getenv(S3ATTRTIMEOUT);
+   char *entry_timeout = getenv(S3ENTRYTIMEOUT);
+   (*stateinfo).attr_timeout = attr_timeout ? strtod(attr_timeout, NULL) : stateinfo->revalidate_secs;
+   (*stateinfo).entry_timeout = entry_timeout ? strtod(entry_timeout, NULL) : stateinfo->revalidate_secs;
+   s3fs_context = stateinfo;
+
    fprintf(stderr, "Initializing s3 credentials\n");
    s3fs_init_credentials(s3key, s3secret);
 
-   fprintf(stderr, "Totally clearing s3 bucket\n");
-   s3fs_clear_bucket(s3bucket);
+   // mounts reuse what is in the bucket, unless asked to start afresh
+   char *clear = getenv(S3CLEAR);
+   (*stateinfo).clear_bucket = clear ? atoi(clear) : 0;
+   if (stateinfo->clear_bucket) {
+       fprintf(stderr, "Totally clearing s3 bucket\n");
+       if (s3fs_clear_bucket(s3bucket) < 0) {
+           fprintf(stderr, "Failed to clear s3 bucket %s\n", s3bucket);
+           return -1;
+       }
+   }
 
-   fprintf(stderr, "Starting up FUSE file system.\n");
-   int fuse_stat = fuse_main(argc, argv, &s3fs_ops, stateinfo);
-   fprintf(stderr, "Startup function (fuse_main) returned %d\n", fuse_stat);
+   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+   char max_read[64];
+   snprintf(max_read, sizeof(max_read), "max_read=%d", S3FS_MAX_IO);
+   int fuse_stat;
+   if (getenv(S3LOWLEVEL)) {
+       fuse_opt_insert_arg(&args, 1, "-o");
+       fuse_opt_insert_arg(&args, 2, max_read);
+       fprintf(stderr, "Starting up FUSE file system (low-level).\n");
+       fuse_stat = s3fs_ll_main(&args, stateinfo);
+   } else {
+       char timeouts[128];
+       snprintf(timeouts, sizeof(timeouts), "attr_timeout=%g,entry_timeout=%g",
+                stateinfo->attr_timeout, stateinfo->entry_timeout);
+       fuse_opt_insert_arg(&args, 1, "-o");
+       fuse_opt_insert_arg(&args, 2, timeouts);
+       fuse_opt_insert_arg(&args, 3, "-o");
+       fuse_opt_insert_arg(&args, 4, max_read);
+
+       fprintf(stderr, "Starting up FUSE file system.\n");
+       fuse_stat = fuse_main(args.argc, args.argv, &s3fs_ops, stateinfo);
+   }
+   fprintf(stderr, "Startup function returned %d\n", fuse_stat);
+   fuse_opt_free_args(&args);
    
    return fuse_stat;
 }
@@ -2,6 +2,7 @@
 #define __USERSPACEFS_H__
 
 #include <sys/stat.h>
+#include <limits.h>   // for NAME_MAX
 #include <stdint.h>   // for uint32_t, etc.
 #include <sys/time.h> // for struct timeval
 
@@ -14,12 +15,56 @@
 #define S3ACCESSKEY "S3_ACCESS_KEY_ID"
 #define S3SECRETKEY "S3_SECRET_ACCESS_KEY"
 #define S3BUCKET "S3_BUCKET"
+#define S3CACHEDIR "S3FS_CACHE_DIR"     // enables the local data cache
+#define S3CACHESIZE "S3FS_CACHE_MB"     // cache size cap, in megabytes
+#define S3REVALIDATE "S3FS_REVALIDATE_SECS" // trust cached objects this long
+#define S3ATTRTIMEOUT "S3FS_ATTR_TIMEOUT"   // kernel attribute cache, seconds
+#define S3ENTRYTIMEOUT "S3FS_ENTRY_TIMEOUT" // kernel lookup cache, seconds
+#define S3LOWLEVEL "S3FS_LOWLEVEL"          // serve through the inode API
+#define S3DIRCOMMIT "S3FS_DIR_COMMIT_MS"    // batch directory changes this long
+#define S3INLINE "S3FS_INLINE_BYTES"        // keep files this small in their directory
+#define S3PACK "S3FS_PACK_BYTES"            // pack files this small together
+#define S3COMPRESS "S3FS_COMPRESS"          // zlib level for stored objects, 0 = off
+#define S3CHUNK "S3FS_CHUNK_KB"             // store files as deduplicated chunks this big
+#define S3APPEND "S3FS_APPEND_SEGMENTS"     // upload appends alone, merging past this many
+#define S3JOURNAL "S3FS_JOURNAL"            // 1 = fsync to a local journal (needs S3CACHEDIR)
+#define S3CLEAR "S3FS_CLEAR_BUCKET"         // 1 = delete everything in the bucket at mount
+#define S3MANIFEST "S3FS_MANIFEST_SECS"     // checkpoint a namespace manifest this often
+#define S3PREFETCHDEPTH "S3FS_PREFETCH_DEPTH"     // subdirectory levels fetched at opendir
+#define S3PREFETCHFILES "S3FS_PREFETCH_FILES"     // files fetched ahead of opens in order
+#define S3PREFETCHTHREADS "S3FS_PREFETCH_THREADS" // concurrent prefetches
+#define S3HEDGE "S3FS_HEDGE_PERCENT"        // share of slow gets/heads sent twice, 0 = off
+#define S3CONNECTMS "S3FS_CONNECT_MS"       // request deadlines: 0 = adaptive, -1 = none
+#define S3FIRSTBYTEMS "S3FS_FIRST_BYTE_MS"
+#define S3TOTALMS "S3FS_TOTAL_MS"
+
+#define S3FS_DEFAULT_CACHE_MB 1024
+#define S3FS_DEFAULT_REVALIDATE_SECS 5
+#define S3FS_DEFAULT_DIR_COMMIT_MS 200
+#define S3FS_DEFAULT_PREFETCH_THREADS 8
+#define S3FS_INLINE_MAX 2048  // largest file S3INLINE can keep in a directory
+#define S3FS_PACK_MAX (1024 * 1024) // largest file S3PACK can pack
 
 #define BUFFERSIZE 1024
 
 // store filesystem state information in this struct
 typedef struct {
    char s3bucket[BUFFERSIZE];
+   char cachedir[BUFFERSIZE];   // empty if the data cache is disabled
+   uint64_t cache_max_bytes;
+   int revalidate_secs;         // how long cached objects go unchecked
+   double attr_timeout;         // kernel attribute cache timeout
+   double entry_timeout;        // kernel lookup cache timeout
+   int dir_commit_ms;           // group commit window for directory changes
+   int inline_max;              // files up to this size live in their directory
+   int pack_max;                // files up to this size live in packs
+   int append_segments;         // segments an appended file may have, 0 = off
+   int journal;                 // fsync to the local journal
+   int clear_bucket;            // the bucket was emptied at mount
+   int manifest_secs;           // namespace manifest checkpoint interval, 0 = off
+   int prefetch_depth;          // subdirectory levels prefetched, 0 = off
+   int prefetch_files;          // files prefetched ahead of opens, 0 = off
+   int prefetch_threads;        // concurrent prefetches
 } s3context_t;
 
 /*
@@ -29,7 +74,7 @@ typedef struct {
 
 typedef struct {
 char type; // file, directory, or usused
-char* name;
+char name[NAME_MAX + 1]; // stored inline: directory objects live in s3
 mode_t protection;
 uid_t user_id;
 gid_t group_id;
@@ -38,6 +83,12 @@ off_t size;
 time_t last_access;
 time_t mod_time;
 time_t status_change;
+char inlined; // file contents are data[], not an object of their own
+char packed; // file contents are size bytes at pack_offset of pack pack_id
+uint64_t pack_id;
+uint64_t pack_offset;
+uint16_t inline_len; // bytes of data[] in use (the file size, when inlined)
+char data[S3FS_INLINE_MAX]; // must stay last: only inline_len bytes are stored
 } s3dirent_t;
 
 
@@ -0,0 +1,935 @@
+/*
+ * s3fs_ll.c: the low-level (inode based) FUSE front end.
+ *
+ * The kernel names files by inode number here.  Every inode we have handed
+ * out lives in a table that records its parent and its name, so a callback
+ * finds its object key by following a few in-memory parent links instead
+ * of splitting and resolving a path again.  Inodes are reference counted
+ * by lookup/forget, as the protocol requires, and numbers are never reused.
+ *
+ * When we notice that something changed behind the kernel's back (a file's
+ * attributes differ from what we last reported, or an entry has vanished
+ * from a directory listing) we push exactly that inode or entry out of the
+ * kernel caches.  Notifications are sent from their own thread, because
+ * sending one from inside a request can deadlock against the kernel.
+ *
+ * The operations themselves are the ones in s3fs.c; see s3fs_ops.h.
+ */
+
+#include "s3fs_ops.h"
+#include <fuse_lowlevel.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LL_HASH_BUCKETS 4096
+#define LL_UNKNOWN_INO 0xffffffff   // d_ino for entries we never looked up
+
+typedef struct ll_node {
+    fuse_ino_t ino;
+    struct ll_node *parent;
+    char *name;
+    uint64_t nlookup;             // kernel references: lookups minus forgets
+    int pins;                     // nodes that have this one as parent
+    int linked;                   // still reachable through parent/name
+    int reported;                 // size/mtime below were sent to the kernel
+    off_t size;
+    time_t mtime;
+    struct ll_node *ino_next;     // chain in the inode hash
+    struct ll_node *name_next;    // chain in the (parent, name) hash
+    struct ll_node *kids;         // linked children
+    struct ll_node *sib_prev, *sib_next;
+} ll_node_t;
+
+static pthread_mutex_t ll_lock = PTHREAD_MUTEX_INITIALIZER;
+static ll_node_t *ll_by_ino[LL_HASH_BUCKETS];
+static ll_node_t *ll_by_name[LL_HASH_BUCKETS];
+static ll_node_t ll_root;
+static fuse_ino_t ll_next_ino = FUSE_ROOT_ID + 1;
+
+// Pending kernel cache invalidations
+typedef struct ll_notice {
+    fuse_ino_t ino;               // inode, or parent of name
+    char *name;                   // NULL to invalidate the inode itself
+    struct ll_notice *next;
+} ll_notice_t;
+
+static pthread_mutex_t notice_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notice_cond = PTHREAD_COND_INITIALIZER;
+static ll_notice_t *notice_head = NULL, *notice_tail = NULL;
+static int notice_stop = 0;
+static struct fuse_chan *ll_chan = NULL;
+
+
+// inode table -------------------------------------------------------------
+
+static unsigned ino_hash(fuse_ino_t ino)
+{
+    return ino % LL_HASH_BUCKETS;
+}
+
+static unsigned name_hash(const ll_node_t *parent, const char *name)
+{
+    unsigned h = (unsigned) parent->ino * 2654435761u;
+    while (*name) {
+        h = h * 33 + (unsigned char) *name++;
+    }
+    return h % LL_HASH_BUCKETS;
+}
+
+// All of the node functions below are called with ll_lock held.
+static ll_node_t *node_get(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID) {
+        return &ll_root;
+    }
+    ll_node_t *n = ll_by_ino[ino_hash(ino)];
+    while (n && n->ino != ino) {
+        n = n->ino_next;
+    }
+    return n;
+}
+
+static ll_node_t *node_find(ll_node_t *parent, const char *name)
+{
+    ll_node_t *n = ll_by_name[name_hash(parent, name)];
+    while (n && (n->parent != parent || strcmp(n->name, name) != 0)) {
+        n = n->name_next;
+    }
+    return n;
+}
+
+static void node_attach(ll_node_t *n, ll_node_t *parent, char *name)
+{
+    n->parent = parent;
+    n->name = name;
+    parent->pins++;
+    unsigned h = name_hash(parent, name);
+    n->name_next = ll_by_name[h];
+    ll_by_name[h] = n;
+    n->sib_prev = NULL;
+    n->sib_next = parent->kids;
+    if (parent->kids) {
+        parent->kids->sib_prev = n;
+    }
+    parent->kids = n;
+    n->linked = 1;
+}
+
+// Make n unreachable by name.  It keeps its parent (for its path) until
+// it is freed.
+static void node_unlink(ll_node_t *n)
+{
+    if (!n->linked) {
+        return;
+    }
+    ll_node_t **pp = &ll_by_name[name_hash(n->parent, n->name)];
+    while (*pp != n) {
+        pp = &(*pp)->name_next;
+    }
+    *pp = n->name_next;
+    if (n->sib_prev) {
+        n->sib_prev->sib_next = n->sib_next;
+    } else {
+        n->parent->kids = n->sib_next;
+    }
+    if (n->sib_next) {
+        n->sib_next->sib_prev = n->sib_prev;
+    }
+    n->linked = 0;
+}
+
+// Free n (and then possibly its parent) once nothing refers to it.
+static void node_release(ll_node_t *n)
+{
+    while (n != &ll_root && n->nlookup == 0 && n->pins == 0) {
+        ll_node_t *parent = n->parent;
+        node_unlink(n);
+        ll_node_t **pp = &ll_by_ino[ino_hash(n->ino)];
+        while (*pp != n) {
+            pp = &(*pp)->ino_next;
+        }
+        *pp = n->ino_next;
+        free(n->name);
+        free(n);
+        parent->pins--;
+        n = parent;
+    }
+}
+
+// Find or create the node for name in parent.
+static ll_node_t *node_link(ll_node_t *parent, const char *name)
+{
+    ll_node_t *n = node_find(parent, name);
+    if (n) {
+        return n;
+    }
+    n = calloc(1, sizeof(ll_node_t));
+    char *copy = strdup(name);
+    if (!n || !copy) {
+        free(n);
+        free(copy);
+        return NULL;
+    }
+    n->ino = ll_next_ino++;
+    unsigned h = ino_hash(n->ino);
+    n->ino_next = ll_by_ino[h];
+    ll_by_ino[h] = n;
+    node_attach(n, parent, copy);
+    return n;
+}
+
+static int node_path(ll_node_t *n, char *path, size_t len)
+{
+    if (n == &ll_root) {
+        snprintf(path, len, "/");
+        return 0;
+    }
+    // measure, then fill in from the end
+    size_t need = 0;
+    ll_node_t *p;
+    for (p = n; p != &ll_root; p = p->parent) {
+        need += strlen(p->name) + 1;
+    }
+    if (need + 1 > len) {
+        return -ENAMETOOLONG;
+    }
+    path[need] = '\0';
+    for (p = n; p != &ll_root; p = p->parent) {
+        size_t l = strlen(p->name);
+        need -= l;
+        memcpy(path + need, p->name, l);
+        path[--need] = '/';
+    }
+    return 0;
+}
+
+static int child_path(const char *dir, const char *name, char *path,
+                      size_t len)
+{
+    int n = snprintf(path, len, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir,
+                     name);
+    return (n < 0 || (size_t) n >= len) ? -ENAMETOOLONG : 0;
+}
+
+// Look up the key of ino, and of its parent directory and its name in it.
+// For the root, dir and path are both "/".
+static int ino_paths(fuse_ino_t ino, char *dir, char *path, char *name)
+{
+    pthread_mutex_lock(&ll_lock);
+    ll_node_t *n = node_get(ino);
+    int rv = -ENOENT;
+    if (n) {
+        rv = node_path(n, path, PATH_MAX);
+        if (rv == 0) {
+            rv = node_path(n == &ll_root ? n : n->parent, dir, PATH_MAX);
+        }
+        snprintf(name, NAME_MAX + 1, "%s", n == &ll_root ? "/" : n->name);
+    }
+    pthread_mutex_unlock(&ll_lock);
+    return rv;
+}
+
+static int ino_path(fuse_ino_t ino, char *path)
+{
+    char dir[PATH_MAX], name[NAME_MAX + 1];
+    return ino_paths(ino, dir, path, name);
+}
+
+
+// kernel notifications ----------------------------------------------------
+
+static void notice_post(fuse_ino_t ino, const char *name)
+{
+    if (!ll_chan) {
+        return;
+    }
+    ll_notice_t *nt = calloc(1, sizeof(ll_notice_t));
+    if (!nt || (name && !(nt->name = strdup(name)))) {
+        free(nt);
+        return;
+    }
+    nt->ino = ino;
+    pthread_mutex_lock(&notice_lock);
+    if (notice_tail) {
+        notice_tail->next = nt;
+    } else {
+        notice_head = nt;
+    }
+    notice_tail = nt;
+    pthread_cond_signal(&notice_cond);
+    pthread_mutex_unlock(&notice_lock);
+}
+
+static void *notice_thread(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&notice_lock);
+    for (;;) {
+        while (!notice_head && !notice_stop) {
+            pthread_cond_wait(&notice_cond, &notice_lock);
+        }
+        ll_notice_t *nt = notice_head;
+        if (!nt) {
+            break;
+        }
+        notice_head = nt->next;
+        if (!notice_head) {
+            notice_tail = NULL;
+        }
+        pthread_mutex_unlock(&notice_lock);
+
+        // -ENOENT just means the kernel had nothing cached
+        if (nt->name) {
+            fuse_lowlevel_notify_inval_entry(ll_chan, nt->ino, nt->name,
+                                             strlen(nt->name));
+        } else {
+            fuse_lowlevel_notify_inval_inode(ll_chan, nt->ino, 0, 0);
+        }
+        free(nt->name);
+        free(nt);
+        pthread_mutex_lock(&notice_lock);
+    }
+    pthread_mutex_unlock(&notice_lock);
+    return NULL;
+}
+
+// Remember the attributes reported for n; if a file changed since we last
+// reported it, the kernel's cached pages are stale.  Called with ll_lock
+// held.
+static void note_attr(ll_node_t *n, const struct stat *st, int quiet)
+{
+    if (n->reported && !quiet && S_ISREG(st->st_mode) &&
+        (n->size != st->st_size || n->mtime != st->st_mtime)) {
+        notice_post(n->ino, NULL);
+    }
+    n->size = st->st_size;
+    n->mtime = st->st_mtime;
+    n->reported = 1;
+}
+
+static int ll_getattr_ino(fuse_ino_t ino, struct stat *st, int quiet)
+{
+    char dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 1];
+    int rv = ino_paths(ino, dir, path, name);
+    if (rv == 0) {
+        memset(st, 0, sizeof(struct stat));
+        rv = fs_getattr_child(dir, name, path, st);
+    }
+    if (rv == 0) {
+        st->st_ino = ino;
+        pthread_mutex_lock(&ll_lock);
+        ll_node_t *n = node_get(ino);
+        if (n) {
+            note_attr(n, st, quiet);
+        }
+        pthread_mutex_unlock(&ll_lock);
+    }
+    return rv;
+}
+
+// Stat name in parent and take a lookup reference on its inode.
+static int ll_entry(fuse_ino_t parent, const char *name,
+                    struct fuse_entry_param *e)
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    int rv = ino_path(parent, dir);
+    if (rv == 0) {
+        rv = child_path(dir, name, path, sizeof(path));
+    }
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    if (rv == 0) {
+        rv = fs_getattr_child(dir, name, path, &e->attr);
+    }
+
+    pthread_mutex_lock(&ll_lock);
+    ll_node_t *p = node_get(parent);
+    if (rv == 0 && !p) {
+        rv = -ENOENT;
+    }
+    if (rv == -ENOENT && p) {
+        // it went away behind our back
+        ll_node_t *n = node_find(p, name);
+        if (n) {
+            node_unlink(n);
+            node_release(n);
+        }
+    }
+    if (rv == 0) {
+        ll_node_t *n = node_link(p, name);
+        if (n) {
+            n->nlookup++;
+            note_attr(n, &e->attr, 0);
+            e->ino = n->ino;
+            e->attr.st_ino = n->ino;
+        } else {
+            rv = -ENOMEM;
+        }
+    }
+    pthread_mutex_unlock(&ll_lock);
+
+    e->attr_timeout = s3fs_context->attr_timeout;
+    e->entry_timeout = s3fs_context->entry_timeout;
+    return rv;
+}
+
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    int rv = ll_entry(parent, name, &e);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+
+// operations --------------------------------------------------------------
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+    fs_init(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+    fs_destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    reply_entry(req, parent, name);
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+    pthread_mutex_lock(&ll_lock);
+    ll_node_t *n = node_get(ino);
+    if (n && n != &ll_root) {
+        n->nlookup -= nlookup < n->nlookup ? nlookup : n->nlookup;
+        node_release(n);
+    }
+    pthread_mutex_unlock(&ll_lock);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    ll_forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+                            struct fuse_forget_data *forgets)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    struct stat st;
+    int rv = ll_getattr_ino(ino, &st, 0);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_attr(req, &st, s3fs_context->attr_timeout);
+    }
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi)
+{
+    // like the high-level interface, only size changes are supported
+    if (to_set & ~FUSE_SET_ATTR_SIZE) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        rv = fi ? fs_ftruncate(path, attr->st_size, fi)
+                : fs_truncate(path, attr->st_size);
+    }
+    struct stat st;
+    if (rv == 0) {
+        rv = ll_getattr_ino(ino, &st, 1);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_attr(req, &st, s3fs_context->attr_timeout);
+    }
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, dev_t rdev)
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    int rv = ino_path(parent, dir);
+    if (rv == 0) {
+        rv = child_path(dir, name, path, sizeof(path));
+    }
+    if (rv == 0) {
+        rv = fs_mknod(path, mode, rdev);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        reply_entry(req, parent, name);
+    }
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode)
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    int rv = ino_path(parent, dir);
+    if (rv == 0) {
+        rv = child_path(dir, name, path, sizeof(path));
+    }
+    if (rv == 0) {
+        rv = fs_mkdir(path, mode);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        reply_entry(req, parent, name);
+    }
+}
+
+// Shared by unlink and rmdir.
+static void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      int (*remove)(const char *))
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    int rv = ino_path(parent, dir);
+    if (rv == 0) {
+        rv = child_path(dir, name, path, sizeof(path));
+    }
+    if (rv == 0) {
+        rv = remove(path);
+    }
+    if (rv == 0) {
+        pthread_mutex_lock(&ll_lock);
+        ll_node_t *p = node_get(parent);
+        ll_node_t *n = p ? node_find(p, name) : NULL;
+        if (n) {
+            node_unlink(n);
+            node_release(n);
+        }
+        pthread_mutex_unlock(&ll_lock);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_remove(req, parent, name, fs_unlink);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_remove(req, parent, name, fs_rmdir);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname)
+{
+    char dir[PATH_MAX], path[PATH_MAX], newdir[PATH_MAX], newpath[PATH_MAX];
+    int rv = ino_path(parent, dir);
+    if (rv == 0) {
+        rv = ino_path(newparent, newdir);
+    }
+    if (rv == 0) {
+        rv = child_path(dir, name, path, sizeof(path));
+    }
+    if (rv == 0) {
+        rv = child_path(newdir, newname, newpath, sizeof(newpath));
+    }
+    if (rv == 0) {
+        rv = fs_rename(path, newpath);
+    }
+    if (rv == 0) {
+        pthread_mutex_lock(&ll_lock);
+        ll_node_t *p = node_get(parent);
+        ll_node_t *np = node_get(newparent);
+        ll_node_t *n = p ? node_find(p, name) : NULL;
+        char *copy = strdup(newname);
+        ll_node_t *old = np ? node_find(np, newname) : NULL;
+        if (old && old != n) {
+            node_unlink(old);
+        } else {
+            old = NULL;
+        }
+        if (n && np && copy) {
+            // descendants follow automatically: they only know their parent
+            ll_node_t *oldparent = n->parent;
+            node_unlink(n);
+            free(n->name);
+            node_attach(n, np, copy);
+            oldparent->pins--;
+            node_release(oldparent);
+        } else {
+            if (n) {
+                node_unlink(n);
+                node_release(n);
+            }
+            free(copy);
+        }
+        if (old) {
+            node_release(old);
+        }
+        pthread_mutex_unlock(&ll_lock);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_open(path, fi);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    struct fuse_bufvec *bv = NULL;
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_read_buf(path, &bv, size, off, fi);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+    size_t i;
+    for (i = 0; i < bv->count; i++) {
+        if (!(bv->buf[i].flags & FUSE_BUF_IS_FD)) {
+            free(bv->buf[i].mem);
+        }
+    }
+    free(bv);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_write(path, buf, size, off, fi);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_write(req, rv);
+    }
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_bufvec *bufv, off_t off,
+                         struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_write_buf(path, bufv, off, fi);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_write(req, rv);
+    }
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_flush(path, fi);
+    }
+    if (rv == 0) {
+        // the new size and mtime are our own doing: the kernel's pages
+        // already hold this data, so don't invalidate them later
+        struct stat st;
+        ll_getattr_ino(ino, &st, 1);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_fsync(path, datasync, fi);
+    }
+    if (rv == 0) {
+        struct stat st;
+        ll_getattr_ino(ino, &st, 1);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_release(path, fi);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+
+// A directory listing, built at opendir and handed out by offset.
+typedef struct {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    char **names;
+    int count;
+} ll_dir_t;
+
+static int ll_dir_fill(void *data, const char *name, const struct stat *stbuf,
+                       off_t off)
+{
+    ll_dir_t *d = (ll_dir_t *) data;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = LL_UNKNOWN_INO;
+
+    size_t len = fuse_add_direntry(d->req, NULL, 0, name, NULL, 0);
+    char *buf = realloc(d->buf, d->size + len);
+    char **names = realloc(d->names, (d->count + 1) * sizeof(char *));
+    if (buf) {
+        d->buf = buf;
+    }
+    if (names) {
+        d->names = names;
+    }
+    if (!buf || !names || !(d->names[d->count] = strdup(name))) {
+        return 1;
+    }
+    d->count++;
+    fuse_add_direntry(d->req, d->buf + d->size, len, name, &st,
+                      d->size + len);
+    d->size += len;
+    return 0;
+}
+
+static void ll_dir_free(ll_dir_t *d)
+{
+    int i;
+    for (i = 0; i < d->count; i++) {
+        free(d->names[i]);
+    }
+    free(d->names);
+    free(d->buf);
+    free(d);
+}
+
+// Entries we know about that are missing from a fresh listing were removed
+// by someone else: drop them from the kernel's dentry cache.
+static void ll_dir_prune(fuse_ino_t ino, ll_dir_t *d)
+{
+    pthread_mutex_lock(&ll_lock);
+    ll_node_t *p = node_get(ino);
+    ll_node_t *n = p ? p->kids : NULL;
+    while (n) {
+        ll_node_t *next = n->sib_next;
+        int i;
+        for (i = 0; i < d->count && strcmp(d->names[i], n->name) != 0; i++) {
+        }
+        if (i == d->count) {
+            notice_post(ino, n->name);
+            node_unlink(n);
+            node_release(n);
+        }
+        n = next;
+    }
+    pthread_mutex_unlock(&ll_lock);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_opendir(path, fi);
+    }
+    ll_dir_t *d = NULL;
+    if (rv == 0 && !(d = calloc(1, sizeof(ll_dir_t)))) {
+        rv = -ENOMEM;
+    }
+    if (rv == 0) {
+        d->req = req;
+        rv = fs_readdir(path, d, ll_dir_fill, 0, fi);
+    }
+    if (rv < 0) {
+        if (d) {
+            ll_dir_free(d);
+        }
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    ll_dir_prune(ino, d);
+    fi->fh = (uintptr_t) d;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+    ll_dir_t *d = (ll_dir_t *) (uintptr_t) fi->fh;
+    if (off < (off_t) d->size) {
+        size_t n = d->size - off;
+        fuse_reply_buf(req, d->buf + off, n < size ? n : size);
+    } else {
+        fuse_reply_buf(req, NULL, 0);
+    }
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+    ll_dir_t *d = (ll_dir_t *) (uintptr_t) fi->fh;
+    if (d) {
+        ll_dir_free(d);
+    }
+    fi->fh = 0;
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_releasedir(path, fi);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                        struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_fsyncdir(path, datasync, fi);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    char path[PATH_MAX];
+    int rv = ino_path(ino, path);
+    if (rv == 0) {
+        rv = fs_access(path, mask);
+    }
+    fuse_reply_err(req, -rv);
+}
+
+
+static struct fuse_lowlevel_ops s3fs_ll_ops = {
+    .init         = ll_init,
+    .destroy      = ll_destroy,
+    .lookup       = ll_lookup,
+    .forget       = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr      = ll_getattr,
+    .setattr      = ll_setattr,
+    .mknod        = ll_mknod,
+    .mkdir        = ll_mkdir,
+    .unlink       = ll_unlink,
+    .rmdir        = ll_rmdir,
+    .rename       = ll_rename,
+    .open         = ll_open,
+    .read         = ll_read,
+    .write        = ll_write,
+    .write_buf    = ll_write_buf,
+    .flush        = ll_flush,
+    .release      = ll_release,
+    .fsync        = ll_fsync,
+    .opendir      = ll_opendir,
+    .readdir      = ll_readdir,
+    .releasedir   = ll_releasedir,
+    .fsyncdir     = ll_fsyncdir,
+    .access       = ll_access,
+};
+
+
+int s3fs_ll_main(struct fuse_args *args, s3context_t *ctx)
+{
+    char *mountpoint = NULL;
+    int multithreaded, foreground;
+    int err = -1;
+
+    ll_root.ino = FUSE_ROOT_ID;
+    ll_root.parent = &ll_root;
+    ll_root.linked = 1;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                           &foreground) == -1) {
+        return 1;
+    }
+    struct fuse_chan *ch = fuse_mount(mountpoint, args);
+    if (ch) {
+        struct fuse_session *se = fuse_lowlevel_new(args, &s3fs_ll_ops,
+                                                    sizeof(s3fs_ll_ops), ctx);
+        if (se) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                // threads don't survive daemonizing, so start them after
+                if (fuse_daemonize(foreground) != -1) {
+                    pthread_t notifier;
+                    int notifying = 0;
+                    ll_chan = ch;
+                    if (pthread_create(&notifier, NULL, notice_thread,
+                                       NULL) == 0) {
+                        notifying = 1;
+                    } else {
+                        ll_chan = NULL;
+                    }
+                    err = multithreaded ? fuse_session_loop_mt(se)
+                                        : fuse_session_loop(se);
+                    if (notifying) {
+                        pthread_mutex_lock(&notice_lock);
+                        notice_stop = 1;
+                        pthread_cond_signal(&notice_cond);
+                        pthread_mutex_unlock(&notice_lock);
+                        pthread_join(notifier, NULL);
+                    }
+                    ll_chan = NULL;
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * The s3fs file system operations, shared by the high-level (path based)
+ * and low-level (inode based) FUSE front ends.
+ */
+#ifndef __S3FS_OPS_H__
+#define __S3FS_OPS_H__
+
+#include "s3fs.h"   // must come first: sets FUSE_USE_VERSION
+#include <fuse.h>
+
+// file system state; valid from main() onwards
+extern s3context_t *s3fs_context;
+
+void *fs_init(struct fuse_conn_info *conn);
+void fs_destroy(void *userdata);
+int fs_getattr(const char *path, struct stat *statbuf);
+int fs_getattr_child(const char *directory, const char *base, const char *path,
+                     struct stat *statbuf);
+int fs_opendir(const char *path, struct fuse_file_info *fi);
+int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+               struct fuse_file_info *fi);
+int fs_releasedir(const char *path, struct fuse_file_info *fi);
+int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi);
+int fs_mkdir(const char *path, mode_t mode);
+int fs_rmdir(const char *path);
+int fs_mknod(const char *path, mode_t mode, dev_t dev);
+int fs_open(const char *path, struct fuse_file_info *fi);
+int fs_read(const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi);
+int fs_write(const char *path, const char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi);
+int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                off_t offset, struct fuse_file_info *fi);
+int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                 struct fuse_file_info *fi);
+int fs_flush(const char *path, struct fuse_file_info *fi);
+int fs_release(const char *path, struct fuse_file_info *fi);
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int fs_rename(const char *path, const char *newpath);
+int fs_unlink(const char *path);
+int fs_truncate(const char *path, off_t newsize);
+int fs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
+int fs_access(const char *path, int mask);
+
+/*
+ * Mount and serve the file system through the low-level inode API.
+ * Takes the same command line as fuse_main; returns its exit status.
+ */
+int s3fs_ll_main(struct fuse_args *args, s3context_t *ctx);
+
+#endif // __S3FS_OPS_H__
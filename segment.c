@@ -0,0 +1,160 @@
+/*
+ * segment.c: append segment ids and the segment merger.  See segment.h
+ * for an overview.
+ *
+ * The merger is a single thread working through a queue of keys; a key
+ * already queued isn't queued again.  Merging itself is done by
+ * s3fs_merge_segments, under the same lock as appends to the object.
+ */
+
+#include "segment.h"
+#include "libs3_wrapper.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+typedef struct merge_entry {
+    char *key;
+    struct merge_entry *next;
+} merge_entry_t;
+
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_cond = PTHREAD_COND_INITIALIZER;
+static merge_entry_t *merge_head = NULL, *merge_tail = NULL;
+static char *merge_bucket = NULL;
+static int merge_stop = 0;
+static int merge_started = 0;
+static pthread_t merge_thread;
+static int segment_max = 0;
+static uint64_t segment_serial = 0;
+
+
+static void *merger(void *arg)
+{
+    pthread_mutex_lock(&merge_lock);
+    for (;;) {
+        while (!merge_head && !merge_stop) {
+            pthread_cond_wait(&merge_cond, &merge_lock);
+        }
+        merge_entry_t *e = merge_head;
+        if (!e) {
+            break;
+        }
+        // the key stays queued while it is merged, so it isn't queued twice
+        pthread_mutex_unlock(&merge_lock);
+        if (s3fs_merge_segments(merge_bucket, e->key) < 0) {
+            fprintf(stderr, "s3fs: couldn't merge the segments of %s\n", e->key);
+        }
+        pthread_mutex_lock(&merge_lock);
+        merge_head = e->next;
+        if (!merge_head) {
+            merge_tail = NULL;
+        }
+        free(e->key);
+        free(e);
+    }
+    pthread_mutex_unlock(&merge_lock);
+    return NULL;
+}
+
+void s3fs_segment_init(const char *bucket, int max_segments)
+{
+    segment_max = max_segments < 0 ? 0 : max_segments;
+    if (segment_max == 0) {
+        return;
+    }
+    merge_bucket = strdup(bucket);
+    merge_stop = 0;
+    merge_started = merge_bucket && pthread_create(&merge_thread, NULL, merger, NULL) == 0;
+}
+
+void s3fs_segment_destroy(void)
+{
+    if (!merge_started) {
+        return;
+    }
+    pthread_mutex_lock(&merge_lock);
+    merge_stop = 1;
+    pthread_cond_signal(&merge_cond);
+    pthread_mutex_unlock(&merge_lock);
+    pthread_join(merge_thread, NULL);
+    merge_started = 0;
+    free(merge_bucket);
+    merge_bucket = NULL;
+}
+
+int s3fs_segment_enabled(void)
+{
+    return segment_max != 0;
+}
+
+int s3fs_segment_max(void)
+{
+    return segment_max;
+}
+
+void s3fs_segment_id(const char *key, uint64_t offset, uint8_t *id)
+{
+    struct {
+        uint64_t offset, serial;
+        struct timespec now;
+        pid_t pid;
+    } salt;
+    memset(&salt, 0, sizeof(salt));
+    salt.offset = offset;
+    salt.serial = __sync_fetch_and_add(&segment_serial, 1);
+    clock_gettime(CLOCK_REALTIME, &salt.now);
+    salt.pid = getpid();
+
+    size_t len = strlen(key);
+    uint8_t *buf = malloc(len + sizeof(salt));
+    if (!buf) {
+        // the salt alone is still unique to this process
+        SHA256((const uint8_t *) &salt, sizeof(salt), id);
+        return;
+    }
+    memcpy(buf, key, len);
+    memcpy(buf + len, &salt, sizeof(salt));
+    SHA256(buf, len + sizeof(salt), id);
+    free(buf);
+}
+
+void s3fs_segment_key(const uint8_t *id, char *key, size_t size)
+{
+    char hex[S3FS_SEGMENT_ID * 2 + 1];
+    int i;
+    for (i = 0; i < S3FS_SEGMENT_ID; i++) {
+        sprintf(hex + 2 * i, "%02x", id[i]);
+    }
+    snprintf(key, size, "/.s3fs-segments/%s", hex);
+}
+
+void s3fs_segment_merge_later(const char *key)
+{
+    pthread_mutex_lock(&merge_lock);
+    merge_entry_t *e = merge_head;
+    while (e && strcmp(e->key, key)) {
+        e = e->next;
+    }
+    if (!e && merge_started && !merge_stop && (e = malloc(sizeof(*e)))) {
+        e->key = strdup(key);
+        e->next = NULL;
+        if (!e->key) {
+            free(e);
+        } else {
+            if (merge_tail) {
+                merge_tail->next = e;
+            } else {
+                merge_head = e;
+            }
+            merge_tail = e;
+            pthread_cond_signal(&merge_cond);
+        }
+    }
+    pthread_mutex_unlock(&merge_lock);
+}
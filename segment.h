@@ -0,0 +1,53 @@
+/*
+ * Append segments.
+ *
+ * A file that is only ever appended to, such as a log, needn't be
+ * uploaded again in full on every flush.  Instead each flush stores just
+ * the new tail as a segment object, and the object itself becomes an
+ * index of its segments (in the manifest format of chunk.h, with segment
+ * ids in place of chunk hashes).  Reads stitch the segments back
+ * together; see s3fs_append_object in libs3_wrapper.h.
+ *
+ * So that reads don't end up fetching hundreds of tiny segments, an
+ * object with too many of them is queued for a background merger, which
+ * folds its most recent segments into one.
+ */
+#ifndef __S3FS_SEGMENT_H__
+#define __S3FS_SEGMENT_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define S3FS_SEGMENT_ID 32   // same as S3FS_CHUNK_HASH
+
+/*
+ * Allow appends to objects in bucket, merging objects with more than
+ * max_segments segments, and start the merger; max_segments 0 disables
+ * appends.
+ */
+void s3fs_segment_init(const char *bucket, int max_segments);
+
+/*
+ * Stop the merger, after it finishes the merges queued so far.
+ */
+void s3fs_segment_destroy(void);
+
+int s3fs_segment_enabled(void);
+int s3fs_segment_max(void);
+
+/*
+ * Make a new segment id, unique to this append of key at offset.
+ */
+void s3fs_segment_id(const char *key, uint64_t offset, uint8_t *id);
+
+/*
+ * The key of the segment with id.
+ */
+void s3fs_segment_key(const uint8_t *id, char *key, size_t size);
+
+/*
+ * Queue key to have its segments merged.
+ */
+void s3fs_segment_merge_later(const char *key);
+
+#endif // __S3FS_SEGMENT_H__
@@ -0,0 +1,545 @@
+/*
+ * writeback.c: write-back staging of open files in local spill files.
+ * See writeback.h for an overview.
+ */
+
+#include "writeback.h"
+#include "cache_io.h"
+#include "delq.h"
+#include "journal.h"
+#include "libs3_wrapper.h"
+#include "segment.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct s3fs_wb {
+    char *key;
+    int refs;             // opens sharing this handle
+    int fd;               // spill file (already unlinked), or -1
+    off_t size;           // size of the staged object
+    off_t stored;         // leading part of it that isn't a hole
+    off_t base;           // leading part not loaded yet (see wb_stage)
+    const char *bucket;   // where to load it from
+    off_t flushed;        // length of the object in s3 as of the last flush
+    off_t dirty_from;     // lowest offset changed since then
+    int dirty;            // staged contents differ from s3
+    int jdirty;           // ...and from the journal
+    uint64_t jseq;        // journal record of the contents, or 0
+    int small;            // has no object of its own (see s3fs_wb_stage_small)
+    pthread_mutex_t lock; // protects everything but key, refs and next
+    struct s3fs_wb *next;
+};
+
+static pthread_mutex_t wb_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static s3fs_wb_t *wb_table = NULL;
+static char spill_dir[PATH_MAX] = "/tmp";
+
+#define SPILL_NAME "/s3fs-spill-XXXXXX"
+
+
+int s3fs_wb_init(const char *dir)
+{
+    if (strlen(dir) >= sizeof(spill_dir)) {
+        return -1;
+    }
+    snprintf(spill_dir, sizeof(spill_dir), "%s", dir);
+    return 0;
+}
+
+static s3fs_wb_t *wb_find(const char *key)
+{
+    s3fs_wb_t *wb = wb_table;
+    while (wb && strcmp(wb->key, key) != 0) {
+        wb = wb->next;
+    }
+    return wb;
+}
+
+s3fs_wb_t *s3fs_wb_open(const char *key, off_t size, off_t stored)
+{
+    pthread_mutex_lock(&wb_table_lock);
+    s3fs_wb_t *wb = wb_find(key);
+    if (!wb) {
+        wb = calloc(1, sizeof(s3fs_wb_t));
+        if (!wb || !(wb->key = strdup(key))) {
+            free(wb);
+            pthread_mutex_unlock(&wb_table_lock);
+            return NULL;
+        }
+        wb->fd = -1;
+        wb->size = size;
+        wb->stored = stored < size ? stored : size;
+        wb->flushed = wb->dirty_from = wb->stored;
+        pthread_mutex_init(&wb->lock, NULL);
+        wb->next = wb_table;
+        wb_table = wb;
+    }
+    wb->refs++;
+    pthread_mutex_unlock(&wb_table_lock);
+    return wb;
+}
+
+s3fs_wb_t *s3fs_wb_get(const char *key)
+{
+    pthread_mutex_lock(&wb_table_lock);
+    s3fs_wb_t *wb = wb_find(key);
+    if (wb) {
+        wb->refs++;
+    }
+    pthread_mutex_unlock(&wb_table_lock);
+    return wb;
+}
+
+int s3fs_wb_release_shared(s3fs_wb_t *wb)
+{
+    pthread_mutex_lock(&wb_table_lock);
+    int dropped = wb->refs > 1;
+    if (dropped) {
+        wb->refs--;
+    }
+    pthread_mutex_unlock(&wb_table_lock);
+    return dropped;
+}
+
+void s3fs_wb_release(s3fs_wb_t *wb)
+{
+    pthread_mutex_lock(&wb_table_lock);
+    if (--wb->refs > 0) {
+        pthread_mutex_unlock(&wb_table_lock);
+        return;
+    }
+    s3fs_wb_t **pp = &wb_table;
+    while (*pp != wb) {
+        pp = &(*pp)->next;
+    }
+    *pp = wb->next;
+    pthread_mutex_unlock(&wb_table_lock);
+
+    if (wb->dirty) {
+        fprintf(stderr, "s3fs writeback: discarding unflushed data for %s\n",
+                wb->key);
+    }
+    if (wb->fd >= 0) {
+        close(wb->fd);
+    }
+    pthread_mutex_destroy(&wb->lock);
+    free(wb->key);
+    free(wb);
+}
+
+int s3fs_wb_rename(const char *from, const char *to)
+{
+    size_t len = strlen(from);
+    pthread_mutex_lock(&wb_table_lock);
+    int count = 0, i = 0;
+    s3fs_wb_t *wb;
+    for (wb = wb_table; wb; wb = wb->next) {
+        if (strncmp(wb->key, from, len) == 0 &&
+            (wb->key[len] == '\0' || wb->key[len] == '/')) {
+            count++;
+        }
+    }
+    s3fs_wb_t **moved = malloc((count ? count : 1) * sizeof(s3fs_wb_t *));
+    if (!moved) {
+        pthread_mutex_unlock(&wb_table_lock);
+        return -1;
+    }
+    for (wb = wb_table; wb && i < count; wb = wb->next) {
+        if (strncmp(wb->key, from, len) == 0 &&
+            (wb->key[len] == '\0' || wb->key[len] == '/')) {
+            wb->refs++;
+            moved[i++] = wb;
+        }
+    }
+    pthread_mutex_unlock(&wb_table_lock);
+
+    int rv = 0;
+    for (i = 0; i < count; i++) {
+        wb = moved[i];
+        // wait out an upload or load under the old key
+        pthread_mutex_lock(&wb->lock);
+        size_t klen = strlen(to) + strlen(wb->key + len) + 1;
+        char *key = malloc(klen);
+        if (key) {
+            snprintf(key, klen, "%s%s", to, wb->key + len);
+            pthread_mutex_lock(&wb_table_lock);
+            char *old = wb->key;
+            wb->key = key;
+            // ahead of a handle still open on a file replaced by the move
+            s3fs_wb_t **pp = &wb_table;
+            while (*pp != wb) {
+                pp = &(*pp)->next;
+            }
+            *pp = wb->next;
+            wb->next = wb_table;
+            wb_table = wb;
+            pthread_mutex_unlock(&wb_table_lock);
+            free(old);
+            // journaled contents are filed under the old name
+            if (wb->jseq) {
+                wb->jseq = 0;
+                wb->jdirty = wb->dirty;
+            }
+        } else {
+            rv = -1;
+        }
+        pthread_mutex_unlock(&wb->lock);
+        if (!s3fs_wb_release_shared(wb)) {
+            s3fs_wb_release(wb);
+        }
+    }
+    free(moved);
+    return rv;
+}
+
+// Stage len bytes of data as the start of the file in a new spill file;
+// the rest of the file reads as zeros.  Called with wb->lock held.
+static int wb_spill(s3fs_wb_t *wb, const uint8_t *data, ssize_t len)
+{
+    char path[sizeof(spill_dir) + sizeof(SPILL_NAME)];
+    if (snprintf(path, sizeof(path), "%s" SPILL_NAME, spill_dir) >= (int) sizeof(path)) {
+        return -ENAMETOOLONG;
+    }
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -errno;
+    }
+    unlink(path);
+
+    if (len > 0 && s3fs_io_pwrite(fd, data, len, 0) != len) {
+        close(fd);
+        return -EIO;
+    }
+    if (ftruncate(fd, wb->size) < 0) {
+        close(fd);
+        return -errno;
+    }
+    wb->fd = fd;
+    wb->stored = len;
+    return 0;
+}
+
+// Stage the first limit bytes of the object's current contents.  Called
+// with wb->lock held.
+static int wb_load(s3fs_wb_t *wb, const char *bucket, off_t limit)
+{
+    uint8_t *data = NULL;
+    ssize_t len = 0;
+    off_t want = limit < wb->stored ? limit : wb->stored;
+    if (want > 0) {
+        // a prefix is a ranged get; all of it is a plain one
+        len = s3fs_get_object(bucket, wb->key, &data, 0,
+                              want < wb->stored ? want : 0);
+    }
+    if (len < 0) {
+        return -EIO;
+    }
+    int rv = wb_spill(wb, data, len);
+    free(data);
+    return rv;
+}
+
+// Load the base of the spill file.  Called with wb->lock held.
+static int wb_fill(s3fs_wb_t *wb, const char *bucket)
+{
+    if (wb->base == 0) {
+        return 0;
+    }
+    uint8_t *data = NULL;
+    ssize_t len = s3fs_get_object(bucket, wb->key, &data, 0, wb->base);
+    int rv = len == wb->base &&
+             s3fs_io_pwrite(wb->fd, data, len, 0) == len ? 0 : -EIO;
+    free(data);
+    if (rv == 0) {
+        wb->base = 0;
+    }
+    return rv;
+}
+
+// Stage the object for a write at offset.  An append to an object in s3
+// doesn't need what is already there, as only the new bytes will be
+// uploaded (see s3fs_append_object): the object stays the base of the
+// spill file, and is only loaded if something else needs it.  Called
+// with wb->lock held.
+static int wb_stage(s3fs_wb_t *wb, const char *bucket, off_t offset)
+{
+    if (wb->fd < 0 && s3fs_segment_enabled() && offset > 0 &&
+        offset == wb->stored && offset == wb->size) {
+        int rv = wb_spill(wb, NULL, 0);
+        if (rv == 0) {
+            wb->stored = wb->base = offset;
+            wb->bucket = bucket;
+        }
+        return rv;
+    }
+    if (wb->fd < 0) {
+        return wb_load(wb, bucket, wb->size);
+    }
+    return offset < wb->base ? wb_fill(wb, bucket) : 0;
+}
+
+// Note a write of len bytes at offset.  Called with wb->lock held.
+static void wb_wrote(s3fs_wb_t *wb, off_t offset, ssize_t len)
+{
+    wb->dirty = wb->jdirty = 1;
+    if (offset < wb->dirty_from) {
+        wb->dirty_from = offset;
+    }
+    if (offset + len > wb->size) {
+        wb->size = offset + len;
+    }
+    if (offset + len > wb->stored) {
+        wb->stored = offset + len;
+    }
+}
+
+int s3fs_wb_stage_small(s3fs_wb_t *wb, const void *data, size_t len)
+{
+    pthread_mutex_lock(&wb->lock);
+    int rv = 0;
+    if (wb->fd < 0) {
+        wb->size = len;
+        rv = wb_spill(wb, data, len);
+        wb->small = rv == 0;
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return rv;
+}
+
+ssize_t s3fs_wb_write(s3fs_wb_t *wb, const char *bucket, const char *buf,
+                      size_t size, off_t offset)
+{
+    pthread_mutex_lock(&wb->lock);
+    ssize_t rv = wb_stage(wb, bucket, offset);
+    if (rv == 0) {
+        rv = s3fs_io_pwrite(wb->fd, buf, size, offset);
+        if (rv > 0) {
+            wb_wrote(wb, offset, rv);
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return rv;
+}
+
+ssize_t s3fs_wb_write_with(s3fs_wb_t *wb, const char *bucket, off_t offset,
+                          s3fs_wb_writer_t writer, void *arg)
+{
+    pthread_mutex_lock(&wb->lock);
+    ssize_t rv = wb_stage(wb, bucket, offset);
+    if (rv == 0) {
+        rv = writer(wb->fd, offset, arg);
+        if (rv > 0) {
+            wb_wrote(wb, offset, rv);
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return rv;
+}
+
+// Whether a read of size bytes at offset can be served from the spill
+// file, loading its base if the read needs it.  A read of the base alone
+// isn't: the object in s3 still starts with it, so the caller can read it
+// from there.  Called with wb->lock held.
+static int wb_reads_base(s3fs_wb_t *wb, size_t size, off_t offset)
+{
+    if (wb->base == 0) {
+        return 1;
+    }
+    return offset + (off_t) size > wb->base && wb_fill(wb, wb->bucket) == 0;
+}
+
+ssize_t s3fs_wb_read_fd(s3fs_wb_t *wb, size_t size, off_t offset, int *fd)
+{
+    pthread_mutex_lock(&wb->lock);
+    ssize_t rv = -1;
+    if (wb->fd >= 0 && wb_reads_base(wb, size, offset)) {
+        rv = 0;
+        if (offset < wb->size) {
+            rv = wb->size - offset < (off_t) size ? wb->size - offset
+                                                   : (off_t) size;
+        }
+        *fd = wb->fd;
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return rv;
+}
+
+ssize_t s3fs_wb_read(s3fs_wb_t *wb, char *buf, size_t size, off_t offset)
+{
+    pthread_mutex_lock(&wb->lock);
+    ssize_t rv = -1;
+    if (wb->fd >= 0 && wb_reads_base(wb, size, offset)) {
+        rv = 0;
+        if (offset < wb->size) {
+            if (offset + (off_t) size > wb->size) {
+                size = wb->size - offset;
+            }
+            rv = s3fs_io_pread(wb->fd, buf, size, offset);
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return rv;
+}
+
+int s3fs_wb_truncate(s3fs_wb_t *wb, const char *bucket, off_t size)
+{
+    pthread_mutex_lock(&wb->lock);
+    int rv = 0;
+    if (wb->fd < 0) {
+        rv = wb_load(wb, bucket, size);
+    } else {
+        rv = wb_fill(wb, bucket);
+    }
+    if (rv == 0 && ftruncate(wb->fd, size) < 0) {
+        rv = -errno;
+    }
+    if (rv == 0) {
+        wb->size = size;
+        if (wb->stored > size) {
+            wb->stored = size;
+        }
+        if (wb->dirty_from > size) {
+            wb->dirty_from = size;
+        }
+        wb->dirty = wb->jdirty = 1;
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return rv;
+}
+
+int s3fs_wb_staged_size(const char *key, off_t *size)
+{
+    int rv = -1;
+    // wb->lock can be held across a download, so don't wait for it with
+    // the table locked
+    s3fs_wb_t *wb = s3fs_wb_get(key);
+    if (wb) {
+        pthread_mutex_lock(&wb->lock);
+        if (wb->fd >= 0) {
+            *size = wb->size;
+            rv = 0;
+        }
+        pthread_mutex_unlock(&wb->lock);
+        if (!s3fs_wb_release_shared(wb)) {
+            s3fs_wb_release(wb);
+        }
+    }
+    return rv;
+}
+
+// Upload only what was appended since the last flush, if that is all
+// that changed.  Returns 0 on success, or -1 if the whole object has to
+// be uploaded instead.  Called with wb->lock held.
+static int wb_flush_tail(s3fs_wb_t *wb, const char *bucket)
+{
+    if (!s3fs_segment_enabled() || wb->flushed == 0 ||
+        wb->dirty_from < wb->flushed || wb->stored < wb->flushed) {
+        return -1;
+    }
+    ssize_t len = wb->stored - wb->flushed;
+    if (len == 0) {
+        // the file only grew a hole, which isn't uploaded anyway
+        return 0;
+    }
+    uint8_t *data = malloc(len);
+    int rv = data &&
+             s3fs_io_pread(wb->fd, data, len, wb->flushed) == len &&
+             s3fs_append_object(bucket, wb->key, data, len, wb->flushed,
+                                NULL) == len ? 0 : -1;
+    free(data);
+    return rv;
+}
+
+// Note that the staged contents are in s3.  Called with wb->lock held.
+static void wb_flushed(s3fs_wb_t *wb)
+{
+    wb->dirty = wb->jdirty = 0;
+    wb->flushed = wb->dirty_from = wb->stored;
+    if (wb->jseq) {
+        s3fs_journal_done_data(wb->key, wb->jseq);
+        wb->jseq = 0;
+    }
+}
+
+int s3fs_wb_flush(s3fs_wb_t *wb, const char *bucket, off_t *size,
+                  void **small, size_t small_max)
+{
+    pthread_mutex_lock(&wb->lock);
+    if (!wb->dirty) {
+        pthread_mutex_unlock(&wb->lock);
+        return 0;
+    }
+    int rv = -1;
+    // journaled contents are only done with once they are in s3, so they
+    // are uploaded even if small
+    if (wb->small && small && wb->size <= (off_t) small_max && !wb->jseq) {
+        // still small enough to keep elsewhere; the hole reads back as zeros
+        uint8_t *data = malloc(wb->size ? wb->size : 1);
+        if (data && s3fs_io_pread(wb->fd, data, wb->size, 0) == wb->size) {
+            wb->dirty = 0;
+            *size = wb->size;
+            *small = data;
+            rv = S3FS_WB_SMALL;
+        } else {
+            free(data);
+        }
+        pthread_mutex_unlock(&wb->lock);
+        return rv;
+    }
+    if (wb->small) {
+        // an object deleted under this name before may still be queued
+        s3fs_delq_cancel(wb->key);
+    }
+    if (!wb->small && wb_flush_tail(wb, bucket) == 0) {
+        wb_flushed(wb);
+        *size = wb->size;
+        pthread_mutex_unlock(&wb->lock);
+        return 1;
+    }
+    // the hole at the end of the file stays out of the object
+    uint8_t *data = malloc(wb->stored ? wb->stored : 1);
+    if (data && wb_fill(wb, bucket) == 0 &&
+        (wb->stored == 0 ||
+         s3fs_io_pread(wb->fd, data, wb->stored, 0) == wb->stored) &&
+        s3fs_put_object(bucket, wb->key, data, wb->stored) == wb->stored) {
+        wb_flushed(wb);
+        wb->small = 0;
+        *size = wb->size;
+        rv = 1;
+    }
+    free(data);
+    pthread_mutex_unlock(&wb->lock);
+    return rv;
+}
+
+int s3fs_wb_journal(s3fs_wb_t *wb, const char *bucket, uint64_t *seq)
+{
+    pthread_mutex_lock(&wb->lock);
+    int rv = 0;
+    if (wb->jdirty) {
+        rv = -1;
+        uint8_t *data = NULL;
+        if (wb->stored <= S3FS_JOURNAL_MAX_DATA && wb_fill(wb, bucket) == 0 &&
+            (data = malloc(wb->stored ? wb->stored : 1)) &&
+            (wb->stored == 0 ||
+             s3fs_io_pread(wb->fd, data, wb->stored, 0) == wb->stored)) {
+            uint64_t s = s3fs_journal_data(wb->key, data, wb->stored, wb->size);
+            if (s) {
+                wb->jseq = s;
+                wb->jdirty = 0;
+                rv = 0;
+            }
+        }
+        free(data);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    // directory changes journaled before now are covered too
+    *seq = s3fs_journal_seq();
+    return rv;
+}
@@ -0,0 +1,152 @@
+/*
+ * Write-back staging for open files.
+ *
+ * Writes to an open file are not sent to s3 one at a time.  Instead, the
+ * first write stages the object's current contents in a local spill file,
+ * writes then go to the spill file, and the whole object is uploaded when
+ * the file is flushed.  All opens of the same object share one handle,
+ * so readers of an open file see its unflushed writes.
+ *
+ * The object in s3 may be shorter than the file: a file extended by
+ * truncation ends in a hole of zeros that is never uploaded.  The handle
+ * tracks both the file size and how much of it is stored data.
+ *
+ * When appends are on (see segment.h), a file that is only appended to
+ * isn't loaded at all: the spill file just holds the new bytes, and a
+ * flush uploads only those.  The rest is loaded if it is ever needed.
+ *
+ * A small file may have no object at all, its contents being kept in its
+ * directory entry or in a pack instead (see s3dirent_t).  Such a file is
+ * staged from there, and its contents are handed back to the caller on
+ * flush for as long as it stays small.
+ */
+#ifndef __S3FS_WRITEBACK_H__
+#define __S3FS_WRITEBACK_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+typedef struct s3fs_wb s3fs_wb_t;
+
+/*
+ * Spill files are created in directory dir (which must exist).  Returns 0
+ * on success, or -1 if dir is too long (spill files then stay in /tmp).
+ */
+int s3fs_wb_init(const char *dir);
+
+/*
+ * Get the handle for key, creating it if this is the first open.  size is
+ * the file size and stored the length of the object in s3; they only
+ * matter when the handle is created.  Every call must be matched by a
+ * call to s3fs_wb_release.  Returns NULL on failure.
+ */
+s3fs_wb_t *s3fs_wb_open(const char *key, off_t size, off_t stored);
+
+/*
+ * Get the handle for key only if it is already open.  Returns NULL if
+ * key has no handle.  A reference taken here is dropped with
+ * s3fs_wb_release_shared.
+ */
+s3fs_wb_t *s3fs_wb_get(const char *key);
+
+/*
+ * Drop a reference unless it is the last one.  Returns 1 if it was
+ * dropped, or 0 if the caller still holds the last reference and should
+ * flush before calling s3fs_wb_release.
+ */
+int s3fs_wb_release_shared(s3fs_wb_t *wb);
+
+/*
+ * Move the handle for from, and those of every file below it if it is a
+ * directory, to the same names under to, so that later flushes upload to
+ * where the files are now.  Returns 0 on success, or -1 if some handle
+ * could not be moved.
+ */
+int s3fs_wb_rename(const char *from, const char *to);
+
+/*
+ * Stage len bytes of data, the contents of a small file with no object of
+ * its own, unless the file is already staged.  Returns 0 on success, or
+ * -errno.
+ */
+int s3fs_wb_stage_small(s3fs_wb_t *wb, const void *data, size_t len);
+
+/*
+ * Drop a reference taken by s3fs_wb_open.  The last reference discards
+ * the spill file, so the handle should be flushed first.
+ */
+void s3fs_wb_release(s3fs_wb_t *wb);
+
+/*
+ * Write size bytes at offset.  Returns the number of bytes written,
+ * or -errno on failure.
+ */
+ssize_t s3fs_wb_write(s3fs_wb_t *wb, const char *bucket, const char *buf,
+                      size_t size, off_t offset);
+
+/*
+ * Write through a callback instead of from a buffer: writer is called with
+ * the spill file descriptor and offset, must write its data there (with
+ * pwrite or equivalent) and return the number of bytes written or -errno.
+ * Lets a caller move data into the spill file without an extra copy.
+ */
+typedef ssize_t (*s3fs_wb_writer_t)(int fd, off_t offset, void *arg);
+
+ssize_t s3fs_wb_write_with(s3fs_wb_t *wb, const char *bucket, off_t offset,
+                          s3fs_wb_writer_t writer, void *arg);
+
+/*
+ * Read from the staged copy of the object.  Returns the number of bytes
+ * read, or -1 if nothing is staged, or the range is only in s3 (and the
+ * caller should read from the cache or s3 instead).
+ */
+ssize_t s3fs_wb_read(s3fs_wb_t *wb, char *buf, size_t size, off_t offset);
+
+/*
+ * Zero-copy variant of s3fs_wb_read: returns the number of staged bytes
+ * available at offset (at most size) and sets *fd to the spill file, which
+ * stays open until the handle's last release.  Returns -1 in the same
+ * cases as s3fs_wb_read.
+ */
+ssize_t s3fs_wb_read_fd(s3fs_wb_t *wb, size_t size, off_t offset, int *fd);
+
+/*
+ * Change the size of the staged object, staging it first if necessary.
+ * Only the bytes that are kept are fetched (none when truncating to
+ * zero), and extending the file just adds to its hole.  Returns 0 on
+ * success, or -errno on failure.
+ */
+int s3fs_wb_truncate(s3fs_wb_t *wb, const char *bucket, off_t size);
+
+/*
+ * If key is open with staged contents, set *size to their size and
+ * return 0.  Returns -1 otherwise.
+ */
+int s3fs_wb_staged_size(const char *key, off_t *size);
+
+#define S3FS_WB_SMALL 2
+
+/*
+ * Upload the staged contents if they have changed since the last flush.
+ * On success, returns 1 if an upload happened (and sets *size to the new
+ * object size) or 0 if there was nothing to do.  Returns -1 on failure.
+ *
+ * A file staged by s3fs_wb_stage_small that is still at most small_max
+ * bytes isn't uploaded: *small is set to a malloc'ed copy of its contents
+ * instead, for the caller to store, and S3FS_WB_SMALL is returned.  Once
+ * it grows past that it becomes an ordinary object.
+ */
+int s3fs_wb_flush(s3fs_wb_t *wb, const char *bucket, off_t *size,
+                  void **small, size_t small_max);
+
+/*
+ * Copy the staged contents to the journal (see journal.h), unless they
+ * are there already or unchanged since the last flush.  Sets *seq to the
+ * journal position to sync to, and returns 0 on success; returns -1 if
+ * they are too large to journal or on failure, in which case the caller
+ * should flush instead.  Journaled contents are uploaded by the next
+ * flush, even if the file is small.
+ */
+int s3fs_wb_journal(s3fs_wb_t *wb, const char *bucket, uint64_t *seq);
+
+#endif // __S3FS_WRITEBACK_H__